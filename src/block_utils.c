@@ -3,6 +3,19 @@
 #include "disk_emulator.h"
 #include "data_blocks_handler.h"
 #include "inode_table.h"
+#include "buffer_cache.h"
+
+// Read the index-th block id of an indirect block straight from the pinned cache buffer
+static big_int get_indirect_block_entry(big_int indirect_block_id, big_int index) {
+	struct buffer *buffer = buffer_get(indirect_block_id);
+	if(buffer == NULL) {
+		return 0;
+	}
+
+	big_int block_id = ((struct block_id_list *) buffer->data)->list[index];
+	buffer_release(buffer);
+	return block_id;
+}
 
 big_int get_single_indirect_block_id(big_int single_indirect_block_id, big_int index) {
 	if(single_indirect_block_id == 0) {
@@ -10,11 +23,7 @@ big_int get_single_indirect_block_id(big_int single_indirect_block_id, big_int i
 		return 0;
 	}
 
-	struct block_id_list single_indirect_block;
-	if(read_block(single_indirect_block_id, &single_indirect_block) == 0) {
-		return single_indirect_block.list[index];
-	}
-	return 0;
+	return get_indirect_block_entry(single_indirect_block_id, index);
 }
 
 big_int get_double_indirect_block_id(big_int double_indirect_block_id, big_int index) {
@@ -23,14 +32,9 @@ big_int get_double_indirect_block_id(big_int double_indirect_block_id, big_int i
 		return 0;
 	}
 
-	struct block_id_list double_indirect_block;
-	if(read_block(double_indirect_block_id, &double_indirect_block) == 0) {
-
-		big_int bucket = index / BLOCK_ID_LIST_LENGTH;
-		big_int offset = index % BLOCK_ID_LIST_LENGTH;
-		return get_single_indirect_block_id(double_indirect_block.list[bucket], offset);
-	}
-	return 0;
+	big_int bucket = index / BLOCK_ID_LIST_LENGTH;
+	big_int offset = index % BLOCK_ID_LIST_LENGTH;
+	return get_single_indirect_block_id(get_indirect_block_entry(double_indirect_block_id, bucket), offset);
 }
 
 big_int get_triple_indirect_block_id(big_int triple_indirect_block_id, big_int index) {
@@ -39,14 +43,9 @@ big_int get_triple_indirect_block_id(big_int triple_indirect_block_id, big_int i
 		return 0;
 	}
 
-	struct block_id_list triple_indirect_block;
-	if(read_block(triple_indirect_block_id, &triple_indirect_block) == 0) {
-
-		big_int bucket = index / (BLOCK_ID_LIST_LENGTH * BLOCK_ID_LIST_LENGTH);
-		big_int offset = index % (BLOCK_ID_LIST_LENGTH * BLOCK_ID_LIST_LENGTH);
-		return get_double_indirect_block_id(triple_indirect_block.list[bucket], offset);
-	}
-	return 0;
+	big_int bucket = index / (BLOCK_ID_LIST_LENGTH * BLOCK_ID_LIST_LENGTH);
+	big_int offset = index % (BLOCK_ID_LIST_LENGTH * BLOCK_ID_LIST_LENGTH);
+	return get_double_indirect_block_id(get_indirect_block_entry(triple_indirect_block_id, bucket), offset);
 }
 
 big_int get_block_id(struct inode *inode, big_int index) {
@@ -77,126 +76,241 @@ big_int get_block_id(struct inode *inode, big_int index) {
 	return 0;
 }
 
-int set_single_indirect_block_id(big_int single_indirect_block_id, big_int index, big_int block_id) {
-	if(single_indirect_block_id == 0) {
-		fprintf(stderr, "single indirect block id not set\n");
-		return -1;
-	}
-
-	struct block_id_list single_indirect_block;
-	if(read_block(single_indirect_block_id, &single_indirect_block) == 0) {
-		single_indirect_block.list[index] = block_id;
-		return write_block(single_indirect_block_id, &single_indirect_block, sizeof(struct block_id_list));
+// Blocks of a block map waiting to be freed together
+struct free_batch {
+	big_int block_ids[FREE_BATCH_BLOCKS];
+	int count;
+	int failed;
+};
+
+static void add_to_free_batch(struct free_batch *batch, big_int block_id) {
+	batch->block_ids[batch->count++] = block_id;
+	if(batch->count == FREE_BATCH_BLOCKS) {
+		batch->failed |= data_block_free_n(batch->block_ids, batch->count) == -1;
+		batch->count = 0;
 	}
-	return -1;
 }
 
-int set_double_indirect_block_id(big_int double_indirect_block_id, big_int index, big_int block_id) {
-	if(double_indirect_block_id == 0) {
-		fprintf(stderr, "double indirect block id not set\n");
-		return -1;
-	}
+// Adds the blocks mapped by the indirect block block_id, level levels above the data blocks, then block_id itself
+// to the batch. The block is read before any of them can be freed
+static void free_indirect_tree(big_int block_id, int level, struct free_batch *batch) {
+	struct block_id_list list;
+	unsigned int i;
 
-	struct block_id_list double_indirect_block;
-	if(read_block(double_indirect_block_id, &double_indirect_block) == 0) {
+	if(block_id == 0) {
+		return;
+	}
+	if(read_block(block_id, &list) == -1) {
+		fprintf(stderr, "failed to read indirect block %" PRIu64 ", the blocks it maps are lost\n", block_id);
+		batch->failed = 1;
+		return;
+	}
+	for(i = 0; i < BLOCK_ID_LIST_LENGTH; i++) {
+		if(level > 1) {
+			free_indirect_tree(list.list[i], level - 1, batch);
+		} else if(list.list[i] != 0) {
+			add_to_free_batch(batch, list.list[i]);
+		}
+	}
+	add_to_free_batch(batch, block_id);
+}
 
-		big_int bucket = index / BLOCK_ID_LIST_LENGTH;
-		big_int offset = index % BLOCK_ID_LIST_LENGTH;
+int free_block_map(struct inode *inode) {
+	struct free_batch batch;
+	int i;
 
-		// Make sure we have valid block
-		if(double_indirect_block.list[bucket] == 0) {
-			struct data_block data_block;
-			if(data_block_alloc(&data_block) == -1) {
-				fprintf(stderr, "Failed to alloc data block\n");
-				return -1;
-			}
-			double_indirect_block.list[bucket] = data_block.data_block_id;
-			write_block(double_indirect_block_id, &double_indirect_block, sizeof(struct block_id_list));
+	batch.count = 0;
+	batch.failed = 0;
+	for(i = 0; i < NUM_DIRECT_BLOCKS; i++) {
+		if(inode->direct_blocks[i] != 0) {
+			add_to_free_batch(&batch, inode->direct_blocks[i]);
+			inode->direct_blocks[i] = 0;
 		}
-		return set_single_indirect_block_id(double_indirect_block.list[bucket], offset, block_id);
 	}
-	return -1;
+	free_indirect_tree(inode->single_indirect_block, 1, &batch);
+	free_indirect_tree(inode->double_indirect_block, 2, &batch);
+	free_indirect_tree(inode->triple_indirect_block, 3, &batch);
+	inode->single_indirect_block = inode->double_indirect_block = inode->triple_indirect_block = 0;
+	inode->num_allocated_blocks = 0;
+
+	if(batch.count > 0) {
+		batch.failed |= data_block_free_n(batch.block_ids, batch.count) == -1;
+	}
+	return batch.failed ? -1 : 0;
 }
 
-int set_triple_indirect_block_id(big_int triple_indirect_block_id, big_int index, big_int block_id) {
-	if(triple_indirect_block_id == 0) {
-		fprintf(stderr, "triple indirect block id not set\n");
+// Finds the indirect block holding the entry of the index-th block of the inode, past the direct blocks, and the
+// position of the entry in it. With allocate, the missing indirect blocks on the way are allocated, then linked
+// from the top. They are taken one after the other from *goal, which is moved past them, or anywhere together
+// when there is no goal nor reservation. Without allocate, *leaf is 0 when one of them is missing
+static int find_indirect_entry(struct inode *inode, big_int index, int allocate, big_int *goal, big_int *reservation, big_int *leaf, big_int *entry) {
+	struct block_id_list list;
+	big_int *root, path[3], entries[3], new_block_ids[3];
+	int levels, missing, i, j;
+
+	index -= NUM_DIRECT_BLOCKS;
+
+	if(index < BLOCK_ID_LIST_LENGTH) {
+		root = &inode->single_indirect_block;
+		levels = 1;
+	} else if((index -= BLOCK_ID_LIST_LENGTH) < BLOCK_ID_LIST_LENGTH * BLOCK_ID_LIST_LENGTH) {
+		root = &inode->double_indirect_block;
+		levels = 2;
+	} else if((index -= BLOCK_ID_LIST_LENGTH * BLOCK_ID_LIST_LENGTH) < BLOCK_ID_LIST_LENGTH * BLOCK_ID_LIST_LENGTH * BLOCK_ID_LIST_LENGTH) {
+		root = &inode->triple_indirect_block;
+		levels = 3;
+	} else {
+		fprintf(stderr, "index is out of range for set_block_id\n");
 		return -1;
 	}
 
-	struct block_id_list triple_indirect_block;
-	if(read_block(triple_indirect_block_id, &triple_indirect_block) == 0) {
-
-		big_int bucket = index / (BLOCK_ID_LIST_LENGTH * BLOCK_ID_LIST_LENGTH);
-		big_int offset = index % (BLOCK_ID_LIST_LENGTH * BLOCK_ID_LIST_LENGTH);
+	// entries[i] is the entry to follow in the indirect block of level i, path[i] is that block
+	for(i = levels - 1; i >= 0; i--) {
+		entries[i] = index % BLOCK_ID_LIST_LENGTH;
+		index /= BLOCK_ID_LIST_LENGTH;
+	}
+	path[0] = *root;
+	for(i = 0; i < levels - 1 && path[i] != 0; i++) {
+		path[i + 1] = get_indirect_block_entry(path[i], entries[i]);
+	}
+	if(path[i] != 0) {
+		i++;
+	}
 
-		// Make sure we have valid block
-		if(triple_indirect_block.list[bucket] == 0) {
-			struct data_block data_block;
-			if(data_block_alloc(&data_block) == -1) {
-				fprintf(stderr, "Failed to alloc data block\n");
+	// Levels i and below are missing
+	missing = levels - i;
+	if(missing > 0 && !allocate) {
+		*leaf = 0;
+		return 0;
+	}
+	if(missing > 0) {
+		if(*goal == 0 && reservation == NULL && data_block_alloc_n(missing, new_block_ids) == -1) {
+			fprintf(stderr, "Failed to alloc data block\n");
+			return -1;
+		}
+		for(j = 0; j < missing; j++) {
+			if(*goal != 0 || reservation != NULL) {
+				if(data_block_alloc_reserved_run(*goal, 1, &new_block_ids[j], reservation) == -1) {
+					fprintf(stderr, "Failed to alloc data block\n");
+					data_block_free_n(new_block_ids, j);
+					return -1;
+				}
+				*goal = *goal != 0 ? new_block_ids[j] + 1 : 0;
+			}
+			path[i + j] = new_block_ids[j];
+		}
+		// The allocator doesn't zero out the new blocks: they are written whole from the bottom up, each one only
+		// holding the entry of the next, before being linked
+		for(j = levels - 1; j >= i; j--) {
+			memset(&list, 0, sizeof(struct block_id_list));
+			if(j < levels - 1) {
+				list.list[entries[j]] = path[j + 1];
+			}
+			if(write_block(path[j], &list, sizeof(struct block_id_list)) == -1) {
 				return -1;
 			}
-			triple_indirect_block.list[bucket] = data_block.data_block_id;
-			write_block(triple_indirect_block_id, &triple_indirect_block, sizeof(struct block_id_list));
 		}
-		return set_double_indirect_block_id(triple_indirect_block.list[bucket], offset, block_id);
+		if(i == 0) {
+			*root = path[0];
+		} else if(write_block_offset(path[i - 1], &path[i], sizeof(big_int), entries[i - 1] * sizeof(big_int)) == -1) {
+			return -1;
+		}
 	}
-	return -1;
+
+	*leaf = path[levels - 1];
+	*entry = entries[levels - 1];
+	return 0;
 }
 
+// The missing indirect blocks go right after the block they map
 int set_block_id(struct inode *inode, big_int index, big_int block_id) {
+	big_int leaf, entry, goal = block_id;
+
 	// Check for direct block
 	if(index < NUM_DIRECT_BLOCKS) {
 		inode->direct_blocks[index] = block_id;
 		return 0;
 	}
 
-	index -= NUM_DIRECT_BLOCKS;
+	if(find_indirect_entry(inode, index, 1, &goal, NULL, &leaf, &entry) == -1) {
+		return -1;
+	}
+	return write_block_offset(leaf, &block_id, sizeof(big_int), entry * sizeof(big_int));
+}
 
-	if(index < BLOCK_ID_LIST_LENGTH) {
-		// Make sure we have valid block
-		if(inode->single_indirect_block == 0) {
-			struct data_block data_block;
-			if(data_block_alloc(&data_block) == -1) {
-				fprintf(stderr, "Failed to alloc data block\n");
+int set_block_id_range(struct inode *inode, big_int index, big_int first_block_id, big_int count) {
+	big_int block_ids[BLOCK_ID_LIST_LENGTH], leaf, entry, length, i, goal = first_block_id;
+
+	while(count > 0) {
+		if(index < NUM_DIRECT_BLOCKS) {
+			inode->direct_blocks[index++] = first_block_id;
+			first_block_id += first_block_id != 0;
+			count--;
+			continue;
+		}
+
+		// The entries that share an indirect block are written at once
+		if(find_indirect_entry(inode, index, first_block_id != 0, &goal, NULL, &leaf, &entry) == -1) {
+			return -1;
+		}
+		length = BLOCK_ID_LIST_LENGTH - entry < count ? BLOCK_ID_LIST_LENGTH - entry : count;
+		if(leaf != 0) {
+			for(i = 0; i < length; i++) {
+				block_ids[i] = first_block_id ? first_block_id + i : 0;
+			}
+			if(write_block_offset(leaf, block_ids, length * sizeof(big_int), entry * sizeof(big_int)) == -1) {
 				return -1;
 			}
-			inode->single_indirect_block = data_block.data_block_id;
 		}
-		return set_single_indirect_block_id(inode->single_indirect_block, index, block_id);
+
+		index += length;
+		count -= length;
+		if(first_block_id != 0) {
+			first_block_id += length;
+		}
 	}
+	return 0;
+}
 
-	index -= BLOCK_ID_LIST_LENGTH;
+int prepare_block_map(struct inode *inode, big_int index, big_int count, big_int *goal, big_int *reservation) {
+	big_int leaf, entry;
 
-	if(index < BLOCK_ID_LIST_LENGTH * BLOCK_ID_LIST_LENGTH) {
-		// Make sure we have valid block
-		if(inode->double_indirect_block == 0) {
-			struct data_block data_block;
-			if(data_block_alloc(&data_block) == -1) {
-				fprintf(stderr, "Failed to alloc data block\n");
-				return -1;
-			}
-			inode->double_indirect_block = data_block.data_block_id;
+	if(index < NUM_DIRECT_BLOCKS) {
+		count -= NUM_DIRECT_BLOCKS - index < count ? NUM_DIRECT_BLOCKS - index : count;
+		index = NUM_DIRECT_BLOCKS;
+	}
+
+	// One lookup per indirect block holding entries of the range
+	while(count > 0) {
+		if(find_indirect_entry(inode, index, 1, goal, reservation, &leaf, &entry) == -1) {
+			return -1;
 		}
-		return set_double_indirect_block_id(inode->double_indirect_block, index, block_id);
+		index += BLOCK_ID_LIST_LENGTH - entry;
+		count -= BLOCK_ID_LIST_LENGTH - entry < count ? BLOCK_ID_LIST_LENGTH - entry : count;
 	}
+	return 0;
+}
 
-	index -= BLOCK_ID_LIST_LENGTH * BLOCK_ID_LIST_LENGTH;
+big_int count_index_blocks(big_int index, big_int count) {
+	big_int first = NUM_DIRECT_BLOCKS, span = BLOCK_ID_LIST_LENGTH, end = index + count, total = 0;
+	int levels, level;
 
-	if(index < BLOCK_ID_LIST_LENGTH * BLOCK_ID_LIST_LENGTH * BLOCK_ID_LIST_LENGTH) {
-		// Make sure we have valid block
-		if(inode->triple_indirect_block == 0) {
-			struct data_block data_block;
-			if(data_block_alloc(&data_block) == -1) {
-				fprintf(stderr, "Failed to alloc data block\n");
-				return -1;
-			}
-			inode->triple_indirect_block = data_block.data_block_id;
-		}
-		return set_triple_indirect_block_id(inode->triple_indirect_block, index, block_id);
+	if(count == 0) {
+		return 0;
 	}
+	// The single, double and triple indirect blocks map the ranges of span blocks that follow the direct blocks
+	for(levels = 1; levels <= 3 && first < end; levels++, first += span, span *= BLOCK_ID_LIST_LENGTH) {
+		big_int begin = index > first ? index - first : 0, last = (end < first + span ? end : first + span) - first - 1;
+		big_int entries = 1;
 
-	fprintf(stderr, "index is out of range for set_block_id\n");
-	return -1;
-}
\ No newline at end of file
+		if(index >= first + span) {
+			continue;
+		}
+		// Each level has one block per BLOCK_ID_LIST_LENGTH^level blocks of the range
+		for(level = 1; level <= levels; level++) {
+			entries *= BLOCK_ID_LIST_LENGTH;
+			total += last / entries - begin / entries + 1;
+		}
+	}
+	return total;
+}
@@ -3,6 +3,8 @@
 
 #include "common.h"
 
+#define FREE_BATCH_BLOCKS 1024 // Blocks freed at once by free_block_map
+
 big_int get_single_indirect_block_id(big_int single_indirect_block_id, big_int index);
 
 big_int get_double_indirect_block_id(big_int double_indirect_block_id, big_int index);
@@ -11,12 +13,23 @@ big_int get_triple_indirect_block_id(big_int triple_indirect_block_id, big_int i
 
 big_int get_block_id(struct inode *inode, big_int index);
 
-int set_single_indirect_block_id(big_int single_indirect_block_id, big_int index, big_int block_id);
+// Frees every data block and indirect block mapped by the inode, FREE_BATCH_BLOCKS at a time, and clears its block
+// map. Unlike walking the first num_blocks blocks, it also finds the blocks preallocated past the end of the file.
+// Returns -1 if some of them could not be read or freed
+int free_block_map(struct inode *inode);
+
+int set_block_id(struct inode *inode, big_int index, big_int block_id);
 
-int set_double_indirect_block_id(big_int double_indirect_block_id, big_int index, big_int block_id);
+// Maps the count blocks of the inode from index to the blocks that follow first_block_id, or unmaps them when
+// first_block_id is 0, in which case the indirect blocks that don't exist are skipped instead of allocated
+int set_block_id_range(struct inode *inode, big_int index, big_int first_block_id, big_int count);
 
-int set_triple_indirect_block_id(big_int triple_indirect_block_id, big_int index, big_int block_id);
+// Allocates the indirect blocks missing to map the count blocks of the inode from index, one after the other from
+// *goal, and moves *goal past them. Called before allocating the data from *goal, the indirect blocks land right
+// before the data they map. They are taken from *reservation when it is not NULL (see data_block_reserve)
+int prepare_block_map(struct inode *inode, big_int index, big_int count, big_int *goal, big_int *reservation);
 
-int set_block_id(struct inode *inode, big_int index, big_int block_id);
+// Number of indirect blocks that map the count blocks of a file from index: the most prepare_block_map can allocate
+big_int count_index_blocks(big_int index, big_int count);
 
 #endif
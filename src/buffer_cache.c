@@ -0,0 +1,868 @@
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "buffer_cache.h"
+#include "disk_emulator.h"
+#include "uthash.h"
+
+// All the buffers are allocated once at init so the cache never uses more than BUFFER_CACHE_SIZE blocks.
+// Buffers are indexed by block id in a hash table and chained in a LRU list (lru.lru_next is the most recently used).
+//
+// Locking: buffer_cache_lock protects the hash table, the LRU list, the ref counts, the dirty flags and the stats.
+// It is never held during disk I/O. The content of a buffer is protected by its own lock, which is only taken
+// by threads that pinned the buffer, so an unpinned buffer can always be locked without waiting.
+// A thread holding a buffer lock may take buffer_cache_lock, never the other way around (except for unpinned buffers).
+static struct buffer *buffers = NULL;
+static struct buffer *buffer_table = NULL;
+static struct buffer lru;
+static struct buffer_cache_stats stats;
+static pthread_mutex_t buffer_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int write_back = 0;
+
+// Only one flush at a time, otherwise an old copy of a block could be written after a newer one
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static int flushing_buffers = 0; // Clean buffers pinned by the flush until their copy reaches the disk
+
+static pthread_t flusher;
+static int flusher_running = 0;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+
+static void lru_remove(struct buffer *buffer) {
+	buffer->lru_prev->lru_next = buffer->lru_next;
+	buffer->lru_next->lru_prev = buffer->lru_prev;
+}
+
+static void lru_push_front(struct buffer *buffer) {
+	buffer->lru_next = lru.lru_next;
+	buffer->lru_prev = &lru;
+	lru.lru_next->lru_prev = buffer;
+	lru.lru_next = buffer;
+}
+
+static void mark_clean(struct buffer *buffer) {
+	if (buffer->dirty) {
+		buffer->dirty = 0;
+		stats.dirty_blocks--;
+	}
+}
+
+static void mark_dirty(struct buffer *buffer) {
+	if (!buffer->dirty) {
+		buffer->dirty = 1;
+		buffer->dirty_since = time(NULL);
+		stats.dirty_blocks++;
+	}
+}
+
+static int is_dirty_ratio_exceeded(void) {
+	return stats.dirty_blocks * 100 >= (big_int) BUFFER_CACHE_SIZE * DIRTY_RATIO;
+}
+
+// Must be called with buffer_cache_lock held
+static void invalidate_buffer(struct buffer *buffer) {
+	if (buffer->valid) {
+		HASH_DEL(buffer_table, buffer);
+		buffer->valid = 0;
+	}
+	mark_clean(buffer);
+
+	// Invalid buffers are the first ones to be reused
+	lru_remove(buffer);
+	lru.lru_prev->lru_next = buffer;
+	buffer->lru_prev = lru.lru_prev;
+	buffer->lru_next = &lru;
+	lru.lru_prev = buffer;
+}
+
+static void unpin_buffer(struct buffer *buffer) {
+	pthread_mutex_lock(&buffer_cache_lock);
+	buffer->ref_count--;
+	pthread_mutex_unlock(&buffer_cache_lock);
+}
+
+static void release_buffer(struct buffer *buffer) {
+	pthread_mutex_unlock(&buffer->lock);
+	unpin_buffer(buffer);
+}
+
+// Returns the least recently used buffer that is neither pinned nor dirty, NULL if there is none
+static struct buffer * find_victim(void) {
+	struct buffer *buffer;
+
+	for (buffer = lru.lru_prev; buffer != &lru; buffer = buffer->lru_prev) {
+		if (buffer->ref_count == 0 && !buffer->dirty) {
+			return buffer;
+		}
+	}
+	return NULL;
+}
+
+static int flush_dirty_buffers(time_t dirty_before);
+
+// Must be called with buffer_cache_lock held (it may be released while dirty blocks are written back). The returned buffer is pinned.
+// If the block was not cached, a buffer is assigned to it and returned with its lock held and *created set to 1:
+// the caller has to fill it before unlocking it.
+static struct buffer * lookup_buffer(big_int block_id, int *created) {
+	struct buffer *buffer;
+
+	*created = 0;
+	HASH_FIND(hh, buffer_table, &block_id, sizeof(big_int), buffer);
+	if (buffer) {
+		stats.hits++;
+		buffer->ref_count++;
+		lru_remove(buffer);
+		lru_push_front(buffer);
+		return buffer;
+	}
+
+	stats.misses++;
+	while ((buffer = find_victim()) == NULL) {
+		if (stats.dirty_blocks == 0 && flushing_buffers == 0) {
+			fprintf(stderr, "all the buffers of the cache are pinned\n");
+			return NULL;
+		}
+
+		// Every unpinned buffer is dirty (or being written back), write them back to make room
+		pthread_mutex_unlock(&buffer_cache_lock);
+		int flushed = flush_dirty_buffers(time(NULL));
+		pthread_mutex_lock(&buffer_cache_lock);
+		if (flushed == -1) {
+			return NULL;
+		}
+
+		// The block might have been loaded by someone else in the meantime
+		HASH_FIND(hh, buffer_table, &block_id, sizeof(big_int), buffer);
+		if (buffer) {
+			buffer->ref_count++;
+			lru_remove(buffer);
+			lru_push_front(buffer);
+			return buffer;
+		}
+	}
+
+	if (buffer->valid) {
+		LOGD("evicting block %" PRIu64 " from buffer cache", buffer->block_id);
+		HASH_DEL(buffer_table, buffer);
+		stats.evictions++;
+	}
+
+	pthread_mutex_lock(&buffer->lock); // Never blocks as the buffer is not pinned
+	buffer->block_id = block_id;
+	buffer->valid = 1;
+	buffer->ref_count = 1;
+	HASH_ADD(hh, buffer_table, block_id, sizeof(big_int), buffer);
+	lru_remove(buffer);
+	lru_push_front(buffer);
+	*created = 1;
+	return buffer;
+}
+
+// Returns the buffer of block_id pinned and locked. The block is read from disk if it was not cached,
+// unless read_from_disk is 0 (the caller will then overwrite the whole block).
+static struct buffer * acquire_buffer(big_int block_id, int read_from_disk) {
+	struct buffer *buffer;
+	int created;
+
+	pthread_mutex_lock(&buffer_cache_lock);
+	buffer = lookup_buffer(block_id, &created);
+	pthread_mutex_unlock(&buffer_cache_lock);
+
+	if (buffer == NULL) {
+		return NULL;
+	}
+
+	if (!created) {
+		// Waits for the thread that is loading the block if any
+		pthread_mutex_lock(&buffer->lock);
+		if (!buffer->valid) {
+			// Loading the block failed
+			pthread_mutex_unlock(&buffer->lock);
+			unpin_buffer(buffer);
+			return NULL;
+		}
+		return buffer;
+	}
+
+	if (read_from_disk && device_read_block(block_id, buffer->data) == -1) {
+		pthread_mutex_lock(&buffer_cache_lock);
+		invalidate_buffer(buffer);
+		pthread_mutex_unlock(&buffer_cache_lock);
+		release_buffer(buffer);
+		return NULL;
+	}
+	return buffer;
+}
+
+// Must be called with the buffer locked once its content was modified
+static int commit_buffer(struct buffer *buffer) {
+	if (write_back) {
+		pthread_mutex_lock(&buffer_cache_lock);
+		mark_dirty(buffer);
+		if (is_dirty_ratio_exceeded()) {
+			pthread_cond_signal(&flusher_cond);
+		}
+		pthread_mutex_unlock(&buffer_cache_lock);
+		return 0;
+	}
+
+	// Write-through: the disk is always up to date with the cache
+	if (device_write_block(buffer->block_id, buffer->data, BLOCK_SIZE) == -1) {
+		pthread_mutex_lock(&buffer_cache_lock);
+		invalidate_buffer(buffer);
+		pthread_mutex_unlock(&buffer_cache_lock);
+		return -1;
+	}
+
+	pthread_mutex_lock(&buffer_cache_lock);
+	mark_clean(buffer);
+	pthread_mutex_unlock(&buffer_cache_lock);
+	return 0;
+}
+
+static int compare_buffers_by_block_id(const void *a, const void *b) {
+	big_int block_a = (*(struct buffer * const *) a)->block_id;
+	big_int block_b = (*(struct buffer * const *) b)->block_id;
+	return (block_a > block_b) - (block_a < block_b);
+}
+
+// ios are sorted by block id and hold each block once. Every run of contiguous blocks is written with one
+// vectored write, the isolated blocks are submitted together as one batch.
+static int write_coalesced_blocks(struct block_io *ios, int count) {
+	struct block_io *isolated;
+	struct iovec *iov;
+	int i, j, run, num_isolated = 0, num_runs = 0, result = 0;
+
+	isolated = (struct block_io *) malloc(count * sizeof(struct block_io));
+	iov = (struct iovec *) malloc(count * sizeof(struct iovec));
+	for (i = 0; i < count; i += run) {
+		run = 1;
+		while (i + run < count && ios[i + run].block_id == ios[i].block_id + run) {
+			run++;
+		}
+		if (run == 1) {
+			isolated[num_isolated++] = ios[i];
+			continue;
+		}
+
+		for (j = 0; j < run; j++) {
+			iov[j].iov_base = ios[i + j].buffer;
+			iov[j].iov_len = BLOCK_SIZE;
+		}
+		if (device_write_blocks(ios[i].block_id, run, iov) == -1) {
+			result = -1;
+		}
+		num_runs++;
+	}
+
+	if (num_isolated > 0 && device_write_block_batch(isolated, num_isolated) == -1) {
+		result = -1;
+	}
+	free(isolated);
+	free(iov);
+
+	pthread_mutex_lock(&buffer_cache_lock);
+	stats.coalesced_runs += num_runs;
+	pthread_mutex_unlock(&buffer_cache_lock);
+	return result;
+}
+
+// Write to disk the dirty blocks that were dirtied before dirty_before. A block written several times since the last
+// flush is written once, and the blocks are written in block id order with the contiguous ones merged.
+// The blocks are copied so writers are not blocked during the disk writes.
+static int flush_dirty_buffers(time_t dirty_before) {
+	struct buffer **dirty_buffers;
+	struct block_io *ios;
+	char *data;
+	int i, copied, count = 0, result = 0;
+
+	pthread_mutex_lock(&flush_lock);
+	pthread_mutex_lock(&buffer_cache_lock);
+
+	if (buffers == NULL || stats.dirty_blocks == 0) {
+		pthread_mutex_unlock(&buffer_cache_lock);
+		pthread_mutex_unlock(&flush_lock);
+		return 0;
+	}
+
+	dirty_buffers = (struct buffer **) malloc(stats.dirty_blocks * sizeof(struct buffer *));
+	if (dirty_buffers == NULL) {
+		pthread_mutex_unlock(&buffer_cache_lock);
+		pthread_mutex_unlock(&flush_lock);
+		fprintf(stderr, "failed to allocate the list of dirty blocks\n");
+		return -1;
+	}
+	for (i = 0; i < BUFFER_CACHE_SIZE; i++) {
+		if (buffers[i].dirty && buffers[i].dirty_since <= dirty_before) {
+			buffers[i].ref_count++;
+			dirty_buffers[count++] = &buffers[i];
+		}
+	}
+
+	flushing_buffers += count;
+	pthread_mutex_unlock(&buffer_cache_lock);
+
+	qsort(dirty_buffers, count, sizeof(struct buffer *), compare_buffers_by_block_id);
+
+	ios = (struct block_io *) malloc(count * sizeof(struct block_io));
+	if (posix_memalign((void **) &data, DIRECT_IO_ALIGNMENT, (size_t) count * BLOCK_SIZE) != 0) {
+		data = NULL;
+	}
+	if (count > 0 && (ios == NULL || data == NULL)) {
+		// Nothing was copied, the blocks stay dirty for the next flush
+		fprintf(stderr, "failed to allocate the copies of %d dirty blocks\n", count);
+		pthread_mutex_lock(&buffer_cache_lock);
+		for (i = 0; i < count; i++) {
+			dirty_buffers[i]->ref_count--;
+		}
+		flushing_buffers -= count;
+		pthread_mutex_unlock(&buffer_cache_lock);
+		pthread_mutex_unlock(&flush_lock);
+		free(dirty_buffers);
+		free(ios);
+		free(data);
+		return -1;
+	}
+	for (i = 0, copied = 0; i < count; i++) {
+		struct buffer *buffer = dirty_buffers[i];
+
+		pthread_mutex_lock(&buffer->lock);
+		if (buffer->valid && buffer->dirty) {
+			ios[copied].block_id = buffer->block_id;
+			ios[copied].buffer = data + (size_t) copied * BLOCK_SIZE;
+			memcpy(ios[copied].buffer, buffer->data, BLOCK_SIZE);
+			dirty_buffers[copied++] = buffer;
+			pthread_mutex_lock(&buffer_cache_lock);
+			mark_clean(buffer);
+			pthread_mutex_unlock(&buffer_cache_lock);
+
+			// Stays pinned until the copy is on disk, otherwise it could be evicted and read back from disk before that
+			pthread_mutex_unlock(&buffer->lock);
+		} else {
+			release_buffer(buffer);
+			pthread_mutex_lock(&buffer_cache_lock);
+			flushing_buffers--;
+			pthread_mutex_unlock(&buffer_cache_lock);
+		}
+	}
+	count = copied;
+
+	if (count > 0 && write_coalesced_blocks(ios, count) == -1) {
+		result = -1;
+	}
+
+	pthread_mutex_lock(&buffer_cache_lock);
+	for (i = 0; i < count; i++) {
+		if (result == -1 && dirty_buffers[i]->valid) {
+			// Keep the block dirty so it is written again later
+			mark_dirty(dirty_buffers[i]);
+		}
+		dirty_buffers[i]->ref_count--;
+	}
+	flushing_buffers -= count;
+	stats.writebacks += count;
+	pthread_mutex_unlock(&buffer_cache_lock);
+	pthread_mutex_unlock(&flush_lock);
+
+	LOGD("flushed %d dirty blocks", count);
+	free(dirty_buffers);
+	free(ios);
+	free(data);
+	return result;
+}
+
+// Wakes up every FLUSHER_INTERVAL_SECONDS (or when too many blocks are dirty) and writes back
+// the blocks that have been dirty for more than DIRTY_EXPIRE_SECONDS
+static void * flusher_main(void *arg) {
+	(void) arg;
+
+	pthread_mutex_lock(&buffer_cache_lock);
+	while (flusher_running) {
+		struct timespec timeout;
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_sec += FLUSHER_INTERVAL_SECONDS;
+		pthread_cond_timedwait(&flusher_cond, &buffer_cache_lock, &timeout);
+
+		if (!flusher_running) {
+			break;
+		}
+
+		time_t dirty_before = time(NULL) - DIRTY_EXPIRE_SECONDS;
+		if (is_dirty_ratio_exceeded()) {
+			dirty_before = time(NULL);
+		}
+
+		pthread_mutex_unlock(&buffer_cache_lock);
+		flush_dirty_buffers(dirty_before);
+		pthread_mutex_lock(&buffer_cache_lock);
+	}
+	pthread_mutex_unlock(&buffer_cache_lock);
+	return NULL;
+}
+
+int init_buffer_cache(void) {
+	int i;
+
+	if (buffers) {
+		return -1; // Cache already initialised
+	}
+
+	// Aligned so that the buffers can be read and written with O_DIRECT
+	if (posix_memalign((void **) &buffers, DIRECT_IO_ALIGNMENT, BUFFER_CACHE_SIZE * sizeof(struct buffer)) != 0) {
+		fprintf(stderr, "failed to allocate buffer cache\n");
+		buffers = NULL;
+		return -1;
+	}
+	memset(buffers, 0, BUFFER_CACHE_SIZE * sizeof(struct buffer));
+
+	buffer_table = NULL;
+	lru.lru_next = &lru;
+	lru.lru_prev = &lru;
+	for (i = 0; i < BUFFER_CACHE_SIZE; i++) {
+		pthread_mutex_init(&buffers[i].lock, NULL);
+		lru_push_front(&buffers[i]);
+	}
+	memset(&stats, 0, sizeof(struct buffer_cache_stats));
+	return 0;
+}
+
+void free_buffer_cache(void) {
+	int i;
+
+	if (buffers == NULL) {
+		return;
+	}
+
+	stop_buffer_cache_flusher();
+	if (sync_buffer_cache() == -1) {
+		fprintf(stderr, "failed to write back dirty blocks\n");
+	}
+
+	LOGD("buffer cache hits: %" PRIu64 ", misses: %" PRIu64 ", evictions: %" PRIu64, stats.hits, stats.misses, stats.evictions);
+	pthread_mutex_lock(&buffer_cache_lock);
+	HASH_CLEAR(hh, buffer_table);
+	for (i = 0; i < BUFFER_CACHE_SIZE; i++) {
+		pthread_mutex_destroy(&buffers[i].lock);
+	}
+	free(buffers);
+	buffers = NULL;
+	pthread_mutex_unlock(&buffer_cache_lock);
+}
+
+void set_buffer_cache_write_back(int enabled) {
+	pthread_mutex_lock(&buffer_cache_lock);
+	write_back = enabled;
+	pthread_mutex_unlock(&buffer_cache_lock);
+
+	if (!enabled) {
+		sync_buffer_cache();
+	}
+}
+
+int start_buffer_cache_flusher(void) {
+	pthread_mutex_lock(&buffer_cache_lock);
+	if (flusher_running) {
+		pthread_mutex_unlock(&buffer_cache_lock);
+		return -1;
+	}
+
+	flusher_running = 1;
+	if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+		fprintf(stderr, "failed to start the flusher thread\n");
+		flusher_running = 0;
+		pthread_mutex_unlock(&buffer_cache_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&buffer_cache_lock);
+	return 0;
+}
+
+void stop_buffer_cache_flusher(void) {
+	pthread_mutex_lock(&buffer_cache_lock);
+	if (!flusher_running) {
+		pthread_mutex_unlock(&buffer_cache_lock);
+		return;
+	}
+
+	flusher_running = 0;
+	pthread_cond_signal(&flusher_cond);
+	pthread_mutex_unlock(&buffer_cache_lock);
+	pthread_join(flusher, NULL);
+}
+
+int sync_buffer_cache(void) {
+	return flush_dirty_buffers(time(NULL));
+}
+
+struct buffer * buffer_get(big_int block_id) {
+	return acquire_buffer(block_id, 1);
+}
+
+void buffer_release(struct buffer *buffer) {
+	release_buffer(buffer);
+}
+
+int buffer_cache_read(big_int block_id, void *target) {
+	struct buffer *buffer = acquire_buffer(block_id, 1);
+	if (buffer == NULL) {
+		return -1;
+	}
+
+	memcpy(target, buffer->data, BLOCK_SIZE);
+	release_buffer(buffer);
+	return 0;
+}
+
+int buffer_cache_write(big_int block_id, void *data, size_t buffer_size) {
+	int result;
+	size_t copy_size = buffer_size < BLOCK_SIZE ? buffer_size : BLOCK_SIZE;
+	struct buffer *buffer = acquire_buffer(block_id, 0);
+	if (buffer == NULL) {
+		return -1;
+	}
+
+	memcpy(buffer->data, data, copy_size);
+	if (copy_size < BLOCK_SIZE) {
+		memset(buffer->data + copy_size, 0, BLOCK_SIZE - copy_size);
+	}
+
+	result = commit_buffer(buffer);
+	release_buffer(buffer);
+	return result;
+}
+
+int buffer_cache_write_offset(big_int block_id, void *data, size_t buffer_size, int offset) {
+	int result;
+	struct buffer *buffer = acquire_buffer(block_id, 1);
+	if (buffer == NULL) {
+		return -1;
+	}
+
+	memcpy(buffer->data + offset, data, buffer_size);
+	result = commit_buffer(buffer);
+	release_buffer(buffer);
+	return result;
+}
+
+// Copies the cached content of block_id to target. Returns -1 if the block is not cached
+static int copy_cached_block(big_int block_id, void *target) {
+	struct buffer *buffer;
+	int result = -1;
+
+	pthread_mutex_lock(&buffer_cache_lock);
+	HASH_FIND(hh, buffer_table, &block_id, sizeof(big_int), buffer);
+	if (buffer == NULL) {
+		pthread_mutex_unlock(&buffer_cache_lock);
+		return -1;
+	}
+	buffer->ref_count++;
+	lru_remove(buffer);
+	lru_push_front(buffer);
+	pthread_mutex_unlock(&buffer_cache_lock);
+
+	pthread_mutex_lock(&buffer->lock);
+	if (buffer->valid) {
+		memcpy(target, buffer->data, BLOCK_SIZE);
+		result = 0;
+	}
+	release_buffer(buffer);
+	return result;
+}
+
+// Misses are not cached: batches are used for bulk transfers that would only evict hotter blocks
+int buffer_cache_read_batch(struct block_io *ios, int count) {
+	struct block_io *misses;
+	int i, num_misses = 0, hits = 0;
+
+	misses = (struct block_io *) malloc(count * sizeof(struct block_io));
+	for (i = 0; i < count; i++) {
+		if (copy_cached_block(ios[i].block_id, ios[i].buffer) == 0) {
+			hits++;
+		} else {
+			misses[num_misses++] = ios[i];
+		}
+	}
+
+	pthread_mutex_lock(&buffer_cache_lock);
+	stats.hits += hits;
+	stats.misses += num_misses;
+	pthread_mutex_unlock(&buffer_cache_lock);
+
+	if (num_misses > 0 && device_read_block_batch(misses, num_misses) == -1) {
+		free(misses);
+		return -1;
+	}
+
+	// A block cached while we were reading the disk may be more recent than what we read
+	for (i = 0; i < num_misses; i++) {
+		copy_cached_block(misses[i].block_id, misses[i].buffer);
+	}
+	free(misses);
+	return 0;
+}
+
+// The cached blocks (which may be dirty) are copied, each run of missing blocks is read from disk with one vectored read
+int buffer_cache_read_blocks(big_int start_block_id, int count, struct iovec *iov) {
+	char *cached;
+	int i, j, run, hits = 0;
+
+	cached = (char *) malloc(count);
+	for (i = 0; i < count; i++) {
+		cached[i] = copy_cached_block(start_block_id + i, iov[i].iov_base) == 0;
+		hits += cached[i];
+	}
+
+	for (i = 0; i < count; i += run) {
+		run = 1;
+		if (cached[i]) {
+			continue;
+		}
+		while (i + run < count && !cached[i + run]) {
+			run++;
+		}
+		if (device_read_blocks(start_block_id + i, run, &iov[i]) == -1) {
+			free(cached);
+			return -1;
+		}
+
+		// A block cached while we were reading the disk may be more recent than what we read
+		for (j = i; j < i + run; j++) {
+			copy_cached_block(start_block_id + j, iov[j].iov_base);
+		}
+	}
+	free(cached);
+
+	pthread_mutex_lock(&buffer_cache_lock);
+	stats.hits += hits;
+	stats.misses += count - hits;
+	pthread_mutex_unlock(&buffer_cache_lock);
+	return 0;
+}
+
+// Loads the blocks that are not cached with one batch read. Best effort: it stops when there is no clean buffer
+// to reuse rather than writing dirty blocks back, and the blocks that someone else is loading are skipped.
+int buffer_cache_prefetch(big_int *block_ids, int count) {
+	struct buffer **loading;
+	struct block_io *ios;
+	int i, num_loading = 0, result = 0;
+
+	loading = (struct buffer **) malloc(count * sizeof(struct buffer *));
+	ios = (struct block_io *) malloc(count * sizeof(struct block_io));
+
+	pthread_mutex_lock(&buffer_cache_lock);
+	for (i = 0; i < count; i++) {
+		struct buffer *buffer;
+		int created;
+
+		HASH_FIND(hh, buffer_table, &block_ids[i], sizeof(big_int), buffer);
+		if (buffer) {
+			continue;
+		}
+		// Writing dirty blocks back could wait for a buffer locked by a thread waiting for the ones we are loading
+		if (find_victim() == NULL) {
+			break;
+		}
+
+		buffer = lookup_buffer(block_ids[i], &created);
+		loading[num_loading] = buffer;
+		ios[num_loading].block_id = block_ids[i];
+		ios[num_loading].buffer = buffer->data;
+		num_loading++;
+	}
+	stats.prefetches += num_loading;
+	pthread_mutex_unlock(&buffer_cache_lock);
+
+	if (num_loading > 0 && device_read_block_batch(ios, num_loading) == -1) {
+		result = -1;
+	}
+
+	for (i = 0; i < num_loading; i++) {
+		if (result == -1) {
+			pthread_mutex_lock(&buffer_cache_lock);
+			invalidate_buffer(loading[i]);
+			pthread_mutex_unlock(&buffer_cache_lock);
+		}
+		release_buffer(loading[i]);
+	}
+	free(loading);
+	free(ios);
+	return result;
+}
+
+// In write-back mode the blocks only have to be updated in the cache
+static int write_back_blocks(struct block_io *ios, int count) {
+	int i;
+
+	for (i = 0; i < count; i++) {
+		struct buffer *buffer = acquire_buffer(ios[i].block_id, 0);
+		if (buffer == NULL) {
+			return -1;
+		}
+
+		memcpy(buffer->data, ios[i].buffer, BLOCK_SIZE);
+		pthread_mutex_lock(&buffer_cache_lock);
+		mark_dirty(buffer);
+		if (is_dirty_ratio_exceeded()) {
+			pthread_cond_signal(&flusher_cond);
+		}
+		pthread_mutex_unlock(&buffer_cache_lock);
+		release_buffer(buffer);
+	}
+	return 0;
+}
+
+// Write-through of up to WRITE_THROUGH_BATCH_SIZE blocks, sorted by block id and without duplicates.
+// The buffers stay locked until the disk is written so that the cache and the disk always hold the same
+// version of a block. They are locked in block id order so threads locking several buffers can't deadlock.
+// If contiguous is set the blocks are written with one vectored write, otherwise with one batch.
+static int write_through_blocks(struct block_io *ios, int count, int contiguous) {
+	struct buffer *held[WRITE_THROUGH_BATCH_SIZE];
+	struct block_io device_ios[WRITE_THROUGH_BATCH_SIZE];
+	struct iovec iov[WRITE_THROUGH_BATCH_SIZE];
+	int i, acquired, result;
+
+	for (acquired = 0; acquired < count; acquired++) {
+		held[acquired] = acquire_buffer(ios[acquired].block_id, 0);
+		if (held[acquired] == NULL) {
+			break;
+		}
+		memcpy(held[acquired]->data, ios[acquired].buffer, BLOCK_SIZE);
+		device_ios[acquired].block_id = ios[acquired].block_id;
+		device_ios[acquired].buffer = held[acquired]->data;
+		iov[acquired].iov_base = held[acquired]->data;
+		iov[acquired].iov_len = BLOCK_SIZE;
+	}
+
+	if (acquired < count) {
+		result = -1;
+	} else if (contiguous) {
+		result = device_write_blocks(ios[0].block_id, count, iov);
+	} else {
+		result = device_write_block_batch(device_ios, count);
+	}
+
+	for (i = 0; i < acquired; i++) {
+		if (result == -1) {
+			// Some of the buffers may not have been fully written
+			pthread_mutex_lock(&buffer_cache_lock);
+			invalidate_buffer(held[i]);
+			pthread_mutex_unlock(&buffer_cache_lock);
+		}
+		release_buffer(held[i]);
+	}
+	return result;
+}
+
+static int compare_block_ios(const void *a, const void *b) {
+	const struct block_io *io_a = *(const struct block_io * const *) a;
+	const struct block_io *io_b = *(const struct block_io * const *) b;
+
+	if (io_a->block_id != io_b->block_id) {
+		return (io_a->block_id > io_b->block_id) - (io_a->block_id < io_b->block_id);
+	}
+	// Keeps the order of the batch for the same block so that the last write wins
+	return (io_a > io_b) - (io_a < io_b);
+}
+
+int buffer_cache_write_batch(struct block_io *ios, int count) {
+	struct block_io **sorted_ios, *unique_ios;
+	int i, num_unique = 0, result = 0;
+
+	if (write_back) {
+		return write_back_blocks(ios, count);
+	}
+
+	sorted_ios = (struct block_io **) malloc(count * sizeof(struct block_io *));
+	unique_ios = (struct block_io *) malloc(count * sizeof(struct block_io));
+	for (i = 0; i < count; i++) {
+		sorted_ios[i] = &ios[i];
+	}
+	qsort(sorted_ios, count, sizeof(struct block_io *), compare_block_ios);
+	for (i = 0; i < count; i++) {
+		if (i < count - 1 && sorted_ios[i + 1]->block_id == sorted_ios[i]->block_id) {
+			continue;
+		}
+		unique_ios[num_unique++] = *sorted_ios[i];
+	}
+
+	for (i = 0; i < num_unique && result == 0; i += WRITE_THROUGH_BATCH_SIZE) {
+		int batch = num_unique - i < WRITE_THROUGH_BATCH_SIZE ? num_unique - i : WRITE_THROUGH_BATCH_SIZE;
+		result = write_through_blocks(&unique_ios[i], batch, 0);
+	}
+
+	free(sorted_ios);
+	free(unique_ios);
+	return result;
+}
+
+int buffer_cache_write_blocks(big_int start_block_id, int count, struct iovec *iov) {
+	struct block_io ios[WRITE_THROUGH_BATCH_SIZE];
+	int i, j, batch, result = 0;
+
+	for (i = 0; i < count && result == 0; i += batch) {
+		batch = count - i < WRITE_THROUGH_BATCH_SIZE ? count - i : WRITE_THROUGH_BATCH_SIZE;
+		for (j = 0; j < batch; j++) {
+			ios[j].block_id = start_block_id + i + j;
+			ios[j].buffer = iov[i + j].iov_base;
+		}
+		result = write_back ? write_back_blocks(ios, batch) : write_through_blocks(ios, batch, 1);
+	}
+	return result;
+}
+
+static void clear_cached_blocks(big_int start_block_id, big_int count) {
+	big_int i;
+	int busy = 0;
+
+	for (i = 0; i < count; i++) {
+		big_int block_id = start_block_id + i;
+		struct buffer *buffer;
+
+		pthread_mutex_lock(&buffer_cache_lock);
+		HASH_FIND(hh, buffer_table, &block_id, sizeof(big_int), buffer);
+		if (buffer == NULL) {
+			pthread_mutex_unlock(&buffer_cache_lock);
+			continue;
+		}
+		busy |= buffer->ref_count > 0;
+		buffer->ref_count++;
+		pthread_mutex_unlock(&buffer_cache_lock);
+
+		// The cached copy is cleared instead of dropped, a thread waiting for the buffer still finds it valid
+		pthread_mutex_lock(&buffer->lock);
+		if (buffer->valid) {
+			memset(buffer->data, 0, BLOCK_SIZE);
+		}
+		pthread_mutex_lock(&buffer_cache_lock);
+		mark_clean(buffer);
+		pthread_mutex_unlock(&buffer_cache_lock);
+		release_buffer(buffer);
+	}
+
+	// A pinned buffer may have a copy being written back by the flush in progress, it has to reach the disk
+	// before the block is zeroed out or discarded
+	if (busy) {
+		pthread_mutex_lock(&flush_lock);
+		pthread_mutex_unlock(&flush_lock);
+	}
+}
+
+int buffer_cache_zero_blocks(big_int start_block_id, big_int count) {
+	clear_cached_blocks(start_block_id, count);
+	return device_zero_out(start_block_id, count);
+}
+
+int buffer_cache_forget_blocks(big_int start_block_id, big_int count, int discard) {
+	clear_cached_blocks(start_block_id, count);
+	if (discard) {
+		return device_discard(start_block_id, count);
+	}
+	return device_punch(start_block_id, count) == -1;
+}
+
+void get_buffer_cache_stats(struct buffer_cache_stats *target) {
+	pthread_mutex_lock(&buffer_cache_lock);
+	memcpy(target, &stats, sizeof(struct buffer_cache_stats));
+	pthread_mutex_unlock(&buffer_cache_lock);
+}
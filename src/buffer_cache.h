@@ -0,0 +1,76 @@
+#ifndef _BUFFER_CACHE_
+#define _BUFFER_CACHE_
+
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "uthash.h"
+#include "uring_queue.h"
+
+#define WRITE_THROUGH_BATCH_SIZE 64 // Maximum number of buffers locked at once by a multi-block write
+
+struct buffer {
+	char data[BLOCK_SIZE] __attribute__((aligned(DIRECT_IO_ALIGNMENT))); // First to avoid padding
+	big_int block_id;
+	int valid; // 1 if the buffer holds the content of block_id
+	int ref_count; // Number of users that pinned the buffer. A pinned buffer is never evicted
+	int dirty; // 1 if the buffer was modified and not yet written to disk (write-back mode only)
+	time_t dirty_since;
+	pthread_mutex_t lock; // Protects data. Only taken by threads that pinned the buffer
+	struct buffer *lru_prev;
+	struct buffer *lru_next;
+	UT_hash_handle hh;
+};
+
+struct buffer_cache_stats {
+	big_int hits;
+	big_int misses;
+	big_int evictions;
+	big_int writebacks; // Number of dirty blocks written to disk
+	big_int coalesced_runs; // Number of runs of contiguous dirty blocks written back with a single write
+	big_int prefetches; // Number of blocks loaded by buffer_cache_prefetch (also counted as misses)
+	big_int dirty_blocks;
+};
+
+int init_buffer_cache(void);
+void free_buffer_cache(void); // Writes dirty blocks back and drops every cached block
+
+// In write-back mode, writes only update the cache and dirty blocks are written to disk later by the flusher thread
+// or when calling sync_buffer_cache(). Write-through (the default) writes every block to disk immediately.
+void set_buffer_cache_write_back(int enabled);
+int start_buffer_cache_flusher(void);
+void stop_buffer_cache_flusher(void);
+int sync_buffer_cache(void); // Writes every dirty block to disk, in block id order
+
+struct buffer * buffer_get(big_int block_id); // Returns the block pinned and locked in the cache (read from disk on a miss), NULL on failure
+void buffer_release(struct buffer *buffer); // Unlock and unpin a buffer returned by buffer_get
+
+int buffer_cache_read(big_int block_id, void *target);
+int buffer_cache_write(big_int block_id, void *buffer, size_t buffer_size); // Same semantic as write_block: data is padded with 0s
+int buffer_cache_write_offset(big_int block_id, void *buffer, size_t buffer_size, int offset); // Atomic read-modify-write of part of a block
+
+// Blocks missing from the cache are read from disk in a single batch and are not cached
+int buffer_cache_read_batch(struct block_io *ios, int count);
+// Blocks are cached then, in write-through mode, written to disk in batches of WRITE_THROUGH_BATCH_SIZE blocks
+int buffer_cache_write_batch(struct block_io *ios, int count);
+
+// Same for the count contiguous blocks starting at start_block_id, iov[i] holds block start_block_id + i.
+// The disk is accessed with vectored I/O.
+int buffer_cache_read_blocks(big_int start_block_id, int count, struct iovec *iov);
+int buffer_cache_write_blocks(big_int start_block_id, int count, struct iovec *iov);
+
+// Loads the blocks in the cache ahead of their use, without copying them anywhere
+int buffer_cache_prefetch(big_int *block_ids, int count);
+
+// The count blocks from start_block_id read as 0s from now on: their cached copies are cleared and marked clean,
+// and they are zeroed out on the disk (see device_zero_out)
+int buffer_cache_zero_blocks(big_int start_block_id, big_int count);
+// Same for blocks that are freed: with discard the disk is told that they are unused (see device_discard),
+// otherwise holes are punched in them when the disk can (see device_punch). Returns 1 if the disk keeps their
+// content, they are left for the trimmer
+int buffer_cache_forget_blocks(big_int start_block_id, big_int count, int discard);
+
+void get_buffer_cache_stats(struct buffer_cache_stats *stats);
+
+#endif
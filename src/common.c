@@ -1,22 +1,185 @@
+#include <pthread.h>
+
 #include "common.h"
 #include "disk_emulator.h"
+#include "buffer_cache.h"
 #include "data_blocks_handler.h"
+#include "inodes_handler.h"
 #include "block_utils.h"
 #include "namei.h"
 
+static pthread_mutex_t superblock_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void lock_superblock(void) {
+	pthread_mutex_lock(&superblock_lock);
+}
+
+void unlock_superblock(void) {
+	pthread_mutex_unlock(&superblock_lock);
+}
+
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER; // Serializes the commits, protects last_commit
+static struct superblock last_commit;
+
+static pthread_t checkpointer;
+static int checkpointer_running = 0;
+static pthread_cond_t checkpointer_cond = PTHREAD_COND_INITIALIZER;
+
+const char *check_superblock(const struct superblock *sb) {
+	if(sb->magic != FSTR_MAGIC) {
+		return "no FSTR file system found, format it with mkfs.fstr";
+	}
+	if(sb->version != FSTR_VERSION) {
+		return "unsupported file system version";
+	}
+	// The layout is computed from constants of the build, it has to match the one mkfs used
+	if(sb->fs_size != FS_SIZE || sb->block_bitmap != BITMAP_BEGIN || sb->blocks_per_group != BLOCKS_PER_GROUP
+		|| sb->num_block_groups != NUM_BLOCK_GROUPS || sb->inode_bitmap != INODE_BITMAP_BEGIN) {
+		return "the file system was formatted with another size or layout";
+	}
+	if(sb->num_cached_free_blocks > FREE_BLOCKS_CACHE_SIZE || sb->num_cached_free_inodes > FREE_INODES_CACHE_SIZE) {
+		return "corrupted superblock";
+	}
+	return NULL;
+}
+
 int init_superblock(void) {
 	struct data_block block;
+	const char *reason;
+	int clean;
+
 	if(read_block(0, &block.block)) {
 		fprintf(stderr, "Failed to read superblock\n");
 		return -1;
 	}
 
+	reason = check_superblock((struct superblock *) block.block);
+	if(reason) {
+		fprintf(stderr, "Cannot mount the volume: %s\n", reason);
+		return -1;
+	}
+
+	lock_superblock();
 	memcpy(&superblock, &block.block, sizeof(struct superblock));
-	return 0;
+	clean = superblock.clean;
+	if(!clean) {
+		// The caches may be stale, their blocks and inodes are free in the bitmaps on disk
+		superblock.num_cached_free_blocks = 0;
+		superblock.num_cached_free_inodes = 0;
+	}
+	unlock_superblock();
+
+	init_inode_groups();
+	if(init_block_bitmap() == -1 || init_inode_bitmap() == -1) {
+		return -1;
+	}
+
+	if(!clean) {
+		fprintf(stderr, "The file system was not unmounted cleanly, recovering the free block and inode counters\n");
+		big_int free_blocks = count_free_blocks();
+		big_int free_inodes = count_free_inodes();
+		lock_superblock();
+		superblock.num_free_blocks = free_blocks;
+		superblock.num_free_inodes = free_inodes;
+		unlock_superblock();
+	}
+
+	// Mounted: the counters on disk can't be trusted until the next clean unmount
+	lock_superblock();
+	superblock.clean = 0;
+	unlock_superblock();
+	if(commit_superblock() == -1) {
+		return -1;
+	}
+	return sync_disk_emulator();
 }
 
 int commit_superblock(void) {
-	return write_block(0, &superblock, sizeof(struct superblock));
+	struct superblock copy;
+	int result;
+
+	// Write a consistent snapshot, other threads may be updating the counters
+	pthread_mutex_lock(&commit_lock);
+	lock_superblock();
+	memcpy(&copy, &superblock, sizeof(struct superblock));
+	unlock_superblock();
+	result = write_block(0, &copy, sizeof(struct superblock));
+	if(result == 0) {
+		memcpy(&last_commit, &copy, sizeof(struct superblock));
+	}
+	pthread_mutex_unlock(&commit_lock);
+	return result;
+}
+
+int unmount_superblock(void) {
+	lock_superblock();
+	superblock.clean = 1;
+	unlock_superblock();
+	return commit_superblock();
+}
+
+// Commits the superblock every CHECKPOINT_INTERVAL_SECONDS if it changed since the last commit. The buffer cache
+// writes it to disk with the other dirty blocks
+static void * checkpointer_main(void *arg) {
+	(void) arg;
+
+	pthread_mutex_lock(&commit_lock);
+	while(checkpointer_running) {
+		struct timespec timeout;
+		struct superblock copy;
+
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_sec += CHECKPOINT_INTERVAL_SECONDS;
+		pthread_cond_timedwait(&checkpointer_cond, &commit_lock, &timeout);
+
+		if(!checkpointer_running) {
+			break;
+		}
+
+		lock_superblock();
+		memcpy(&copy, &superblock, sizeof(struct superblock));
+		unlock_superblock();
+		if(memcmp(&copy, &last_commit, sizeof(struct superblock)) != 0) {
+			pthread_mutex_unlock(&commit_lock);
+			if(commit_superblock() == -1) {
+				fprintf(stderr, "failed to checkpoint the superblock\n");
+			}
+			pthread_mutex_lock(&commit_lock);
+		}
+	}
+	pthread_mutex_unlock(&commit_lock);
+	return NULL;
+}
+
+int start_superblock_checkpointer(void) {
+	pthread_mutex_lock(&commit_lock);
+	if(checkpointer_running) {
+		pthread_mutex_unlock(&commit_lock);
+		return -1;
+	}
+
+	checkpointer_running = 1;
+	if(pthread_create(&checkpointer, NULL, checkpointer_main, NULL) != 0) {
+		fprintf(stderr, "failed to start the superblock checkpointer thread\n");
+		checkpointer_running = 0;
+		pthread_mutex_unlock(&commit_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&commit_lock);
+	return 0;
+}
+
+void stop_superblock_checkpointer(void) {
+	pthread_mutex_lock(&commit_lock);
+	if(!checkpointer_running) {
+		pthread_mutex_unlock(&commit_lock);
+		return;
+	}
+
+	checkpointer_running = 0;
+	pthread_cond_signal(&checkpointer_cond);
+	pthread_mutex_unlock(&commit_lock);
+	pthread_join(checkpointer, NULL);
 }
 	
 int write_block_offset(big_int block_id, void *buffer, size_t buffer_size, int offset) {
@@ -25,13 +188,13 @@ int write_block_offset(big_int block_id, void *buffer, size_t buffer_size, int o
 		return -1;
 	}
 
-	char *target = malloc(sizeof(char) * BLOCK_SIZE);
-	read_block(block_id, target);
-	memcpy(target + offset, buffer, buffer_size);
-	write_block(block_id, target, BLOCK_SIZE);
-	free(target);
+	if(block_id >= NUM_BLOCKS) {
+		fprintf(stderr, "cannot write block id outside range\n");
+		return -1;
+	}
 
-	return 0;
+	// Done in place in the cache so that concurrent updates of other parts of the block are not lost
+	return buffer_cache_write_offset(block_id, buffer, buffer_size, offset);
 }
 
 int init_dir_block(struct dir_block *dir_block, int dir_inode_id, int parent_inode_id) {
@@ -65,23 +228,26 @@ int add_entry_to_parent(struct inode *parent_inode, int inode_id, const char *na
 		}		
 	}
 
-	// Alloc a new block and add entry there
-	struct data_block block;
-	if(data_block_alloc(&block) == -1) {
+	// Alloc a new block and add entry there. It follows the last block of the directory, or goes to the
+	// block group of the directory inode, so that the blocks of a directory are read together
+	big_int goal = parent_inode->num_blocks > 0 ? get_block_id(parent_inode, parent_inode->num_blocks - 1) + 1 : get_group_goal(get_inode_group(parent_inode->inode_id));
+	big_int block_id;
+	if(prepare_block_map(parent_inode, parent_inode->num_blocks, 1, &goal, NULL) == -1 || data_block_alloc_run(goal, 1, &block_id) == -1) {
 		fprintf(stderr, "could not alloc data block\n");
 		return -1;
 	}
 
 	// Add this block to inode
-	if(set_block_id(parent_inode, parent_inode->num_blocks, block.data_block_id) == -1) {
+	if(set_block_id(parent_inode, parent_inode->num_blocks, block_id) == -1) {
 		fprintf(stderr, "could not add newly allocated block to inode\n");
 		return -1;
 	}
 	parent_inode->num_blocks++;
 
-	struct dir_block *dir_block = (struct dir_block*) block.block;
-	add_entry_to_dir_block(dir_block, inode_id, name);
-	return write_block(block.data_block_id, dir_block, sizeof(struct dir_block));
+	struct dir_block dir_block;
+	memset(&dir_block, 0, sizeof(struct dir_block));
+	add_entry_to_dir_block(&dir_block, inode_id, name);
+	return write_block(block_id, &dir_block, sizeof(struct dir_block));
 }
 
 int remove_entry_from_parent(struct inode *parent_inode, int inode_id) {
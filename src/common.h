@@ -20,6 +20,8 @@
 #include <unistd.h>
 
 #define DISK_STORE_PATH "/dev/vdc"
+#define FSTR_MAGIC 0x46535452 // "FSTR", first field of the superblock of a formatted volume
+#define FSTR_VERSION 4 // Layout of the volume written by mkfs, a volume of another version is not mounted
 
 // #define DEBUG
 #ifdef DEBUG
@@ -28,11 +30,18 @@
 #define LOGD(A, ...)
 #endif
 
-#define FREE_BLOCKS_CACHE_SIZE 0
-#define FREE_INODES_CACHE_SIZE 0
+#define FREE_BLOCKS_CACHE_SIZE 64 // Free block ids kept in the superblock, refilled from the bitmap in bulk
+#define FREE_INODES_CACHE_SIZE 64 // Free inode ids kept in the superblock, refilled from the inode bitmap
+
+#define BUFFER_CACHE_SIZE 4096 // Number of blocks kept in the buffer cache (16MB)
+#define DIRTY_EXPIRE_SECONDS 5 // Age after which a dirty block is written back by the flusher
+#define DIRTY_RATIO 20 // Percentage of dirty blocks in the cache that wakes up the flusher
+#define FLUSHER_INTERVAL_SECONDS 1
+#define CHECKPOINT_INTERVAL_SECONDS 5 // The superblock is committed this often when its counters changed
 
 #define FS_SIZE ((big_int) 30 * 1024 * 1024 * 1024) // 30GB
 #define BLOCK_SIZE 4096 // 4KB
+#define DIRECT_IO_ALIGNMENT 4096 // Alignment of the buffers, offsets and sizes of O_DIRECT I/O
 #define INODE_SIZE 256
 #define NUM_INODES ((int) (0.1 * NUM_BLOCKS))
 #define ILIST_BEGIN 1
@@ -41,7 +50,13 @@
 
 #define NUM_BLOCKS (FS_SIZE / BLOCK_SIZE)
 #define NUM_INODE_BLOCKS ((big_int) ceil((NUM_INODES * INODE_SIZE) / (float) BLOCK_SIZE))
+#define BITMAP_BEGIN (ILIST_BEGIN + NUM_INODE_BLOCKS) // The free block bitmap follows the inode list
+#define NUM_BITMAP_BLOCKS ((NUM_BLOCKS + BLOCK_SIZE * 8 - 1) / (BLOCK_SIZE * 8))
+#define INODE_BITMAP_BEGIN (BITMAP_BEGIN + NUM_BITMAP_BLOCKS) // The inode bitmap follows the free block bitmap
+#define NUM_INODE_BITMAP_BLOCKS ((NUM_INODES + BLOCK_SIZE * 8 - 1) / (BLOCK_SIZE * 8))
 #define BLOCK_ID_LIST_LENGTH (BLOCK_SIZE / sizeof(big_int))
+#define BLOCKS_PER_GROUP 8192 // The volume is split in block groups of 32MB, each allocated independently
+#define NUM_BLOCK_GROUPS ((NUM_BLOCKS + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP)
 
 #define NAMEI_ENTRY_SIZE 64
 #define PATH_DELIMITER "/"
@@ -57,17 +72,26 @@ typedef enum {
 
 struct superblock {
 	// General
+	big_int magic; // FSTR_MAGIC
+	big_int version; // FSTR_VERSION of the mkfs that formatted the volume
 	big_int fs_size;
+	big_int clean; // 1 when the file system was unmounted cleanly, 0 while it is mounted
 
 	// Free blocks management stuff
 	big_int num_free_blocks;
+	big_int num_cached_free_blocks; // The cached blocks are marked used in the bitmap until they are freed
 	big_int free_blocks_cache[FREE_BLOCKS_CACHE_SIZE];
-	big_int next_free_block_list;
+	big_int block_bitmap; // First block of the bitmap, a set bit is a used block
+	big_int blocks_per_group;
+	big_int num_block_groups;
 
 	// Free inodes management stuff
 	big_int num_free_inodes;
+	big_int num_cached_free_inodes; // The cached inodes stay free in the bitmap, they are checked when taken
 	big_int free_inodes_cache[FREE_INODES_CACHE_SIZE];
-	big_int next_free_inode;
+	big_int next_free_inode; // The search of the inode bitmap for free inodes resumes there
+	big_int inode_bitmap; // First block of the inode bitmap, a set bit is a used inode
+	big_int uninit_inode_slices[(NUM_BLOCK_GROUPS + 63) / 64]; // Bit g is set while the inode slice of group g is not formatted
 
 } superblock;
 
@@ -96,8 +120,8 @@ struct block_id_list {
 };
 
 struct data_block {
+	char block[BLOCK_SIZE] __attribute__((aligned(DIRECT_IO_ALIGNMENT))); // Aligned so it can go to the disk without a copy
 	big_int data_block_id;
-	char block[BLOCK_SIZE];
 };
 
 struct dir_block {
@@ -105,9 +129,22 @@ struct dir_block {
     char names[BLOCK_SIZE / NAMEI_ENTRY_SIZE][NAMEI_ENTRY_SIZE - sizeof(int)];
 };
 
+// Reads the superblock of a volume formatted by mkfs.fstr and mounts it, -1 if the volume can't be mounted
 int init_superblock(void);
+// Returns NULL if the superblock describes a volume that can be mounted, why it can't otherwise
+const char *check_superblock(const struct superblock *sb);
+
+// Must be held when updating the in-memory superblock
+void lock_superblock(void);
+void unlock_superblock(void);
 
+// The counters of the superblock live in memory, the superblock is only committed by the checkpointer thread,
+// on fsync and on unmount. A superblock that was not unmounted cleanly gets its counters back from the bitmap and
+// the inode list at mount
 int commit_superblock(void);
+int unmount_superblock(void); // Marks the file system as unmounted cleanly and commits the superblock
+int start_superblock_checkpointer(void);
+void stop_superblock_checkpointer(void);
 
 int write_block_offset(big_int block_id, void *buffer, size_t buffer_size, int offset);
 
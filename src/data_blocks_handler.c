@@ -1,148 +1,527 @@
+#include <pthread.h>
+
 #include "common.h"
 #include "disk_emulator.h"
 #include "data_blocks_handler.h"
+#include "buffer_cache.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The free block bitmap is kept in memory, allocating and freeing only update the word of the bit in memory
+// and in the cached bitmap block: the disk is not read and the bitmap is written back with the other blocks.
+// Bit i % 64 of word i / 64 is block i, the words are stored in host order like every block id.
+// Single blocks are allocated from the free block cache of the superblock and freed to it, the bitmap is only
+// used to refill it or when it is full. The cached blocks are set in memory so that nothing else takes them, but
+// clear in the bitmap on disk: the superblock is only checkpointed from time to time, and after an unclean
+// shutdown the stale cache is dropped without losing its blocks.
+// Allocating a block does no disk I/O: the callers either write the whole block before it is mapped or ask for it
+// to be zeroed out (see buffer_cache_zero_blocks), so it never exposes what it held before. Freed blocks get their
+// storage back instead: holes are punched in them when the disk can (see device_punch) and they read as 0s until
+// they are written again. They are discarded right away with immediate discard, otherwise the trimmer thread
+// discards the free runs of the groups that had blocks freed and not punched, like fstrim.
+//
+// The volume is split in block groups of BLOCKS_PER_GROUP blocks. Each group has its own words of the bitmap,
+// free block counter, search hint and lock: threads allocating in different groups don't wait for each other
+// and a run of blocks never spans two groups. Allocations go to the group of their goal first.
+static uint64_t block_bitmap[BITMAP_WORDS] __attribute__((aligned(64)));
+
+struct block_group {
+	pthread_mutex_t lock; // Protects the words of the group in the bitmap and the fields below
+	big_int free_blocks; // Clear bits of the group, the cached free blocks are not counted
+	big_int hint; // Word where the last block of the group was allocated, the search for a free block starts there
+	int needs_trim; // Blocks were freed to the bitmap of the group since its last trim
+};
+
+static struct block_group block_groups[NUM_BLOCK_GROUPS];
+static pthread_once_t block_groups_once = PTHREAD_ONCE_INIT;
+static big_int last_group = 0; // Group of the last allocation without goal, accessed atomically
+static big_int reserved_blocks = 0; // Free blocks promised to delayed allocations. Protected by the superblock lock
+static int immediate_discard = 0; // Accessed atomically
+static int cached_blocks_need_trim = 0; // Blocks were freed to the free block cache. Protected by data_blocks_lock
+
+static pthread_t trimmer;
+static int trimmer_running = 0;
+static pthread_cond_t trimmer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t trimmer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Protects the free block cache of the superblock. Taken before the lock of a group
+static pthread_mutex_t data_blocks_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 big_int get_block_number_of_first_datablock(void) {
-	return 1 + NUM_INODE_BLOCKS;
+	return INODE_BITMAP_BEGIN + NUM_INODE_BITMAP_BLOCKS;
 }
 
-// first block number is when i = 1
-big_int get_ith_block_number_in_datablock(char * datablock, int i) {
-	// a block number is encoded on 4 bytes (size of an integer)
-	big_int block_number;
-	memcpy(&block_number, &datablock[(i-1) * sizeof(big_int)], sizeof(big_int));
-	return block_number;
+big_int get_block_group(big_int block_id) {
+	return block_id / BLOCKS_PER_GROUP;
 }
 
-// first block number is when i = 1
-void set_ith_block_number_in_datablock(char * datablock, int i, big_int block_number) {
-	// a block number is encoded on 4 bytes (size of an integer)
-	memcpy(&datablock[(i-1) * sizeof(big_int)], &block_number, sizeof(big_int));
+big_int get_group_goal(big_int group) {
+	big_int first = group * BLOCKS_PER_GROUP;
+
+	if (group >= NUM_BLOCK_GROUPS) {
+		return 0;
+	}
+	return first > get_block_number_of_first_datablock() ? first : get_block_number_of_first_datablock();
 }
 
-// Returns 0 if there is only the pointer to the next datablock containing IDs of free datablocks) or if there is no pointer.
-int has_at_least_one_datablock_number_left_without_pointer(char * datablock) {
-	big_int block_number;
-	int i;
+big_int get_group_free_blocks(big_int group) {
+	big_int free_blocks;
 
-	for (i = BLOCK_ID_LIST_LENGTH; i >= 2; i--) {
-		memcpy(&block_number, &datablock[(i-1) * sizeof(big_int)], sizeof(big_int));
+	pthread_mutex_lock(&block_groups[group].lock);
+	free_blocks = block_groups[group].free_blocks;
+	pthread_mutex_unlock(&block_groups[group].lock);
+	return free_blocks;
+}
 
-		if (block_number != 0) {
-			return 1;
-		}
+static void init_block_group_locks(void) {
+	big_int i;
+	for (i = 0; i < NUM_BLOCK_GROUPS; i++) {
+		pthread_mutex_init(&block_groups[i].lock, NULL);
 	}
-	return 0;
 }
 
-int is_datablock_full_of_free_datablock_numbers(char * datablock) {
-	big_int block_number;
-	int i;
+// Must be called before any allocation, the groups are not locked
+int init_block_bitmap(void) {
+	struct iovec *iov = malloc(NUM_BITMAP_BLOCKS * sizeof(struct iovec));
+	big_int i, j;
+	int result;
+
+	for (i = 0; i < NUM_BITMAP_BLOCKS; i++) {
+		iov[i].iov_base = (char *) block_bitmap + i * BLOCK_SIZE;
+		iov[i].iov_len = BLOCK_SIZE;
+	}
+	pthread_once(&block_groups_once, init_block_group_locks);
 
-	for (i = 2; i <= (int)BLOCK_ID_LIST_LENGTH; i++) {
-		memcpy(&block_number, &datablock[(i-1) * sizeof(big_int)], sizeof(big_int));
+	pthread_mutex_lock(&data_blocks_lock);
+	result = read_blocks(BITMAP_BEGIN, NUM_BITMAP_BLOCKS, iov);
+	for (i = 0; result == 0 && i < NUM_BLOCK_GROUPS; i++) {
+		struct block_group *group = &block_groups[i];
 
-		if (block_number == 0) {
-			return 0;
+		group->free_blocks = 0;
+		for (j = i * GROUP_BITMAP_WORDS; j < (i + 1) * GROUP_BITMAP_WORDS; j++) {
+			group->free_blocks += 64 - __builtin_popcountll(block_bitmap[j]);
 		}
+		group->hint = i * GROUP_BITMAP_WORDS;
+		group->needs_trim = 0;
 	}
-	return 1;
+	// The blocks of the free block cache read from the superblock are clear on disk
+	for (i = 0; result == 0 && i < superblock.num_cached_free_blocks; i++) {
+		big_int block_id = superblock.free_blocks_cache[i];
+		if (!((block_bitmap[block_id / 64] >> (block_id % 64)) & 1)) {
+			block_bitmap[block_id / 64] |= (uint64_t) 1 << (block_id % 64);
+			block_groups[get_block_group(block_id)].free_blocks--;
+		}
+	}
+	__atomic_store_n(&last_group, 0, __ATOMIC_RELAXED);
+	cached_blocks_need_trim = 0;
+	pthread_mutex_unlock(&data_blocks_lock);
+
+	free(iov);
+	if (result == -1) {
+		fprintf(stderr, "Failed to read the free block bitmap\n");
+	}
+	return result;
 }
 
-int get_ith_position_of_free_spot_in_free_datablock_number_list_for_new_free_datablock(char * datablock) {
-	// a block number is encoded on 4 bytes (size of an integer)
-	big_int block_number;
+// Returns 1 if every word of the group of BITMAP_SCAN_WORDS words starting at first is full
+static int is_bitmap_group_full(big_int first) {
+#ifdef __SSE2__
+	const __m128i *group = (const __m128i *) &block_bitmap[first];
+	__m128i all = _mm_load_si128(&group[0]);
 	int i;
 
-	for (i = 2; (big_int)i <= BLOCK_ID_LIST_LENGTH; i++) {
-		memcpy(&block_number, &datablock[(i-1) * sizeof(big_int)], sizeof(big_int));
+	for (i = 1; i < BITMAP_SCAN_WORDS / 2; i++) {
+		all = _mm_and_si128(all, _mm_load_si128(&group[i]));
+	}
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(all, _mm_set1_epi8(-1))) == 0xFFFF;
+#else
+	uint64_t all = ~(uint64_t) 0;
+	int i;
 
-		if (block_number == 0) {
+	for (i = 0; i < BITMAP_SCAN_WORDS; i++) {
+		all &= block_bitmap[first + i];
+	}
+	return all == ~(uint64_t) 0;
+#endif
+}
+
+// Returns the first word of [first, last) with a free block, or last if there is none.
+// Full groups of words are skipped with a single test, only the group holding a free block is searched word by word.
+static big_int find_free_word(big_int first, big_int last) {
+	big_int i = first;
+
+	for (; i < last && i % BITMAP_SCAN_WORDS; i++) {
+		if (~block_bitmap[i]) {
+			return i;
+		}
+	}
+	while (i + BITMAP_SCAN_WORDS <= last && is_bitmap_group_full(i)) {
+		i += BITMAP_SCAN_WORDS;
+	}
+	for (; i < last; i++) {
+		if (~block_bitmap[i]) {
 			return i;
 		}
 	}
-	return -1;
+	return last;
 }
 
-// Browse the block numbers in datablock from right to left and stop when it find a non zero block number. 
-// (It avoid the 1st block number which is a pointer to next datablock containing free datablock numbers)
-// It returns it to the user and set 0 at the block number position
-big_int get_first_free_datablock_starting_from_end_of_block_and_set_0(char * datablock) {
-	int number_of_block_numbers, i;
-	big_int block_number;
+// Writes the words of the bitmap holding the bits of blocks [first, last] to their blocks, without the bits of
+// the cached free blocks. Must be called with the lock of the groups of the blocks held
+static int write_bitmap_words(big_int first, big_int last) {
+	uint64_t words[BITMAP_WORDS_PER_BLOCK];
+	big_int word = first / 64, last_word = last / 64, i;
+
+	while (word <= last_word) {
+		big_int block_end = (word / BITMAP_WORDS_PER_BLOCK + 1) * BITMAP_WORDS_PER_BLOCK;
+		big_int end = last_word + 1 < block_end ? last_word + 1 : block_end;
+
+		memcpy(words, &block_bitmap[word], (end - word) * sizeof(uint64_t));
+		lock_superblock();
+		for (i = 0; i < superblock.num_cached_free_blocks; i++) {
+			big_int block_id = superblock.free_blocks_cache[i];
+			if (block_id / 64 >= word && block_id / 64 < end) {
+				words[block_id / 64 - word] &= ~((uint64_t) 1 << (block_id % 64));
+			}
+		}
+		unlock_superblock();
 
-	number_of_block_numbers = BLOCK_ID_LIST_LENGTH;
-	for (i = number_of_block_numbers; i > 1; i--) {
-		block_number = get_ith_block_number_in_datablock(datablock, i);
-		
-		if (block_number != 0) {
-			set_ith_block_number_in_datablock(datablock, i, 0);
-			return block_number;
+		if (write_block_offset(BITMAP_BEGIN + word / BITMAP_WORDS_PER_BLOCK, words,
+				(end - word) * sizeof(uint64_t), (word % BITMAP_WORDS_PER_BLOCK) * sizeof(uint64_t)) == -1) {
+			return -1;
 		}
+		word = end;
 	}
-
 	return 0;
 }
 
-int data_block_alloc(struct data_block *datablock) {
-	int position_of_first_datablock;
-	big_int free_block_number_to_be_used;
-	char read_buffer[BLOCK_SIZE];
-	
-	// 	We get 1st datablock. That's also the block that contains the id of the free data blocks and 
-	// 	the pointer to the next data block containing other part of free data block numbers!
-	
-	position_of_first_datablock = get_block_number_of_first_datablock();
-	free_block_number_to_be_used = -1;
-	
-	// Read the datablock containing normally some of the free data block numbers.
-	if (read_block(position_of_first_datablock, read_buffer) == -1) {
+// Writes the bitmap words of blocks that entered or left the free block cache, so that the bitmap on disk shows
+// them free or used. Takes the lock of their groups
+static int write_cached_blocks_words(big_int *block_ids, int count) {
+	int i, result = 0;
+
+	for (i = 0; i < count; i++) {
+		struct block_group *group = &block_groups[get_block_group(block_ids[i])];
+
+		pthread_mutex_lock(&group->lock);
+		if (write_bitmap_words(block_ids[i], block_ids[i]) == -1) {
+			result = -1;
+		}
+		pthread_mutex_unlock(&group->lock);
+	}
+	return result;
+}
+
+// Sets the bits of the count blocks from first. Must be called with the lock of their group held
+static int mark_blocks_used(big_int first, big_int count) {
+	big_int i;
+
+	for (i = first; i < first + count; i++) {
+		block_bitmap[i / 64] |= (uint64_t) 1 << (i % 64);
+	}
+	if (write_bitmap_words(first, first + count - 1) == -1) {
+		for (i = first; i < first + count; i++) {
+			block_bitmap[i / 64] &= ~((uint64_t) 1 << (i % 64));
+		}
 		return -1;
 	}
+	block_groups[get_block_group(first)].free_blocks -= count;
+	return 0;
+}
 
-	if (has_at_least_one_datablock_number_left_without_pointer(read_buffer) == 1) {
-		
-		free_block_number_to_be_used = get_first_free_datablock_starting_from_end_of_block_and_set_0(read_buffer);
-		if (write_block(position_of_first_datablock, read_buffer, BLOCK_SIZE) == -1) {
-			return -1;
+// Returns the first free block of [block_id, end), or 0 if there is none. end is a multiple of 64.
+// Must be called with the lock of the group held
+static big_int find_free_block(big_int block_id, big_int end) {
+	big_int word = block_id / 64;
+	uint64_t free_bits;
+
+	if (block_id >= end) {
+		return 0;
+	}
+	free_bits = ~block_bitmap[word] & (~(uint64_t) 0 << (block_id % 64));
+	if (free_bits) {
+		return word * 64 + __builtin_ctzll(free_bits);
+	}
+	word = find_free_word(word + 1, end / 64);
+	return word == end / 64 ? 0 : word * 64 + __builtin_ctzll(~block_bitmap[word]);
+}
+
+// Returns the number of free blocks from block_id, up to max. Must be called with the lock of the group held
+static big_int free_run_length(big_int block_id, big_int max) {
+	big_int length = 0;
+
+	// The bits past the end of the volume are set, a run always ends before it
+	while (length < max) {
+		big_int next = block_id + length;
+		uint64_t used_bits = block_bitmap[next / 64] >> (next % 64);
+
+		if (used_bits) {
+			length += __builtin_ctzll(used_bits);
+			break;
 		}
+		length += 64 - next % 64;
+	}
+	return length < max ? length : max;
+}
+
+// Returns the first block of a run of up to count free blocks of the group now marked used, or 0 if the group
+// is full. The first free block from goal is taken, or the start of a longer run found a little further.
+// Must be called with the lock of the group held
+static big_int take_free_run_in_group(big_int group, big_int goal, big_int count, big_int *length) {
+	big_int group_first = group * BLOCKS_PER_GROUP, group_end = group_first + BLOCKS_PER_GROUP;
+	big_int start, limit, best = 0, best_length = 0;
 
-		superblock.num_free_blocks--; // Decrement the number of free data blocks
+	start = find_free_block(goal, group_end);
+	if (start == 0 && (start = find_free_block(group_first, group_end)) == 0) {
+		return 0;
 	}
-	else {
-		// No block numbers left, we copy content of datablock pointed by current block into current block
 
-		// We check if there's a block pointed by current block. If not, we return an error (NULL)
-		big_int next_block_number = get_ith_block_number_in_datablock(read_buffer, 1);
-		
-		if (next_block_number == 0) {
-			return -1;
+	limit = start + ALLOC_RUN_SEARCH_WORDS * 64;
+	while (start != 0 && start < limit) {
+		big_int run = free_run_length(start, count < group_end - start ? count : group_end - start);
+
+		if (run > best_length) {
+			best = start;
+			best_length = run;
 		}
+		if (run == count) {
+			break;
+		}
+		start = find_free_block(start + run, group_end);
+	}
 
-		if (read_block(next_block_number, read_buffer) == -1) {
-			return -1;
+	if (mark_blocks_used(best, best_length) == -1) {
+		return 0;
+	}
+	block_groups[group].hint = (best + best_length - 1) / 64;
+	*length = best_length;
+	return best;
+}
+
+// Returns the first block of a run of up to count free blocks now marked used, or 0 if the volume is full.
+// The groups are searched in turn from the group of goal, or from the group of the last allocation without goal
+// (0). The group of goal is searched from goal, the others from their hint
+static big_int take_free_run(big_int goal, big_int count, big_int *length) {
+	big_int first_group, i, first = 0;
+
+	if (goal == 0 || goal >= NUM_BLOCKS) {
+		goal = 0;
+		first_group = __atomic_load_n(&last_group, __ATOMIC_RELAXED);
+	} else {
+		first_group = get_block_group(goal);
+	}
+
+	for (i = 0; i < NUM_BLOCK_GROUPS && first == 0; i++) {
+		big_int group_id = (first_group + i) % NUM_BLOCK_GROUPS;
+		struct block_group *group = &block_groups[group_id];
+
+		pthread_mutex_lock(&group->lock);
+		if (group->free_blocks > 0) {
+			first = take_free_run_in_group(group_id, i == 0 && goal ? goal : group->hint * 64, count, length);
 		}
+		pthread_mutex_unlock(&group->lock);
 
-		if (write_block(position_of_first_datablock, read_buffer, BLOCK_SIZE) == -1) {
-			return -1;
+		if (first != 0 && goal == 0) {
+			__atomic_store_n(&last_group, group_id, __ATOMIC_RELAXED);
 		}
+	}
+	return first;
+}
 
-		// The block that was pointed by 1st data block will be used as the free data block
-		free_block_number_to_be_used = next_block_number;
+// Takes up to count blocks off the free block counter before they are allocated: from *reservation first (if
+// any), then from the free blocks nobody reserved. Returns how many were taken, *from_reservation of them reserved
+static big_int claim_free_blocks(big_int count, big_int *reservation, big_int *from_reservation) {
+	big_int reserved = 0, unreserved;
+
+	lock_superblock();
+	if (reservation) {
+		reserved = *reservation < count ? *reservation : count;
+		reserved = reserved < reserved_blocks ? reserved : reserved_blocks;
+		*reservation -= reserved;
+		reserved_blocks -= reserved;
 	}
+	unreserved = superblock.num_free_blocks > reserved_blocks ? superblock.num_free_blocks - reserved_blocks : 0;
+	unreserved = unreserved < count - reserved ? unreserved : count - reserved;
+	superblock.num_free_blocks -= reserved + unreserved;
+	unlock_superblock();
 
-	datablock->data_block_id = free_block_number_to_be_used;
-	memset(datablock->block, 0, BLOCK_SIZE); // set 0s to the buffer
-	if (write_block(free_block_number_to_be_used, datablock->block, BLOCK_SIZE) == -1) {
-		// Set 0s the block on disk too
+	*from_reservation = reserved;
+	return reserved + unreserved;
+}
+
+// Gives back the count claimed blocks that were not allocated, reserved of them to *reservation
+static void unclaim_free_blocks(big_int count, big_int *reservation, big_int reserved) {
+	lock_superblock();
+	superblock.num_free_blocks += count;
+	if (reservation) {
+		*reservation += reserved;
+		reserved_blocks += reserved;
+	}
+	unlock_superblock();
+}
+
+// Takes a block from the free block cache of the superblock, 0 if it is empty
+static big_int take_cached_block(void) {
+	big_int block_id = 0;
+
+	pthread_mutex_lock(&data_blocks_lock);
+	lock_superblock();
+	if (superblock.num_cached_free_blocks > 0) {
+		block_id = superblock.free_blocks_cache[--superblock.num_cached_free_blocks];
+	}
+	unlock_superblock();
+	if (block_id != 0 && write_cached_blocks_words(&block_id, 1) == -1) {
+		lock_superblock();
+		superblock.free_blocks_cache[superblock.num_cached_free_blocks++] = block_id;
+		unlock_superblock();
+		block_id = 0;
+	}
+	pthread_mutex_unlock(&data_blocks_lock);
+	return block_id;
+}
+
+int data_block_alloc_reserved_run(big_int goal, int count, big_int *first_block_id, big_int *reservation) {
+	big_int first, claimed, reserved, length = 0;
+
+	if (count < 1) {
 		return -1;
 	}
 
-	commit_superblock();
+	claimed = claim_free_blocks(count, reservation, &reserved);
+	first = claimed > 0 ? take_free_run(goal, claimed, &length) : 0;
+	if (first == 0 && claimed > 0) {
+		// The last free blocks may only be left in the free block cache
+		first = take_cached_block();
+		length = first != 0;
+	}
+	// The reserved blocks are used first, the ones left go back to the reservation
+	unclaim_free_blocks(claimed - length, reservation, reserved > length ? reserved - length : 0);
+	if (first == 0) {
+		return -1;
+	}
+
+	*first_block_id = first;
+	return length;
+}
+
+int data_block_alloc_run(big_int goal, int count, big_int *first_block_id) {
+	return data_block_alloc_reserved_run(goal, count, first_block_id, NULL);
+}
+
+// Takes a batch of free blocks from the bitmap into the cache of the superblock. Their bits, set on disk by
+// take_free_run, are cleared again there once they are in the cache. Must be called with data_blocks_lock held
+static int refill_free_blocks_cache(void) {
+	big_int block_ids[FREE_BLOCKS_CACHE_SIZE], first, length;
+	int count = 0, i;
+
+	while (count < FREE_BLOCKS_CACHE_SIZE && (first = take_free_run(0, FREE_BLOCKS_CACHE_SIZE - count, &length)) != 0) {
+		for (i = 0; i < (int) length; i++) {
+			block_ids[count++] = first + i;
+		}
+	}
+	if (count == 0) {
+		return -1;
+	}
+
+	// The cache is a stack, the lowest block is taken first
+	lock_superblock();
+	for (i = 0; i < count; i++) {
+		superblock.free_blocks_cache[i] = block_ids[count - 1 - i];
+	}
+	superblock.num_cached_free_blocks = count;
+	unlock_superblock();
+	return write_cached_blocks_words(block_ids, count);
+}
+
+int data_block_alloc(struct data_block *datablock) {
+	big_int block_id, reserved;
+
+	if (claim_free_blocks(1, NULL, &reserved) == 0) {
+		return -1;
+	}
+	pthread_mutex_lock(&data_blocks_lock);
+	if (superblock.num_cached_free_blocks == 0 && refill_free_blocks_cache() == -1) {
+		pthread_mutex_unlock(&data_blocks_lock);
+		unclaim_free_blocks(1, NULL, 0);
+		return -1;
+	}
+	lock_superblock();
+	block_id = superblock.free_blocks_cache[--superblock.num_cached_free_blocks];
+	unlock_superblock();
+	pthread_mutex_unlock(&data_blocks_lock);
+
+	if (write_cached_blocks_words(&block_id, 1) == -1) {
+		return -1;
+	}
+
+	// Only the buffer is cleared, the block on the disk is left as is until the caller writes it
+	datablock->data_block_id = block_id;
+	memset(datablock->block, 0, BLOCK_SIZE); // set 0s to the buffer
 	return 0;
 }
 
+// Must be called with data_blocks_lock held
+static int is_cached_free_block(big_int block_id) {
+	big_int i;
+
+	for (i = 0; i < superblock.num_cached_free_blocks; i++) {
+		if (superblock.free_blocks_cache[i] == block_id) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int is_data_block_used(big_int block_id) {
+	struct block_group *group = &block_groups[get_block_group(block_id)];
+	int used;
+
+	pthread_mutex_lock(&data_blocks_lock);
+	pthread_mutex_lock(&group->lock);
+	used = ((block_bitmap[block_id / 64] >> (block_id % 64)) & 1) && !is_cached_free_block(block_id);
+	pthread_mutex_unlock(&group->lock);
+	pthread_mutex_unlock(&data_blocks_lock);
+	return used;
+}
+
+void set_immediate_discard(int enabled) {
+	__atomic_store_n(&immediate_discard, enabled, __ATOMIC_RELAXED);
+}
+
+int is_immediate_discard_enabled(void) {
+	return __atomic_load_n(&immediate_discard, __ATOMIC_RELAXED);
+}
+
+int data_block_reserve(big_int count) {
+	int result = -1;
+
+	lock_superblock();
+	if (superblock.num_free_blocks >= reserved_blocks + count) {
+		reserved_blocks += count;
+		result = 0;
+	}
+	unlock_superblock();
+	return result;
+}
+
+void data_block_release_reservation(big_int count) {
+	lock_superblock();
+	reserved_blocks -= count;
+	unlock_superblock();
+}
+
+big_int get_reserved_blocks(void) {
+	big_int count;
+
+	lock_superblock();
+	count = reserved_blocks;
+	unlock_superblock();
+	return count;
+}
+
 int bread(big_int data_block_nb, struct data_block *datablock) {
 
 	if (read_block(data_block_nb, datablock->block) == -1) {
@@ -157,51 +536,286 @@ int bwrite(struct data_block * datablock) {
 	return write_block(datablock->data_block_id, datablock->block, BLOCK_SIZE);
 }
 
-int data_block_free(struct data_block * datablock) {
-	int position_of_first_datablock, ith_position;
-	char read_buffer[BLOCK_SIZE], buffer[BLOCK_SIZE];
+static int is_data_block(big_int block_id) {
+	if (block_id < get_block_number_of_first_datablock() || block_id >= NUM_BLOCKS) {
+		fprintf(stderr, "cannot free block %" PRIu64 ", it is not a data block\n", block_id);
+		return 0;
+	}
+	return 1;
+}
 
-	// We don't implement lock here for superblock!
+static int compare_block_ids(const void *a, const void *b) {
+	big_int x = *(const big_int *) a, y = *(const big_int *) b;
+	return x < y ? -1 : x > y;
+}
+
+// Drops the cached copies of the freed blocks, one run of consecutive ids at a time. The runs are discarded with
+// discard, otherwise punched when the disk can. Returns 1 if some runs are left for the trimmer, -1 on failure
+static int forget_block_ids(big_int *block_ids, int count, int discard) {
+	int i, j, forgotten, result = 0;
+
+	for (i = 0; i < count; i = j) {
+		for (j = i + 1; j < count && block_ids[j] == block_ids[j - 1] + 1; j++);
+		forgotten = buffer_cache_forget_blocks(block_ids[i], j - i, discard);
+		if (forgotten == -1) {
+			result = -1;
+		} else if (result == 0) {
+			result = forgotten;
+		}
+	}
+	return result;
+}
+
+// Locks or unlocks the groups of the sorted block_ids, in increasing order
+static void lock_block_groups(big_int *block_ids, int count, int lock) {
+	big_int previous = NUM_BLOCK_GROUPS;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		big_int group = get_block_group(block_ids[i]);
+		if (group != previous) {
+			if (lock) {
+				pthread_mutex_lock(&block_groups[group].lock);
+			} else {
+				pthread_mutex_unlock(&block_groups[group].lock);
+			}
+			previous = group;
+		}
+	}
+}
+
+// The blocks go to the cache of the superblock while there is room, to the bitmap otherwise. Nothing is freed,
+// cleared or discarded if one of them is already free. block_ids must be sorted, the bitmap is then written once
+// per group. Must be called with data_blocks_lock held: the blocks are cleared before anyone can allocate them
+static int do_data_blocks_free(big_int *block_ids, int count) {
+	int i, j, cached = 0, untrimmed, result = 0;
+
+	lock_block_groups(block_ids, count, 1);
+	for (i = 0; i < count; i++) {
+		big_int block_id = block_ids[i];
+		if (!((block_bitmap[block_id / 64] >> (block_id % 64)) & 1) || is_cached_free_block(block_id)
+			|| (i > 0 && block_ids[i - 1] == block_id)) {
+			fprintf(stderr, "block %" PRIu64 " is already free\n", block_id);
+			lock_block_groups(block_ids, count, 0);
+			return -1;
+		}
+	}
+	// The blocks are forgotten (and punched or discarded) by runs once they are known to be in use
+	untrimmed = forget_block_ids(block_ids, count, is_immediate_discard_enabled());
+	if (untrimmed == -1) {
+		lock_block_groups(block_ids, count, 0);
+		return -1;
+	}
+
+	lock_superblock();
+	while (cached < count && superblock.num_cached_free_blocks < FREE_BLOCKS_CACHE_SIZE) {
+		superblock.free_blocks_cache[superblock.num_cached_free_blocks++] = block_ids[cached++];
+	}
+	superblock.num_free_blocks += count;
+	unlock_superblock();
+	cached_blocks_need_trim |= cached > 0 && untrimmed;
+
+	for (i = cached; i < count; i++) {
+		block_bitmap[block_ids[i] / 64] &= ~((uint64_t) 1 << (block_ids[i] % 64));
+		block_groups[get_block_group(block_ids[i])].free_blocks++;
+		block_groups[get_block_group(block_ids[i])].needs_trim |= untrimmed;
+	}
+	// The words of the cached blocks are written too, they read as free on disk
+	for (i = 0; i < count; i = j) {
+		for (j = i + 1; j < count && get_block_group(block_ids[j]) == get_block_group(block_ids[i]); j++);
+		if (write_bitmap_words(block_ids[i], block_ids[j - 1]) == -1) {
+			result = -1;
+		}
+	}
+	lock_block_groups(block_ids, count, 0);
+	return result;
+}
 
-	// Look at first datablock and see if it's full (full of free datablock numbers).
-	position_of_first_datablock = get_block_number_of_first_datablock();
+int data_block_free(struct data_block * datablock) {
+	int result;
 
-	// Read the datablock containing normally some of the free data block numbers.
-	if (read_block(position_of_first_datablock, read_buffer) == -1) {
+	if (!is_data_block(datablock->data_block_id)) {
 		return -1;
 	}
 
-	if (is_datablock_full_of_free_datablock_numbers(read_buffer) == 1) {
-		// We copy the content of the 1st datablock (containing free datablock numbers) into the new free datablock
-		// Then we clear the 1st datablock number and set the 1st block number (pointer) to be the number of the new free datablock
+	memset(datablock->block, 0, BLOCK_SIZE); // We sets 0s in the whole freed datablock
 
-		if (write_block(datablock->data_block_id, read_buffer, BLOCK_SIZE) == -1) {
+	pthread_mutex_lock(&data_blocks_lock);
+	result = do_data_blocks_free(&datablock->data_block_id, 1);
+	pthread_mutex_unlock(&data_blocks_lock);
+	return result;
+}
+
+int data_block_free_n(big_int *block_ids, int count) {
+	int i, result;
+
+	for (i = 0; i < count; i++) {
+		if (!is_data_block(block_ids[i])) {
 			return -1;
 		}
+	}
 
-		memset(buffer, 0, BLOCK_SIZE); // We sets 0s in the whole block
-		set_ith_block_number_in_datablock(buffer, 1, datablock->data_block_id);
-		if (write_block(position_of_first_datablock, buffer, BLOCK_SIZE) == -1) {
-			return -1;
+	// The allocator is updated once for the whole batch
+	qsort(block_ids, count, sizeof(big_int), compare_block_ids);
+
+	pthread_mutex_lock(&data_blocks_lock);
+	result = do_data_blocks_free(block_ids, count);
+	pthread_mutex_unlock(&data_blocks_lock);
+	return result;
+}
+
+int data_block_alloc_n(int count, big_int *block_ids) {
+	big_int first, length, claimed, reserved, i;
+	int taken = 0, failed;
+
+	// All the blocks or none, the free blocks reserved by others are left to them
+	claimed = claim_free_blocks(count, NULL, &reserved);
+	if (claimed < (big_int) count) {
+		unclaim_free_blocks(claimed, NULL, 0);
+		return -1;
+	}
+	pthread_mutex_lock(&data_blocks_lock);
+
+	// The cached blocks are taken first, the rest comes from the bitmap by runs
+	lock_superblock();
+	while (taken < count && superblock.num_cached_free_blocks > 0) {
+		block_ids[taken++] = superblock.free_blocks_cache[--superblock.num_cached_free_blocks];
+	}
+	unlock_superblock();
+	failed = write_cached_blocks_words(block_ids, taken) == -1;
+	while (!failed && taken < count && (first = take_free_run(0, count - taken, &length)) != 0) {
+		for (i = 0; i < length; i++) {
+			block_ids[taken++] = first + i;
 		}
 	}
-	else {
-		// We add the new free datablock number at the 1st empty spot in the list of datablock numbers in the 1st datablock
 
-		memset(datablock->block, 0, BLOCK_SIZE); // We sets 0s in the whole new datablock
-		if (write_block(datablock->data_block_id, datablock->block, BLOCK_SIZE) == -1) {
-			return -1;
+	if (failed || taken < count) {
+		// Not enough free blocks or the bitmap could not be written, the ones taken are given back
+		qsort(block_ids, taken, sizeof(big_int), compare_block_ids);
+		do_data_blocks_free(block_ids, taken);
+		pthread_mutex_unlock(&data_blocks_lock);
+		unclaim_free_blocks(count - taken, NULL, 0);
+		return -1;
+	}
+	pthread_mutex_unlock(&data_blocks_lock);
+	return 0;
+}
+
+big_int count_free_blocks(void) {
+	big_int free_blocks = 0, i;
+
+	for (i = 0; i < NUM_BLOCK_GROUPS; i++) {
+		free_blocks += get_group_free_blocks(i);
+	}
+	lock_superblock();
+	free_blocks += superblock.num_cached_free_blocks;
+	unlock_superblock();
+	return free_blocks;
+}
+
+// The lock of the group is held while its free runs are discarded, no block of the group can be allocated and
+// written in the meantime
+big_int trim_free_blocks(void) {
+	big_int block_ids[FREE_BLOCKS_CACHE_SIZE], group, discarded = 0;
+	int failed = 0, count = 0, i, j;
+
+	// The blocks of the free block cache are set in the bitmap, they are discarded on their own
+	pthread_mutex_lock(&data_blocks_lock);
+	if (cached_blocks_need_trim) {
+		lock_superblock();
+		count = superblock.num_cached_free_blocks;
+		memcpy(block_ids, superblock.free_blocks_cache, count * sizeof(big_int));
+		unlock_superblock();
+		qsort(block_ids, count, sizeof(big_int), compare_block_ids);
+		for (i = 0; i < count && !failed; i = j) {
+			for (j = i + 1; j < count && block_ids[j] == block_ids[j - 1] + 1; j++);
+			failed = device_discard(block_ids[i], j - i) == -1;
 		}
+		cached_blocks_need_trim = failed;
+		discarded += failed ? 0 : count;
+	}
+	pthread_mutex_unlock(&data_blocks_lock);
 
-		ith_position = get_ith_position_of_free_spot_in_free_datablock_number_list_for_new_free_datablock(read_buffer);
-		set_ith_block_number_in_datablock(read_buffer, ith_position, datablock->data_block_id);
-		if (write_block(position_of_first_datablock, read_buffer, BLOCK_SIZE) == -1) {
-			return -1;
+	for (group = 0; group < NUM_BLOCK_GROUPS; group++) {
+		big_int end = (group + 1) * BLOCKS_PER_GROUP, block_id, length;
+
+		pthread_mutex_lock(&block_groups[group].lock);
+		if (!block_groups[group].needs_trim) {
+			pthread_mutex_unlock(&block_groups[group].lock);
+			continue;
+		}
+		for (block_id = find_free_block(group * BLOCKS_PER_GROUP, end); block_id != 0;
+			block_id = find_free_block(block_id + length, end)) {
+			length = free_run_length(block_id, end - block_id);
+			if (device_discard(block_id, length) == -1) {
+				failed = 1;
+				break;
+			}
+			discarded += length;
 		}
+		block_groups[group].needs_trim = failed; // Tried again at the next trim
+		pthread_mutex_unlock(&block_groups[group].lock);
 	}
 
-	superblock.num_free_blocks++;
-	commit_superblock();
+	if (failed) {
+		fprintf(stderr, "failed to discard the free blocks\n");
+		return -1;
+	}
+	LOGD("discarded %" PRIu64 " free blocks", discarded);
+	return discarded;
+}
 
+// Wakes up every TRIM_INTERVAL_SECONDS and discards the blocks freed since the last trim
+static void * trimmer_main(void *arg) {
+	(void) arg;
+
+	pthread_mutex_lock(&trimmer_lock);
+	while (trimmer_running) {
+		struct timespec timeout;
+
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_sec += TRIM_INTERVAL_SECONDS;
+		pthread_cond_timedwait(&trimmer_cond, &trimmer_lock, &timeout);
+
+		if (!trimmer_running) {
+			break;
+		}
+
+		pthread_mutex_unlock(&trimmer_lock);
+		trim_free_blocks();
+		pthread_mutex_lock(&trimmer_lock);
+	}
+	pthread_mutex_unlock(&trimmer_lock);
+	return NULL;
+}
+
+int start_block_trimmer(void) {
+	pthread_mutex_lock(&trimmer_lock);
+	if (trimmer_running) {
+		pthread_mutex_unlock(&trimmer_lock);
+		return -1;
+	}
+
+	trimmer_running = 1;
+	if (pthread_create(&trimmer, NULL, trimmer_main, NULL) != 0) {
+		fprintf(stderr, "failed to start the trimmer thread\n");
+		trimmer_running = 0;
+		pthread_mutex_unlock(&trimmer_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&trimmer_lock);
 	return 0;
-}
\ No newline at end of file
+}
+
+void stop_block_trimmer(void) {
+	pthread_mutex_lock(&trimmer_lock);
+	if (!trimmer_running) {
+		pthread_mutex_unlock(&trimmer_lock);
+		return;
+	}
+
+	trimmer_running = 0;
+	pthread_cond_signal(&trimmer_cond);
+	pthread_mutex_unlock(&trimmer_lock);
+	pthread_join(trimmer, NULL);
+}
@@ -3,20 +3,49 @@
 
 #include "common.h"
 
+#define BITMAP_WORDS (NUM_BITMAP_BLOCKS * BLOCK_SIZE / sizeof(uint64_t)) // Size of the free block bitmap in memory
+#define BITMAP_WORDS_PER_BLOCK (BLOCK_SIZE / sizeof(uint64_t))
+#define GROUP_BITMAP_WORDS (BLOCKS_PER_GROUP / 64) // Words of the bitmap of a block group
+#define BITMAP_SCAN_WORDS 8 // Words of the bitmap tested at once when searching a free block, a cache line
+#define ALLOC_RUN_SEARCH_WORDS 64 // Words of the bitmap searched for a long enough run past the first free block
+#define TRIM_INTERVAL_SECONDS 30 // Period of the trimmer thread
+
 
 // TODO Can we just return block id?
-int data_block_alloc(struct data_block *); // Allocate a new data block
+int data_block_alloc(struct data_block *); // Allocate a new data block, no disk I/O: bwrite the cleared buffer for 0s on disk
+// Allocate up to count contiguous blocks, as close after goal as possible (0 for anywhere), in the group of goal
+// if it has free blocks. Returns the number of blocks allocated from *first_block_id. The blocks are not zeroed
+// out, the caller writes them whole or calls buffer_cache_zero_blocks before mapping them
+int data_block_alloc_run(big_int goal, int count, big_int *first_block_id);
+// Same, the blocks are taken from *reservation first, which is decreased by the reserved blocks used
+int data_block_alloc_reserved_run(big_int goal, int count, big_int *first_block_id, big_int *reservation);
 int bread(big_int data_block_nb, struct data_block *); // Read the data block from disk
 int bwrite(struct data_block *); // Write the data block to disk
 int data_block_free(struct data_block *); // WARNING: this doesn't free the struct data_block. It has to be done by developer
+int data_block_alloc_n(int count, big_int *block_ids); // Allocate count data blocks, all of them or none, not zeroed out
+int data_block_free_n(big_int *block_ids, int count); // Free many data blocks at once, block_ids is sorted in place
+// Reservations promise free blocks to delayed allocations and fallocate, which allocate them later with
+// data_block_alloc_reserved_run. The other allocations only get the free blocks that are not reserved, and fail
+// when there are not enough of them
+int data_block_reserve(big_int count); // -1 if there are not enough free blocks left that are not reserved
+void data_block_release_reservation(big_int count);
+big_int get_reserved_blocks(void);
+int init_block_bitmap(void); // Load the free block bitmap written by mkfs in memory, with the blocks cached by the superblock
+big_int count_free_blocks(void); // Free blocks according to the bitmap and the cache, to recover the superblock counter
+int is_data_block_used(big_int block_id); // Returns 1 if the bit of the block is set in the bitmap
+// With immediate discard, freed blocks are discarded on the disk when they are freed. Otherwise holes are punched
+// in them when the disk can (see device_punch), and the others are discarded in batches by trim_free_blocks,
+// called by the trimmer thread and at unmount
+void set_immediate_discard(int enabled); // Disabled by default
+int is_immediate_discard_enabled(void);
+big_int trim_free_blocks(void); // Discards the free runs of the groups that had blocks freed and not punched. Returns the blocks discarded or -1
+int start_block_trimmer(void);
+void stop_block_trimmer(void);
 
 // UTILITIES
 big_int get_block_number_of_first_datablock(void);
-big_int get_ith_block_number_in_datablock(char * datablock, int i);
-void set_ith_block_number_in_datablock(char * datablock, int i, big_int block_number);
-int has_at_least_one_datablock_number_left_without_pointer(char * datablock);
-int is_datablock_full_of_free_datablock_numbers(char * datablock);
-int get_ith_position_of_free_spot_in_free_datablock_number_list_for_new_free_datablock(char * datablock);
-big_int get_first_free_datablock_starting_from_end_of_block_and_set_0(char * datablock);
+big_int get_block_group(big_int block_id);
+big_int get_group_goal(big_int group); // First data block of the group, 0 if there is no such group
+big_int get_group_free_blocks(big_int group); // Free blocks of the group, not counting the cached ones
 
 #endif
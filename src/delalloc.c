@@ -0,0 +1,410 @@
+#include <pthread.h>
+
+#include "common.h"
+#include "delalloc.h"
+#include "uthash.h"
+#include "data_blocks_handler.h"
+#include "inodes_handler.h"
+#include "inode_table.h"
+#include "block_utils.h"
+#include "disk_emulator.h"
+
+struct delayed_block {
+	big_int ith_block; // Position in the file, counted from 1
+	char data[BLOCK_SIZE];
+	UT_hash_handle hh;
+};
+
+struct delayed_file {
+	int inode_number;
+	struct delayed_block *blocks; // Hashed by ith_block
+	big_int reserved; // Free blocks reserved for the delayed blocks and their indirect blocks, used up by the flush
+	time_t dirty_since; // When the oldest delayed block of the file was written
+	UT_hash_handle hh;
+};
+
+// Inode of a file whose flush failed and was not reported yet
+struct flush_error {
+	int inode_number;
+	UT_hash_handle hh;
+};
+
+// Locking: delalloc_lock protects the tables and the counters. The blocks of a file are only written, read,
+// flushed or dropped with the lock of its inode held, which keeps them stable while they are copied or walked.
+static struct delayed_file *files = NULL;
+static struct flush_error *errors = NULL;
+static big_int num_delayed_blocks = 0;
+static int enabled = 0;
+static pthread_mutex_t delalloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t flusher;
+static int flusher_running = 0;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+
+void set_delayed_allocation(int enable) {
+	pthread_mutex_lock(&delalloc_lock);
+	enabled = enable;
+	pthread_mutex_unlock(&delalloc_lock);
+}
+
+int is_delayed_allocation_enabled(void) {
+	int result;
+
+	pthread_mutex_lock(&delalloc_lock);
+	result = enabled;
+	pthread_mutex_unlock(&delalloc_lock);
+	return result;
+}
+
+// Must be called with delalloc_lock held
+static struct delayed_block *find_delayed_block(int inode_number, big_int ith_block, struct delayed_file **file) {
+	struct delayed_block *block = NULL;
+
+	HASH_FIND_INT(files, &inode_number, *file);
+	if (*file) {
+		HASH_FIND(hh, (*file)->blocks, &ith_block, sizeof(big_int), block);
+	}
+	return block;
+}
+
+int delalloc_write_block(int inode_number, big_int ith_block, const void *data) {
+	struct delayed_file *file;
+	struct delayed_block *block;
+
+	pthread_mutex_lock(&delalloc_lock);
+	block = find_delayed_block(inode_number, ith_block, &file);
+	if (block == NULL) {
+		// A new delayed block holds a free block until it is flushed, and its indirect blocks in the worst case:
+		// the blocks flushed together share them, the unused part is released with the last block of the file
+		big_int reserved = 1 + count_index_blocks(ith_block - 1, 1);
+		if (data_block_reserve(reserved) == -1) {
+			pthread_mutex_unlock(&delalloc_lock);
+			return -1;
+		}
+		if (file == NULL) {
+			file = malloc(sizeof(struct delayed_file));
+			file->inode_number = inode_number;
+			file->blocks = NULL;
+			file->reserved = 0;
+			file->dirty_since = time(NULL);
+			HASH_ADD_INT(files, inode_number, file);
+		}
+		file->reserved += reserved;
+		block = malloc(sizeof(struct delayed_block));
+		block->ith_block = ith_block;
+		HASH_ADD(hh, file->blocks, ith_block, sizeof(big_int), block);
+		if (++num_delayed_blocks > DELALLOC_MAX_BLOCKS) {
+			pthread_cond_signal(&flusher_cond);
+		}
+	}
+	memcpy(block->data, data, BLOCK_SIZE);
+	pthread_mutex_unlock(&delalloc_lock);
+	return 0;
+}
+
+int delalloc_read_block(int inode_number, big_int ith_block, void *target) {
+	struct delayed_file *file;
+	struct delayed_block *block;
+
+	pthread_mutex_lock(&delalloc_lock);
+	block = find_delayed_block(inode_number, ith_block, &file);
+	if (block) {
+		memcpy(target, block->data, BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&delalloc_lock);
+	return block != NULL;
+}
+
+// Frees the count blocks of the file from block, and the file once it has no block left, releasing what is left of
+// its reservation
+static void remove_delayed_blocks(struct delayed_file *file, struct delayed_block *block, big_int count) {
+	big_int i, unused = 0;
+
+	pthread_mutex_lock(&delalloc_lock);
+	for (i = 0; i < count; i++) {
+		struct delayed_block *next = block->hh.next;
+		HASH_DEL(file->blocks, block);
+		free(block);
+		block = next;
+	}
+	num_delayed_blocks -= count;
+	if (file->blocks == NULL) {
+		unused = file->reserved;
+		HASH_DEL(files, file);
+		free(file);
+	}
+	pthread_mutex_unlock(&delalloc_lock);
+	data_block_release_reservation(unused);
+}
+
+static int compare_delayed_blocks(struct delayed_block *a, struct delayed_block *b) {
+	return a->ith_block < b->ith_block ? -1 : a->ith_block > b->ith_block;
+}
+
+// Allocates one run for the count consecutive delayed blocks from block, right after the block before them in
+// the file (or in the block group of the inode) and the indirect blocks that map them, maps them and writes them
+// with a single vectored write. They are all taken from the reservation of the file.
+// The allocator may return a shorter run. Returns the number of blocks mapped, which are no longer delayed, and
+// sets *failed on error
+static int write_delayed_run(struct delayed_file *file, struct inode *inod, struct delayed_block *block, big_int count, int *failed) {
+	big_int goal = block->ith_block > 1 ? get_block_id(inod, block->ith_block - 2) : 0;
+	big_int first;
+	struct iovec *iov;
+	int length, mapped;
+
+	goal = goal ? goal + 1 : get_group_goal(get_inode_group(inod->inode_id));
+	if (prepare_block_map(inod, block->ith_block - 1, count, &goal, &file->reserved) == -1) {
+		*failed = 1;
+		return 0;
+	}
+	length = data_block_alloc_reserved_run(goal, count, &first, &file->reserved);
+	if (length == -1) {
+		*failed = 1;
+		return 0;
+	}
+
+	iov = malloc(length * sizeof(struct iovec));
+	for (mapped = 0; mapped < length; mapped++, block = block->hh.next) {
+		if (set_block_id(inod, block->ith_block - 1, first + mapped) == -1) {
+			*failed = 1;
+			break;
+		}
+		iov[mapped].iov_base = block->data;
+		iov[mapped].iov_len = BLOCK_SIZE;
+	}
+
+	if (mapped < length) {
+		// The blocks that could not be mapped stay delayed, the end of the run is given back to their reservation
+		big_int *unused = malloc((length - mapped) * sizeof(big_int));
+		int i;
+		for (i = 0; i < length - mapped; i++) {
+			unused[i] = first + mapped + i;
+		}
+		if (data_block_free_n(unused, length - mapped) == 0 && data_block_reserve(length - mapped) == 0) {
+			file->reserved += length - mapped;
+		}
+		free(unused);
+	}
+	if (mapped > 0 && write_blocks(first, mapped, iov) == -1) {
+		*failed = 1;
+	}
+	free(iov);
+
+	inod->num_allocated_blocks += mapped;
+	return mapped;
+}
+
+// Remembers that a flush of the file failed, until delalloc_take_error reports it
+static void record_flush_error(int inode_number) {
+	struct flush_error *error;
+
+	pthread_mutex_lock(&delalloc_lock);
+	HASH_FIND_INT(errors, &inode_number, error);
+	if (error == NULL) {
+		error = malloc(sizeof(struct flush_error));
+		error->inode_number = inode_number;
+		HASH_ADD_INT(errors, inode_number, error);
+	}
+	pthread_mutex_unlock(&delalloc_lock);
+}
+
+// Forgets the failed flush of the file, returns -1 if there was one. Must be called with delalloc_lock held
+static int remove_flush_error(int inode_number) {
+	struct flush_error *error;
+
+	HASH_FIND_INT(errors, &inode_number, error);
+	if (error == NULL) {
+		return 0;
+	}
+	HASH_DEL(errors, error);
+	free(error);
+	return -1;
+}
+
+int delalloc_take_error(int inode_number) {
+	int result;
+
+	pthread_mutex_lock(&delalloc_lock);
+	result = remove_flush_error(inode_number);
+	pthread_mutex_unlock(&delalloc_lock);
+	return result;
+}
+
+int delalloc_flush_file(int inode_number) {
+	struct delayed_file *file;
+	struct delayed_block *block;
+	struct inode inod;
+	int failed = 0;
+
+	pthread_mutex_lock(&delalloc_lock);
+	HASH_FIND_INT(files, &inode_number, file);
+	pthread_mutex_unlock(&delalloc_lock);
+	if (file == NULL) {
+		return 0;
+	}
+	if (get_inode(inode_number, &inod) == -1) {
+		record_flush_error(inode_number);
+		return -1;
+	}
+
+	// The blocks are walked in file order, each range of consecutive blocks gets its own run
+	HASH_SORT(file->blocks, compare_delayed_blocks);
+	block = file->blocks;
+	while (block && !failed) {
+		struct delayed_block *next = block;
+		big_int count = 1;
+		int written, i;
+
+		while (next->hh.next && ((struct delayed_block *) next->hh.next)->ith_block == next->ith_block + 1) {
+			next = next->hh.next;
+			count++;
+		}
+
+		written = write_delayed_run(file, &inod, block, count, &failed);
+		for (next = block, i = 0; i < written; i++) {
+			next = next->hh.next;
+		}
+		if (written > 0) {
+			remove_delayed_blocks(file, block, written); // Frees the file with its last block
+		}
+		block = next;
+	}
+
+	if (put_inode(&inod) == -1 || failed) {
+		record_flush_error(inode_number);
+		return -1;
+	}
+	return 0;
+}
+
+void delalloc_drop_file(int inode_number) {
+	struct delayed_file *file;
+	struct delayed_block *block, *tmp;
+	big_int count = 0, reserved = 0;
+
+	pthread_mutex_lock(&delalloc_lock);
+	HASH_FIND_INT(files, &inode_number, file);
+	if (file) {
+		HASH_ITER(hh, file->blocks, block, tmp) {
+			HASH_DEL(file->blocks, block);
+			free(block);
+			count++;
+		}
+		reserved = file->reserved;
+		HASH_DEL(files, file);
+		free(file);
+		num_delayed_blocks -= count;
+	}
+	remove_flush_error(inode_number); // Nobody can be told anymore
+	pthread_mutex_unlock(&delalloc_lock);
+
+	// The blocks were never allocated, only their reservation is released
+	data_block_release_reservation(reserved);
+}
+
+int delalloc_needs_flush(void) {
+	int result;
+
+	pthread_mutex_lock(&delalloc_lock);
+	result = num_delayed_blocks > DELALLOC_MAX_BLOCKS;
+	pthread_mutex_unlock(&delalloc_lock);
+	return result;
+}
+
+big_int get_delayed_blocks(void) {
+	big_int result;
+
+	pthread_mutex_lock(&delalloc_lock);
+	result = num_delayed_blocks;
+	pthread_mutex_unlock(&delalloc_lock);
+	return result;
+}
+
+// Flushes the files whose oldest delayed block was written before dirty_before
+static int flush_files(time_t dirty_before) {
+	struct delayed_file *file, *tmp;
+	int *inode_numbers, count = 0, i, result = 0;
+
+	pthread_mutex_lock(&delalloc_lock);
+	inode_numbers = malloc((HASH_COUNT(files) + 1) * sizeof(int));
+	HASH_ITER(hh, files, file, tmp) {
+		if (file->dirty_since <= dirty_before) {
+			inode_numbers[count++] = file->inode_number;
+		}
+	}
+	pthread_mutex_unlock(&delalloc_lock);
+
+	// The files are flushed one at a time under the lock of their inode, like a writer would
+	for (i = 0; i < count; i++) {
+		lock_inode(inode_numbers[i]);
+		if (delalloc_flush_file(inode_numbers[i]) == -1) {
+			fprintf(stderr, "failed to flush the delayed blocks of inode %d\n", inode_numbers[i]);
+			result = -1;
+		}
+		unlock_inode(inode_numbers[i]);
+	}
+	free(inode_numbers);
+	return result;
+}
+
+int delalloc_flush_all(void) {
+	return flush_files(time(NULL));
+}
+
+// Wakes up every FLUSHER_INTERVAL_SECONDS (or when too many blocks are delayed) and flushes the files
+// whose delayed blocks are older than DIRTY_EXPIRE_SECONDS
+static void * flusher_main(void *arg) {
+	(void) arg;
+
+	pthread_mutex_lock(&delalloc_lock);
+	while (flusher_running) {
+		struct timespec timeout;
+		time_t dirty_before;
+
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_sec += FLUSHER_INTERVAL_SECONDS;
+		pthread_cond_timedwait(&flusher_cond, &delalloc_lock, &timeout);
+
+		if (!flusher_running) {
+			break;
+		}
+
+		dirty_before = num_delayed_blocks > DELALLOC_MAX_BLOCKS ? time(NULL) : time(NULL) - DIRTY_EXPIRE_SECONDS;
+		pthread_mutex_unlock(&delalloc_lock);
+		flush_files(dirty_before);
+		pthread_mutex_lock(&delalloc_lock);
+	}
+	pthread_mutex_unlock(&delalloc_lock);
+	return NULL;
+}
+
+int start_delalloc_flusher(void) {
+	pthread_mutex_lock(&delalloc_lock);
+	if (flusher_running) {
+		pthread_mutex_unlock(&delalloc_lock);
+		return -1;
+	}
+
+	flusher_running = 1;
+	if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+		fprintf(stderr, "failed to start the delayed allocation flusher thread\n");
+		flusher_running = 0;
+		pthread_mutex_unlock(&delalloc_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&delalloc_lock);
+	return 0;
+}
+
+void stop_delalloc_flusher(void) {
+	pthread_mutex_lock(&delalloc_lock);
+	if (!flusher_running) {
+		pthread_mutex_unlock(&delalloc_lock);
+		return;
+	}
+
+	flusher_running = 0;
+	pthread_cond_signal(&flusher_cond);
+	pthread_mutex_unlock(&delalloc_lock);
+	pthread_join(flusher, NULL);
+}
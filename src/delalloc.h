@@ -0,0 +1,32 @@
+#ifndef _DELALLOC_
+#define _DELALLOC_
+
+#include "common.h"
+
+#define DELALLOC_MAX_BLOCKS 2048 // Delayed blocks kept in memory (8MB), a writer past it flushes its file
+
+// With delayed allocation, writing a hole of a file only reserves a free block, and the indirect blocks that may
+// have to map it, and keeps the new content in memory. The blocks are allocated when the file is flushed, one
+// contiguous run per range of delayed blocks, and are never allocated if the file is deleted before. File blocks
+// are counted from 1 like in syscalls2.
+void set_delayed_allocation(int enabled); // Disabled by default, disabling it doesn't flush the delayed blocks
+int is_delayed_allocation_enabled(void);
+
+// The calls below expect the caller to hold the lock of the inode
+int delalloc_write_block(int inode_number, big_int ith_block, const void *data); // -1 if no free block can be reserved
+int delalloc_read_block(int inode_number, big_int ith_block, void *target); // Returns 1 if the block is delayed, 0 otherwise
+int delalloc_flush_file(int inode_number); // Allocates and writes the delayed blocks of the file
+void delalloc_drop_file(int inode_number); // Forgets the delayed blocks of a deleted file, releasing their reservation
+// A failed flush of a file is remembered, whoever flushed it (the flusher thread, a writer, the unmount), until it
+// is reported: returns -1 once per failure and 0 otherwise
+int delalloc_take_error(int inode_number);
+
+int delalloc_needs_flush(void); // Returns 1 when more than DELALLOC_MAX_BLOCKS blocks are delayed
+int delalloc_flush_all(void); // Flushes every file, the caller must hold no inode lock
+big_int get_delayed_blocks(void);
+
+// The flusher thread flushes the files whose delayed blocks are older than DIRTY_EXPIRE_SECONDS
+int start_delalloc_flusher(void);
+void stop_delalloc_flusher(void);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef _DISK_BACKEND_
+#define _DISK_BACKEND_
+
+#include <sys/uio.h>
+
+#include "common.h"
+#include "uring_queue.h"
+
+// Storage behind the disk emulator. Every block transferred is BLOCK_SIZE bytes and block ids are checked
+// against NUM_BLOCKS by the disk emulator before calling the backend.
+// read_blocks, write_blocks, read_batch, write_batch, discard, zero_out and punch are optional: the disk emulator
+// falls back to one read or write per block (nothing for discard and punch, writing blocks of 0s for zero_out).
+struct disk_backend_ops {
+	const char *name;
+	int (*init)(const char *path); // path is ignored by the backends that don't need one
+	int (*read)(big_int block_id, void *target);
+	int (*write)(big_int block_id, const void *buffer);
+	int (*read_blocks)(big_int start_block_id, int count, struct iovec *iov); // iov[i] holds block start_block_id + i
+	int (*write_blocks)(big_int start_block_id, int count, struct iovec *iov);
+	int (*read_batch)(struct block_io *ios, int count);
+	int (*write_batch)(struct block_io *ios, int count);
+	int (*flush)(void); // Makes the written blocks durable
+	int (*discard)(big_int start_block_id, big_int count); // The blocks are unused, their content is undefined afterwards
+	int (*zero_out)(big_int start_block_id, big_int count); // The blocks read as 0s afterwards, even after a remount
+	// Same as zero_out, the storage of the blocks is given back too. Cheap enough to be done whenever blocks are
+	// freed, fails when the storage can't do it (a block device only gets discarded in batches)
+	int (*punch)(big_int start_block_id, big_int count);
+	void (*close)(void);
+};
+
+#define MMAP_WINDOW_BLOCKS 16384 // The mmap backend maps the disk store by windows of 64MB
+#define MMAP_MAX_WINDOWS 64 // and keeps at most 4GB of it mapped
+
+extern const struct disk_backend_ops file_backend; // Regular file or block device, positional and io_uring I/O
+extern const struct disk_backend_ops direct_backend; // Same with O_DIRECT, bypassing the kernel page cache
+extern const struct disk_backend_ops memory_backend; // Blocks allocated in memory when first written, lost on unmount
+extern const struct disk_backend_ops mmap_backend; // Regular file or block device mapped in memory
+
+big_int get_memory_backend_used_blocks(void); // Number of blocks the memory backend allocated
+
+#endif
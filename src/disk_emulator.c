@@ -1,82 +1,69 @@
 #include "disk_emulator.h"
+#include "disk_backend.h"
 #include "mkfs.h"
 #include "common.h"
 #include "inode_table.h"
-// in memory emulation of file system
-// #define IN_MEMORY_FS
+#include "buffer_cache.h"
 
+static const struct disk_backend_ops *backends[] = { &file_backend, &direct_backend, &memory_backend, &mmap_backend };
 
-#ifdef IN_MEMORY_FS
+static const struct disk_backend_ops *backend = &file_backend;
+static const char *disk_store_path = DISK_STORE_PATH;
+int disk_created = -1;
 
-static char **block_data;
+static int is_block_range_valid(big_int start_block_id, big_int count) {
+	return start_block_id < NUM_BLOCKS && count <= NUM_BLOCKS - start_block_id;
+}
 
-int init_disk_emulator(void) { // just for in memory simulation; substitue code for opening disk here
-	if (block_data) {
-		return -1; // Disk already allocated
-	}
+// One bit per block, set for the blocks zeroed out on the disk. They read as 0s without reaching the backend until
+// they are written again. The bits are only accessed atomically, a block is never read and written at the same
+// time by the buffer cache
+static uint64_t *unwritten_bitmap = NULL;
 
-	block_data = malloc(NUM_BLOCKS * sizeof(char*));
-	int i;
-	for (i = 0; i < NUM_BLOCKS; i++) {
-		block_data[i] = malloc(BLOCK_SIZE * sizeof(char));
-	}
+int set_disk_backend(const char *name, const char *path) {
+	size_t i;
 
-	// If malloc didn't work well
-	if (block_data) {
-		// Only for in-memory emulation
-		return create_fs();
+	if (disk_created != -1) {
+		fprintf(stderr, "cannot change the backend of an initialised disk\n");
+		return -1;
 	}
-	return -1;
-}
 
-void free_disk_emulator(void) { // just for in memory simulation; substitue code for closing disk here
-	if (block_data) {
-		int i;
-		for (i = 0; i < NUM_BLOCKS; i++) {
-			free(block_data[i]);
+	if (name) {
+		for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+			if (strcmp(backends[i]->name, name) == 0) {
+				break;
+			}
 		}
-		free(block_data);
-		block_data = NULL;
-		purge_inode_table();
+		if (i == sizeof(backends) / sizeof(backends[0])) {
+			fprintf(stderr, "unknown disk backend %s\n", name);
+			return -1;
+		}
+		backend = backends[i];
 	}
-}
-
-int read_block(big_int block_id, void * target) {
-	if (block_id < NUM_BLOCKS) {
-		memcpy(target, block_data[block_id], BLOCK_SIZE);
-		return 0;
+	if (path) {
+		disk_store_path = path;
 	}
-	return -1;
+	return 0;
 }
 
-int write_block(big_int block_id, void * buffer, size_t buffer_size) {
-	if (block_id < NUM_BLOCKS) {
-
-		size_t copy_size = buffer_size < BLOCK_SIZE ? buffer_size : BLOCK_SIZE;
-		memcpy(block_data[block_id], buffer, copy_size);
-		if(copy_size < BLOCK_SIZE) {
-			memset(block_data[block_id] + copy_size, 0, BLOCK_SIZE - copy_size);
-		}
-		return 0;
-	}
-	return -1;
+const char *get_disk_backend_name(void) {
+	return backend->name;
 }
 
-#else
+int init_disk_emulator(void) {
 
-static int disk_store;
-int disk_created = -1;
-
-int init_disk_emulator(void) { 
-	
 	if(disk_created == -1){
-		disk_store = open(DISK_STORE_PATH, O_CREAT|O_RDWR);
-		if (disk_store == -1){
-    		fprintf(stderr, "Error opening disk store\n");
-    		errno = ENODEV;
-    		return -1; // failure
-  		}
-  		LOGD("file descriptor of disk: %d", disk_store);
+		if (backend->init(disk_store_path) == -1) {
+			return -1; // failure
+		}
+		unwritten_bitmap = calloc((NUM_BLOCKS + 63) / 64, sizeof(uint64_t));
+		if (unwritten_bitmap == NULL || init_buffer_cache() == -1) {
+			free(unwritten_bitmap);
+			unwritten_bitmap = NULL;
+			backend->close();
+			return -1;
+		}
+		LOGD("%s disk backend ready", backend->name);
 		disk_created = 0;
 		return 0; // success
 	}
@@ -93,49 +80,107 @@ void free_disk_emulator(void){
 	}
 
 	disk_created = -1;
+	free_buffer_cache();
 	purge_inode_table();
-	if(close(disk_store) == 0) {
-		LOGD("disk store successfully closed");
-	} else {
-		fprintf(stderr, "failed to close disk store\n");
-	}
+	backend->close();
+	free(unwritten_bitmap);
+	unwritten_bitmap = NULL;
 }
 
-int read_block(big_int block_id, void * target) {
+int device_is_unwritten(big_int block_id) {
+	return unwritten_bitmap && (__atomic_load_n(&unwritten_bitmap[block_id / 64], __ATOMIC_RELAXED) >> (block_id % 64)) & 1;
+}
 
-	if(block_id >= NUM_BLOCKS) {
-		fprintf(stderr, "cannot read block id outside range\n");
-		return -1;
+static void set_unwritten_bits(big_int start_block_id, big_int count, int unwritten) {
+	big_int block_id = start_block_id, end = start_block_id + count;
+
+	while (block_id < end) {
+		big_int bits = 64 - block_id % 64 < end - block_id ? 64 - block_id % 64 : end - block_id;
+		uint64_t mask = (bits == 64 ? ~(uint64_t) 0 : (((uint64_t) 1 << bits) - 1)) << (block_id % 64);
+		uint64_t *word = &unwritten_bitmap[block_id / 64];
+
+		if (unwritten) {
+			__atomic_fetch_or(word, mask, __ATOMIC_RELAXED);
+		} else if (__atomic_load_n(word, __ATOMIC_RELAXED) & mask) {
+			__atomic_fetch_and(word, ~mask, __ATOMIC_RELAXED);
+		}
+		block_id += bits;
 	}
+}
 
-	off_t seek_pos = block_id * BLOCK_SIZE;
-	if(lseek(disk_store, seek_pos, SEEK_SET) == -1) {
-		fprintf(stderr, "failed to seek to %" PRId64 " for block %" PRIu64 "\n", seek_pos, block_id);
-		return -1;
+static int write_zeros(big_int start_block_id, big_int count) {
+	struct iovec iov[ZERO_BATCH_BLOCKS];
+	char zeros[BLOCK_SIZE];
+	big_int i;
+	int j, batch;
+
+	memset(zeros, 0, BLOCK_SIZE);
+	for (j = 0; j < ZERO_BATCH_BLOCKS; j++) {
+		iov[j].iov_base = zeros;
+		iov[j].iov_len = BLOCK_SIZE;
 	}
+	for (i = 0; i < count; i += batch) {
+		batch = count - i < ZERO_BATCH_BLOCKS ? count - i : ZERO_BATCH_BLOCKS;
+		if (backend->write_blocks) {
+			if (backend->write_blocks(start_block_id + i, batch, iov) == -1) {
+				return -1;
+			}
+			continue;
+		}
+		for (j = 0; j < batch; j++) {
+			if (backend->write(start_block_id + i + j, zeros) == -1) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+// Only the runs not already known to read as 0s reach the disk
+int device_zero_out(big_int start_block_id, big_int count) {
+	big_int block_id = start_block_id, length;
 
-	ssize_t read_bytes = read(disk_store, target, BLOCK_SIZE);
-	if(read_bytes == -1) {
-		fprintf(stderr, "failed to read block %" PRIu64 " with seek_pos %" PRId64 "\n", block_id, seek_pos);
+	if (!is_block_range_valid(start_block_id, count)) {
+		fprintf(stderr, "cannot zero out block id outside range\n");
 		return -1;
 	}
-
-	if((big_int) read_bytes != BLOCK_SIZE) {
-		LOGD("read returned less than expected bytes: %" PRId64, read_bytes);
+	while (block_id < start_block_id + count) {
+		if (device_is_unwritten(block_id)) {
+			block_id++;
+			continue;
+		}
+		for (length = 1; block_id + length < start_block_id + count && !device_is_unwritten(block_id + length); length++);
+		if ((!backend->zero_out || backend->zero_out(block_id, length) == -1) && write_zeros(block_id, length) == -1) {
+			fprintf(stderr, "failed to zero out blocks %" PRIu64 " to %" PRIu64 "\n", block_id, block_id + length - 1);
+			return -1;
+		}
+		set_unwritten_bits(block_id, length, 1);
+		block_id += length;
 	}
 	return 0;
 }
 
-int write_block(big_int block_id, void * buffer, size_t buffer_size) {
+int device_sync(void) {
+	return backend->flush();
+}
 
+int device_read_block(big_int block_id, void * target) {
 	if(block_id >= NUM_BLOCKS) {
-		fprintf(stderr, "cannot write block id outside range\n");
+		fprintf(stderr, "cannot read block id outside range\n");
 		return -1;
 	}
+	if (device_is_unwritten(block_id)) {
+		memset(target, 0, BLOCK_SIZE);
+		return 0;
+	}
+	return backend->read(block_id, target);
+}
 
-	off_t seek_pos = block_id * BLOCK_SIZE;
-	if(lseek(disk_store, seek_pos, SEEK_SET) == -1) {
-		fprintf(stderr, "failed to seek to %" PRId64 " for block %" PRIu64 "\n", seek_pos, block_id);
+int device_write_block(big_int block_id, void * buffer, size_t buffer_size) {
+	char data[BLOCK_SIZE];
+
+	if(block_id >= NUM_BLOCKS) {
+		fprintf(stderr, "cannot write block id outside range\n");
 		return -1;
 	}
 
@@ -144,25 +189,211 @@ int write_block(big_int block_id, void * buffer, size_t buffer_size) {
 	}
 
 	if(buffer_size < BLOCK_SIZE) {
-		char data[BLOCK_SIZE];
 		memcpy(data, buffer, buffer_size);
 		memset(data + buffer_size, 0, BLOCK_SIZE - buffer_size);
 		buffer = data;
 	}
+	if (backend->write(block_id, buffer) == -1) {
+		return -1;
+	}
+	set_unwritten_bits(block_id, 1, 0);
+	return 0;
+}
+
+static int read_batch(struct block_io *ios, int count) {
+	int i;
+	if (backend->read_batch) {
+		return backend->read_batch(ios, count);
+	}
+	for (i = 0; i < count; i++) {
+		if (backend->read(ios[i].block_id, ios[i].buffer) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
 
-	ssize_t write_bytes = write(disk_store, buffer, BLOCK_SIZE);
-	if(write_bytes == -1) {
-		fprintf(stderr, "failed to write block %" PRIu64 " with seek_pos %" PRId64 "\n", block_id, seek_pos);
+// The unwritten blocks are cleared in memory, only the others are read
+int device_read_block_batch(struct block_io *ios, int count) {
+	struct block_io *written;
+	int i, num_written = 0, result;
+
+	for (i = 0; i < count && !device_is_unwritten(ios[i].block_id); i++);
+	if (i == count) {
+		return read_batch(ios, count);
+	}
+
+	written = malloc(count * sizeof(struct block_io));
+	if (written == NULL) {
+		fprintf(stderr, "failed to allocate the batch of written blocks\n");
 		return -1;
 	}
+	for (i = 0; i < count; i++) {
+		if (device_is_unwritten(ios[i].block_id)) {
+			memset(ios[i].buffer, 0, BLOCK_SIZE);
+		} else {
+			written[num_written++] = ios[i];
+		}
+	}
+	result = num_written > 0 ? read_batch(written, num_written) : 0;
+	free(written);
+	return result;
+}
 
-	if((big_int) write_bytes != BLOCK_SIZE) {
-		fprintf(stderr, "write returned less than expected bytes (%" PRId64 ")\n", write_bytes);
+int device_write_block_batch(struct block_io *ios, int count) {
+	int i;
+	if (backend->write_batch) {
+		if (backend->write_batch(ios, count) == -1) {
+			return -1;
+		}
+	} else {
+		for (i = 0; i < count; i++) {
+			if (backend->write(ios[i].block_id, ios[i].buffer) == -1) {
+				return -1;
+			}
+		}
+	}
+	for (i = 0; i < count; i++) {
+		set_unwritten_bits(ios[i].block_id, 1, 0);
 	}
 	return 0;
 }
 
-#endif
+int device_read_blocks(big_int start_block_id, int count, struct iovec *iov) {
+	int i, unwritten;
+	if (count < 0 || !is_block_range_valid(start_block_id, count)) {
+		fprintf(stderr, "cannot read block id outside range\n");
+		return -1;
+	}
 
+	// The run is read as a whole, then its unwritten blocks are cleared. A run that was never written is not read
+	for (i = 0, unwritten = 0; i < count; i++) {
+		unwritten += device_is_unwritten(start_block_id + i);
+	}
+	if (unwritten < count) {
+		if (backend->read_blocks) {
+			if (backend->read_blocks(start_block_id, count, iov) == -1) {
+				return -1;
+			}
+		} else {
+			for (i = 0; i < count; i++) {
+				if (backend->read(start_block_id + i, iov[i].iov_base) == -1) {
+					return -1;
+				}
+			}
+		}
+	}
+	for (i = 0; unwritten > 0 && i < count; i++) {
+		if (device_is_unwritten(start_block_id + i)) {
+			memset(iov[i].iov_base, 0, BLOCK_SIZE);
+		}
+	}
+	return 0;
+}
 
+int device_write_blocks(big_int start_block_id, int count, struct iovec *iov) {
+	int i;
+	if (count < 0 || !is_block_range_valid(start_block_id, count)) {
+		fprintf(stderr, "cannot write block id outside range\n");
+		return -1;
+	}
+	if (backend->write_blocks) {
+		if (backend->write_blocks(start_block_id, count, iov) == -1) {
+			return -1;
+		}
+	} else {
+		for (i = 0; i < count; i++) {
+			if (backend->write(start_block_id + i, iov[i].iov_base) == -1) {
+				return -1;
+			}
+		}
+	}
+	set_unwritten_bits(start_block_id, count, 0);
+	return 0;
+}
+
+int device_discard(big_int start_block_id, big_int count) {
+	if (!is_block_range_valid(start_block_id, count)) {
+		fprintf(stderr, "cannot discard block id outside range\n");
+		return -1;
+	}
+	if (!backend->discard || count == 0) {
+		return 0; // Discarding is only a hint
+	}
+	// A device may return anything for the blocks afterwards
+	set_unwritten_bits(start_block_id, count, 0);
+	return backend->discard(start_block_id, count);
+}
 
+int device_punch(big_int start_block_id, big_int count) {
+	if (!is_block_range_valid(start_block_id, count) || !backend->punch || backend->punch(start_block_id, count) == -1) {
+		return -1;
+	}
+	set_unwritten_bits(start_block_id, count, 1);
+	return 0;
+}
+
+// Every block access goes through the buffer cache, whatever the backend is
+int read_block(big_int block_id, void * target) {
+	if (block_id >= NUM_BLOCKS) {
+		fprintf(stderr, "cannot read block id outside range\n");
+		return -1;
+	}
+	return buffer_cache_read(block_id, target);
+}
+
+int write_block(big_int block_id, void * buffer, size_t buffer_size) {
+	if (block_id >= NUM_BLOCKS) {
+		fprintf(stderr, "cannot write block id outside range\n");
+		return -1;
+	}
+	return buffer_cache_write(block_id, buffer, buffer_size);
+}
+
+static int is_block_batch_in_range(struct block_io *ios, int count) {
+	int i;
+	for (i = 0; i < count; i++) {
+		if (ios[i].block_id >= NUM_BLOCKS) {
+			fprintf(stderr, "cannot access block id outside range\n");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int read_block_batch(struct block_io *ios, int count) {
+	if (!is_block_batch_in_range(ios, count)) {
+		return -1;
+	}
+	return buffer_cache_read_batch(ios, count);
+}
+
+int write_block_batch(struct block_io *ios, int count) {
+	if (!is_block_batch_in_range(ios, count)) {
+		return -1;
+	}
+	return buffer_cache_write_batch(ios, count);
+}
+
+int read_blocks(big_int start_block_id, int count, struct iovec *iov) {
+	if (count < 0 || !is_block_range_valid(start_block_id, count)) {
+		fprintf(stderr, "cannot read block id outside range\n");
+		return -1;
+	}
+	return buffer_cache_read_blocks(start_block_id, count, iov);
+}
+
+int write_blocks(big_int start_block_id, int count, struct iovec *iov) {
+	if (count < 0 || !is_block_range_valid(start_block_id, count)) {
+		fprintf(stderr, "cannot write block id outside range\n");
+		return -1;
+	}
+	return buffer_cache_write_blocks(start_block_id, count, iov);
+}
+
+int sync_disk_emulator(void) {
+	if (sync_buffer_cache() == -1) {
+		return -1;
+	}
+	return device_sync();
+}
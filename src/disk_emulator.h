@@ -1,12 +1,48 @@
 #ifndef DISK_EMULATOR
 #define DISK_EMULATOR
 
+#include <sys/uio.h>
+
 #include "common.h"
+#include "uring_queue.h"
+
+#define ZERO_BATCH_BLOCKS 64 // Number of blocks of 0s written at once when the backend cannot zero them out
 
+// Selects the storage behind the disk ("file", "direct", "memory" or "mmap") and the disk store it opens, before
+// init_disk_emulator. A NULL argument keeps the current value, the default is the file backend on DISK_STORE_PATH.
+int set_disk_backend(const char *name, const char *path);
+const char *get_disk_backend_name(void);
 int init_disk_emulator(void);
 void free_disk_emulator(void);
 
 int read_block(big_int block_id, void* target);
 int write_block(big_int block_id, void* buffer, size_t buffer_size);
+// Transfer many blocks at once (every buffer holds BLOCK_SIZE bytes). The disk accesses are submitted together.
+int read_block_batch(struct block_io *ios, int count);
+int write_block_batch(struct block_io *ios, int count);
+// Transfer the count physically contiguous blocks starting at start_block_id with vectored I/O.
+// iov[i] holds block start_block_id + i and its iov_len must be BLOCK_SIZE.
+int read_blocks(big_int start_block_id, int count, struct iovec *iov);
+int write_blocks(big_int start_block_id, int count, struct iovec *iov);
+int sync_disk_emulator(void); // Write back the dirty blocks of the cache and make them durable on the disk
+
+// Raw access to the disk, bypassing the buffer cache
+int device_read_block(big_int block_id, void* target);
+int device_write_block(big_int block_id, void* buffer, size_t buffer_size);
+int device_read_block_batch(struct block_io *ios, int count);
+int device_write_block_batch(struct block_io *ios, int count);
+int device_read_blocks(big_int start_block_id, int count, struct iovec *iov);
+int device_write_blocks(big_int start_block_id, int count, struct iovec *iov);
+int device_sync(void);
+// Makes the blocks read as 0s on the disk, with the zero_out of the backend or by writing 0s ZERO_BATCH_BLOCKS
+// at a time. They are then marked unwritten: they read as 0s without any disk access until they are written again.
+// The marks are only kept in memory, the disk itself reads as 0s after a remount
+int device_zero_out(big_int start_block_id, big_int count);
+int device_is_unwritten(big_int block_id);
+// Tells the backend the blocks are unused. Their content is undefined afterwards, they are no longer unwritten
+int device_discard(big_int start_block_id, big_int count);
+// Gives the storage of the blocks back with the punch of the backend, they are unwritten afterwards. Fails without
+// any message when the backend can't punch them
+int device_punch(big_int start_block_id, big_int count);
 
 #endif
@@ -0,0 +1,406 @@
+#define _GNU_SOURCE // fallocate, O_DIRECT
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#undef BLOCK_SIZE // Defined by <linux/fs.h>, we use our own
+
+#include "common.h"
+#include "disk_backend.h"
+#include "uring_queue.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024 // Only exposed by <limits.h> with the X/Open extensions
+#endif
+
+#define BOUNCE_POOL_SIZE 64 // Aligned blocks kept for reuse, more are allocated when needed
+
+// Positional I/O: the disk store is shared by all the FUSE threads so we never move its file offset
+static int disk_store = -1;
+
+// With O_DIRECT the page cache is bypassed and every buffer must be aligned on DIRECT_IO_ALIGNMENT. The buffer
+// cache hands aligned buffers to the disk as is, the others go through a bounce block taken from the pool.
+static int direct_io = 0;
+static void *bounce_pool[BOUNCE_POOL_SIZE];
+static int bounce_pool_count = 0;
+static pthread_mutex_t bounce_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int is_aligned(const void *buffer) {
+	return ((uintptr_t) buffer % DIRECT_IO_ALIGNMENT) == 0;
+}
+
+static void *get_bounce_block(void) {
+	void *block = NULL;
+
+	pthread_mutex_lock(&bounce_pool_lock);
+	if (bounce_pool_count > 0) {
+		block = bounce_pool[--bounce_pool_count];
+	}
+	pthread_mutex_unlock(&bounce_pool_lock);
+
+	if (block == NULL && posix_memalign(&block, DIRECT_IO_ALIGNMENT, BLOCK_SIZE) != 0) {
+		return NULL;
+	}
+	return block;
+}
+
+static void put_bounce_block(void *block) {
+	pthread_mutex_lock(&bounce_pool_lock);
+	if (bounce_pool_count < BOUNCE_POOL_SIZE) {
+		bounce_pool[bounce_pool_count++] = block;
+		block = NULL;
+	}
+	pthread_mutex_unlock(&bounce_pool_lock);
+	free(block);
+}
+
+static int open_disk_store(const char *path, int flags) {
+	struct stat stat;
+
+	disk_store = open(path, O_CREAT|O_RDWR|flags, 0644);
+	if (disk_store == -1){
+		fprintf(stderr, "Error opening disk store %s\n", path);
+		errno = ENODEV;
+		return -1; // failure
+	}
+	LOGD("file descriptor of disk: %d", disk_store);
+
+	// A disk store file smaller than the volume is extended without being written, the image is sparse
+	if (fstat(disk_store, &stat) == 0 && S_ISREG(stat.st_mode) && stat.st_size < (off_t) (NUM_BLOCKS * BLOCK_SIZE)
+		&& ftruncate(disk_store, NUM_BLOCKS * BLOCK_SIZE) == -1) {
+		fprintf(stderr, "failed to extend disk store %s\n", path);
+	}
+	init_uring_queue(); // Falls back to synchronous I/O on failure
+	return 0;
+}
+
+static int file_backend_init(const char *path) {
+	direct_io = 0;
+	return open_disk_store(path, 0);
+}
+
+static int direct_backend_init(const char *path) {
+	direct_io = 1;
+	if (open_disk_store(path, O_DIRECT) == 0) {
+		return 0;
+	}
+	// Some file systems (tmpfs for instance) don't support O_DIRECT
+	fprintf(stderr, "O_DIRECT not supported by disk store %s, using the page cache\n", path);
+	direct_io = 0;
+	return open_disk_store(path, 0);
+}
+
+static void file_backend_close(void) {
+	pthread_mutex_lock(&bounce_pool_lock);
+	while (bounce_pool_count > 0) {
+		free(bounce_pool[--bounce_pool_count]);
+	}
+	pthread_mutex_unlock(&bounce_pool_lock);
+
+	free_uring_queue();
+	if(close(disk_store) == 0) {
+		LOGD("disk store successfully closed");
+	} else {
+		fprintf(stderr, "failed to close disk store\n");
+	}
+	disk_store = -1;
+}
+
+static int pread_block(big_int block_id, void * target) {
+	off_t seek_pos = block_id * BLOCK_SIZE;
+	size_t read_bytes = 0;
+	while(read_bytes < BLOCK_SIZE) {
+		ssize_t result = pread(disk_store, (char *) target + read_bytes, BLOCK_SIZE - read_bytes, seek_pos + read_bytes);
+		if(result == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "failed to read block %" PRIu64 " with seek_pos %" PRId64 "\n", block_id, seek_pos);
+			return -1;
+		}
+		if(result == 0) {
+			// Beyond the end of the disk store, the block was never written
+			LOGD("read returned less than expected bytes: %zu", read_bytes);
+			memset((char *) target + read_bytes, 0, BLOCK_SIZE - read_bytes);
+			break;
+		}
+		read_bytes += result;
+	}
+	return 0;
+}
+
+static int pwrite_block(big_int block_id, const void * buffer) {
+	off_t seek_pos = block_id * BLOCK_SIZE;
+	size_t written_bytes = 0;
+	while(written_bytes < BLOCK_SIZE) {
+		ssize_t result = pwrite(disk_store, (const char *) buffer + written_bytes, BLOCK_SIZE - written_bytes, seek_pos + written_bytes);
+		if(result == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "failed to write block %" PRIu64 " with seek_pos %" PRId64 "\n", block_id, seek_pos);
+			return -1;
+		}
+		written_bytes += result;
+	}
+	return 0;
+}
+
+static int file_backend_read(big_int block_id, void * target) {
+	void *bounce;
+	int result;
+
+	if (!direct_io || is_aligned(target)) {
+		return pread_block(block_id, target);
+	}
+	if ((bounce = get_bounce_block()) == NULL) {
+		return -1;
+	}
+	result = pread_block(block_id, bounce);
+	memcpy(target, bounce, BLOCK_SIZE);
+	put_bounce_block(bounce);
+	return result;
+}
+
+static int file_backend_write(big_int block_id, const void * buffer) {
+	void *bounce;
+	int result;
+
+	if (!direct_io || is_aligned(buffer)) {
+		return pwrite_block(block_id, buffer);
+	}
+	if ((bounce = get_bounce_block()) == NULL) {
+		return -1;
+	}
+	memcpy(bounce, buffer, BLOCK_SIZE);
+	result = pwrite_block(block_id, bounce);
+	put_bounce_block(bounce);
+	return result;
+}
+
+// Returns a bounce block holding the content of buffer for a write, or buffer itself if it is aligned (or if
+// no bounce block could be allocated: the transfer then fails and is done again by file_backend_read/write)
+static void *bounce_block(int write, void *buffer) {
+	void *bounce;
+
+	if (is_aligned(buffer) || (bounce = get_bounce_block()) == NULL) {
+		return buffer;
+	}
+	if (write) {
+		memcpy(bounce, buffer, BLOCK_SIZE);
+	}
+	return bounce;
+}
+
+// Gives the bounce block back to the pool, after copying what it read for a read
+static void unbounce_block(int write, void *buffer, void *bounce) {
+	if (bounce != buffer) {
+		if (!write) {
+			memcpy(buffer, bounce, BLOCK_SIZE);
+		}
+		put_bounce_block(bounce);
+	}
+}
+
+static int are_iov_aligned(struct iovec *iov, int count) {
+	int i;
+	for (i = 0; i < count && is_aligned(iov[i].iov_base); i++);
+	return i == count;
+}
+
+static int are_ios_aligned(struct block_io *ios, int count) {
+	int i;
+	for (i = 0; i < count && is_aligned(ios[i].buffer); i++);
+	return i == count;
+}
+
+// One preadv/pwritev per IOV_MAX blocks. The blocks that were not fully transferred (end of the disk store
+// or short transfer) are done again one by one
+static int file_backend_rw_blocks(int write, big_int start_block_id, int count, struct iovec *iov) {
+	int i, done, batch;
+
+	for (i = 0; i < count; i += batch) {
+		ssize_t result;
+		off_t seek_pos = (start_block_id + i) * BLOCK_SIZE;
+
+		batch = count - i < IOV_MAX ? count - i : IOV_MAX;
+		do {
+			result = write ? pwritev(disk_store, &iov[i], batch, seek_pos) : preadv(disk_store, &iov[i], batch, seek_pos);
+		} while (result == -1 && errno == EINTR);
+
+		done = result > 0 ? result / BLOCK_SIZE : 0;
+		for (; done < batch; done++) {
+			big_int block_id = start_block_id + i + done;
+			if ((write && file_backend_write(block_id, iov[i + done].iov_base) == -1)
+				|| (!write && file_backend_read(block_id, iov[i + done].iov_base) == -1)) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+// With O_DIRECT the misaligned buffers are replaced by bounce blocks for the vectored transfer
+static int file_backend_rw_blocks_direct(int write, big_int start_block_id, int count, struct iovec *iov) {
+	struct iovec *direct_iov;
+	int i, result;
+
+	if (!direct_io || are_iov_aligned(iov, count)) {
+		return file_backend_rw_blocks(write, start_block_id, count, iov);
+	}
+
+	direct_iov = (struct iovec *) malloc(count * sizeof(struct iovec));
+	for (i = 0; i < count; i++) {
+		direct_iov[i].iov_base = bounce_block(write, iov[i].iov_base);
+		direct_iov[i].iov_len = BLOCK_SIZE;
+	}
+	result = file_backend_rw_blocks(write, start_block_id, count, direct_iov);
+	for (i = 0; i < count; i++) {
+		unbounce_block(write, iov[i].iov_base, direct_iov[i].iov_base);
+	}
+	free(direct_iov);
+	return result;
+}
+
+static int file_backend_read_blocks(big_int start_block_id, int count, struct iovec *iov) {
+	return file_backend_rw_blocks_direct(0, start_block_id, count, iov);
+}
+
+static int file_backend_write_blocks(big_int start_block_id, int count, struct iovec *iov) {
+	return file_backend_rw_blocks_direct(1, start_block_id, count, iov);
+}
+
+// Blocks that io_uring could not transfer in one go (end of the disk store, short transfer, unsupported
+// operation or no io_uring at all) are done again synchronously
+static int file_backend_rw_batch(int write, struct block_io *ios, int count) {
+	ssize_t *results;
+	int i;
+
+	results = (ssize_t *) malloc(count * sizeof(ssize_t));
+	if (uring_queue_rw_blocks(disk_store, write, ios, count, results) == -1) {
+		for (i = 0; i < count; i++) {
+			results[i] = -1;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (results[i] == BLOCK_SIZE) {
+			continue;
+		}
+		if ((write && file_backend_write(ios[i].block_id, ios[i].buffer) == -1)
+			|| (!write && file_backend_read(ios[i].block_id, ios[i].buffer) == -1)) {
+			free(results);
+			return -1;
+		}
+	}
+	free(results);
+	return 0;
+}
+
+// With O_DIRECT the misaligned buffers are replaced by bounce blocks for the io_uring batch
+static int file_backend_rw_batch_direct(int write, struct block_io *ios, int count) {
+	struct block_io *direct_ios;
+	int i, result;
+
+	if (!direct_io || are_ios_aligned(ios, count)) {
+		return file_backend_rw_batch(write, ios, count);
+	}
+
+	direct_ios = (struct block_io *) malloc(count * sizeof(struct block_io));
+	for (i = 0; i < count; i++) {
+		direct_ios[i].block_id = ios[i].block_id;
+		direct_ios[i].buffer = bounce_block(write, ios[i].buffer);
+	}
+	result = file_backend_rw_batch(write, direct_ios, count);
+	for (i = 0; i < count; i++) {
+		unbounce_block(write, ios[i].buffer, direct_ios[i].buffer);
+	}
+	free(direct_ios);
+	return result;
+}
+
+static int file_backend_read_batch(struct block_io *ios, int count) {
+	return file_backend_rw_batch_direct(0, ios, count);
+}
+
+static int file_backend_write_batch(struct block_io *ios, int count) {
+	return file_backend_rw_batch_direct(1, ios, count);
+}
+
+static int file_backend_flush(void) {
+	if(fsync(disk_store) == -1) {
+		fprintf(stderr, "failed to sync disk store\n");
+		return -1;
+	}
+	return 0;
+}
+
+// Punches a hole in a disk store file, or sends the request to a block device: BLKDISCARD leaves the content of
+// the range undefined while BLKZEROOUT makes it read as 0s, without writing them if the device supports it
+static int punch_range(big_int start_block_id, big_int count, unsigned long request) {
+	struct stat stat;
+
+	if (fstat(disk_store, &stat) == -1) {
+		return -1;
+	}
+
+	if (S_ISBLK(stat.st_mode)) {
+		uint64_t range[2] = { start_block_id * BLOCK_SIZE, count * BLOCK_SIZE };
+		return ioctl(disk_store, request, &range);
+	}
+	return fallocate(disk_store, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start_block_id * BLOCK_SIZE, count * BLOCK_SIZE);
+}
+
+static int file_backend_discard(big_int start_block_id, big_int count) {
+	return punch_range(start_block_id, count, BLKDISCARD);
+}
+
+static int file_backend_zero_out(big_int start_block_id, big_int count) {
+	return punch_range(start_block_id, count, BLKZEROOUT);
+}
+
+// Only a disk store file gets holes punched, BLKDISCARD can be slow and doesn't zero out the blocks of a device
+static int file_backend_punch(big_int start_block_id, big_int count) {
+	struct stat stat;
+
+	if (fstat(disk_store, &stat) == -1 || S_ISBLK(stat.st_mode)) {
+		return -1;
+	}
+	return fallocate(disk_store, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start_block_id * BLOCK_SIZE, count * BLOCK_SIZE);
+}
+
+const struct disk_backend_ops file_backend = {
+	.name = "file",
+	.init = file_backend_init,
+	.read = file_backend_read,
+	.write = file_backend_write,
+	.read_blocks = file_backend_read_blocks,
+	.write_blocks = file_backend_write_blocks,
+	.read_batch = file_backend_read_batch,
+	.write_batch = file_backend_write_batch,
+	.flush = file_backend_flush,
+	.discard = file_backend_discard,
+	.zero_out = file_backend_zero_out,
+	.punch = file_backend_punch,
+	.close = file_backend_close
+};
+
+// Same as the file backend but the disk store is opened with O_DIRECT
+const struct disk_backend_ops direct_backend = {
+	.name = "direct",
+	.init = direct_backend_init,
+	.read = file_backend_read,
+	.write = file_backend_write,
+	.read_blocks = file_backend_read_blocks,
+	.write_blocks = file_backend_write_blocks,
+	.read_batch = file_backend_read_batch,
+	.write_batch = file_backend_write_batch,
+	.flush = file_backend_flush,
+	.discard = file_backend_discard,
+	.zero_out = file_backend_zero_out,
+	.punch = file_backend_punch,
+	.close = file_backend_close
+};
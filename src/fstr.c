@@ -1,6 +1,13 @@
+#include <stddef.h>
+
 #include "common.h"
 #include "mkfs.h"
 #include "disk_emulator.h"
+#include "buffer_cache.h"
+#include "readahead.h"
+#include "delalloc.h"
+#include "data_blocks_handler.h"
+#include "inodes_handler.h"
 #include "syscalls1.h"
 #include "syscalls2.h"
 
@@ -88,6 +95,13 @@ static int fstr_write(const char *path, const char *buf, size_t size, off_t offs
     return bytes;
 }
 
+static int fstr_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    LOGD("fstr_fallocate(path: \"%s\")", path);
+    if (syscalls2__fallocate(fi->fh, mode, offset, length) == -1) {
+        return -errno;
+    }
+    return 0;
+}
 
 static int fstr_utimens(const char *path, const struct timespec tv[2]) {
     LOGD("fstr_utimens");
@@ -121,6 +135,66 @@ static int fstr_rename(const char *oldpath, const char *newpath) {
     return 0;
 }
 
+static int fstr_flush(const char *path, struct fuse_file_info *fi) {
+    LOGD("fstr_flush(path: \"%s\")", path);
+    if(sync_buffer_cache() == -1) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static int fstr_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    LOGD("fstr_fsync(path: \"%s\")", path);
+    // Allocate the delayed blocks of the file, then checkpoint the superblock, which is otherwise only committed
+    // every few seconds
+    if(syscalls2__fsync(fi->fh) == -1) {
+        return -errno;
+    }
+    if(commit_superblock() == -1 || sync_disk_emulator() == -1) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static void *fstr_init(struct fuse_conn_info *conn) {
+    LOGD("fstr_init");
+    // The flusher thread has to be started here as fuse_main forks when it daemonizes
+    if(start_buffer_cache_flusher() == -1) {
+        fprintf(stderr, "Failed to start the flusher, dirty blocks will only be written on sync\n");
+    }
+    if(start_delalloc_flusher() == -1) {
+        fprintf(stderr, "Failed to start the delayed allocation flusher, delayed blocks will only be allocated on sync\n");
+    }
+    if(start_readahead() == -1) {
+        fprintf(stderr, "Failed to start the readahead thread, files will be read without readahead\n");
+    }
+    if(start_superblock_checkpointer() == -1) {
+        fprintf(stderr, "Failed to start the superblock checkpointer, the superblock will only be committed on sync\n");
+    }
+    if(!is_immediate_discard_enabled() && start_block_trimmer() == -1) {
+        fprintf(stderr, "Failed to start the trimmer, freed blocks will only be discarded at unmount\n");
+    }
+    if(start_itable_initializer() == -1) {
+        fprintf(stderr, "Failed to start the itable initializer, inode slices will be formatted when first used\n");
+    }
+    return NULL;
+}
+
+static void fstr_destroy(void *private_data) {
+    LOGD("fstr_destroy");
+    stop_itable_initializer();
+    stop_readahead();
+    stop_delalloc_flusher();
+    stop_superblock_checkpointer();
+    stop_block_trimmer();
+    if(delalloc_flush_all() == -1) {
+        fprintf(stderr, "failed to flush the delayed blocks, the data written to them is lost\n");
+    }
+    trim_free_blocks();
+    unmount_superblock();
+    free_disk_emulator();
+}
+
 static struct fuse_operations fstr_fuse_oper = {
 	.getattr	= fstr_getattr,
 	.mkdir		= fstr_mkdir,
@@ -132,28 +206,93 @@ static struct fuse_operations fstr_fuse_oper = {
 	.release	= fstr_release,
 	.read		= fstr_read,
 	.write		= fstr_write,
+    .fallocate  = fstr_fallocate,
     .utimens    = fstr_utimens,
     .chmod      = fstr_chmod,
     .chown      = fstr_chown,
-    .rename     = fstr_rename
+    .rename     = fstr_rename,
+    .flush      = fstr_flush,
+    .fsync      = fstr_fsync,
+    .init       = fstr_init,
+    .destroy    = fstr_destroy
+};
+
+struct fstr_options {
+    int write_through;
+    int discard;
+    char *backend;
+    char *disk;
+};
+
+enum {
+    KEY_WRITE_THROUGH,
+    KEY_DISCARD
+};
+
+static struct fuse_opt fstr_fuse_opts[] = {
+    FUSE_OPT_KEY("writethrough", KEY_WRITE_THROUGH),
+    FUSE_OPT_KEY("discard", KEY_DISCARD),
+    { "backend=%s", offsetof(struct fstr_options, backend), 0 },
+    { "disk=%s", offsetof(struct fstr_options, disk), 0 },
+    FUSE_OPT_END
 };
 
+static int fstr_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
+    struct fstr_options *options = data;
+
+    if(key == KEY_WRITE_THROUGH) {
+        options->write_through = 1;
+        return 0; // Not a FUSE option, drop it
+    }
+    if(key == KEY_DISCARD) {
+        options->discard = 1;
+        return 0;
+    }
+    return 1;
+}
+
 int main(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fstr_options options = {
+        .write_through = 0,
+        .discard = 0,
+        .backend = NULL,
+        .disk = NULL
+    };
+
+    // -o writethrough writes every block to disk synchronously instead of caching dirty blocks and delaying allocations
+    // -o discard discards the freed blocks right away instead of every TRIM_INTERVAL_SECONDS
+    // -o backend=file|direct|memory|mmap selects the storage behind the disk, -o disk=<path> the disk store it opens
+    if(fuse_opt_parse(&args, &options, fstr_fuse_opts, fstr_opt_proc) == -1) {
+        return -1;
+    }
+
+    if(set_disk_backend(options.backend, options.disk) == -1) {
+        return -1;
+    }
 
     if(init_disk_emulator() == -1) {
         fprintf(stderr, "Failed to init disk emulator\n");
         return -1;
     }
 
-    if (create_fs() == -1) {
+    // The volume is formatted by mkfs.fstr and reused as is, except the memory backend which starts empty
+    if(strcmp(get_disk_backend_name(), "memory") == 0 && create_fs() == -1) {
         fprintf(stderr, "Failed to create fs\n");
         return -1;
     }
-    
+
     if(init_superblock() == -1) {
         fprintf(stderr, "Failed to init superblock\n");
+        free_disk_emulator();
         return -1;
     }
-    
-	return fuse_main(argc, argv, &fstr_fuse_oper, NULL);
+
+    set_buffer_cache_write_back(!options.write_through);
+    set_delayed_allocation(!options.write_through); // Delaying allocations is only worth it when writes are cached
+    set_immediate_discard(options.discard);
+
+    int ret = fuse_main(args.argc, args.argv, &fstr_fuse_oper, NULL);
+    fuse_opt_free_args(&args);
+    return ret;
 }
@@ -1,16 +1,72 @@
+#include <pthread.h>
+
 #include "common.h"
 #include "inode_table.h"
 #include "inodes_handler.h"
 #include "uthash.h"
 
 #define MAX_CACHE_SIZE 1024
+#define INODE_LOCKS 256 // Inodes are hashed on this many locks
 
 struct inode_entry *cache = NULL;
+static pthread_mutex_t inode_table_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t inode_locks[INODE_LOCKS];
+static pthread_once_t inode_locks_once = PTHREAD_ONCE_INIT;
+
+static void init_inode_locks(void) {
+    int i;
+    for (i = 0; i < INODE_LOCKS; i++) {
+        pthread_mutex_init(&inode_locks[i], NULL);
+    }
+}
+
+void lock_inode(int inode_id) {
+    pthread_once(&inode_locks_once, init_inode_locks);
+    pthread_mutex_lock(&inode_locks[(unsigned int) inode_id % INODE_LOCKS]);
+}
+
+void unlock_inode(int inode_id) {
+    pthread_mutex_unlock(&inode_locks[(unsigned int) inode_id % INODE_LOCKS]);
+}
+
+// prune the cache to MAX_CACHE_SIZE. Called with inode_table_lock held
+static void prune_cache(void) {
+    struct inode_entry *inode_entry, *temp_inode_entry;
+
+    if (HASH_COUNT(cache) >= MAX_CACHE_SIZE) {
+        HASH_ITER(hh, cache, inode_entry, temp_inode_entry) {
+            // prune the first entry (loop is based on insertion order so this deletes the oldest item)
+            LOGD("Removing from cache inode %d", inode_entry->inode_id);
+            HASH_DEL(cache, inode_entry);
+            free_inode_entry(inode_entry);
+            break;
+        }
+    }
+}
+
+// Only adds the inode if it is not cached yet: a concurrent put_inode may have cached a more recent version
+static void add_inode_to_cache(struct inode *inode) {
+    struct inode_entry *inode_entry;
+
+    pthread_mutex_lock(&inode_table_lock);
+    HASH_FIND_INT(cache, &inode->inode_id, inode_entry);
+    if (inode_entry == NULL) {
+        inode_entry = (struct inode_entry*) malloc(sizeof(struct inode_entry));
+        inode_entry->inode_id = inode->inode_id;
+        inode_entry->inode = (struct inode*) malloc(sizeof(struct inode));
+        memcpy(inode_entry->inode, inode, sizeof(struct inode));
+
+        LOGD("Adding to cache inode %d", inode->inode_id);
+        HASH_ADD_INT(cache, inode_id, inode_entry);
+        prune_cache();
+    }
+    pthread_mutex_unlock(&inode_table_lock);
+}
 
 int get_inode(int inode_id, struct inode *inode) {
     if(get_inode_from_cache(inode_id, inode) == -1) {
         if(iget(inode_id, inode) == 0) {
-            put_inode_in_cache(inode);
+            add_inode_to_cache(inode);
             return 0;
         }
         return -1;
@@ -21,6 +77,7 @@ int get_inode(int inode_id, struct inode *inode) {
 int get_inode_from_cache(int inode_id, struct inode *inode) {
     struct inode_entry *inode_entry;
 
+    pthread_mutex_lock(&inode_table_lock);
     HASH_FIND_INT(cache, &inode_id, inode_entry);
     if (inode_entry) {
         LOGD("Cache hit for inode %d", inode_id);
@@ -29,8 +86,10 @@ int get_inode_from_cache(int inode_id, struct inode *inode) {
         HASH_ADD_INT(cache, inode_id, inode_entry);
 
         memcpy(inode, inode_entry->inode, sizeof(struct inode));
+        pthread_mutex_unlock(&inode_table_lock);
         return 0;
     }
+    pthread_mutex_unlock(&inode_table_lock);
     LOGD("Cache miss for inode %d", inode_id);
     return -1;
 }
@@ -56,30 +115,23 @@ int put_inode_in_cache(struct inode *inode) {
     memcpy(inode_entry->inode, inode, sizeof(struct inode));
 
     LOGD("Adding to cache inode %d", inode->inode_id);
+    pthread_mutex_lock(&inode_table_lock);
     HASH_REPLACE_INT(cache, inode->inode_id, inode_entry, temp_inode_entry);
     free_inode_entry(temp_inode_entry);
-    temp_inode_entry = NULL;
-    
-    // prune the cache to MAX_CACHE_SIZE
-    if (HASH_COUNT(cache) >= MAX_CACHE_SIZE) {
-        HASH_ITER(hh, cache, inode_entry, temp_inode_entry) {
-            // prune the first entry (loop is based on insertion order so this deletes the oldest item)
-            LOGD("Removing from cache inode %d", inode_entry->inode_id);
-            HASH_DEL(cache, inode_entry);
-            free_inode_entry(inode_entry);
-            break;
-        }
-    }
+    prune_cache();
+    pthread_mutex_unlock(&inode_table_lock);
     return 0;
 }
 
 void purge_inode_table(void) {
     struct inode_entry *inode_entry, *tmp;
 
+    pthread_mutex_lock(&inode_table_lock);
     HASH_ITER(hh, cache, inode_entry, tmp) {
         HASH_DEL(cache, inode_entry);
         free_inode_entry(inode_entry);
     }
+    pthread_mutex_unlock(&inode_table_lock);
 }
 
 void free_inode_entry(struct inode_entry *inode_entry) {
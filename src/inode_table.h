@@ -14,6 +14,10 @@ int get_inode(int inode_id, struct inode *inode);
 int put_inode(struct inode *inode);
 void purge_inode_table(void);
 
+// Serializes the read-modify-write sequences (get_inode ... put_inode) on an inode
+void lock_inode(int inode_id);
+void unlock_inode(int inode_id);
+
 // Internal use only
 int get_inode_from_cache(int inode_id, struct inode *inode);
 int put_inode_in_cache(struct inode *inode);
@@ -1,8 +1,199 @@
+#include <pthread.h>
+
 #include "inodes_handler.h"
 #include "data_blocks_handler.h"
 #include "block_utils.h"
+#include "mkfs.h"
+#include "disk_emulator.h"
+
+// Protects the free inode cache of the superblock. Taken before the lock of an inode group
+static pthread_mutex_t inodes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The inode bitmap is kept in memory, bit i is inode i + 1. The bit of an inode only changes with the lock of its
+// group held, and inode_bitmap_lock orders the updates of a word with their writes to the disk. The searches
+// read the words without lock, a free inode they find is checked again under the lock of its group.
+// NUM_INODES is not a constant expression, the bitmap is allocated by the first init_inode_bitmap
+static uint64_t *inode_bitmap = NULL;
+static pthread_mutex_t inode_bitmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The inode list is split in slices of whole inode blocks, one per block group holding data blocks (the first
+// groups may only hold the inode list). The inodes of a slice are allocated under the lock of their group,
+// so that files created in different groups don't wait for each other
+struct inode_group {
+	pthread_mutex_t lock; // Makes the lookup of a free inode of the slice and its claim atomic
+	big_int next_free_inode; // The search of the slice resumes there, 0 for its first inode
+	int full; // Set when a search found no free inode, cleared when an inode of the slice is freed
+};
+
+static struct inode_group inode_groups[NUM_BLOCK_GROUPS];
+static pthread_once_t inode_groups_once = PTHREAD_ONCE_INIT;
+
+static pthread_t itable_initializer;
+static int itable_initializer_running = 0;
+static pthread_cond_t itable_initializer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t itable_initializer_lock = PTHREAD_MUTEX_INITIALIZER;
 // ASSUMING INODE NUMBERS START FROM 1
 
+static void init_inode_group_locks(void) {
+	big_int i;
+	for(i = 0; i < NUM_BLOCK_GROUPS; i++){
+		pthread_mutex_init(&inode_groups[i].lock, NULL);
+	}
+}
+
+static big_int get_first_inode_group(void) {
+	return get_block_group(get_block_number_of_first_datablock());
+}
+
+// The inode blocks are spread over the groups from the first one: each gets blocks_per_slice blocks and the
+// first extra_blocks groups one more, so that every group gets a slice as long as there are enough blocks
+static void get_slice_blocks(big_int *blocks_per_slice, big_int *extra_blocks) {
+	big_int groups = NUM_BLOCK_GROUPS - get_first_inode_group();
+	*blocks_per_slice = NUM_INODE_BLOCKS / groups;
+	*extra_blocks = NUM_INODE_BLOCKS % groups;
+}
+
+big_int get_inode_group(int inode_number) {
+	big_int block = (inode_number - 1) / (BLOCK_SIZE / INODE_SIZE), blocks_per_slice, extra_blocks;
+
+	get_slice_blocks(&blocks_per_slice, &extra_blocks);
+	if(block < extra_blocks * (blocks_per_slice + 1)){
+		return get_first_inode_group() + block / (blocks_per_slice + 1);
+	}
+	return get_first_inode_group() + extra_blocks + (block - extra_blocks * (blocks_per_slice + 1)) / blocks_per_slice;
+}
+
+void get_inode_slice(big_int group, big_int *first_inode, big_int *num_inodes) {
+	big_int index = group - get_first_inode_group(), blocks_per_slice, extra_blocks;
+
+	*first_inode = 0;
+	*num_inodes = 0;
+	if(group < get_first_inode_group() || group >= NUM_BLOCK_GROUPS){
+		return;
+	}
+	get_slice_blocks(&blocks_per_slice, &extra_blocks);
+	*first_inode = (index * blocks_per_slice + (index < extra_blocks ? index : extra_blocks)) * (BLOCK_SIZE / INODE_SIZE);
+	*num_inodes = (blocks_per_slice + (index < extra_blocks)) * (BLOCK_SIZE / INODE_SIZE);
+	if(*first_inode >= (big_int) NUM_INODES){
+		*num_inodes = 0;
+	} else if(*first_inode + *num_inodes > (big_int) NUM_INODES){
+		*num_inodes = NUM_INODES - *first_inode; // The last inode block is not full
+	}
+}
+
+// The bits are only cleared once mounted, they are read without the superblock lock
+int is_inode_slice_initialized(big_int group) {
+	return !((__atomic_load_n(&superblock.uninit_inode_slices[group / 64], __ATOMIC_RELAXED) >> (group % 64)) & 1);
+}
+
+int init_inode_slice(big_int group) {
+	big_int first_inode, num_inodes;
+	int result = 0;
+
+	if(is_inode_slice_initialized(group)){
+		return 0;
+	}
+
+	pthread_once(&inode_groups_once, init_inode_group_locks);
+	get_inode_slice(group, &first_inode, &num_inodes);
+	pthread_mutex_lock(&inode_groups[group].lock);
+	if(!is_inode_slice_initialized(group)){
+		result = format_inode_blocks(first_inode / (BLOCK_SIZE / INODE_SIZE), (num_inodes + BLOCK_SIZE / INODE_SIZE - 1) / (BLOCK_SIZE / INODE_SIZE));
+		if(result == 0){
+			lock_superblock();
+			__atomic_fetch_and(&superblock.uninit_inode_slices[group / 64], ~((big_int) 1 << (group % 64)), __ATOMIC_RELAXED);
+			unlock_superblock();
+		}
+	}
+	pthread_mutex_unlock(&inode_groups[group].lock);
+
+	// Committed before an inode of the slice is allocated, otherwise the slice could be formatted again over it
+	// at the next mount. The superblock is written back no later than the inode
+	return result == 0 ? commit_superblock() : -1;
+}
+
+int init_inode_bitmap(void) {
+	struct iovec *iov = malloc(NUM_INODE_BITMAP_BLOCKS * sizeof(struct iovec));
+	big_int i;
+	int result;
+
+	if(inode_bitmap == NULL && (inode_bitmap = aligned_alloc(DIRECT_IO_ALIGNMENT, NUM_INODE_BITMAP_BLOCKS * BLOCK_SIZE)) == NULL){
+		fprintf(stderr, "Failed to allocate the inode bitmap\n");
+		free(iov);
+		return -1;
+	}
+	for(i = 0; i < NUM_INODE_BITMAP_BLOCKS; i++){
+		iov[i].iov_base = (char *) inode_bitmap + i * BLOCK_SIZE;
+		iov[i].iov_len = BLOCK_SIZE;
+	}
+
+	pthread_mutex_lock(&inode_bitmap_lock);
+	result = read_blocks(INODE_BITMAP_BEGIN, NUM_INODE_BITMAP_BLOCKS, iov);
+	pthread_mutex_unlock(&inode_bitmap_lock);
+
+	free(iov);
+	if(result == -1){
+		fprintf(stderr, "Failed to read the inode bitmap\n");
+	}
+	return result;
+}
+
+static int is_inode_used(int inode_number){
+	return (__atomic_load_n(&inode_bitmap[(inode_number - 1) / 64], __ATOMIC_RELAXED) >> ((inode_number - 1) % 64)) & 1;
+}
+
+// Sets or clears the bit of the inode and writes its word. Must be called with the lock of the group of the inode held
+static int set_inode_used(int inode_number, int used){
+	big_int word = (inode_number - 1) / 64;
+	uint64_t mask = (uint64_t) 1 << ((inode_number - 1) % 64), value;
+	int result;
+
+	pthread_mutex_lock(&inode_bitmap_lock);
+	value = used ? __atomic_or_fetch(&inode_bitmap[word], mask, __ATOMIC_RELAXED) : __atomic_and_fetch(&inode_bitmap[word], ~mask, __ATOMIC_RELAXED);
+	result = write_block_offset(INODE_BITMAP_BEGIN + word / INODE_BITMAP_WORDS_PER_BLOCK, &value, sizeof(uint64_t),
+		(word % INODE_BITMAP_WORDS_PER_BLOCK) * sizeof(uint64_t));
+	if(result == -1){
+		__atomic_store_n(&inode_bitmap[word], value ^ mask, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&inode_bitmap_lock);
+	return result;
+}
+
+// Returns the first free inode of [first, last), counted from 0, searching from start and wrapping around once,
+// or -1 if they are all used. A word of the bitmap is tested at once
+static int find_free_inode(big_int first, big_int last, big_int start){
+	big_int count = last - first, i = 0;
+
+	while(i < count){
+		big_int index = first + (start - first + i) % count;
+		big_int span = 64 - index % 64; // Bits left in the word, up to the end of the range or of the search
+		uint64_t free_bits = ~__atomic_load_n(&inode_bitmap[index / 64], __ATOMIC_RELAXED) >> (index % 64);
+
+		span = span < last - index ? span : last - index;
+		span = span < count - i ? span : count - i;
+		if(span < 64){
+			free_bits &= ((uint64_t) 1 << span) - 1;
+		}
+		if(free_bits){
+			return index + __builtin_ctzll(free_bits);
+		}
+		i += span;
+	}
+	return -1;
+}
+
+void init_inode_groups(void) {
+	big_int i;
+
+	pthread_once(&inode_groups_once, init_inode_group_locks);
+	for(i = 0; i < NUM_BLOCK_GROUPS; i++){
+		pthread_mutex_lock(&inode_groups[i].lock);
+		inode_groups[i].next_free_inode = 0;
+		inode_groups[i].full = 0;
+		pthread_mutex_unlock(&inode_groups[i].lock);
+	}
+}
+
 int iget(int inode_number, struct inode* target){
 	int block_number_of_inode;
 	int inode_offset_in_block;
@@ -11,6 +202,13 @@ int iget(int inode_number, struct inode* target){
 		LOGD("IGET: invalid inode number %d", inode_number);
 		return -1;
 	}
+	if(!is_inode_slice_initialized(get_inode_group(inode_number))){
+		// Its block was never formatted
+		memset(target, 0, sizeof(struct inode));
+		target->inode_id = inode_number;
+		target->type = TYPE_FREE;
+		return 0;
+	}
 	//printf("going to get inode number %d", (int)inode_number);
 	block_number_of_inode = ILIST_BEGIN + ((inode_number - 1) / (BLOCK_SIZE / INODE_SIZE));
 	
@@ -30,117 +228,348 @@ int iget(int inode_number, struct inode* target){
 int iput(struct inode * inod) {
 	LOGD("iput inode id: %d", inod->inode_id);
 	if(inod->links_nb == 0) {
-		// Free the inode and data blocks
-		struct data_block data_block;
-		big_int total_blocks = inod->num_blocks;
-		big_int i;
-		for(i = 0; i < total_blocks; ++i) {
-			big_int block_id = get_block_id(inod, i);
-			if(block_id > 0) {
-				data_block.data_block_id = block_id;
-				data_block_free(&data_block);
-				inod->num_allocated_blocks--;
-			}
-		}
-		
-		return ifree(inod);
-	}
-
-	// Else, write the inode block to disk to save changes
-	struct data_block blok;
-	if(bread(ILIST_BEGIN + ((inod->inode_id - 1)/(BLOCK_SIZE/INODE_SIZE)), &blok) == -1){
-		fprintf(stderr, "failed to read block\n");
-		return -1;
+		// Free the inode, its data blocks and indirect blocks. The blocks are freed in batches while the whole
+		// block map is walked, as blocks may be preallocated past the end of the file
+		if(free_block_map(inod) == -1) {
+			fprintf(stderr, "failed to free data blocks of inode %d\n", inod->inode_id);
+		}
+		return ifree(inod); // Freed anyway, the blocks that could not be freed are lost
 	}
+
+	// Else, write the inode to disk to save changes. The block is shared with other inodes so only our slot is updated
 	big_int inode_offset_in_block = ((inod->inode_id - 1) % (BLOCK_SIZE/INODE_SIZE)) * INODE_SIZE;
-	memcpy(&(blok.block[inode_offset_in_block]), inod, sizeof(struct inode));
-	return bwrite(&blok);
+	if(write_block_offset(ILIST_BEGIN + ((inod->inode_id - 1)/(BLOCK_SIZE/INODE_SIZE)), inod, sizeof(struct inode), inode_offset_in_block) == -1){
+		fprintf(stderr, "failed to write inode %d\n", inod->inode_id);
+		return -1;
+	}
+	return 0;
 }
 
-int next_free_inode_number(void){ // It's correctness depends on how mkfs organizes stuff
-	
-	struct data_block blok;
-	struct inode *inod;
-	int i, j;
-	int total_blocks_for_inodes = NUM_INODE_BLOCKS;
-	inod = (struct inode*)malloc(sizeof(struct inode));
-	for(i = 1; i <= total_blocks_for_inodes; i++){
-		bread(i, &blok);
-		for(j = 0; j < BLOCK_SIZE/INODE_SIZE; j++){
-			memcpy(inod, &(blok.block[j*INODE_SIZE]), sizeof(struct inode));
-			if(inod->type == TYPE_FREE){
-				return inod->inode_id;
-			}
+// Takes a batch of free inodes from the bitmap, searched from superblock.next_free_inode and wrapping around once,
+// into the cache of the superblock. Must be called with inodes_lock held
+static int refill_free_inodes_cache(void) {
+	big_int inode_ids[FREE_INODES_CACHE_SIZE];
+	big_int next = superblock.next_free_inode - 1;
+	int count = 0, j;
+
+	while(count < FREE_INODES_CACHE_SIZE){
+		int index = find_free_inode(0, NUM_INODES, next);
+		if(index == -1 || (count > 0 && (big_int) index + 1 == inode_ids[0])){
+			break;
 		}
+		inode_ids[count++] = index + 1;
+		next = (index + 1) % NUM_INODES;
 	}
-	return -1;
+	if(count == 0){
+		return -1;
+	}
+
+	// The cache is a stack, the lowest inode is taken first
+	lock_superblock();
+	for(j = 0; j < count; j++){
+		superblock.free_inodes_cache[j] = inode_ids[count - 1 - j];
+	}
+	superblock.num_cached_free_inodes = count;
+	superblock.next_free_inode = next + 1;
+	unlock_superblock();
+	return 0; // The cached inodes are still free on disk, nothing has to be committed
 }
 
-int ialloc(struct inode* inod){  // THIS DOES NOT SET THE FILETYPE OF INODE. MUST BE DONE AT LAYER 2
-	
-	struct data_block blok3;
-	int free_inode_number;
+// The inode read in inod is free in the bitmap but used in the inode list, the bitmap on disk was behind after an
+// unclean unmount. Its bit is set. Must be called with the lock of its group held
+static void repair_inode_bit(struct inode *inod){
+	if(set_inode_used(inod->inode_id, 1) == 0){
+		lock_superblock();
+		superblock.num_free_inodes--;
+		unlock_superblock();
+	}
+}
+
+// Marks the free inode read in inod as used on disk and in the bitmap. Must be called with the lock of its group held
+static int claim_inode(struct inode *inod){
 	int inode_offset_in_block;
-	
-	free_inode_number = next_free_inode_number(); 
-	if(free_inode_number == -1){
-		LOGD("IALLOC: free inode not found");
+
+	inod->links_nb = 1;
+	inod->type = TYPE_ORDINARY;
+
+	inode_offset_in_block = ((inod->inode_id - 1) % (BLOCK_SIZE / INODE_SIZE)) * INODE_SIZE;	
+	if(write_block_offset(ILIST_BEGIN + ((inod->inode_id - 1) / (BLOCK_SIZE / INODE_SIZE)), inod, sizeof(struct inode), inode_offset_in_block) == -1){
+		LOGD("IALLOC: write of inode was unsuccessful");
 		return -1;
 	}
-	
-	iget(free_inode_number, inod);
-	
+	if(set_inode_used(inod->inode_id, 1) == -1){
+		LOGD("IALLOC: write of inode bitmap was unsuccessful");
+		return -1;
+	}
+
+	lock_superblock();
 	superblock.num_free_inodes--; // decrease count of number of free inodes in the file system
-	commit_superblock();
-	inod->links_nb = 1;
+	unlock_superblock();
+	return 0;
+}
 
-	// Update the inode on disk
-	bread(ILIST_BEGIN + ((inod->inode_id - 1) / (BLOCK_SIZE / INODE_SIZE)), &blok3);
+int ialloc(struct inode* inod){  // THIS DOES NOT SET THE FILETYPE OF INODE. MUST BE DONE AT LAYER 2
 	
-	inode_offset_in_block = ((inod->inode_id - 1) % (BLOCK_SIZE / INODE_SIZE)) * INODE_SIZE;	
-	inod->type = TYPE_ORDINARY;
-	memcpy(&(blok3.block[inode_offset_in_block]), inod, sizeof(struct inode));
+	int free_inode_number;
+	struct inode_group *group;
 	
-	if(bwrite(&blok3) == 0){
-		if(commit_superblock() == 0){
-			LOGD("ialloc returning inode id: %d", inod->inode_id);
-			return 0;
+	pthread_once(&inode_groups_once, init_inode_group_locks);
+	while(1){
+		pthread_mutex_lock(&inodes_lock);
+		if(superblock.num_cached_free_inodes == 0 && refill_free_inodes_cache() == -1){
+			pthread_mutex_unlock(&inodes_lock);
+			LOGD("IALLOC: free inode not found");
+			return -1;
+		}
+		lock_superblock();
+		free_inode_number = superblock.free_inodes_cache[--superblock.num_cached_free_inodes];
+		unlock_superblock();
+		pthread_mutex_unlock(&inodes_lock);
+
+		// A cached inode may have been taken before the superblock was last committed, or from its slice since
+		group = &inode_groups[get_inode_group(free_inode_number)];
+		if(init_inode_slice(get_inode_group(free_inode_number)) == -1){
+			return -1;
+		}
+		pthread_mutex_lock(&group->lock);
+		if(is_inode_used(free_inode_number)){
+			pthread_mutex_unlock(&group->lock);
+			continue;
 		}
-		else{
-			LOGD("IPUT: superblock commit was unsuccessful");		
+		if(iget(free_inode_number, inod) == -1){
+			pthread_mutex_unlock(&group->lock);
 			return -1;
 		}
+		if(inod->type == TYPE_FREE){
+			break;
+		}
+		repair_inode_bit(inod);
+		pthread_mutex_unlock(&group->lock);
+	}
+
+	// Update the inode on disk before releasing the lock so that no other thread can pick it
+	if(claim_inode(inod) == -1){
+		pthread_mutex_unlock(&group->lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&group->lock);
+	LOGD("ialloc returning inode id: %d", inod->inode_id);
+	return 0;
+}
+
+// Claims a free inode of the slice of the group, searched in the bitmap from where the last search stopped.
+// Returns 1 if an inode was claimed, 0 if the slice is full
+static int ialloc_from_slice(struct inode *inod, big_int group_id){
+	struct inode_group *group = &inode_groups[group_id];
+	big_int first_inode, num_inodes;
+	int found = 0;
+
+	get_inode_slice(group_id, &first_inode, &num_inodes);
+	if(num_inodes == 0){
+		return 0;
+	}
+	if(init_inode_slice(group_id) == -1){
+		return -1;
+	}
+
+	pthread_mutex_lock(&group->lock);
+	while(!group->full && !found){
+		int inode_index = find_free_inode(first_inode, first_inode + num_inodes, first_inode + group->next_free_inode);
+
+		if(inode_index == -1){
+			group->full = 1;
+			break;
+		}
+		group->next_free_inode = (inode_index + 1 - first_inode) % num_inodes;
+		if(iget(inode_index + 1, inod) == -1){
+			pthread_mutex_unlock(&group->lock);
+			return -1;
+		}
+		if(inod->type != TYPE_FREE){
+			repair_inode_bit(inod);
+			continue;
+		}
+		if(claim_inode(inod) == -1){
+			pthread_mutex_unlock(&group->lock);
+			return -1;
+		}
+		found = 1;
+	}
+	pthread_mutex_unlock(&group->lock);
+	return found;
+}
+
+int ialloc_in_group(struct inode *inod, big_int group){
+	big_int first_group = get_first_inode_group();
+	big_int num_groups = NUM_BLOCK_GROUPS - first_group, i;
+
+	pthread_once(&inode_groups_once, init_inode_group_locks);
+	if(group < first_group || group >= NUM_BLOCK_GROUPS){
+		group = first_group;
+	}
+
+	// The next groups are tried in turn when the slice of the group is full
+	for(i = 0; i < num_groups; i++){
+		int found = ialloc_from_slice(inod, first_group + (group - first_group + i) % num_groups);
+		if(found == -1){
+			return -1;
+		}
+		if(found){
+			LOGD("ialloc_in_group returning inode id: %d", inod->inode_id);
+			return 0;
+		}
 	}
-	LOGD("IPUT: bwrite was unsuccessful");
+	LOGD("IALLOC: free inode not found");
 	return -1;
 }
 
+big_int count_free_inodes(void){
+	big_int used_inodes = 0, i;
+
+	// The bits past the last inode are never set
+	for(i = 0; i < INODE_BITMAP_WORDS; i++){
+		used_inodes += __builtin_popcountll(__atomic_load_n(&inode_bitmap[i], __ATOMIC_RELAXED));
+	}
+	return NUM_INODES - used_inodes;
+}
+
+big_int find_directory_group(int parent_inode_number){
+	static big_int next_top_level_group = 0; // Rotor, relative to the first group, accessed atomically
+	big_int first_group = get_first_inode_group();
+	big_int num_groups = NUM_BLOCK_GROUPS - first_group, free_blocks = 0, start, i;
+
+	if(parent_inode_number != ROOT_INODE_NUMBER){
+		return get_inode_group(parent_inode_number);
+	}
+
+	pthread_once(&inode_groups_once, init_inode_group_locks);
+	for(i = first_group; i < NUM_BLOCK_GROUPS; i++){
+		free_blocks += get_group_free_blocks(i);
+	}
+
+	// Orlov: a new top level directory goes to the next group, from the rotor, that has free inodes and at
+	// least the average number of free blocks, so that the trees of files below it have room to grow
+	start = __atomic_load_n(&next_top_level_group, __ATOMIC_RELAXED);
+	for(i = 0; i < num_groups; i++){
+		big_int group = first_group + (start + i) % num_groups, first_inode, num_inodes;
+		int full;
+
+		// A group without a slice can't hold the inode, only happens when there are fewer inode blocks than groups
+		get_inode_slice(group, &first_inode, &num_inodes);
+		if(num_inodes == 0){
+			continue;
+		}
+		pthread_mutex_lock(&inode_groups[group].lock);
+		full = inode_groups[group].full;
+		pthread_mutex_unlock(&inode_groups[group].lock);
+		if(!full && get_group_free_blocks(group) * num_groups >= free_blocks){
+			__atomic_store_n(&next_top_level_group, (start + i + 1) % num_groups, __ATOMIC_RELAXED);
+			return group;
+		}
+	}
+	return get_inode_group(parent_inode_number);
+}
+
 int ifree(struct inode * inod){
 	
-	struct data_block blok3;
 	int inode_offset_in_block;
-
-	superblock.num_free_inodes++;
-	commit_superblock();
+	int result;
+	struct inode_group *group;
 
 	struct inode fresh_inode = {
         .inode_id = inod->inode_id,
         .type = TYPE_FREE
     };
 
-	bread(ILIST_BEGIN + ((fresh_inode.inode_id - 1) / (BLOCK_SIZE / INODE_SIZE)), &blok3);
+	pthread_once(&inode_groups_once, init_inode_group_locks);
+	group = &inode_groups[get_inode_group(fresh_inode.inode_id)];
+	pthread_mutex_lock(&group->lock);
 	inode_offset_in_block = ((fresh_inode.inode_id - 1) % (BLOCK_SIZE / INODE_SIZE)) * INODE_SIZE;
-	memcpy(&(blok3.block[inode_offset_in_block]), &fresh_inode, sizeof(struct inode));
-	
-	if(bwrite(&blok3) == 0){
-		if(commit_superblock() == 0){
-			return 0;
+	result = write_block_offset(ILIST_BEGIN + ((fresh_inode.inode_id - 1) / (BLOCK_SIZE / INODE_SIZE)), &fresh_inode, sizeof(struct inode), inode_offset_in_block);
+	if(result == 0){
+		result = set_inode_used(fresh_inode.inode_id, 0);
+	}
+	if(result == 0){
+		group->full = 0;
+	}
+	pthread_mutex_unlock(&group->lock);
+
+	if(result == 0){
+		// The inode is reused first if there is room in the cache, the bitmap search finds it otherwise
+		pthread_mutex_lock(&inodes_lock);
+		lock_superblock();
+		if(superblock.num_cached_free_inodes < FREE_INODES_CACHE_SIZE){
+			superblock.free_inodes_cache[superblock.num_cached_free_inodes++] = fresh_inode.inode_id;
 		}
-		else{
-			LOGD("IPUT: superblock commit was unsuccessful");		
-			return -1;
-		}	
+		superblock.num_free_inodes++;
+		unlock_superblock();
+		pthread_mutex_unlock(&inodes_lock);
+		return 0;
 	}
-	LOGD("IFREE: bwrite was unsuccessful");
+	LOGD("IFREE: write of inode was unsuccessful");
 	return -1;
 }
+
+// Formats one unformatted slice every ITABLE_INIT_DELAY_MS, in group order, and stops once they all are
+static void * itable_initializer_main(void *arg) {
+	big_int group = get_first_inode_group();
+	(void) arg;
+
+	pthread_mutex_lock(&itable_initializer_lock);
+	while(itable_initializer_running && group < NUM_BLOCK_GROUPS){
+		struct timespec timeout;
+
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_nsec += ITABLE_INIT_DELAY_MS * 1000000L;
+		timeout.tv_sec += timeout.tv_nsec / 1000000000L;
+		timeout.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&itable_initializer_cond, &itable_initializer_lock, &timeout);
+
+		if(!itable_initializer_running){
+			break;
+		}
+
+		pthread_mutex_unlock(&itable_initializer_lock);
+		while(group < NUM_BLOCK_GROUPS && is_inode_slice_initialized(group)){
+			group++;
+		}
+		if(group < NUM_BLOCK_GROUPS && init_inode_slice(group) == -1){
+			fprintf(stderr, "failed to format the inode slice of group %" PRIu64 "\n", group);
+		}
+		group++;
+		pthread_mutex_lock(&itable_initializer_lock);
+	}
+	pthread_mutex_unlock(&itable_initializer_lock);
+	return NULL;
+}
+
+int start_itable_initializer(void) {
+	pthread_mutex_lock(&itable_initializer_lock);
+	if(itable_initializer_running){
+		pthread_mutex_unlock(&itable_initializer_lock);
+		return -1;
+	}
+
+	itable_initializer_running = 1;
+	if(pthread_create(&itable_initializer, NULL, itable_initializer_main, NULL) != 0){
+		fprintf(stderr, "failed to start the itable initializer thread\n");
+		itable_initializer_running = 0;
+		pthread_mutex_unlock(&itable_initializer_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&itable_initializer_lock);
+	return 0;
+}
+
+void stop_itable_initializer(void) {
+	pthread_mutex_lock(&itable_initializer_lock);
+	if(!itable_initializer_running){
+		pthread_mutex_unlock(&itable_initializer_lock);
+		return;
+	}
+
+	itable_initializer_running = 0;
+	pthread_cond_signal(&itable_initializer_cond);
+	pthread_mutex_unlock(&itable_initializer_lock);
+	pthread_join(itable_initializer, NULL);
+}
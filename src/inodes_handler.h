@@ -3,10 +3,31 @@
 
 #include "common.h"
 
+#define INODE_BITMAP_WORDS (NUM_INODE_BITMAP_BLOCKS * BLOCK_SIZE / sizeof(uint64_t)) // Size of the inode bitmap in memory
+#define INODE_BITMAP_WORDS_PER_BLOCK (BLOCK_SIZE / sizeof(uint64_t))
+#define ITABLE_INIT_DELAY_MS 100 // Pause of the itable initializer between two slices, to leave the disk to the files
+
 int ialloc(struct inode *target);	// allocate an inode. // THIS DOES NOT SET THE FILETYPE OF INODE. MUST BE DONE AT LAYER 2
 int iget(int inode_number, struct inode *target); // read an inode
-int next_free_inode_number(void);
 int iput(struct inode *); // Update the inode and free inode and data blocks if link count reaches 0
 int ifree(struct inode *); // free the inode and put it in the free inode list
+// allocate an inode from the inode slice of the block group, or of the next groups if it is full
+int ialloc_in_group(struct inode *target, big_int group);
+big_int get_inode_group(int inode_number); // block group whose inode slice holds the inode
+// block group for a new directory: the group of its parent, or for a top level directory a group with room
+// to spare, a different one each time
+big_int find_directory_group(int parent_inode_number);
+void init_inode_groups(void); // forget the search positions of the inode slices, called at mount and by mkfs
+int init_inode_bitmap(void); // load the inode bitmap written by mkfs in memory, before any allocation
+big_int count_free_inodes(void); // free inodes according to the bitmap, to recover the counter of the superblock
+
+// The inodes of the slice of the group are [first_inode, first_inode + num_inodes), counted from 0
+void get_inode_slice(big_int group, big_int *first_inode, big_int *num_inodes);
+// A slice left unformatted by a lazy mkfs only holds free inodes, its blocks are not read until it is formatted,
+// either by the itable initializer thread after mount or before the first inode of the slice is allocated
+int is_inode_slice_initialized(big_int group);
+int init_inode_slice(big_int group); // formats the slice if needed and commits the superblock
+int start_itable_initializer(void);
+void stop_itable_initializer(void);
 
 #endif
@@ -0,0 +1,201 @@
+#include <pthread.h>
+
+#include "common.h"
+#include "disk_backend.h"
+
+// The disk is a radix tree indexed by block id: RADIX_LEVELS levels of nodes holding RADIX_FANOUT pointers,
+// the leaves are the blocks. Nodes and blocks are only allocated when a block is first written with something
+// else than 0s, blocks that were never written read as 0s. Memory use follows what the file system stores.
+//
+// Locking: reading or writing an allocated block only takes tree_lock shared, allocating or freeing a part of
+// the tree takes it exclusive. The content of a block is not protected, like a sector of a real disk.
+#define RADIX_BITS 9
+#define RADIX_FANOUT (1 << RADIX_BITS)
+#define RADIX_LEVELS 4 // Enough for 2^36 blocks (256TB)
+
+struct radix_node {
+	void *slots[RADIX_FANOUT];
+};
+
+static struct radix_node *root = NULL;
+static big_int used_blocks = 0;
+static pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static int slot_index(big_int block_id, int level) {
+	return (block_id >> ((RADIX_LEVELS - 1 - level) * RADIX_BITS)) & (RADIX_FANOUT - 1);
+}
+
+// Returns the block or NULL if it was never written. Must be called with tree_lock held
+static char *lookup_block(big_int block_id) {
+	struct radix_node *node = root;
+	int level;
+
+	for (level = 0; node && level < RADIX_LEVELS - 1; level++) {
+		node = node->slots[slot_index(block_id, level)];
+	}
+	return node ? node->slots[slot_index(block_id, RADIX_LEVELS - 1)] : NULL;
+}
+
+// Returns the block, allocated with the missing nodes if needed. Must be called with tree_lock held exclusive
+static char *insert_block(big_int block_id) {
+	struct radix_node *node = root;
+	char *block;
+	int level;
+
+	for (level = 0; level < RADIX_LEVELS - 1; level++) {
+		void **slot = &node->slots[slot_index(block_id, level)];
+		if (*slot == NULL && (*slot = calloc(1, sizeof(struct radix_node))) == NULL) {
+			return NULL;
+		}
+		node = *slot;
+	}
+
+	block = node->slots[slot_index(block_id, RADIX_LEVELS - 1)];
+	if (block == NULL && (block = calloc(1, BLOCK_SIZE)) != NULL) {
+		node->slots[slot_index(block_id, RADIX_LEVELS - 1)] = block;
+		used_blocks++;
+	}
+	return block;
+}
+
+static int is_zero_block(const char *buffer) {
+	int i;
+	for (i = 0; i < BLOCK_SIZE; i++) {
+		if (buffer[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void free_node(struct radix_node *node, int level) {
+	int i;
+
+	for (i = 0; i < RADIX_FANOUT; i++) {
+		if (node->slots[i] && level < RADIX_LEVELS - 1) {
+			free_node(node->slots[i], level + 1);
+		} else {
+			free(node->slots[i]);
+		}
+	}
+	free(node);
+}
+
+static int memory_backend_init(const char *path) {
+	(void) path;
+
+	root = calloc(1, sizeof(struct radix_node));
+	if (root == NULL) {
+		fprintf(stderr, "failed to allocate the in-memory disk\n");
+		return -1;
+	}
+	used_blocks = 0;
+	return 0;
+}
+
+static void memory_backend_close(void) {
+	pthread_rwlock_wrlock(&tree_lock);
+	free_node(root, 0);
+	root = NULL;
+	used_blocks = 0;
+	pthread_rwlock_unlock(&tree_lock);
+}
+
+static int memory_backend_read(big_int block_id, void *target) {
+	char *block;
+
+	pthread_rwlock_rdlock(&tree_lock);
+	block = lookup_block(block_id);
+	if (block) {
+		memcpy(target, block, BLOCK_SIZE);
+	} else {
+		memset(target, 0, BLOCK_SIZE);
+	}
+	pthread_rwlock_unlock(&tree_lock);
+	return 0;
+}
+
+static int memory_backend_write(big_int block_id, const void *buffer) {
+	char *block;
+
+	pthread_rwlock_rdlock(&tree_lock);
+	block = lookup_block(block_id);
+	if (block) {
+		memcpy(block, buffer, BLOCK_SIZE);
+		pthread_rwlock_unlock(&tree_lock);
+		return 0;
+	}
+	pthread_rwlock_unlock(&tree_lock);
+
+	if (is_zero_block(buffer)) {
+		return 0; // Nothing to store, the block still reads as 0s
+	}
+
+	pthread_rwlock_wrlock(&tree_lock);
+	block = insert_block(block_id);
+	if (block) {
+		memcpy(block, buffer, BLOCK_SIZE);
+	}
+	pthread_rwlock_unlock(&tree_lock);
+
+	if (block == NULL) {
+		fprintf(stderr, "failed to allocate block %" PRIu64 " of the in-memory disk\n", block_id);
+		return -1;
+	}
+	return 0;
+}
+
+static int memory_backend_flush(void) {
+	return 0; // Nothing to persist
+}
+
+// Frees the blocks of [start, end) under node, which covers the blocks from base. Only the allocated part of
+// the tree is visited. Must be called with tree_lock held exclusive
+static void discard_range(struct radix_node *node, int level, big_int base, big_int start, big_int end) {
+	big_int span = (big_int) 1 << ((RADIX_LEVELS - 1 - level) * RADIX_BITS);
+	int i;
+
+	for (i = 0; i < RADIX_FANOUT; i++) {
+		big_int first = base + i * span;
+
+		if (node->slots[i] == NULL || first + span <= start || first >= end) {
+			continue;
+		}
+		if (level < RADIX_LEVELS - 1) {
+			discard_range(node->slots[i], level + 1, first, start, end);
+		} else {
+			free(node->slots[i]);
+			node->slots[i] = NULL;
+			used_blocks--;
+		}
+	}
+}
+
+// Frees the blocks, they read as 0s afterwards. The empty nodes are kept
+static int memory_backend_discard(big_int start_block_id, big_int count) {
+	pthread_rwlock_wrlock(&tree_lock);
+	discard_range(root, 0, 0, start_block_id, start_block_id + count);
+	pthread_rwlock_unlock(&tree_lock);
+	return 0;
+}
+
+big_int get_memory_backend_used_blocks(void) {
+	big_int blocks;
+
+	pthread_rwlock_rdlock(&tree_lock);
+	blocks = used_blocks;
+	pthread_rwlock_unlock(&tree_lock);
+	return blocks;
+}
+
+// No punch: like a thin-provisioned device, the memory of the freed blocks is only given back by the discards
+const struct disk_backend_ops memory_backend = {
+	.name = "memory",
+	.init = memory_backend_init,
+	.read = memory_backend_read,
+	.write = memory_backend_write,
+	.flush = memory_backend_flush,
+	.discard = memory_backend_discard,
+	.zero_out = memory_backend_discard,
+	.close = memory_backend_close
+};
@@ -1,13 +1,27 @@
 #include "common.h"
 #include "mkfs.h"
 #include "disk_emulator.h"
+#include "buffer_cache.h"
 #include "data_blocks_handler.h"
 #include "inode_table.h"
 #include "inodes_handler.h"
 
+static int lazy_itable_init = 0;
+
+void set_lazy_itable_init(int enabled) {
+    lazy_itable_init = enabled;
+}
+
 int create_fs(void) {
     LOGD("Creating FSTR...");
 
+    // Nothing is kept from the previous content of the volume, which is discarded instead of being overwritten:
+    // only the metadata is written and an image file stays sparse
+    if(buffer_cache_forget_blocks(0, NUM_BLOCKS, 1) != 0) {
+        fprintf(stderr, "failed to discard the volume\n");
+        return -1;
+    }
+
     if(create_superblock() != 0) {
         fprintf(stderr, "failed to create superblock\n");
         return -1;
@@ -18,38 +32,53 @@ int create_fs(void) {
         return -1;   
     }
 
-    if(create_free_blocks() != 0)  {
-        fprintf(stderr, "failed to create free block lists\n");
+    if(create_block_bitmap() != 0)  {
+        fprintf(stderr, "failed to create free block bitmap\n");
         return -1;   
     }
 
+    if(create_inode_bitmap() != 0)  {
+        fprintf(stderr, "failed to create inode bitmap\n");
+        return -1;
+    }
+
     if(create_root_dir() != 0)  {
         fprintf(stderr, "failed to create mkdir root\n");
         return -1;   
     }
 
     LOGD("Finished creating FSTR!");
-    return 0;
+    // The counters changed while the root directory was created
+    return commit_superblock();
 }
 
 // Write empty superblock to disk
 int create_superblock(void) {
+    superblock.magic = FSTR_MAGIC;
+    superblock.version = FSTR_VERSION;
     superblock.fs_size = FS_SIZE;
+    superblock.clean = 1; // Never mounted
 
-    superblock.num_free_blocks = ((NUM_BLOCKS - NUM_INODE_BLOCKS - 1) * (BLOCK_ID_LIST_LENGTH - 1)) / BLOCK_ID_LIST_LENGTH;
+    superblock.num_free_blocks = NUM_BLOCKS - get_block_number_of_first_datablock();
     int i;
+    superblock.num_cached_free_blocks = 0;
     for(i = 0; i < FREE_BLOCKS_CACHE_SIZE; i++) {
         // empty cache list
         superblock.free_blocks_cache[i] = 0;
     }
-    superblock.next_free_block_list = 1 + NUM_INODE_BLOCKS; // starts right after inode blocks
+    superblock.block_bitmap = BITMAP_BEGIN; // starts right after inode blocks
+    superblock.blocks_per_group = BLOCKS_PER_GROUP;
+    superblock.num_block_groups = NUM_BLOCK_GROUPS;
 
     superblock.num_free_inodes = NUM_INODES;
+    superblock.num_cached_free_inodes = 0;
     for(i = 0; i < FREE_INODES_CACHE_SIZE; i++) {
         // empty cache list
         superblock.free_inodes_cache[i] = 0;
     }
     superblock.next_free_inode = 1; // first free inode number
+    superblock.inode_bitmap = INODE_BITMAP_BEGIN; // starts right after the free block bitmap
+    memset(superblock.uninit_inode_slices, 0, sizeof(superblock.uninit_inode_slices)); // Set by create_inodes
 
     LOGD("FS size: %" PRIu64, superblock.fs_size);
     LOGD("Block size: %d", BLOCK_SIZE);
@@ -57,6 +86,7 @@ int create_superblock(void) {
     LOGD("inode size: %d", INODE_SIZE);
     LOGD("No. of inodes: %d", NUM_INODES);
     LOGD("No. of inode blocks: %lu", NUM_INODE_BLOCKS);
+    LOGD("No. of block groups: %" PRIu64, superblock.num_block_groups);
     LOGD("No. of free blocks: %" PRIu64 "", superblock.num_free_blocks);
     LOGD("Size of struct superblock: %ld", sizeof(struct superblock));
     LOGD("Size of struct inode: %ld", sizeof(struct inode));
@@ -64,20 +94,66 @@ int create_superblock(void) {
     return write_block(0, &superblock, sizeof(struct superblock));
 }
 
+// Whole inode blocks are formatted in memory and written MKFS_BATCH_BLOCKS at a time with one vectored write
+int format_inode_blocks(big_int first_block, big_int count) {
+    struct iovec iov[MKFS_BATCH_BLOCKS];
+    char *blocks = malloc(MKFS_BATCH_BLOCKS * BLOCK_SIZE);
+    big_int block_id;
+    int batch = 0;
+
+    for(block_id = first_block; block_id < first_block + count; block_id++) {
+        char *block = blocks + batch * BLOCK_SIZE;
+        int i;
+
+        memset(block, 0, BLOCK_SIZE);
+        for(i = 0; i < BLOCK_SIZE / INODE_SIZE; i++) {
+            struct inode inode = {
+                .inode_id = block_id * (BLOCK_SIZE / INODE_SIZE) + i + 1,
+                .type = TYPE_FREE
+            };
+            if(inode.inode_id > NUM_INODES) {
+                break;
+            }
+            memcpy(block + i * INODE_SIZE, &inode, sizeof(struct inode));
+        }
+
+        iov[batch].iov_base = block;
+        iov[batch].iov_len = BLOCK_SIZE;
+        batch++;
+        if(batch == MKFS_BATCH_BLOCKS || block_id == first_block + count - 1) {
+            if(write_blocks(ILIST_BEGIN + block_id + 1 - batch, batch, iov)) {
+                fprintf(stderr, "Failed to write inodes\n");
+                free(blocks);
+                return -1;
+            }
+            batch = 0;
+        }
+    }
+
+    free(blocks);
+    return 0;
+}
+
 int create_inodes(void) {
-    int i;
-    for(i = 0; i < NUM_INODES; i++){
-        struct inode inode = {
-            .inode_id = i + 1,
-            .type = TYPE_FREE
-        };
-
-        if(write_inode(&inode)) {
-            fprintf(stderr, "Failed to write inodes\n");
-            return -1;
+    big_int first_group = get_inode_group(ROOT_INODE_NUMBER), count = NUM_INODE_BLOCKS, group;
+
+    if(lazy_itable_init) {
+        // Only the slice holding the root inode is written, the blocks of the others read as 0s until then
+        big_int first_inode, num_inodes;
+        get_inode_slice(first_group, &first_inode, &num_inodes);
+        count = (num_inodes + BLOCK_SIZE / INODE_SIZE - 1) / (BLOCK_SIZE / INODE_SIZE);
+        for(group = first_group + 1; group < NUM_BLOCK_GROUPS; group++) {
+            get_inode_slice(group, &first_inode, &num_inodes);
+            if(num_inodes > 0) {
+                superblock.uninit_inode_slices[group / 64] |= (big_int) 1 << (group % 64);
+            }
         }
     }
 
+    if(format_inode_blocks(0, count) == -1) {
+        return -1;
+    }
+    init_inode_groups();
     return 0;
 }
 
@@ -87,42 +163,72 @@ int write_inode(struct inode *inode) {
     return write_block_offset(block_id, inode, sizeof(struct inode), offset);
 }
 
-int create_free_blocks(void) {
-    struct block_id_list block_id_list;
-
-    big_int num_free_block_lists = NUM_BLOCKS - (1 + NUM_INODE_BLOCKS + superblock.num_free_blocks);
+// Sets the bits of blocks [begin, end) that fall in the bitmap block holding the bits from first_bit
+static void set_bitmap_range(uint64_t *words, big_int first_bit, big_int begin, big_int end) {
+    big_int last_bit = first_bit + BLOCK_SIZE * 8;
+    big_int i;
 
-    big_int free_block_id = 1 + NUM_INODE_BLOCKS + num_free_block_lists;
+    for(i = begin > first_bit ? begin : first_bit; i < end && i < last_bit; i++) {
+        words[(i - first_bit) / 64] |= (uint64_t) 1 << (i % 64);
+    }
+}
 
+// The blocks before the first data block (superblock, inodes and bitmaps) are used, and so are the bits
+// past the end of the volume so that they are never allocated
+int create_block_bitmap(void) {
+    struct block_io ios[MKFS_BATCH_BLOCKS];
+    char *blocks = malloc(MKFS_BATCH_BLOCKS * BLOCK_SIZE);
     big_int i;
-    for(i = 0; i < num_free_block_lists; i++) {
-        big_int block_id = 1 + NUM_INODE_BLOCKS + i;
-        big_int next_block_id = 0;
-        if(i < num_free_block_lists - 1) {
-            next_block_id = block_id + 1;
-        }
+    int count = 0;
+
+    for(i = 0; i < NUM_BITMAP_BLOCKS; i++) {
+        uint64_t *words = (uint64_t *) (blocks + count * BLOCK_SIZE);
+        big_int first_bit = i * BLOCK_SIZE * 8;
+
+        memset(words, 0, BLOCK_SIZE);
+        set_bitmap_range(words, first_bit, 0, get_block_number_of_first_datablock());
+        set_bitmap_range(words, first_bit, NUM_BLOCKS, NUM_BITMAP_BLOCKS * BLOCK_SIZE * 8);
 
-        // Store block_id of next free list
-        block_id_list.list[0] = next_block_id;
-
-        int j;
-        for(j = BLOCK_ID_LIST_LENGTH - 1; j > 0; j--) {
-            if(free_block_id < NUM_BLOCKS) {
-                // Store block_id of free block
-                block_id_list.list[j] = free_block_id++;
-            } else {
-                // No free block available
-                block_id_list.list[j] = 0;
+        ios[count].block_id = BITMAP_BEGIN + i;
+        ios[count].buffer = words;
+        count++;
+        if(count == MKFS_BATCH_BLOCKS || i == NUM_BITMAP_BLOCKS - 1) {
+            if(write_block_batch(ios, count)) {
+                fprintf(stderr, "Failed to write free block bitmap\n");
+                free(blocks);
+                return -1;
             }
+            count = 0;
         }
+    }
+
+    free(blocks);
+    return init_block_bitmap();
+}
+
+// Every inode is free, the root directory is allocated from it afterwards
+int create_inode_bitmap(void) {
+    struct iovec iov[MKFS_BATCH_BLOCKS];
+    char *zeros = calloc(1, BLOCK_SIZE);
+    big_int i;
+    int count = 0;
 
-        if(write_block(block_id, &block_id_list, sizeof(struct block_id_list))) {
-            fprintf(stderr, "Failed to write free blocks\n");
-            return -1;
+    for(i = 0; i < NUM_INODE_BITMAP_BLOCKS; i++) {
+        iov[count].iov_base = zeros;
+        iov[count].iov_len = BLOCK_SIZE;
+        count++;
+        if(count == MKFS_BATCH_BLOCKS || i == NUM_INODE_BITMAP_BLOCKS - 1) {
+            if(write_blocks(INODE_BITMAP_BEGIN + i + 1 - count, count, iov)) {
+                fprintf(stderr, "Failed to write inode bitmap\n");
+                free(zeros);
+                return -1;
+            }
+            count = 0;
         }
     }
 
-    return 0;
+    free(zeros);
+    return init_inode_bitmap();
 }
 
 int create_root_dir(void) {
@@ -3,15 +3,24 @@
 
 #include "common.h"
 
+#define MKFS_BATCH_BLOCKS 256 // Number of blocks formatted in memory and written together
+
+// With lazy itable init, create_fs only formats the inode slice of the first group, the others are formatted
+// after mount (see init_inode_slice). Disabled by default
+void set_lazy_itable_init(int enabled);
 int create_fs(void);
 
 int create_superblock(void);
 
 int create_inodes(void);
+// Writes free inodes in the count inode blocks from first_block, counted from the start of the inode list
+int format_inode_blocks(big_int first_block, big_int count);
 
 int write_inode(struct inode *inode);
 
-int create_free_blocks(void);
+int create_block_bitmap(void);
+
+int create_inode_bitmap(void);
 
 int create_root_dir(void);
 
@@ -0,0 +1,63 @@
+#include "common.h"
+#include "mkfs.h"
+#include "disk_emulator.h"
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-f] [-l] [-b file|direct|mmap] [disk store]\n", name);
+    fprintf(stderr, "  -f  format the volume even if it already holds an FSTR file system\n");
+    fprintf(stderr, "  -l  only format the inodes of the root directory slice, fstr formats the others after mount\n");
+    fprintf(stderr, "  -b  disk backend used to access the volume (file by default)\n");
+}
+
+// Formats the volume (DISK_STORE_PATH by default) once, fstr then mounts it as many times as needed
+int main(int argc, char *argv[]) {
+    struct data_block block;
+    const char *backend = NULL;
+    int force = 0, option;
+
+    while((option = getopt(argc, argv, "flb:")) != -1) {
+        switch(option) {
+        case 'f':
+            force = 1;
+            break;
+        case 'l':
+            set_lazy_itable_init(1);
+            break;
+        case 'b':
+            backend = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(argc - optind > 1 || (backend && strcmp(backend, "memory") == 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if(set_disk_backend(backend, optind < argc ? argv[optind] : NULL) == -1) {
+        return 1;
+    }
+    if(init_disk_emulator() == -1) {
+        fprintf(stderr, "Failed to init disk emulator\n");
+        return 1;
+    }
+
+    // An existing file system is only overwritten on purpose
+    if(!force && read_block(0, block.block) == 0 && check_superblock((struct superblock *) block.block) == NULL) {
+        fprintf(stderr, "The volume already holds an FSTR file system, use -f to format it anyway\n");
+        free_disk_emulator();
+        return 1;
+    }
+
+    if(create_fs() == -1 || sync_disk_emulator() == -1) {
+        fprintf(stderr, "Failed to create fs\n");
+        free_disk_emulator();
+        return 1;
+    }
+    free_disk_emulator();
+
+    printf("FSTR file system created: %" PRIu64 " blocks of %d bytes, %d inodes\n", NUM_BLOCKS, BLOCK_SIZE, NUM_INODES);
+    return 0;
+}
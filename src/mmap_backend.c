@@ -0,0 +1,242 @@
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "disk_backend.h"
+
+// The disk store is mapped shared, window by window on first access: block accesses are memory copies served
+// by the kernel page cache. At most MMAP_MAX_WINDOWS windows stay mapped, the least recently used window that
+// no thread is copying from is unmapped to make room for a new one.
+// Each window remembers the range written since the last flush so that only that range is msync'ed.
+struct mmap_window {
+	char *data; // NULL while unmapped
+	int users; // Threads copying from or to the window, it cannot be unmapped while they do
+	unsigned long last_use;
+	big_int dirty_begin; // Blocks [dirty_begin, dirty_end) of the window were written since the last flush
+	big_int dirty_end;
+};
+
+#define NUM_MMAP_WINDOWS ((NUM_BLOCKS + MMAP_WINDOW_BLOCKS - 1) / MMAP_WINDOW_BLOCKS)
+
+static int disk_store = -1;
+static struct mmap_window *windows = NULL;
+static int mapped_windows = 0;
+static unsigned long use_clock = 0;
+static pthread_mutex_t windows_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static big_int window_blocks(big_int index) {
+	big_int first_block = index * MMAP_WINDOW_BLOCKS;
+	return NUM_BLOCKS - first_block < MMAP_WINDOW_BLOCKS ? NUM_BLOCKS - first_block : MMAP_WINDOW_BLOCKS;
+}
+
+// Must be called with windows_lock held
+static void mark_window_dirty(struct mmap_window *window, big_int begin, big_int end) {
+	if (window->dirty_end == 0) {
+		window->dirty_begin = begin;
+		window->dirty_end = end;
+	} else {
+		window->dirty_begin = begin < window->dirty_begin ? begin : window->dirty_begin;
+		window->dirty_end = end > window->dirty_end ? end : window->dirty_end;
+	}
+}
+
+static int sync_window_range(struct mmap_window *window, big_int begin, big_int end) {
+	if (msync(window->data + begin * BLOCK_SIZE, (end - begin) * BLOCK_SIZE, MS_SYNC) == -1) {
+		fprintf(stderr, "failed to sync disk store mapping\n");
+		return -1;
+	}
+	return 0;
+}
+
+// Must be called with windows_lock held
+static void unmap_window(struct mmap_window *window) {
+	if (window->dirty_end != 0) {
+		sync_window_range(window, window->dirty_begin, window->dirty_end);
+		window->dirty_begin = window->dirty_end = 0;
+	}
+	munmap(window->data, window_blocks(window - windows) * BLOCK_SIZE);
+	window->data = NULL;
+	mapped_windows--;
+}
+
+// Must be called with windows_lock held. When every mapped window is in use, we go over the limit for a while
+static void evict_window(void) {
+	struct mmap_window *victim = NULL;
+	big_int i;
+
+	for (i = 0; i < NUM_MMAP_WINDOWS; i++) {
+		if (windows[i].data && windows[i].users == 0 && (!victim || windows[i].last_use < victim->last_use)) {
+			victim = &windows[i];
+		}
+	}
+	if (victim) {
+		unmap_window(victim);
+	}
+}
+
+// Returns the window holding block_id, mapped and pinned until put_window
+static struct mmap_window *get_window(big_int block_id) {
+	struct mmap_window *window = &windows[block_id / MMAP_WINDOW_BLOCKS];
+
+	pthread_mutex_lock(&windows_lock);
+	if (!window->data) {
+		big_int index = window - windows;
+		char *data;
+
+		if (mapped_windows >= MMAP_MAX_WINDOWS) {
+			evict_window();
+		}
+		data = mmap(NULL, window_blocks(index) * BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, disk_store, index * MMAP_WINDOW_BLOCKS * BLOCK_SIZE);
+		if (data == MAP_FAILED) {
+			pthread_mutex_unlock(&windows_lock);
+			fprintf(stderr, "failed to map disk store window %" PRIu64 "\n", index);
+			return NULL;
+		}
+		window->data = data;
+		mapped_windows++;
+	}
+	window->users++;
+	window->last_use = ++use_clock;
+	pthread_mutex_unlock(&windows_lock);
+	return window;
+}
+
+// Unpins the window. If blocks [begin, end) of the window were written, they are synced on the next flush
+static void put_window(struct mmap_window *window, big_int begin, big_int end) {
+	pthread_mutex_lock(&windows_lock);
+	if (begin < end) {
+		mark_window_dirty(window, begin, end);
+	}
+	window->users--;
+	pthread_mutex_unlock(&windows_lock);
+}
+
+static int mmap_backend_init(const char *path) {
+	struct stat stat;
+
+	disk_store = open(path, O_CREAT|O_RDWR, 0644);
+	if (disk_store == -1) {
+		fprintf(stderr, "Error opening disk store %s\n", path);
+		errno = ENODEV;
+		return -1;
+	}
+
+	// A disk store file must cover the whole volume, accessing a mapping beyond its end raises SIGBUS
+	if (fstat(disk_store, &stat) == -1
+		|| (S_ISREG(stat.st_mode) && (big_int) stat.st_size < FS_SIZE && ftruncate(disk_store, FS_SIZE) == -1)) {
+		fprintf(stderr, "failed to size disk store %s\n", path);
+		close(disk_store);
+		disk_store = -1;
+		return -1;
+	}
+
+	windows = calloc(NUM_MMAP_WINDOWS, sizeof(struct mmap_window));
+	if (!windows) {
+		close(disk_store);
+		disk_store = -1;
+		return -1;
+	}
+	mapped_windows = 0;
+	return 0;
+}
+
+static void mmap_backend_close(void) {
+	big_int i;
+
+	pthread_mutex_lock(&windows_lock);
+	for (i = 0; i < NUM_MMAP_WINDOWS; i++) {
+		if (windows[i].data) {
+			unmap_window(&windows[i]);
+		}
+	}
+	pthread_mutex_unlock(&windows_lock);
+	free(windows);
+	windows = NULL;
+	close(disk_store);
+	disk_store = -1;
+}
+
+// Copies count blocks starting at start_block_id from or to the buffers of iov, one window at a time
+static int mmap_backend_rw_blocks(int write, big_int start_block_id, int count, struct iovec *iov) {
+	int i = 0;
+
+	while (i < count) {
+		big_int block_id = start_block_id + i;
+		big_int begin = block_id % MMAP_WINDOW_BLOCKS, end = begin;
+		struct mmap_window *window = get_window(block_id);
+
+		if (!window) {
+			return -1;
+		}
+		for (; i < count && end < MMAP_WINDOW_BLOCKS; i++, end++) {
+			if (write) {
+				memcpy(window->data + end * BLOCK_SIZE, iov[i].iov_base, BLOCK_SIZE);
+			} else {
+				memcpy(iov[i].iov_base, window->data + end * BLOCK_SIZE, BLOCK_SIZE);
+			}
+		}
+		put_window(window, begin, write ? end : begin);
+	}
+	return 0;
+}
+
+static int mmap_backend_read(big_int block_id, void *target) {
+	struct iovec iov = { target, BLOCK_SIZE };
+	return mmap_backend_rw_blocks(0, block_id, 1, &iov);
+}
+
+static int mmap_backend_write(big_int block_id, const void *buffer) {
+	struct iovec iov = { (void *) buffer, BLOCK_SIZE };
+	return mmap_backend_rw_blocks(1, block_id, 1, &iov);
+}
+
+static int mmap_backend_read_blocks(big_int start_block_id, int count, struct iovec *iov) {
+	return mmap_backend_rw_blocks(0, start_block_id, count, iov);
+}
+
+static int mmap_backend_write_blocks(big_int start_block_id, int count, struct iovec *iov) {
+	return mmap_backend_rw_blocks(1, start_block_id, count, iov);
+}
+
+// Only the ranges written since the last flush are synced, the windows unmapped in between were synced then.
+// A window is pinned while it is synced so that the other threads keep accessing the disk meanwhile.
+static int mmap_backend_flush(void) {
+	int result = 0;
+	big_int i;
+
+	pthread_mutex_lock(&windows_lock);
+	for (i = 0; i < NUM_MMAP_WINDOWS; i++) {
+		struct mmap_window *window = &windows[i];
+		big_int begin = window->dirty_begin, end = window->dirty_end;
+		int synced;
+
+		if (!window->data || end == 0) {
+			continue;
+		}
+		window->dirty_begin = window->dirty_end = 0;
+		window->users++;
+		pthread_mutex_unlock(&windows_lock);
+
+		synced = sync_window_range(window, begin, end);
+
+		pthread_mutex_lock(&windows_lock);
+		if (synced == -1) {
+			mark_window_dirty(window, begin, end);
+			result = -1;
+		}
+		window->users--;
+	}
+	pthread_mutex_unlock(&windows_lock);
+	return result;
+}
+
+const struct disk_backend_ops mmap_backend = {
+	.name = "mmap",
+	.init = mmap_backend_init,
+	.read = mmap_backend_read,
+	.write = mmap_backend_write,
+	.read_blocks = mmap_backend_read_blocks,
+	.write_blocks = mmap_backend_write_blocks,
+	.flush = mmap_backend_flush,
+	.close = mmap_backend_close
+};
@@ -27,7 +27,8 @@ int namei(const char *path) {
 	}
 
 	char *dup_path = strdup(path);
-	char *next_file = strtok(dup_path, PATH_DELIMITER);
+	char *save_ptr;
+	char *next_file = strtok_r(dup_path, PATH_DELIMITER, &save_ptr); // strtok is not reentrant and FUSE calls us from several threads
 	struct inode next_inode;
 	int next_inode_success = get_inode(ROOT_INODE_NUMBER, &next_inode);
 	struct dir_block dir_block;
@@ -52,7 +53,7 @@ int namei(const char *path) {
 			return -1;
 		}
 
-		next_file = strtok(NULL, PATH_DELIMITER);
+		next_file = strtok_r(NULL, PATH_DELIMITER, &save_ptr);
 		next_inode_success = get_inode(next_inode_number, &next_inode);
 	}
 
@@ -0,0 +1,149 @@
+#include <pthread.h>
+
+#include "common.h"
+#include "readahead.h"
+#include "buffer_cache.h"
+#include "inode_table.h"
+#include "block_utils.h"
+
+struct readahead_request {
+	int inode_number;
+	big_int first_block;
+	int count;
+};
+
+// Circular queue of the readaheads, consumed by a single thread
+static struct readahead_request queue[READAHEAD_QUEUE_SIZE];
+static int queue_head = 0;
+static int queue_length = 0;
+static int busy = 0; // The thread is loading a readahead that is no longer in the queue
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_t readahead_thread;
+static int readahead_running = 0;
+
+int readahead_file_blocks_now(int inode_number, big_int first_block, int count) {
+	big_int block_ids[READAHEAD_BATCH_BLOCKS];
+	struct inode inod;
+	int i, num_blocks;
+
+	while (count > 0) {
+		// The inode lock keeps the block list stable while it is walked. Looking up the blocks reads
+		// the indirect blocks through the cache, so they are loaded as well.
+		lock_inode(inode_number);
+		if (get_inode(inode_number, &inod) == -1) {
+			unlock_inode(inode_number);
+			return -1;
+		}
+		if (first_block > inod.num_blocks) {
+			unlock_inode(inode_number);
+			return 0; // Nothing to read beyond the end of the file
+		}
+
+		num_blocks = 0;
+		for (i = 0; i < count && i < READAHEAD_BATCH_BLOCKS && first_block + i <= inod.num_blocks; i++) {
+			big_int block_id = get_block_id(&inod, first_block + i - 1);
+			if (block_id != 0) {
+				block_ids[num_blocks++] = block_id;
+			}
+		}
+		unlock_inode(inode_number);
+
+		if (num_blocks > 0 && buffer_cache_prefetch(block_ids, num_blocks) == -1) {
+			return -1;
+		}
+		first_block += i;
+		count -= i;
+	}
+	return 0;
+}
+
+static void *readahead_main(void *arg) {
+	(void) arg;
+
+	pthread_mutex_lock(&queue_lock);
+	while (readahead_running) {
+		struct readahead_request request;
+
+		if (queue_length == 0) {
+			pthread_cond_wait(&queue_cond, &queue_lock);
+			continue;
+		}
+
+		request = queue[queue_head];
+		queue_head = (queue_head + 1) % READAHEAD_QUEUE_SIZE;
+		queue_length--;
+		busy = 1;
+		pthread_mutex_unlock(&queue_lock);
+
+		if (readahead_file_blocks_now(request.inode_number, request.first_block, request.count) == -1) {
+			LOGD("readahead of inode %d failed", request.inode_number);
+		}
+
+		pthread_mutex_lock(&queue_lock);
+		busy = 0;
+		if (queue_length == 0) {
+			pthread_cond_broadcast(&idle_cond);
+		}
+	}
+	pthread_mutex_unlock(&queue_lock);
+	return NULL;
+}
+
+int start_readahead(void) {
+	pthread_mutex_lock(&queue_lock);
+	if (readahead_running) {
+		pthread_mutex_unlock(&queue_lock);
+		return -1;
+	}
+
+	queue_head = 0;
+	queue_length = 0;
+	readahead_running = 1;
+	if (pthread_create(&readahead_thread, NULL, readahead_main, NULL) != 0) {
+		fprintf(stderr, "failed to start the readahead thread\n");
+		readahead_running = 0;
+		pthread_mutex_unlock(&queue_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&queue_lock);
+	return 0;
+}
+
+void stop_readahead(void) {
+	pthread_mutex_lock(&queue_lock);
+	if (!readahead_running) {
+		pthread_mutex_unlock(&queue_lock);
+		return;
+	}
+
+	readahead_running = 0;
+	queue_length = 0;
+	pthread_cond_signal(&queue_cond);
+	pthread_cond_broadcast(&idle_cond);
+	pthread_mutex_unlock(&queue_lock);
+	pthread_join(readahead_thread, NULL);
+}
+
+void readahead_file_blocks(int inode_number, big_int first_block, int count) {
+	pthread_mutex_lock(&queue_lock);
+	if (readahead_running && queue_length < READAHEAD_QUEUE_SIZE) {
+		struct readahead_request *request = &queue[(queue_head + queue_length) % READAHEAD_QUEUE_SIZE];
+		request->inode_number = inode_number;
+		request->first_block = first_block;
+		request->count = count;
+		queue_length++;
+		pthread_cond_signal(&queue_cond);
+	}
+	pthread_mutex_unlock(&queue_lock);
+}
+
+void wait_readahead(void) {
+	pthread_mutex_lock(&queue_lock);
+	while (readahead_running && (queue_length > 0 || busy)) {
+		pthread_cond_wait(&idle_cond, &queue_lock);
+	}
+	pthread_mutex_unlock(&queue_lock);
+}
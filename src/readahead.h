@@ -0,0 +1,23 @@
+#ifndef _READAHEAD_
+#define _READAHEAD_
+
+#include "common.h"
+
+#define READAHEAD_MIN_BLOCKS 4 // Window of the first readahead of a sequential reader
+#define READAHEAD_MAX_BLOCKS 256 // The window doubles on each sequential read up to 1MB
+#define READAHEAD_BATCH_BLOCKS 64 // Blocks loaded by one batch read
+#define READAHEAD_QUEUE_SIZE 64 // Readaheads waiting for the readahead thread, the new ones are dropped when it is full
+
+// The readahead thread loads in the buffer cache the datablocks that sequential readers will need next
+int start_readahead(void);
+void stop_readahead(void); // Drops the queued readaheads
+
+// Queues the readahead of the count datablocks of the file starting at first_block (counted from 1).
+// Does nothing if the readahead thread is not running.
+void readahead_file_blocks(int inode_number, big_int first_block, int count);
+void wait_readahead(void); // Waits until the queued readaheads are done
+
+// Loads the datablocks in the buffer cache right away, with the indirect blocks needed to find them
+int readahead_file_blocks_now(int inode_number, big_int first_block, int count);
+
+#endif
@@ -1,3 +1,5 @@
+#include <pthread.h>
+
 #include "syscalls1.h"
 #include "common.h"
 #include "inodes_handler.h"
@@ -6,8 +8,12 @@
 #include "disk_emulator.h"
 #include "block_utils.h"
 #include "namei.h"
+#include "delalloc.h"
 
-int syscalls1__mkdir(const char *path, mode_t mode) {
+// Taken as a writer by the calls that change the directory tree and as a reader by the ones that only look it up
+static pthread_rwlock_t namespace_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static int do_mkdir(const char *path, mode_t mode) {
 
 	// Check for existing file
 	if(namei(path) != -1) {
@@ -36,19 +42,20 @@ int syscalls1__mkdir(const char *path, mode_t mode) {
 		return -1;
 	}
 
-	// Prepare a new data block for creating empty dir block
-	struct data_block block;
-	if(data_block_alloc(&block) == -1) {
-		fprintf(stderr, "could not find a free data block\n");
+	// Prepare a new inode, in the block group of its parent unless it is a top level directory
+	struct inode inode;
+	if(ialloc_in_group(&inode, find_directory_group(parent_inode.inode_id)) == -1) {
+		fprintf(stderr, "could not find a free inode\n");
 		errno = EDQUOT;
 		free(dup_path);
 		return -1;
 	}
 
-	// Prepare a new inode
-	struct inode inode;
-	if(ialloc(&inode) == -1) {
-		fprintf(stderr, "could not find a free inode\n");
+	// Prepare a new data block for creating empty dir block, in the block group of the inode
+	big_int block_id;
+	if(data_block_alloc_run(get_group_goal(get_inode_group(inode.inode_id)), 1, &block_id) == -1) {
+		fprintf(stderr, "could not find a free data block\n");
+		ifree(&inode);
 		errno = EDQUOT;
 		free(dup_path);
 		return -1;
@@ -60,7 +67,6 @@ int syscalls1__mkdir(const char *path, mode_t mode) {
 	inode.last_modified_inode = time(NULL);
 
 	// Init the new dir block
-	big_int block_id = block.data_block_id;
 	struct dir_block dir_block;
 	if(init_dir_block(&dir_block, inode.inode_id, parent_inode.inode_id) == -1) {
 		fprintf(stderr, "failed to format a dir block\n");
@@ -93,7 +99,7 @@ int syscalls1__mkdir(const char *path, mode_t mode) {
 	return put_inode(&parent_inode);;
 }
 
-int syscalls1__mknod(const char *path, mode_t mode, dev_t dev) {
+static int do_mknod(const char *path, mode_t mode, dev_t dev) {
 
 	(void) dev;
 	
@@ -124,9 +130,9 @@ int syscalls1__mknod(const char *path, mode_t mode, dev_t dev) {
 		return -1;
 	}
 
-	// Prepare a new inode
+	// Prepare a new inode, in the block group of its parent
 	struct inode inode;
-	if(ialloc(&inode) == -1) {
+	if(ialloc_in_group(&inode, get_inode_group(parent_inode.inode_id)) == -1) {
 		fprintf(stderr, "could not find a free inode\n");
 		errno = EDQUOT;
 		free(dup_path);
@@ -152,7 +158,7 @@ int syscalls1__mknod(const char *path, mode_t mode, dev_t dev) {
 	return put_inode(&parent_inode);;
 }
 
-int syscalls1__readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset) {
+static int do_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset) {
 
 	(void) offset;
 
@@ -186,26 +192,33 @@ int syscalls1__readdir(const char *path, void *buffer, fuse_fill_dir_t filler, o
 	return 0;
 }
 
-int syscalls1__unlink(const char *path) {
+static int do_unlink(const char *path) {
 
 	struct inode inode;
-	if(get_inode(namei(path), &inode) == -1) {
+	int inode_id = namei(path);
+	lock_inode(inode_id);
+	if(get_inode(inode_id, &inode) == -1) {
+		unlock_inode(inode_id);
 		fprintf(stderr, "failed to get inode\n");
 		errno = ENOENT;
 		return -1;
 	}
 
 	if(inode.type != TYPE_ORDINARY) {
+		unlock_inode(inode_id);
 		fprintf(stderr, "cannot unlink non ordinary files\n");
 		return -1;
 	}
 
-	// Free inode and associated data blocks
+	// Free inode and associated data blocks. The blocks whose allocation is delayed were never allocated
+	delalloc_drop_file(inode_id);
 	inode.links_nb = 0;
 	if(put_inode(&inode) == -1) {
+		unlock_inode(inode_id);
 		fprintf(stderr, "failed to put inode\n");
 		return -1;
 	}
+	unlock_inode(inode_id);
 
 	struct inode parent_inode;
 	if(get_inode(get_parent_inode_id(path), &parent_inode) == -1) {
@@ -221,7 +234,7 @@ int syscalls1__unlink(const char *path) {
 	return put_inode(&parent_inode);
 }
 
-int syscalls1__rmdir(const char *path) {
+static int do_rmdir(const char *path) {
 
 	struct inode inode;
 	if(get_inode(namei(path), &inode) == -1) {
@@ -285,7 +298,7 @@ int syscalls1__rmdir(const char *path) {
 }
 
 
-int syscalls1__lstat(const char *path, struct stat *buf) {
+static int do_lstat(const char *path, struct stat *buf) {
 
 	struct inode inode;
 	if(get_inode(namei(path), &inode) == -1) {
@@ -315,10 +328,13 @@ int syscalls1__lstat(const char *path, struct stat *buf) {
 	return 0;
 }
 
-int syscalls1__utimens(const char *path, const struct timespec tv[2]) {
+static int do_utimens(const char *path, const struct timespec tv[2]) {
 
 	struct inode inode;
-	if(get_inode(namei(path), &inode) == -1) {
+	int inode_id = namei(path);
+	lock_inode(inode_id);
+	if(get_inode(inode_id, &inode) == -1) {
+		unlock_inode(inode_id);
 		fprintf(stderr, "failed to get inode\n");
 		errno = ENOENT;
 		return -1;
@@ -331,26 +347,36 @@ int syscalls1__utimens(const char *path, const struct timespec tv[2]) {
 		inode.last_accessed_file += tv[0].tv_sec;
 		inode.last_modified_file += tv[1].tv_sec;
 	}
-	return put_inode(&inode);
+	int result = put_inode(&inode);
+	unlock_inode(inode_id);
+	return result;
 }
 
-int syscalls1__chmod(const char *path, mode_t mode) {
+static int do_chmod(const char *path, mode_t mode) {
 
 	struct inode inode;
-	if(get_inode(namei(path), &inode) == -1) {
+	int inode_id = namei(path);
+	lock_inode(inode_id);
+	if(get_inode(inode_id, &inode) == -1) {
+		unlock_inode(inode_id);
 		fprintf(stderr, "failed to get inode\n");
 		errno = ENOENT;
 		return -1;
 	}
 	
 	inode.mode = mode;
-	return put_inode(&inode);
+	int result = put_inode(&inode);
+	unlock_inode(inode_id);
+	return result;
 }
 
-int syscalls1__chown(const char *path, uid_t uid, gid_t gid) {
+static int do_chown(const char *path, uid_t uid, gid_t gid) {
 
 	struct inode inode;
-	if(get_inode(namei(path), &inode) == -1) {
+	int inode_id = namei(path);
+	lock_inode(inode_id);
+	if(get_inode(inode_id, &inode) == -1) {
+		unlock_inode(inode_id);
 		fprintf(stderr, "failed to get inode\n");
 		errno = ENOENT;
 		return -1;
@@ -358,10 +384,12 @@ int syscalls1__chown(const char *path, uid_t uid, gid_t gid) {
 
 	inode.uid = uid;
 	inode.gid = gid;
-	return put_inode(&inode);
+	int result = put_inode(&inode);
+	unlock_inode(inode_id);
+	return result;
 }
 
-int syscalls1__rename(const char *oldpath, const char *newpath) {
+static int do_rename(const char *oldpath, const char *newpath) {
 
 	// Check for name lengths
 	char *dup_old_path = strdup(oldpath);
@@ -381,14 +409,14 @@ int syscalls1__rename(const char *oldpath, const char *newpath) {
 	// Remove file/dir at newpath
 	if(get_inode(namei(newpath), &new_inode) == 0) {
 		if(new_inode.type == TYPE_DIRECTORY) {
-			if(syscalls1__rmdir(newpath) == -1) {
+			if(do_rmdir(newpath) == -1) {
 				fprintf(stderr, "New directory already exists and cannot be removed\n");
 				free(dup_old_path);
 				free(dup_new_path);
 				return -1;
 			}
 		} else if(new_inode.type == TYPE_ORDINARY) {
-			if(syscalls1__unlink(newpath) == -1) {
+			if(do_unlink(newpath) == -1) {
 				fprintf(stderr, "New file already exists and cannot be removed\n");
 				free(dup_old_path);
 				free(dup_new_path);
@@ -454,3 +482,93 @@ int syscalls1__rename(const char *oldpath, const char *newpath) {
 	free(dup_new_path);
 	return put_inode(&old_parent_inode);
 }
+
+int syscalls1__mkdir(const char *path, mode_t mode) {
+	int result;
+
+	pthread_rwlock_wrlock(&namespace_lock);
+	result = do_mkdir(path, mode);
+	pthread_rwlock_unlock(&namespace_lock);
+	return result;
+}
+
+int syscalls1__mknod(const char *path, mode_t mode, dev_t dev) {
+	int result;
+
+	pthread_rwlock_wrlock(&namespace_lock);
+	result = do_mknod(path, mode, dev);
+	pthread_rwlock_unlock(&namespace_lock);
+	return result;
+}
+
+int syscalls1__readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset) {
+	int result;
+
+	pthread_rwlock_rdlock(&namespace_lock);
+	result = do_readdir(path, buffer, filler, offset);
+	pthread_rwlock_unlock(&namespace_lock);
+	return result;
+}
+
+int syscalls1__unlink(const char *path) {
+	int result;
+
+	pthread_rwlock_wrlock(&namespace_lock);
+	result = do_unlink(path);
+	pthread_rwlock_unlock(&namespace_lock);
+	return result;
+}
+
+int syscalls1__rmdir(const char *path) {
+	int result;
+
+	pthread_rwlock_wrlock(&namespace_lock);
+	result = do_rmdir(path);
+	pthread_rwlock_unlock(&namespace_lock);
+	return result;
+}
+
+int syscalls1__lstat(const char *path, struct stat *buf) {
+	int result;
+
+	pthread_rwlock_rdlock(&namespace_lock);
+	result = do_lstat(path, buf);
+	pthread_rwlock_unlock(&namespace_lock);
+	return result;
+}
+
+int syscalls1__utimens(const char *path, const struct timespec tv[2]) {
+	int result;
+
+	pthread_rwlock_rdlock(&namespace_lock);
+	result = do_utimens(path, tv);
+	pthread_rwlock_unlock(&namespace_lock);
+	return result;
+}
+
+int syscalls1__chmod(const char *path, mode_t mode) {
+	int result;
+
+	pthread_rwlock_rdlock(&namespace_lock);
+	result = do_chmod(path, mode);
+	pthread_rwlock_unlock(&namespace_lock);
+	return result;
+}
+
+int syscalls1__chown(const char *path, uid_t uid, gid_t gid) {
+	int result;
+
+	pthread_rwlock_rdlock(&namespace_lock);
+	result = do_chown(path, uid, gid);
+	pthread_rwlock_unlock(&namespace_lock);
+	return result;
+}
+
+int syscalls1__rename(const char *oldpath, const char *newpath) {
+	int result;
+
+	pthread_rwlock_wrlock(&namespace_lock);
+	result = do_rename(oldpath, newpath);
+	pthread_rwlock_unlock(&namespace_lock);
+	return result;
+}
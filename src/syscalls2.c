@@ -1,10 +1,17 @@
 #include <stdarg.h>
+#include <pthread.h>
+#include <linux/falloc.h>
 
 #include "syscalls2.h"
 #include "common.h"
 #include "block_utils.h"
 #include "inode_table.h"
 #include "data_blocks_handler.h"
+#include "inodes_handler.h"
+#include "disk_emulator.h"
+#include "buffer_cache.h"
+#include "readahead.h"
+#include "delalloc.h"
 
 #ifdef SYSCALL2__TEST
 	static int namei(const char *path) {
@@ -33,6 +40,9 @@ static int min(int x, int y) {
 
 struct file_descriptor_table *file_descriptor_tables = NULL;
 
+// Protects file_descriptor_tables. The utilities below expect the caller to hold it
+static pthread_mutex_t file_descriptor_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct file_descriptor_table * allocate_file_descriptor_table(int pid) {
 	struct file_descriptor_table * result_table;
 
@@ -188,7 +198,7 @@ int get_size_of_file(big_int num_used_blocks, int num_used_bytes_in_last_block)
 int syscalls2__open(const char *path, int oflag, ...) {
 	struct file_descriptor_entry * fde;
 	struct inode inod;
-	int inode_number, pid;
+	int inode_number, pid, fd;
 	mode_t mode;
 
 	if (oflag & O_CREAT) {
@@ -212,9 +222,8 @@ int syscalls2__open(const char *path, int oflag, ...) {
 		return -1;
 	}
 
-	get_inode(inode_number, &inod);
-
 	pid = syscall2__get_pid();
+	pthread_mutex_lock(&file_descriptor_tables_lock);
 	fde = allocate_file_descriptor_entry(pid);
 
 	// The different modes can be: O_RDONLY, O_RDWR, O_WRONLY, O_APPEND (not implemented for now)   O_CREAT, O_TRUNC (not implemented for now cause fuse doesn't use those flags)
@@ -238,6 +247,7 @@ int syscalls2__open(const char *path, int oflag, ...) {
 			// We need to look for last block number that is not a zero in the list of blocks of the inode. Then if it's indirect block, we need to look inside
 		}
 		else {
+			pthread_mutex_unlock(&file_descriptor_tables_lock);
 			errno = EACCES;
 			return -1;
 		}
@@ -247,25 +257,38 @@ int syscalls2__open(const char *path, int oflag, ...) {
 	}
 
 	fde->inode_number = inode_number;
-
-	inod.last_accessed_file = time(NULL);
-	put_inode(&inod);
-	return fde->fd;
+	fde->readahead_next_block = 1; // Reading from the beginning of the file is sequential
+	fde->readahead_window = 0;
+	fde->readahead_end = 0;
+	fd = fde->fd;
+	pthread_mutex_unlock(&file_descriptor_tables_lock);
+
+	lock_inode(inode_number);
+	if (get_inode(inode_number, &inod) == 0) {
+		inod.last_accessed_file = time(NULL);
+		put_inode(&inod);
+	}
+	unlock_inode(inode_number);
+	return fd;
 }
 
 int syscalls2__close(int fildes) {
 	struct file_descriptor_entry * fde;
 	struct file_descriptor_table * fdt;
-	int pid;
+	int pid, inode_number, written;
 
 	pid = syscall2__get_pid();
+	pthread_mutex_lock(&file_descriptor_tables_lock);
 	fde = get_file_descriptor_entry(pid, fildes);
 
 	if (fde == NULL) {
+		pthread_mutex_unlock(&file_descriptor_tables_lock);
 		errno = EBADF;
 		return -1;
 	}
 
+	inode_number = fde->inode_number;
+	written = fde->mode != READ;
 	delete_file_descriptor_entry(pid, fildes);
 	fdt = get_file_descriptor_table(pid);
 
@@ -273,6 +296,13 @@ int syscalls2__close(int fildes) {
 	if (fdt->used_descriptors == 3) {
 		delete_file_descriptor_table(pid);
 	}
+	pthread_mutex_unlock(&file_descriptor_tables_lock);
+
+	// The delayed blocks stay delayed, but a writer is told if they could not be flushed
+	if (written && delalloc_take_error(inode_number) == -1) {
+		errno = EIO;
+		return -1;
+	}
 	return 0;
 }
 
@@ -320,39 +350,117 @@ big_int convert_byte_offset_to_ith_datablock(off_t offset) {
 	return (offset / BLOCK_SIZE) + 1;
 }
 
-ssize_t syscalls2__pread(int fildes, void *buf, size_t nbyte, off_t offset) {
+// Looks up the open file and checks its mode. Returns the inode number or -1
+static int get_inode_number_of_open_file(int fildes, access_mode mode) {
 	struct file_descriptor_entry * fde;
-	struct inode inod;
-	struct data_block db;
-	int pid;
-	size_t remaining_bytes, bytes_to_be_copied, read_bytes;
-	off_t current_offset_in_block;
-	big_int block_num_pos, current_block_number;
+	int inode_number;
 
-	pid = syscall2__get_pid();
-	fde = get_file_descriptor_entry(pid, fildes);
+	pthread_mutex_lock(&file_descriptor_tables_lock);
+	fde = get_file_descriptor_entry(syscall2__get_pid(), fildes);
 
-	if (fde == NULL) {
+	if (fde == NULL || (fde->mode != mode && fde->mode != READ_WRITE)) {
+		pthread_mutex_unlock(&file_descriptor_tables_lock);
 		errno = EBADF;
-		return -1; // file descriptor doesn't exist
+		return -1; // file descriptor doesn't exist or wasn't opened with the right mode
 	}
+	inode_number = fde->inode_number;
+	pthread_mutex_unlock(&file_descriptor_tables_lock);
+	return inode_number;
+}
 
-	if ((fde->mode != READ) && (fde->mode != READ_WRITE)) {
-		errno = EBADF;
-		return -1;
+// The entry may have been closed while the file was read or written
+static void set_byte_offset_of_open_file(int fildes, off_t byte_offset) {
+	struct file_descriptor_entry * fde;
+
+	pthread_mutex_lock(&file_descriptor_tables_lock);
+	fde = get_file_descriptor_entry(syscall2__get_pid(), fildes);
+	if (fde) {
+		fde->byte_offset = byte_offset;
 	}
+	pthread_mutex_unlock(&file_descriptor_tables_lock);
+}
+
+// Moves count datablocks between data and the disk. Runs of physically contiguous blocks are moved with a single
+// vectored call and the other blocks with one batch. Blocks numbered 0 (not allocated) are skipped
+static int transfer_datablocks(int write, big_int *block_numbers, int count, char *data) {
+	struct block_io ios[DATABLOCKS_BATCH_SIZE];
+	struct iovec iov[DATABLOCKS_BATCH_SIZE];
+	int i, j, run, num_ios = 0;
+
+	for (i = 0; i < count; i += run) {
+		run = 1;
+		if (block_numbers[i] == 0) {
+			continue;
+		}
+		while (i + run < count && block_numbers[i + run] == block_numbers[i] + run) {
+			run++;
+		}
 
-	if (get_inode(fde->inode_number, &inod) == -1) {
+		if (run == 1) {
+			ios[num_ios].block_id = block_numbers[i];
+			ios[num_ios].buffer = data + (size_t) i * BLOCK_SIZE;
+			num_ios++;
+			continue;
+		}
+
+		for (j = 0; j < run; j++) {
+			iov[j].iov_base = data + (size_t) (i + j) * BLOCK_SIZE;
+			iov[j].iov_len = BLOCK_SIZE;
+		}
+		if ((write ? write_blocks(block_numbers[i], run, iov) : read_blocks(block_numbers[i], run, iov)) == -1) {
+			return -1;
+		}
+	}
+
+	if (num_ios > 0) {
+		return write ? write_block_batch(ios, num_ios) : read_block_batch(ios, num_ios);
+	}
+	return 0;
+}
+
+// Reads the num_blocks blocks of the file starting at first_block (counted from 1).
+// Non allocated datablocks are filled with 0s, or with their content if their allocation is delayed
+static int read_datablocks(struct inode * inod, big_int first_block, int num_blocks, char *target) {
+	big_int block_numbers[DATABLOCKS_BATCH_SIZE];
+	int i;
+
+	for (i = 0; i < num_blocks; i++) {
+		block_numbers[i] = get_ith_datablock_number(inod, first_block + i);
+		if (block_numbers[i] == 0 && !delalloc_read_block(inod->inode_id, first_block + i, target + (size_t) i * BLOCK_SIZE)) {
+			memset(target + (size_t) i * BLOCK_SIZE, 0, BLOCK_SIZE);
+		}
+	}
+	return transfer_datablocks(0, block_numbers, num_blocks, target);
+}
+
+static ssize_t read_inode_data(int inode_number, void *buf, size_t nbyte, off_t offset) {
+	struct inode inod;
+	char *window;
+	size_t remaining_bytes, bytes_to_be_copied, read_bytes;
+	off_t current_offset_in_block;
+	big_int block_num_pos, last_block_num_pos, window_first_block;
+	int window_size, window_num_blocks;
+
+	if (get_inode(inode_number, &inod) == -1) {
 		errno = EIO;
 		return -1;
 	}
 
-	if (offset >= get_size_of_file(inod.num_blocks, inod.num_used_bytes_in_last_block)) {
+	if (offset >= get_size_of_file(inod.num_blocks, inod.num_used_bytes_in_last_block) || nbyte == 0) {
 		return 0; // request to read at position bigger than size of file
 	}
 
 	block_num_pos = convert_byte_offset_to_ith_datablock(offset);
-	current_block_number = get_ith_datablock_number(&inod, block_num_pos);
+	last_block_num_pos = convert_byte_offset_to_ith_datablock(offset + nbyte - 1);
+	if (last_block_num_pos > inod.num_blocks) {
+		last_block_num_pos = inod.num_blocks;
+	}
+
+	// The datablocks are read DATABLOCKS_BATCH_SIZE at a time in a window
+	window_size = min(DATABLOCKS_BATCH_SIZE, last_block_num_pos - block_num_pos + 1);
+	window = malloc((size_t) window_size * BLOCK_SIZE);
+	window_first_block = block_num_pos;
+	window_num_blocks = 0;
 
 	read_bytes = 0;
 	remaining_bytes = nbyte;
@@ -369,24 +477,23 @@ ssize_t syscalls2__pread(int fildes, void *buf, size_t nbyte, off_t offset) {
 		if (block_num_pos == inod.num_blocks) {
 			if ((inod.num_used_bytes_in_last_block == current_offset_in_block) && remaining_bytes > 0) {
 				// We have reached the end of the file and there are still some bytes to be read
-				fde->byte_offset = get_size_of_file(inod.num_blocks, inod.num_used_bytes_in_last_block);
-				return read_bytes;
+				break;
 			}
 			bytes_to_be_copied = min(bytes_to_be_copied, inod.num_used_bytes_in_last_block - current_offset_in_block);
 		}
 
-		if (current_block_number == 0) {
-			// Non allocated datablock so we fill with 0s only
-			memset(&((char *)buf)[read_bytes], 0, bytes_to_be_copied);
-		}
-		else {
-			if (bread(current_block_number, &db) == -1) {
+		if (block_num_pos >= window_first_block + window_num_blocks) {
+			window_first_block = block_num_pos;
+			window_num_blocks = min(window_size, last_block_num_pos - block_num_pos + 1);
+			if (read_datablocks(&inod, window_first_block, window_num_blocks, window) == -1) {
+				free(window);
 				errno = EIO;
 				return -1;
 			}
-			memcpy(&((char *)buf)[read_bytes], &db.block[current_offset_in_block], bytes_to_be_copied);
 		}
 
+		memcpy(&((char *)buf)[read_bytes], &window[(block_num_pos - window_first_block) * BLOCK_SIZE + current_offset_in_block], bytes_to_be_copied);
+
 		read_bytes += bytes_to_be_copied;
 		current_offset_in_block = (current_offset_in_block + bytes_to_be_copied) % BLOCK_SIZE;
 		remaining_bytes -= bytes_to_be_copied;
@@ -394,11 +501,9 @@ ssize_t syscalls2__pread(int fildes, void *buf, size_t nbyte, off_t offset) {
 		if (current_offset_in_block == 0) {
 			// We need to read the next datablock cause we have reached the end of a block in this read step
 			block_num_pos++;
-			current_block_number = get_ith_datablock_number(&inod, block_num_pos);
 		}
 	}
-
-	fde->byte_offset = offset + read_bytes;
+	free(window);
 
 	inod.last_accessed_file = time(NULL);
 	if (put_inode(&inod) == -1) {
@@ -408,29 +513,109 @@ ssize_t syscalls2__pread(int fildes, void *buf, size_t nbyte, off_t offset) {
 	return read_bytes;
 }
 
-ssize_t syscalls2__pwrite(int fildes, const void *buf, size_t nbyte, off_t offset) {
+// A read that starts where the previous one ended (or in its last block) is sequential: the window doubles and the
+// blocks that follow are queued for readahead once less than half a window is left ahead of the reader.
+// Any other read collapses the window.
+static void update_readahead_of_open_file(int fildes, int inode_number, off_t offset, size_t read_bytes) {
 	struct file_descriptor_entry * fde;
-	struct inode inod;
-	struct data_block db;
-	int pid;
-	size_t remaining_bytes, bytes_to_be_copied, written_bytes;
-	off_t current_offset_in_block;
-	big_int block_num_pos, current_block_number;
-
-	pid = syscall2__get_pid();
-	fde = get_file_descriptor_entry(pid, fildes);
+	big_int first_block = convert_byte_offset_to_ith_datablock(offset);
+	big_int last_block = convert_byte_offset_to_ith_datablock(offset + read_bytes - 1);
+	big_int readahead_start = 0, readahead_end = 0;
 
+	pthread_mutex_lock(&file_descriptor_tables_lock);
+	fde = get_file_descriptor_entry(syscall2__get_pid(), fildes);
 	if (fde == NULL) {
-		errno = EBADF;
-		return -1; // file descriptor doesn't exist
+		pthread_mutex_unlock(&file_descriptor_tables_lock);
+		return;
 	}
 
-	if ((fde->mode != WRITE) && (fde->mode != READ_WRITE)) {
-		errno = EBADF;
+	if (first_block == fde->readahead_next_block || first_block + 1 == fde->readahead_next_block) {
+		fde->readahead_window = fde->readahead_window == 0 ? READAHEAD_MIN_BLOCKS : min(2 * fde->readahead_window, READAHEAD_MAX_BLOCKS);
+	} else {
+		fde->readahead_window = 0;
+		fde->readahead_end = 0;
+	}
+	fde->readahead_next_block = last_block + 1;
+
+	if (fde->readahead_window > 0 && fde->readahead_end < last_block + 1 + fde->readahead_window / 2) {
+		readahead_start = fde->readahead_end > last_block + 1 ? fde->readahead_end : last_block + 1;
+		readahead_end = last_block + 1 + fde->readahead_window;
+		fde->readahead_end = readahead_end;
+	}
+	pthread_mutex_unlock(&file_descriptor_tables_lock);
+
+	if (readahead_end > readahead_start) {
+		readahead_file_blocks(inode_number, readahead_start, readahead_end - readahead_start);
+	}
+}
+
+ssize_t syscalls2__pread(int fildes, void *buf, size_t nbyte, off_t offset) {
+	ssize_t read_bytes;
+	int inode_number;
+
+	inode_number = get_inode_number_of_open_file(fildes, READ);
+	if (inode_number == -1) {
 		return -1;
 	}
 
-	get_inode(fde->inode_number, &inod);
+	lock_inode(inode_number);
+	read_bytes = read_inode_data(inode_number, buf, nbyte, offset);
+	unlock_inode(inode_number);
+
+	if (read_bytes > 0) {
+		set_byte_offset_of_open_file(fildes, offset + read_bytes);
+		update_readahead_of_open_file(fildes, inode_number, offset, read_bytes);
+	}
+	return read_bytes;
+}
+
+// Where the blocks of the file from ith_block go: right after the block before them so that a file written
+// sequentially is laid out sequentially, or in the block group of the inode
+static big_int get_datablock_goal(struct inode *inod, big_int ith_block) {
+	big_int previous = ith_block > 1 ? get_ith_datablock_number(inod, ith_block - 1) : 0;
+	return previous ? previous + 1 : get_group_goal(get_inode_group(inod->inode_id));
+}
+
+// Allocates one contiguous run for the holes of the file from block ith_block, at most max of them, preceded by
+// the indirect blocks that will map them.
+// The holes are consecutive so the whole run is used before the window of max blocks is written.
+static int alloc_run_for_holes(struct inode *inod, big_int ith_block, int max, big_int *first_block_id) {
+	big_int goal = get_datablock_goal(inod, ith_block);
+	int holes = 1;
+
+	while (holes < max && get_ith_datablock_number(inod, ith_block + holes) == 0) {
+		holes++;
+	}
+	if (prepare_block_map(inod, ith_block - 1, holes, &goal, NULL) == -1) {
+		return -1;
+	}
+	return data_block_alloc_run(goal, holes, first_block_id);
+}
+
+static void free_unused_run(big_int first_block_id, int length) {
+	big_int *block_ids = malloc(length * sizeof(big_int));
+	int i;
+
+	for (i = 0; i < length; i++) {
+		block_ids[i] = first_block_id + i;
+	}
+	if (length > 0) {
+		data_block_free_n(block_ids, length);
+	}
+	free(block_ids);
+}
+
+static ssize_t write_inode_data(int inode_number, const void *buf, size_t nbyte, off_t offset) {
+	struct inode inod;
+	big_int block_numbers[DATABLOCKS_BATCH_SIZE];
+	char *window;
+	size_t remaining_bytes, bytes_to_be_copied, written_bytes;
+	off_t current_offset_in_block;
+	big_int block_num_pos, last_block_num_pos, current_block_number, run_next_block = 0, window_first_block = 0;
+	int window_size, window_num_blocks, run_length = 0, i;
+	int delayed = is_delayed_allocation_enabled();
+
+	get_inode(inode_number, &inod);
 	block_num_pos = convert_byte_offset_to_ith_datablock(offset);
 
 	if (offset >= get_size_of_file(inod.num_blocks, inod.num_used_bytes_in_last_block) && !is_ith_block_in_range_of_direct_and_indirect_blocks(block_num_pos)) {
@@ -440,50 +625,91 @@ ssize_t syscalls2__pwrite(int fildes, const void *buf, size_t nbyte, off_t offse
 		return -1;
 	}
 
-	current_block_number = get_ith_datablock_number(&inod, block_num_pos);
 	remaining_bytes = nbyte;
 	current_offset_in_block = offset % BLOCK_SIZE;
 	written_bytes = 0;
 
+	// The new content of the datablocks is prepared in a window that is written DATABLOCKS_BATCH_SIZE blocks at a time
+	last_block_num_pos = nbyte == 0 ? block_num_pos : convert_byte_offset_to_ith_datablock(offset + nbyte - 1);
+	window_size = min(DATABLOCKS_BATCH_SIZE, last_block_num_pos - block_num_pos + 1);
+	window = malloc((size_t) window_size * BLOCK_SIZE);
+	window_num_blocks = 0;
 
 	while (remaining_bytes > 0) {
+		char *window_block = window + (size_t) window_num_blocks * BLOCK_SIZE;
+
 		bytes_to_be_copied = min(BLOCK_SIZE - current_offset_in_block, remaining_bytes);
+		current_block_number = get_ith_datablock_number(&inod, block_num_pos);
+		if (window_num_blocks == 0) {
+			window_first_block = block_num_pos;
+		}
 
+		if (current_block_number == 0 && delayed) {
+			// The block is only given a reservation when the window is written, it is allocated on flush
+			if (bytes_to_be_copied == BLOCK_SIZE || !delalloc_read_block(inode_number, block_num_pos, window_block)) {
+				memset(window_block, 0, BLOCK_SIZE);
+			}
+		}
 		// if datablock is not allocated
-		if (current_block_number == 0) {
-			if (data_block_alloc(&db) == -1) {
-				errno = EDQUOT;
-				return -1;
+		else if (current_block_number == 0) {
+			if (run_length == 0) {
+				run_length = alloc_run_for_holes(&inod, block_num_pos, min(window_size - window_num_blocks, last_block_num_pos - block_num_pos + 1), &run_next_block);
+				if (run_length == -1) {
+					free(window);
+					errno = EDQUOT;
+					return -1;
+				}
 			}
-			if (set_ith_datablock_number(&inod, block_num_pos, db.data_block_id) == -1) {
+			if (set_ith_datablock_number(&inod, block_num_pos, run_next_block) == -1) {
+				free_unused_run(run_next_block, run_length);
+				free(window);
 				errno = EIO;
 				return -1;
 			}
 
 			// We increment the number of datablocks allocated for the file
 			inod.num_allocated_blocks++;
+			current_block_number = run_next_block++;
+			run_length--;
+			memset(window_block, 0, BLOCK_SIZE);
 		}
-		else {
-			if (bread(current_block_number, &db) == -1) {
+		else if (bytes_to_be_copied < BLOCK_SIZE) {
+			// The block is only partially overwritten
+			if (read_block(current_block_number, window_block) == -1) {
+				free(window);
 				errno = EIO;
 				return -1;
 			}
 		}
 
-		memcpy(&db.block[current_offset_in_block], &((char *)buf)[written_bytes], bytes_to_be_copied);
-		if (bwrite(&db) == -1) {
-			errno = EIO;
-			return -1;
-		}
+		memcpy(&window_block[current_offset_in_block], &((char *)buf)[written_bytes], bytes_to_be_copied);
+		block_numbers[window_num_blocks++] = current_block_number;
+
 		written_bytes += bytes_to_be_copied;
 		current_offset_in_block = (current_offset_in_block + bytes_to_be_copied) % BLOCK_SIZE;
 		remaining_bytes -= bytes_to_be_copied;
 
+		if (window_num_blocks == window_size || remaining_bytes == 0) {
+			if (transfer_datablocks(1, block_numbers, window_num_blocks, window) == -1) {
+				free(window);
+				errno = EIO;
+				return -1;
+			}
+			for (i = 0; delayed && i < window_num_blocks; i++) {
+				if (block_numbers[i] == 0 && delalloc_write_block(inode_number, window_first_block + i, window + (size_t) i * BLOCK_SIZE) == -1) {
+					free(window);
+					errno = EDQUOT;
+					return -1;
+				}
+			}
+			window_num_blocks = 0;
+		}
+
 		if (current_offset_in_block == 0) {
 			block_num_pos++;
-			current_block_number = get_ith_datablock_number(&inod, block_num_pos);
 		}
 	}
+	free(window);
 
 	// Update the inode for the number of blocks used and position of last byte in file
 	if ((block_num_pos > inod.num_blocks) || (block_num_pos == inod.num_blocks && current_offset_in_block > inod.num_used_bytes_in_last_block)) {
@@ -504,7 +730,243 @@ ssize_t syscalls2__pwrite(int fildes, const void *buf, size_t nbyte, off_t offse
 		errno = EIO;
 		return -1;
 	}
+	return written_bytes;
+}
+
+ssize_t syscalls2__pwrite(int fildes, const void *buf, size_t nbyte, off_t offset) {
+	ssize_t written_bytes;
+	int inode_number;
+
+	inode_number = get_inode_number_of_open_file(fildes, WRITE);
+	if (inode_number == -1) {
+		return -1;
+	}
 
-	fde->byte_offset = offset + written_bytes;
+	lock_inode(inode_number);
+	written_bytes = write_inode_data(inode_number, buf, nbyte, offset);
+	if (written_bytes > 0 && delalloc_needs_flush() && delalloc_flush_file(inode_number) == -1) {
+		fprintf(stderr, "failed to flush the delayed blocks of inode %d\n", inode_number);
+	}
+	unlock_inode(inode_number);
+
+	if (written_bytes >= 0) {
+		set_byte_offset_of_open_file(fildes, offset + written_bytes);
+	}
 	return written_bytes;
 }
+
+// Allocates one contiguous run per range of holes of the count blocks of the file from first_block, the blocks and
+// indirect blocks are taken from *reservation
+static int allocate_holes(struct inode *inod, big_int first_block, big_int count, big_int *reservation) {
+	big_int ith_block = first_block, first_block_id, goal;
+	int length;
+
+	while (ith_block < first_block + count) {
+		big_int run = 0;
+
+		while (ith_block + run < first_block + count && get_ith_datablock_number(inod, ith_block + run) == 0) {
+			run++;
+		}
+		if (run == 0) {
+			ith_block++;
+			continue;
+		}
+
+		goal = get_datablock_goal(inod, ith_block);
+		if (prepare_block_map(inod, ith_block - 1, run, &goal, reservation) == -1) {
+			errno = ENOSPC;
+			return -1;
+		}
+		length = data_block_alloc_reserved_run(goal, run, &first_block_id, reservation);
+		if (length == -1) {
+			errno = ENOSPC;
+			return -1;
+		}
+		// Nothing is written to the blocks, they have to read as 0s before being mapped
+		if (buffer_cache_zero_blocks(first_block_id, length) == -1
+			|| set_block_id_range(inod, ith_block - 1, first_block_id, length) == -1) {
+			free_unused_run(first_block_id, length);
+			errno = EIO;
+			return -1;
+		}
+		inod->num_allocated_blocks += length;
+		ith_block += length;
+	}
+	return 0;
+}
+
+// Maps the holes of the count blocks of the file from first_block (counted from 1) to new blocks, one contiguous
+// run per range of holes, placed like the holes filled by pwrite.
+// The new blocks read as 0s, they are zeroed out on the disk
+static int preallocate_datablocks(struct inode *inod, big_int first_block, big_int count) {
+	big_int ith_block, holes = 0, reserved;
+	int result;
+
+	for (ith_block = first_block; ith_block < first_block + count; ith_block++) {
+		holes += get_ith_datablock_number(inod, ith_block) == 0;
+	}
+	if (holes == 0) {
+		return 0;
+	}
+	// The blocks and the indirect blocks that may map them are reserved until they are allocated: a range too big
+	// for the volume fails without allocating any, and delayed allocations can't be promised the same blocks.
+	// The allocation uses up the reservation, what is left of it is released
+	reserved = holes + count_index_blocks(first_block - 1, count);
+	if (data_block_reserve(reserved) == -1) {
+		errno = ENOSPC;
+		return -1;
+	}
+	result = allocate_holes(inod, first_block, count, &reserved);
+	data_block_release_reservation(reserved);
+	return result;
+}
+
+// Writes 0s over nbyte bytes of the block ith_block of the file from offset_in_block, if it is allocated
+static int zero_datablock_range(struct inode *inod, big_int ith_block, off_t offset_in_block, size_t nbyte) {
+	char zeros[BLOCK_SIZE];
+	big_int block_number = get_ith_datablock_number(inod, ith_block);
+
+	if (block_number == 0) {
+		return 0; // A hole already reads as 0s
+	}
+	memset(zeros, 0, nbyte);
+	return write_block_offset(block_number, zeros, nbyte, offset_in_block);
+}
+
+// Unmaps the count blocks of the file from first_block and frees them, BLOCK_ID_LIST_LENGTH at a time
+static int deallocate_datablocks(struct inode *inod, big_int first_block, big_int count) {
+	big_int block_ids[BLOCK_ID_LIST_LENGTH];
+	big_int ith_block, batch, i;
+	int num_block_ids;
+
+	for (ith_block = first_block; ith_block < first_block + count; ith_block += batch) {
+		batch = first_block + count - ith_block < BLOCK_ID_LIST_LENGTH ? first_block + count - ith_block : BLOCK_ID_LIST_LENGTH;
+		num_block_ids = 0;
+		for (i = 0; i < batch; i++) {
+			big_int block_number = get_ith_datablock_number(inod, ith_block + i);
+			if (block_number != 0) {
+				block_ids[num_block_ids++] = block_number;
+			}
+		}
+		if (num_block_ids == 0) {
+			continue;
+		}
+
+		if (set_block_id_range(inod, ith_block - 1, 0, batch) == -1) {
+			return -1;
+		}
+		if (data_block_free_n(block_ids, num_block_ids) == -1) {
+			return -1;
+		}
+		inod->num_allocated_blocks -= num_block_ids;
+	}
+	return 0;
+}
+
+// Frees the blocks fully inside [offset, offset + len) and zeroes the parts of the blocks at both ends
+static int punch_hole(struct inode *inod, off_t offset, off_t len) {
+	off_t end = offset + len;
+	big_int first_full_block = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE + 1;
+	big_int end_full_block = end / BLOCK_SIZE + 1;
+
+	if (first_full_block > end_full_block) {
+		// The range is inside a single block
+		return zero_datablock_range(inod, convert_byte_offset_to_ith_datablock(offset), offset % BLOCK_SIZE, len);
+	}
+	if (offset % BLOCK_SIZE && zero_datablock_range(inod, convert_byte_offset_to_ith_datablock(offset), offset % BLOCK_SIZE, BLOCK_SIZE - offset % BLOCK_SIZE) == -1) {
+		return -1;
+	}
+	if (end % BLOCK_SIZE && zero_datablock_range(inod, convert_byte_offset_to_ith_datablock(end), 0, end % BLOCK_SIZE) == -1) {
+		return -1;
+	}
+	return deallocate_datablocks(inod, first_full_block, end_full_block - first_full_block);
+}
+
+int syscalls2__fsync(int fildes) {
+	int inode_number, result;
+
+	inode_number = get_inode_number_of_open_file(fildes, READ);
+	if (inode_number == -1) {
+		inode_number = get_inode_number_of_open_file(fildes, WRITE);
+	}
+	if (inode_number == -1) {
+		return -1;
+	}
+
+	lock_inode(inode_number);
+	result = delalloc_flush_file(inode_number);
+	// The failure is reported once, whether it happened now or in the background
+	if (delalloc_take_error(inode_number) == -1) {
+		result = -1;
+	}
+	unlock_inode(inode_number);
+
+	if (result == -1) {
+		errno = EIO;
+	}
+	return result;
+}
+
+static int fallocate_inode(int inode_number, int mode, off_t offset, off_t len) {
+	struct inode inod;
+	big_int first_block = convert_byte_offset_to_ith_datablock(offset);
+	big_int last_block = convert_byte_offset_to_ith_datablock(offset + len - 1);
+	int result;
+
+	if (!is_ith_block_in_range_of_direct_and_indirect_blocks(last_block)) {
+		errno = EFBIG;
+		return -1;
+	}
+	// The delayed blocks of the file are allocated first so that the block map tells the whole story
+	if (delalloc_flush_file(inode_number) == -1 || get_inode(inode_number, &inod) == -1) {
+		errno = EIO;
+		return -1;
+	}
+
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		result = punch_hole(&inod, offset, len);
+		if (result == -1) {
+			errno = EIO;
+		}
+	}
+	else {
+		result = preallocate_datablocks(&inod, first_block, last_block - first_block + 1);
+		if (result == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && offset + len > get_size_of_file(inod.num_blocks, inod.num_used_bytes_in_last_block)) {
+			inod.num_blocks = last_block;
+			inod.num_used_bytes_in_last_block = (offset + len - 1) % BLOCK_SIZE + 1;
+			inod.last_modified_inode = time(NULL);
+		}
+	}
+
+	// The blocks mapped before an error are kept, like on a volume that ran out of space in the middle
+	inod.last_modified_file = time(NULL);
+	if (put_inode(&inod) == -1) {
+		errno = EIO;
+		return -1;
+	}
+	return result;
+}
+
+int syscalls2__fallocate(int fildes, int mode, off_t offset, off_t len) {
+	int inode_number, result;
+
+	if (offset < 0 || len <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	// Like on Linux, punching a hole never changes the size of the file and has to say so
+	if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) || mode == FALLOC_FL_PUNCH_HOLE) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	inode_number = get_inode_number_of_open_file(fildes, WRITE);
+	if (inode_number == -1) {
+		return -1;
+	}
+
+	lock_inode(inode_number);
+	result = fallocate_inode(inode_number, mode, offset, len);
+	unlock_inode(inode_number);
+	return result;
+}
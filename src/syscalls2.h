@@ -9,6 +9,7 @@
 // The methods below use user file descriptor tables
 
 #define FD_NOT_USED -1
+#define DATABLOCKS_BATCH_SIZE 64 // Maximum number of datablocks moved at once by pread and pwrite
 
 #ifdef SYSCALL2__TEST
 	int syscall2__pid;
@@ -27,6 +28,9 @@ struct file_descriptor_entry {
 	access_mode mode;
 	int inode_number;
 	int byte_offset;
+	big_int readahead_next_block; // Block a sequential reader reads next
+	int readahead_window; // Blocks read ahead of a sequential reader, 0 after a random read
+	big_int readahead_end; // The blocks before it were already queued for readahead
 };
 
 struct file_descriptor_table {
@@ -40,9 +44,15 @@ struct file_descriptor_table {
 
 ssize_t syscalls2__pread(int fildes, void *buf, size_t nbyte, off_t offset); 
 ssize_t syscalls2__pwrite(int fildes, const void *buf, size_t nbyte, off_t offset);
+// Supports mode 0 and FALLOC_FL_KEEP_SIZE, which allocate the holes of the range in contiguous runs, and
+// FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, which frees the blocks of the range
+int syscalls2__fallocate(int fildes, int mode, off_t offset, off_t len);
+// Allocates the delayed blocks of the file. Fails with EIO if that fails or if a flush of the file failed in the
+// background since the last fsync or close
+int syscalls2__fsync(int fildes);
 
 int syscalls2__open(const char *path, int oflag, ... ); // Supports O_RDONLY, O_RDWR, O_WRONLY. O_APPEND, O_CREAT and O_TRUNC are not yet supported
-int syscalls2__close(int fildes);
+int syscalls2__close(int fildes); // The descriptor is closed even if it fails with EIO, like syscalls2__fsync
 
 
 // UTILITIES
@@ -0,0 +1,279 @@
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE // Defined by <linux/fs.h>, we use our own
+
+#include "common.h"
+#include "uring_queue.h"
+
+// Minimal io_uring wrapper built on the raw system calls so that we don't depend on liburing.
+// Every thread doing I/O gets its own ring the first time it needs one, so that the batches of different threads
+// are in flight together. A ring is only used by its thread, queues_lock only protects the list of rings.
+struct uring_queue {
+	int ring_fd;
+	int ready; // The ring is mapped
+	int failed; // The ring broke, the thread uses synchronous I/O until the next init_uring_queue
+	unsigned int entries;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	struct uring_queue *next;
+};
+
+static struct uring_queue *queues = NULL; // Every ring created, owned by the thread it was created for
+static int queues_enabled = 0; // io_uring works and the disk is open
+static pthread_mutex_t queues_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t queue_key; // Ring of the calling thread
+static pthread_once_t queue_key_once = PTHREAD_ONCE_INIT;
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *params) {
+	return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+	return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void unmap_queue(struct uring_queue *queue) {
+	if (queue->sqes && queue->sqes != MAP_FAILED) {
+		munmap(queue->sqes, queue->sqes_size);
+	}
+	if (queue->cq_ring && queue->cq_ring != MAP_FAILED && queue->cq_ring != queue->sq_ring) {
+		munmap(queue->cq_ring, queue->cq_ring_size);
+	}
+	if (queue->sq_ring && queue->sq_ring != MAP_FAILED) {
+		munmap(queue->sq_ring, queue->sq_ring_size);
+	}
+	close(queue->ring_fd);
+	queue->sqes = NULL;
+	queue->sq_ring = NULL;
+	queue->cq_ring = NULL;
+	queue->ready = 0;
+}
+
+static int setup_queue(struct uring_queue *queue) {
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(struct io_uring_params));
+	queue->ring_fd = io_uring_setup(URING_ENTRIES, &params);
+	if (queue->ring_fd == -1) {
+		LOGD("io_uring is not available (errno %d), using synchronous I/O", errno);
+		return -1;
+	}
+
+	queue->entries = params.sq_entries;
+	queue->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	queue->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		// Both rings live in the same mapping
+		if (queue->cq_ring_size > queue->sq_ring_size) {
+			queue->sq_ring_size = queue->cq_ring_size;
+		}
+		queue->cq_ring_size = queue->sq_ring_size;
+	}
+
+	queue->sq_ring = mmap(NULL, queue->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, queue->ring_fd, IORING_OFF_SQ_RING);
+	if (queue->sq_ring == MAP_FAILED) {
+		fprintf(stderr, "failed to map io_uring submission queue\n");
+		unmap_queue(queue);
+		return -1;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		queue->cq_ring = queue->sq_ring;
+	} else {
+		queue->cq_ring = mmap(NULL, queue->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, queue->ring_fd, IORING_OFF_CQ_RING);
+		if (queue->cq_ring == MAP_FAILED) {
+			fprintf(stderr, "failed to map io_uring completion queue\n");
+			unmap_queue(queue);
+			return -1;
+		}
+	}
+
+	queue->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	queue->sqes = mmap(NULL, queue->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, queue->ring_fd, IORING_OFF_SQES);
+	if (queue->sqes == MAP_FAILED) {
+		fprintf(stderr, "failed to map io_uring submission entries\n");
+		unmap_queue(queue);
+		return -1;
+	}
+
+	queue->sq_head = (unsigned int *) ((char *) queue->sq_ring + params.sq_off.head);
+	queue->sq_tail = (unsigned int *) ((char *) queue->sq_ring + params.sq_off.tail);
+	queue->sq_mask = (unsigned int *) ((char *) queue->sq_ring + params.sq_off.ring_mask);
+	queue->sq_array = (unsigned int *) ((char *) queue->sq_ring + params.sq_off.array);
+	queue->cq_head = (unsigned int *) ((char *) queue->cq_ring + params.cq_off.head);
+	queue->cq_tail = (unsigned int *) ((char *) queue->cq_ring + params.cq_off.tail);
+	queue->cq_mask = (unsigned int *) ((char *) queue->cq_ring + params.cq_off.ring_mask);
+	queue->cqes = (struct io_uring_cqe *) ((char *) queue->cq_ring + params.cq_off.cqes);
+
+	queue->ready = 1;
+	LOGD("io_uring queue ready with %u entries", queue->entries);
+	return 0;
+}
+
+// Called when a thread that used io_uring exits
+static void destroy_thread_queue(void *arg) {
+	struct uring_queue *queue = arg, **link;
+
+	pthread_mutex_lock(&queues_lock);
+	for (link = &queues; *link != queue; link = &(*link)->next);
+	*link = queue->next;
+	if (queue->ready) {
+		unmap_queue(queue);
+	}
+	pthread_mutex_unlock(&queues_lock);
+	free(queue);
+}
+
+static void create_queue_key(void) {
+	pthread_key_create(&queue_key, destroy_thread_queue);
+}
+
+// Returns the ring of the calling thread, set up the first time, or NULL if the thread has to use synchronous I/O
+static struct uring_queue *get_thread_queue(void) {
+	struct uring_queue *queue;
+
+	pthread_once(&queue_key_once, create_queue_key);
+	pthread_mutex_lock(&queues_lock);
+	if (!queues_enabled) {
+		pthread_mutex_unlock(&queues_lock);
+		return NULL;
+	}
+
+	queue = pthread_getspecific(queue_key);
+	if (queue == NULL) {
+		queue = calloc(1, sizeof(struct uring_queue));
+		if (queue == NULL) {
+			pthread_mutex_unlock(&queues_lock);
+			return NULL;
+		}
+		queue->next = queues;
+		queues = queue;
+		pthread_setspecific(queue_key, queue);
+	}
+	// The rings are unmapped by free_uring_queue, the thread gets a new one after the next init
+	if (!queue->ready && !queue->failed && setup_queue(queue) == -1) {
+		queue->failed = 1;
+	}
+	pthread_mutex_unlock(&queues_lock);
+	return queue->ready ? queue : NULL;
+}
+
+int init_uring_queue(void) {
+	struct uring_queue *queue;
+
+	pthread_mutex_lock(&queues_lock);
+	queues_enabled = 1;
+	for (queue = queues; queue; queue = queue->next) {
+		queue->failed = 0;
+	}
+	pthread_mutex_unlock(&queues_lock);
+
+	// The ring of the calling thread tells whether the kernel supports io_uring
+	if (get_thread_queue() == NULL) {
+		pthread_mutex_lock(&queues_lock);
+		queues_enabled = 0;
+		pthread_mutex_unlock(&queues_lock);
+		return -1;
+	}
+	return 0;
+}
+
+// No I/O may be in flight
+void free_uring_queue(void) {
+	struct uring_queue *queue;
+
+	pthread_mutex_lock(&queues_lock);
+	queues_enabled = 0;
+	for (queue = queues; queue; queue = queue->next) {
+		if (queue->ready) {
+			unmap_queue(queue);
+		}
+	}
+	pthread_mutex_unlock(&queues_lock);
+}
+
+// Submits up to queue->entries requests and reaps all their completions
+static int submit_and_wait(struct uring_queue *queue, int fd, int write, struct block_io *ios, int count, ssize_t *results) {
+	unsigned int tail, head, mask = *queue->sq_mask;
+	int i, submitted = 0, completed = 0;
+
+	tail = *queue->sq_tail;
+	for (i = 0; i < count; i++) {
+		unsigned int index = tail & mask;
+		struct io_uring_sqe *sqe = &queue->sqes[index];
+
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->fd = fd;
+		sqe->addr = (unsigned long) ios[i].buffer;
+		sqe->len = BLOCK_SIZE;
+		sqe->off = ios[i].block_id * BLOCK_SIZE;
+		sqe->user_data = i;
+		queue->sq_array[index] = index;
+		tail++;
+	}
+	// The kernel must see the entries before the new tail
+	__atomic_store_n(queue->sq_tail, tail, __ATOMIC_RELEASE);
+
+	while (completed < count) {
+		int result = io_uring_enter(queue->ring_fd, count - submitted, 1, IORING_ENTER_GETEVENTS);
+		if (result == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "io_uring_enter failed (errno %d)\n", errno);
+			return -1;
+		}
+		submitted += result;
+
+		head = *queue->cq_head;
+		while (head != __atomic_load_n(queue->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &queue->cqes[head & *queue->cq_mask];
+			results[cqe->user_data] = cqe->res;
+			head++;
+			completed++;
+		}
+		__atomic_store_n(queue->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+int uring_queue_rw_blocks(int fd, int write, struct block_io *ios, int count, ssize_t *results) {
+	struct uring_queue *queue = get_thread_queue();
+	int i, batch;
+
+	if (queue == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < count; i += batch) {
+		batch = count - i < (int) queue->entries ? count - i : (int) queue->entries;
+		if (submit_and_wait(queue, fd, write, &ios[i], batch, &results[i]) == -1) {
+			// The ring is in an unknown state, the thread stops using it
+			pthread_mutex_lock(&queues_lock);
+			unmap_queue(queue);
+			queue->failed = 1;
+			pthread_mutex_unlock(&queues_lock);
+			return -1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef _URING_QUEUE_
+#define _URING_QUEUE_
+
+#include "common.h"
+
+#define URING_ENTRIES 64 // Size of the submission queue. Bigger batches are submitted in several rounds
+
+// A block to transfer in a batch. buffer holds BLOCK_SIZE bytes
+struct block_io {
+	big_int block_id;
+	void *buffer;
+};
+
+// Returns -1 if the kernel doesn't support io_uring, the callers then have to use synchronous I/O
+int init_uring_queue(void);
+void free_uring_queue(void);
+
+// Submits all the reads (or writes) of the batch at once on the ring of the calling thread and waits for all of
+// them to complete. The batches of different threads don't wait for each other.
+// results[i] is set to the number of bytes transferred for ios[i] or to -errno. Short transfers are not retried.
+// Returns -1 if the batch could not be submitted at all.
+int uring_queue_rw_blocks(int fd, int write, struct block_io *ios, int count, ssize_t *results);
+
+#endif
@@ -22,6 +22,7 @@ for filename in $test_files
 do
 	# MKFS
 	cd $BIN_FOLDER_OF_FSTR
+	sudo ./mkfs.fstr -f > /dev/null
 
 	# Create the mount point
 	sudo fusermount -u $MOUNT_POINT &> /dev/null
@@ -2,6 +2,7 @@
 
 static void RunAllTests(void) {
   RUN_TEST_GROUP(TestDiskEmulator);
+  RUN_TEST_GROUP(TestBufferCache);
   RUN_TEST_GROUP(TestMkfs);
   RUN_TEST_GROUP(TestCommon);
   RUN_TEST_GROUP(TestBlockUtils);
@@ -6,9 +6,12 @@
 #include "mkfs.h"
 #include "inodes_handler.h"
 #include "block_utils.h"
+#include "data_blocks_handler.h"
 
 TEST_GROUP_RUNNER(TestBlockUtils) {
 	RUN_TEST_CASE(TestBlockUtils, traverse_complete_block_list);
+	RUN_TEST_CASE(TestBlockUtils, indirect_blocks_are_allocated_together_and_freed_with_the_inode);
+	RUN_TEST_CASE(TestBlockUtils, count_index_blocks__counts_every_indirect_block_of_the_range);
 }
 
 TEST_GROUP(TestBlockUtils);
@@ -48,3 +51,51 @@ TEST(TestBlockUtils, traverse_complete_block_list) {
 	}
 	TEST_ASSERT_EQUAL(0, get_block_id(&inode, i));
 }
+
+TEST(TestBlockUtils, indirect_blocks_are_allocated_together_and_freed_with_the_inode) {
+	struct inode inode;
+	struct block_id_list list;
+	big_int indirect_block_ids[3];
+	big_int num_free_blocks, index;
+	int i;
+	ialloc(&inode);
+
+	// The first block of the triple indirection needs 3 indirect blocks
+	num_free_blocks = superblock.num_free_blocks;
+	index = NUM_DIRECT_BLOCKS + BLOCK_ID_LIST_LENGTH + BLOCK_ID_LIST_LENGTH * BLOCK_ID_LIST_LENGTH;
+	TEST_ASSERT_EQUAL(0, set_block_id(&inode, index, 0));
+	TEST_ASSERT_EQUAL(num_free_blocks - 3, superblock.num_free_blocks);
+	indirect_block_ids[0] = inode.triple_indirect_block;
+	for (i = 1; i < 3; i++) {
+		TEST_ASSERT_EQUAL(0, read_block(indirect_block_ids[i - 1], &list));
+		indirect_block_ids[i] = list.list[0];
+		TEST_ASSERT_TRUE(indirect_block_ids[i] != 0);
+	}
+
+	// Its neighbour only needs the entry to be set
+	TEST_ASSERT_EQUAL(0, set_block_id(&inode, index + 1, 0));
+	TEST_ASSERT_EQUAL(num_free_blocks - 3, superblock.num_free_blocks);
+
+	// Deleting the file frees its indirect blocks
+	inode.links_nb = 0;
+	inode.num_blocks = 0;
+	TEST_ASSERT_EQUAL(0, iput(&inode));
+	TEST_ASSERT_EQUAL(num_free_blocks, superblock.num_free_blocks);
+	TEST_ASSERT_EQUAL(0, is_data_block_used(indirect_block_ids[0]));
+	TEST_ASSERT_EQUAL(0, is_data_block_used(indirect_block_ids[2]));
+}
+
+TEST(TestBlockUtils, count_index_blocks__counts_every_indirect_block_of_the_range) {
+	big_int double_first = NUM_DIRECT_BLOCKS + BLOCK_ID_LIST_LENGTH;
+	big_int triple_first = double_first + BLOCK_ID_LIST_LENGTH * BLOCK_ID_LIST_LENGTH;
+
+	TEST_ASSERT_EQUAL(0, count_index_blocks(0, NUM_DIRECT_BLOCKS));
+	TEST_ASSERT_EQUAL(0, count_index_blocks(NUM_DIRECT_BLOCKS, 0));
+	TEST_ASSERT_EQUAL(1, count_index_blocks(0, NUM_DIRECT_BLOCKS + 1));
+	TEST_ASSERT_EQUAL(1, count_index_blocks(NUM_DIRECT_BLOCKS, BLOCK_ID_LIST_LENGTH));
+	// The double indirect block and two of its blocks
+	TEST_ASSERT_EQUAL(3, count_index_blocks(double_first + BLOCK_ID_LIST_LENGTH - 1, 2));
+	// Last block of the single indirection, all of the double one and first block of the triple one
+	TEST_ASSERT_EQUAL(1 + (1 + BLOCK_ID_LIST_LENGTH) + 3, count_index_blocks(double_first - 1, triple_first - double_first + 2));
+	TEST_ASSERT_EQUAL(3, count_index_blocks(triple_first + 5, 1));
+}
@@ -0,0 +1,250 @@
+#include "unity.h"
+#include "unity_fixture.h"
+
+#include "common.h"
+#include "disk_emulator.h"
+#include "buffer_cache.h"
+
+TEST_GROUP_RUNNER(TestBufferCache) {
+	RUN_TEST_CASE(TestBufferCache, read_block__second_read_of_a_block_is_a_hit);
+	RUN_TEST_CASE(TestBufferCache, write_block__is_written_through_to_disk);
+	RUN_TEST_CASE(TestBufferCache, buffer_get__pinned_buffers_are_not_evicted);
+	RUN_TEST_CASE(TestBufferCache, least_recently_used_block_is_evicted_first);
+	RUN_TEST_CASE(TestBufferCache, write_back__blocks_reach_disk_on_sync);
+	RUN_TEST_CASE(TestBufferCache, write_back__dirty_blocks_are_written_before_eviction);
+	RUN_TEST_CASE(TestBufferCache, write_back__flusher_writes_back_when_dirty_ratio_is_exceeded);
+	RUN_TEST_CASE(TestBufferCache, prefetch__prefetched_blocks_are_read_as_hits);
+	RUN_TEST_CASE(TestBufferCache, write_back__rewritten_and_contiguous_blocks_are_coalesced_on_sync);
+}
+
+TEST_GROUP(TestBufferCache);
+
+// To be executed before each test case
+TEST_SETUP(TestBufferCache) {
+	init_disk_emulator();
+}
+
+// To be executed after each test
+TEST_TEAR_DOWN(TestBufferCache) {
+	stop_buffer_cache_flusher();
+	set_buffer_cache_write_back(0);
+	free_disk_emulator();
+}
+
+TEST(TestBufferCache, read_block__second_read_of_a_block_is_a_hit) {
+	char buffer[BLOCK_SIZE];
+	struct buffer_cache_stats stats;
+
+	get_buffer_cache_stats(&stats);
+	TEST_ASSERT_EQUAL(0, stats.hits);
+	TEST_ASSERT_EQUAL(0, stats.misses);
+
+	TEST_ASSERT_EQUAL(0, read_block(12, buffer));
+	get_buffer_cache_stats(&stats);
+	TEST_ASSERT_EQUAL(0, stats.hits);
+	TEST_ASSERT_EQUAL(1, stats.misses);
+
+	TEST_ASSERT_EQUAL(0, read_block(12, buffer));
+	get_buffer_cache_stats(&stats);
+	TEST_ASSERT_EQUAL(1, stats.hits);
+	TEST_ASSERT_EQUAL(1, stats.misses);
+}
+
+TEST(TestBufferCache, write_block__is_written_through_to_disk) {
+	char buffer[BLOCK_SIZE], read_buffer[BLOCK_SIZE];
+
+	memset(buffer, 'z', BLOCK_SIZE);
+	TEST_ASSERT_EQUAL(0, write_block(25, buffer, BLOCK_SIZE));
+
+	// The disk has the data even if we bypass the cache
+	TEST_ASSERT_EQUAL(0, device_read_block(25, read_buffer));
+	TEST_ASSERT_EQUAL(0, memcmp(buffer, read_buffer, BLOCK_SIZE));
+
+	TEST_ASSERT_EQUAL(0, read_block(25, read_buffer));
+	TEST_ASSERT_EQUAL(0, memcmp(buffer, read_buffer, BLOCK_SIZE));
+}
+
+TEST(TestBufferCache, buffer_get__pinned_buffers_are_not_evicted) {
+	char buffer[BLOCK_SIZE];
+	struct buffer *pinned;
+	struct buffer_cache_stats stats;
+	big_int i, hits;
+
+	memset(buffer, 'p', BLOCK_SIZE);
+	write_block(3, buffer, BLOCK_SIZE);
+
+	pinned = buffer_get(3);
+	TEST_ASSERT_NOT_NULL(pinned);
+	TEST_ASSERT_EQUAL(1, pinned->ref_count);
+
+	// Go through more blocks than the cache can hold
+	for (i = 0; i < BUFFER_CACHE_SIZE + 10; i++) {
+		read_block(100 + i, buffer);
+	}
+
+	TEST_ASSERT_EQUAL(3, pinned->block_id);
+	TEST_ASSERT_EQUAL('p', pinned->data[0]);
+	buffer_release(pinned);
+	TEST_ASSERT_EQUAL(0, pinned->ref_count);
+
+	// Block 3 is still cached
+	get_buffer_cache_stats(&stats);
+	hits = stats.hits;
+	read_block(3, buffer);
+	get_buffer_cache_stats(&stats);
+	TEST_ASSERT_EQUAL(hits + 1, stats.hits);
+}
+
+TEST(TestBufferCache, least_recently_used_block_is_evicted_first) {
+	char buffer[BLOCK_SIZE];
+	struct buffer_cache_stats stats;
+	big_int i;
+
+	// Fill the cache with blocks 0 to BUFFER_CACHE_SIZE - 1
+	for (i = 0; i < BUFFER_CACHE_SIZE; i++) {
+		read_block(i, buffer);
+	}
+
+	read_block(0, buffer); // Block 0 becomes the most recently used
+	read_block(BUFFER_CACHE_SIZE, buffer); // Block 1 gets evicted
+
+	get_buffer_cache_stats(&stats);
+	TEST_ASSERT_EQUAL(1, stats.evictions);
+
+	read_block(0, buffer);
+	get_buffer_cache_stats(&stats);
+	TEST_ASSERT_EQUAL(2, stats.hits);
+
+	read_block(1, buffer);
+	get_buffer_cache_stats(&stats);
+	TEST_ASSERT_EQUAL(2, stats.hits);
+	TEST_ASSERT_EQUAL(2, stats.evictions);
+}
+
+TEST(TestBufferCache, write_back__blocks_reach_disk_on_sync) {
+	char buffer[BLOCK_SIZE], read_buffer[BLOCK_SIZE];
+	struct buffer_cache_stats stats;
+
+	memset(buffer, 0, BLOCK_SIZE);
+	write_block(40, buffer, BLOCK_SIZE);
+
+	set_buffer_cache_write_back(1);
+	memset(buffer, 'w', BLOCK_SIZE);
+	TEST_ASSERT_EQUAL(0, write_block(40, buffer, BLOCK_SIZE));
+
+	// Only the cache has the new content
+	get_buffer_cache_stats(&stats);
+	TEST_ASSERT_EQUAL(1, stats.dirty_blocks);
+	device_read_block(40, read_buffer);
+	TEST_ASSERT_EQUAL(0, read_buffer[0]);
+	read_block(40, read_buffer);
+	TEST_ASSERT_EQUAL('w', read_buffer[0]);
+
+	TEST_ASSERT_EQUAL(0, sync_buffer_cache());
+	get_buffer_cache_stats(&stats);
+	TEST_ASSERT_EQUAL(0, stats.dirty_blocks);
+	TEST_ASSERT_EQUAL(1, stats.writebacks);
+	device_read_block(40, read_buffer);
+	TEST_ASSERT_EQUAL(0, memcmp(buffer, read_buffer, BLOCK_SIZE));
+}
+
+TEST(TestBufferCache, write_back__dirty_blocks_are_written_before_eviction) {
+	char buffer[BLOCK_SIZE], read_buffer[BLOCK_SIZE];
+	big_int i;
+
+	set_buffer_cache_write_back(1);
+	for (i = 0; i < BUFFER_CACHE_SIZE; i++) {
+		memset(buffer, (char) i, BLOCK_SIZE);
+		TEST_ASSERT_EQUAL(0, write_block(i, buffer, BLOCK_SIZE));
+	}
+
+	// The cache is full of dirty blocks, a new block can only be cached once they are written back
+	TEST_ASSERT_EQUAL(0, read_block(BUFFER_CACHE_SIZE, read_buffer));
+	for (i = 0; i < BUFFER_CACHE_SIZE; i++) {
+		device_read_block(i, read_buffer);
+		TEST_ASSERT_EQUAL((char) i, read_buffer[0]);
+	}
+}
+
+TEST(TestBufferCache, write_back__flusher_writes_back_when_dirty_ratio_is_exceeded) {
+	char buffer[BLOCK_SIZE];
+	struct buffer_cache_stats stats;
+	big_int i;
+	int retries;
+
+	set_buffer_cache_write_back(1);
+	TEST_ASSERT_EQUAL(0, start_buffer_cache_flusher());
+	TEST_ASSERT_EQUAL(-1, start_buffer_cache_flusher());
+
+	memset(buffer, 'f', BLOCK_SIZE);
+	for (i = 0; i < (BUFFER_CACHE_SIZE * DIRTY_RATIO) / 100 + 1; i++) {
+		write_block(i, buffer, BLOCK_SIZE);
+	}
+
+	// The flusher doesn't wait for the blocks to expire
+	for (retries = 0; retries < 30; retries++) {
+		get_buffer_cache_stats(&stats);
+		if (stats.dirty_blocks == 0) {
+			break;
+		}
+		usleep(100000);
+	}
+	TEST_ASSERT_EQUAL(0, stats.dirty_blocks);
+}
+
+TEST(TestBufferCache, prefetch__prefetched_blocks_are_read_as_hits) {
+	big_int block_ids[] = { 300, 301, 302, 900, 301 };
+	char buffers[3][BLOCK_SIZE];
+	struct iovec iov[3];
+	struct buffer_cache_stats stats;
+	int i;
+
+	memset(buffers[0], 'p', BLOCK_SIZE);
+	TEST_ASSERT_EQUAL(0, device_write_block(301, buffers[0], BLOCK_SIZE));
+
+	TEST_ASSERT_EQUAL(0, buffer_cache_prefetch(block_ids, 5));
+	get_buffer_cache_stats(&stats);
+	TEST_ASSERT_EQUAL(4, stats.prefetches);
+	TEST_ASSERT_EQUAL(4, stats.misses);
+
+	for (i = 0; i < 3; i++) {
+		iov[i].iov_base = buffers[i];
+		iov[i].iov_len = BLOCK_SIZE;
+	}
+	TEST_ASSERT_EQUAL(0, read_blocks(300, 3, iov));
+	TEST_ASSERT_EQUAL('p', buffers[1][0]);
+	get_buffer_cache_stats(&stats);
+	TEST_ASSERT_EQUAL(3, stats.hits);
+	TEST_ASSERT_EQUAL(4, stats.misses);
+
+	TEST_ASSERT_EQUAL(0, buffer_cache_prefetch(block_ids, 5)); // Everything is cached already
+	get_buffer_cache_stats(&stats);
+	TEST_ASSERT_EQUAL(4, stats.prefetches);
+}
+
+TEST(TestBufferCache, write_back__rewritten_and_contiguous_blocks_are_coalesced_on_sync) {
+	big_int block_ids[] = { 52, 50, 90, 51, 50, 71, 70 };
+	char buffer[BLOCK_SIZE], read_buffer[BLOCK_SIZE];
+	struct buffer_cache_stats stats;
+	int i;
+
+	set_buffer_cache_write_back(1);
+	for (i = 0; i < 7; i++) {
+		memset(buffer, 'a' + i, BLOCK_SIZE);
+		TEST_ASSERT_EQUAL(0, write_block(block_ids[i], buffer, BLOCK_SIZE));
+	}
+
+	TEST_ASSERT_EQUAL(0, sync_buffer_cache());
+	get_buffer_cache_stats(&stats);
+	TEST_ASSERT_EQUAL(6, stats.writebacks); // Block 50 is written once
+	TEST_ASSERT_EQUAL(2, stats.coalesced_runs); // 50-52 and 70-71, 90 is on its own
+
+	device_read_block(50, read_buffer);
+	TEST_ASSERT_EQUAL('e', read_buffer[0]); // The last write wins
+	device_read_block(52, read_buffer);
+	TEST_ASSERT_EQUAL('a', read_buffer[BLOCK_SIZE - 1]);
+	device_read_block(90, read_buffer);
+	TEST_ASSERT_EQUAL('c', read_buffer[0]);
+	device_read_block(70, read_buffer);
+	TEST_ASSERT_EQUAL('g', read_buffer[0]);
+}
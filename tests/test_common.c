@@ -4,9 +4,13 @@
 #include "common.h"
 #include "disk_emulator.h"
 #include "mkfs.h"
+#include "data_blocks_handler.h"
+#include "inodes_handler.h"
 
 TEST_GROUP_RUNNER(TestCommon) {
 	RUN_TEST_CASE(TestCommon, commit_and_read_superblock);
+	RUN_TEST_CASE(TestCommon, init_superblock__recovers_the_counters_after_an_unclean_shutdown);
+	RUN_TEST_CASE(TestCommon, init_superblock__only_mounts_a_volume_formatted_by_mkfs);
 	RUN_TEST_CASE(TestCommon, write_block_offset);
 	RUN_TEST_CASE(TestCommon, init_dir_block);
 	RUN_TEST_CASE(TestCommon, add_and_remove_entry_from_dir_block);
@@ -40,6 +44,69 @@ TEST(TestCommon, commit_and_read_superblock) {
 	TEST_ASSERT_EQUAL(0, memcmp(&superblock, &copy, sizeof(struct superblock)));
 }
 
+TEST(TestCommon, init_superblock__recovers_the_counters_after_an_unclean_shutdown) {
+	struct data_block block, cached_block;
+	struct inode inod;
+	big_int num_free_blocks, num_free_inodes, num_cached_free_blocks;
+
+	// Mounting marks the superblock on disk as not clean
+	TEST_ASSERT_EQUAL(0, init_superblock());
+	TEST_ASSERT_EQUAL(0, superblock.clean);
+	TEST_ASSERT_EQUAL(0, data_block_alloc(&block));
+	TEST_ASSERT_EQUAL(0, ialloc(&inod));
+	num_free_blocks = superblock.num_free_blocks;
+	num_free_inodes = superblock.num_free_inodes;
+	cached_block.data_block_id = superblock.free_blocks_cache[superblock.num_cached_free_blocks - 1];
+
+	// The blocks reach the disk but not the superblock, as if the volume was not unmounted
+	TEST_ASSERT_EQUAL(0, sync_disk_emulator());
+	TEST_ASSERT_EQUAL(0, init_superblock());
+	TEST_ASSERT_EQUAL(num_free_blocks, superblock.num_free_blocks);
+	TEST_ASSERT_EQUAL(num_free_inodes, superblock.num_free_inodes);
+	TEST_ASSERT_EQUAL(0, superblock.num_cached_free_blocks);
+	TEST_ASSERT_EQUAL(1, is_data_block_used(block.data_block_id));
+	TEST_ASSERT_EQUAL(0, is_data_block_used(cached_block.data_block_id)); // Not lost with the cache
+
+	// After a clean unmount the cache is used again
+	TEST_ASSERT_EQUAL(0, data_block_alloc(&block));
+	num_free_blocks = superblock.num_free_blocks;
+	num_cached_free_blocks = superblock.num_cached_free_blocks;
+	cached_block.data_block_id = superblock.free_blocks_cache[num_cached_free_blocks - 1];
+	TEST_ASSERT_EQUAL(0, unmount_superblock());
+	TEST_ASSERT_EQUAL(0, init_superblock());
+	TEST_ASSERT_EQUAL(num_free_blocks, superblock.num_free_blocks);
+	TEST_ASSERT_EQUAL(num_cached_free_blocks, superblock.num_cached_free_blocks);
+	TEST_ASSERT_EQUAL(0, is_data_block_used(cached_block.data_block_id));
+	TEST_ASSERT_EQUAL(1, is_data_block_used(block.data_block_id));
+	TEST_ASSERT_EQUAL(0, data_block_alloc(&block));
+	TEST_ASSERT_EQUAL(cached_block.data_block_id, block.data_block_id);
+}
+
+TEST(TestCommon, init_superblock__only_mounts_a_volume_formatted_by_mkfs) {
+	struct superblock formatted;
+	struct data_block block;
+
+	// The file system is reused as is from one mount to the next
+	TEST_ASSERT_EQUAL(0, unmount_superblock());
+	memcpy(&formatted, &superblock, sizeof(struct superblock));
+	TEST_ASSERT_EQUAL(0, init_superblock());
+	TEST_ASSERT_EQUAL(FSTR_MAGIC, superblock.magic);
+	TEST_ASSERT_EQUAL(formatted.num_free_blocks, superblock.num_free_blocks);
+
+	memset(block.block, 0, BLOCK_SIZE);
+	TEST_ASSERT_EQUAL(0, write_block(0, block.block, BLOCK_SIZE));
+	TEST_ASSERT_EQUAL(-1, init_superblock());
+
+	formatted.version = FSTR_VERSION + 1;
+	TEST_ASSERT_EQUAL(0, write_block(0, &formatted, sizeof(struct superblock)));
+	TEST_ASSERT_EQUAL(-1, init_superblock());
+	TEST_ASSERT_NOT_NULL(check_superblock(&formatted));
+
+	formatted.version = FSTR_VERSION;
+	formatted.fs_size = FS_SIZE / 2;
+	TEST_ASSERT_NOT_NULL(check_superblock(&formatted));
+}
+
 TEST(TestCommon, write_block_offset) {
 	big_int block_id = 5;
 
@@ -7,18 +7,20 @@
 #include "common.h"
 #include "disk_emulator.h"
 #include "data_blocks_handler.h"
+#include "mkfs.h"
+#include "disk_backend.h"
 
 
 TEST_GROUP_RUNNER(TestDataBlocksHandler) {
 	RUN_TEST_CASE(TestDataBlocksHandler, get_block_number_of_first_datablock);
-	RUN_TEST_CASE(TestDataBlocksHandler, get_ith_block_number_in_datablock__returns_ID_of_datablock_placed_in_ith_position_in_datablock);
-	RUN_TEST_CASE(TestDataBlocksHandler, set_ith_block_number_in_datablock__sets_datablock_ID_at_ith_position_in_datablock);
-	RUN_TEST_CASE(TestDataBlocksHandler, has_at_least_one_datablock_number_left_without_pointer__returns_0_if_there_is_only_pointer_to_next_datablock_or_no_pointer_at_all);
-	RUN_TEST_CASE(TestDataBlocksHandler, get_first_free_datablock_starting_from_end_of_block_and_set_0);
 	RUN_TEST_CASE(TestDataBlocksHandler, data_block_alloc__allocates_correctly_a_datablock);
-	RUN_TEST_CASE(TestDataBlocksHandler, is_datablock_full_of_free_datablock_numbers);
-	RUN_TEST_CASE(TestDataBlocksHandler, get_ith_position_of_free_spot_in_free_datablock_number_list_for_new_free_datablock);
 	RUN_TEST_CASE(TestDataBlocksHandler, data_block_free);
+	RUN_TEST_CASE(TestDataBlocksHandler, data_block_free__rejects_metadata_and_free_blocks);
+	RUN_TEST_CASE(TestDataBlocksHandler, data_block_alloc_run__allocates_contiguous_blocks_near_the_goal);
+	RUN_TEST_CASE(TestDataBlocksHandler, data_block_alloc_n_and_data_block_free_n);
+	RUN_TEST_CASE(TestDataBlocksHandler, data_block_alloc_run__stays_in_the_block_group_of_the_goal);
+	RUN_TEST_CASE(TestDataBlocksHandler, data_block_free_n__freed_blocks_read_as_0s_after_a_remount);
+	RUN_TEST_CASE(TestDataBlocksHandler, trim_free_blocks__discards_the_blocks_freed_since_the_last_trim);
 	RUN_TEST_CASE(TestDataBlocksHandler, bread);
 	RUN_TEST_CASE(TestDataBlocksHandler, bwrite);
 }
@@ -40,374 +42,353 @@ TEST_TEAR_DOWN(TestDataBlocksHandler) {
 
 TEST(TestDataBlocksHandler, get_block_number_of_first_datablock) {
 	// BLOCK_SIZE = 4096
-	// NUM_INODES = 820
-	// INODE_SIZE = 256
+	// NUM_INODE_BLOCKS blocks of inodes, NUM_BITMAP_BLOCKS blocks of bitmap then NUM_INODE_BITMAP_BLOCKS blocks of inode bitmap
 
-	TEST_ASSERT_EQUAL(NUM_INODE_BLOCKS + 1, get_block_number_of_first_datablock());
+	TEST_ASSERT_EQUAL(1 + NUM_INODE_BLOCKS + NUM_BITMAP_BLOCKS + NUM_INODE_BITMAP_BLOCKS, get_block_number_of_first_datablock());
 }
 
-TEST(TestDataBlocksHandler, get_ith_block_number_in_datablock__returns_ID_of_datablock_placed_in_ith_position_in_datablock) {
-	char datablock[BLOCK_SIZE];
+// Returns the bit of block_id in the bitmap stored on disk
+static int read_bitmap_bit(big_int block_id) {
+	uint64_t words[BLOCK_SIZE / sizeof(uint64_t)];
+	big_int word = block_id / 64;
 
-	bzero(datablock, BLOCK_SIZE); // Write zeros everywhere in block as it should be when block is empty
-
-	big_int block_number_1_to_be_copied = 1039;
-	big_int block_number_2_to_be_copied = 23567;
-	big_int block_number_3_to_be_copied = 2;
-
-	memcpy(&datablock[0], &block_number_1_to_be_copied, sizeof(big_int));
-	memcpy(&datablock[8], &block_number_2_to_be_copied, sizeof(big_int));
-	memcpy(&datablock[16], &block_number_3_to_be_copied, sizeof(big_int));
-
-	TEST_ASSERT_EQUAL(block_number_1_to_be_copied, get_ith_block_number_in_datablock(datablock, 1));
-	TEST_ASSERT_EQUAL(block_number_2_to_be_copied, get_ith_block_number_in_datablock(datablock, 2));
-	TEST_ASSERT_EQUAL(block_number_3_to_be_copied, get_ith_block_number_in_datablock(datablock, 3));
-}
-
-TEST(TestDataBlocksHandler, set_ith_block_number_in_datablock__sets_datablock_ID_at_ith_position_in_datablock) {
-	char datablock[BLOCK_SIZE];
-
-	bzero(datablock, BLOCK_SIZE); // Write zeros everywhere in block as it should be when block is empty
-
-	big_int block_number_1_to_be_copied = 1039;
-	big_int block_number_2_to_be_copied = 23567;
-	big_int block_number_3_to_be_copied = 2;
-
-	set_ith_block_number_in_datablock(datablock, 1, block_number_1_to_be_copied);
-	set_ith_block_number_in_datablock(datablock, 2, block_number_2_to_be_copied);
-	set_ith_block_number_in_datablock(datablock, 3, block_number_3_to_be_copied);
-
-	TEST_ASSERT_EQUAL(block_number_1_to_be_copied, get_ith_block_number_in_datablock(datablock, 1));
-	TEST_ASSERT_EQUAL(block_number_2_to_be_copied, get_ith_block_number_in_datablock(datablock, 2));
-	TEST_ASSERT_EQUAL(block_number_3_to_be_copied, get_ith_block_number_in_datablock(datablock, 3));
-}
-
-TEST(TestDataBlocksHandler, has_at_least_one_datablock_number_left_without_pointer__returns_0_if_there_is_only_pointer_to_next_datablock_or_no_pointer_at_all) {
-	char datablock[BLOCK_SIZE];
-
-	bzero(datablock, BLOCK_SIZE); // Write zeros everywhere in block as it should be when block is empty
-
-	big_int pointer_to_next_datablock_containing_IDs_of_free_datablocks = 1039;
-	big_int block_number_1 = 23567;
-
-	set_ith_block_number_in_datablock(datablock, 1, pointer_to_next_datablock_containing_IDs_of_free_datablocks);
-
-	TEST_ASSERT_EQUAL(0, has_at_least_one_datablock_number_left_without_pointer(datablock));
-
-	set_ith_block_number_in_datablock(datablock, 2, block_number_1);
-	TEST_ASSERT_EQUAL(1, has_at_least_one_datablock_number_left_without_pointer(datablock));
-
-	bzero(datablock, BLOCK_SIZE);
-	set_ith_block_number_in_datablock(datablock, 145, block_number_1);
-	TEST_ASSERT_EQUAL(1, has_at_least_one_datablock_number_left_without_pointer(datablock));
-}
-
-TEST(TestDataBlocksHandler, get_first_free_datablock_starting_from_end_of_block_and_set_0) {
-	char datablock[BLOCK_SIZE];
-
-	bzero(datablock, BLOCK_SIZE); // Write zeros everywhere in block as it should be when block is empty
-
-	// No free block available
-	TEST_ASSERT_EQUAL(0, get_first_free_datablock_starting_from_end_of_block_and_set_0(datablock));
-
-	// No free block available because 1st block number is pointer to next datablock so cannot be used
-	set_ith_block_number_in_datablock(datablock, 1, 5678);
-	TEST_ASSERT_EQUAL(0, get_first_free_datablock_starting_from_end_of_block_and_set_0(datablock));
-
-	int block_number;
-	for (block_number = 2; block_number <= 143; block_number++) {
-		set_ith_block_number_in_datablock(datablock, block_number, (big_int)(block_number+13));
-	}
-
-	TEST_ASSERT_EQUAL(156, get_first_free_datablock_starting_from_end_of_block_and_set_0(datablock));
-
-	TEST_ASSERT_EQUAL(0, get_ith_block_number_in_datablock(datablock, 143));
-	TEST_ASSERT_EQUAL(155, get_ith_block_number_in_datablock(datablock, 142));
-	TEST_ASSERT_EQUAL(0, get_ith_block_number_in_datablock(datablock, 144));
+	read_block(BITMAP_BEGIN + word / (BLOCK_SIZE / sizeof(uint64_t)), words);
+	return (words[word % (BLOCK_SIZE / sizeof(uint64_t))] >> (block_id % 64)) & 1;
 }
 
-
 TEST(TestDataBlocksHandler, data_block_alloc__allocates_correctly_a_datablock) {
-	int first_datablock_position;
-	big_int first_free_datablock_number, second_free_datablock_number, pointer_next_free_datablock_list;
-	big_int first_free_datablock_number_in_second_list;
-	char datablock_buffer[BLOCK_SIZE];
-	char datablock_buffer2[BLOCK_SIZE];
+	big_int first_datablock_position, num_free_blocks;
 	char free_block_buffer[BLOCK_SIZE];
-
 	struct data_block result_datablock;
 
 	// BEGINNING OF SETUP for the test
 	init_disk_emulator();
-
-	superblock.num_free_blocks = 560;
+	create_fs(); // The root directory uses the first data block
 
 	first_datablock_position = get_block_number_of_first_datablock();
+	num_free_blocks = superblock.num_free_blocks;
 
-	pointer_next_free_datablock_list = first_datablock_position + 7; // These are random but they have to be after 1st datablock
-	first_free_datablock_number = first_datablock_position + 4; 
-	second_free_datablock_number = first_datablock_position + 2;
-
-	memset(datablock_buffer, 0, BLOCK_SIZE); // Set 0s to the datablock before setting datablock numbers
-
-	// We set here the IDs of the free datablocks in the superblock free datablock list
-	// Set pointer to next block
-	set_ith_block_number_in_datablock(datablock_buffer, 1, pointer_next_free_datablock_list);
-
-	// Set 1st free datablock number
-	set_ith_block_number_in_datablock(datablock_buffer, 3, first_free_datablock_number);
-	set_ith_block_number_in_datablock(datablock_buffer, 2, second_free_datablock_number);
-
-	// We write to disk the datablock containing the list of free datablocks
-	write_block(first_datablock_position, datablock_buffer, BLOCK_SIZE);
-
-	// We write the IDs of the free datablocks in the datablock that is pointed by the 1st (superblock free datablock list) datablock
-	memset(datablock_buffer2, 0, BLOCK_SIZE); // Set 0s to the datablock before setting datablock numbers
-	first_free_datablock_number_in_second_list = first_datablock_position + 11;
-	set_ith_block_number_in_datablock(datablock_buffer2, 1, 0); // We say that there's no pointer to a 3rd datablock.
-	set_ith_block_number_in_datablock(datablock_buffer2, BLOCK_ID_LIST_LENGTH, first_free_datablock_number_in_second_list);
-
-	// We write to disk the datablock containing the 2nd list of free datablocks
-	write_block(pointer_next_free_datablock_list, datablock_buffer2, BLOCK_SIZE);
-
-	// We write a bunch of random stuff in the blocks that are supposed to be free to see if the data will be cleared
+	// We write a bunch of random stuff in the blocks that are supposed to be free, only the returned buffer is cleared
 	strcpy(free_block_buffer, "Hey bro! How is it going?");
-	write_block(first_free_datablock_number, free_block_buffer, BLOCK_SIZE);
-	write_block(second_free_datablock_number, free_block_buffer, BLOCK_SIZE);
-	write_block(first_free_datablock_number_in_second_list, free_block_buffer, BLOCK_SIZE);
+	write_block(first_datablock_position + 1, free_block_buffer, BLOCK_SIZE);
+	write_block(first_datablock_position + 2, free_block_buffer, BLOCK_SIZE);
 
 	// END OF SETUP
 
-	TEST_ASSERT_EQUAL(560, superblock.num_free_blocks);
-
-	// We assert that we get the right free datablock numbers during the allocation
-	data_block_alloc(&result_datablock);
-	TEST_ASSERT_EQUAL(first_free_datablock_number, result_datablock.data_block_id);
-	read_block(first_free_datablock_number, free_block_buffer); // We want to check whether the block got cleared on disk
-	TEST_ASSERT_EQUAL(0, free_block_buffer[0]); // Assert that block got cleared
-	TEST_ASSERT_EQUAL(0, free_block_buffer[1]);
-	TEST_ASSERT_EQUAL(559, superblock.num_free_blocks);
-
-	data_block_alloc(&result_datablock);
-	TEST_ASSERT_EQUAL(second_free_datablock_number, result_datablock.data_block_id);
-	read_block(second_free_datablock_number, free_block_buffer); // We want to check whether the block got cleared on disk
-	TEST_ASSERT_EQUAL(0, free_block_buffer[0]); // Assert that block got cleared
+	TEST_ASSERT_EQUAL(1, is_data_block_used(first_datablock_position));
+	TEST_ASSERT_EQUAL(1, is_data_block_used(first_datablock_position - 1)); // The bitmap itself
+
+	// Free blocks are handed out in order and marked used in the bitmap on disk, without writing the blocks
+	TEST_ASSERT_EQUAL(0, data_block_alloc(&result_datablock));
+	TEST_ASSERT_EQUAL(first_datablock_position + 1, result_datablock.data_block_id);
+	TEST_ASSERT_EQUAL(0, result_datablock.block[0]); // Assert that the buffer got cleared
+	read_block(first_datablock_position + 1, free_block_buffer); // The block is left as is on disk until it is written
+	TEST_ASSERT_EQUAL('H', free_block_buffer[0]);
+	TEST_ASSERT_EQUAL(0, bwrite(&result_datablock));
+	read_block(first_datablock_position + 1, free_block_buffer);
+	TEST_ASSERT_EQUAL(0, free_block_buffer[0]);
 	TEST_ASSERT_EQUAL(0, free_block_buffer[1]);
-	TEST_ASSERT_EQUAL(558, superblock.num_free_blocks);
-
-	// Now that should be the block that was containing the 2nd part of the list of free datablock IDS that should be given back
-	data_block_alloc(&result_datablock);
-	TEST_ASSERT_EQUAL_MESSAGE(pointer_next_free_datablock_list, result_datablock.data_block_id, "WASFD");
-	read_block(pointer_next_free_datablock_list, free_block_buffer); // We want to check whether the block got cleared on disk
-	TEST_ASSERT_EQUAL(0, free_block_buffer[0]); // Assert that block got cleared
-	TEST_ASSERT_EQUAL(0, free_block_buffer[1]);
-	TEST_ASSERT_EQUAL(558, superblock.num_free_blocks); // We don't decrease the value because it was a block containing numbers
-
-	data_block_alloc(&result_datablock);
-	TEST_ASSERT_EQUAL(first_free_datablock_number_in_second_list, result_datablock.data_block_id);
-	read_block(first_free_datablock_number_in_second_list, free_block_buffer); // We want to check whether the block got cleared on disk
-	TEST_ASSERT_EQUAL(0, free_block_buffer[0]); // Assert that block got cleared
-	TEST_ASSERT_EQUAL(0, free_block_buffer[1]);
-	TEST_ASSERT_EQUAL(557, superblock.num_free_blocks);
-
-	// At this point we have no more free block numbers stored so we should get -1
-	TEST_ASSERT_EQUAL(-1, data_block_alloc(&result_datablock));
-	TEST_ASSERT_EQUAL(557, superblock.num_free_blocks);
+	TEST_ASSERT_EQUAL(num_free_blocks - 1, superblock.num_free_blocks);
+	TEST_ASSERT_EQUAL(1, is_data_block_used(first_datablock_position + 1));
+	TEST_ASSERT_EQUAL(1, read_bitmap_bit(first_datablock_position + 1));
+
+	TEST_ASSERT_EQUAL(0, data_block_alloc(&result_datablock));
+	TEST_ASSERT_EQUAL(first_datablock_position + 2, result_datablock.data_block_id);
+	TEST_ASSERT_EQUAL(0, result_datablock.block[0]);
+	TEST_ASSERT_EQUAL(num_free_blocks - 2, superblock.num_free_blocks);
+	TEST_ASSERT_EQUAL(1, read_bitmap_bit(first_datablock_position + 2));
+
+	// The bitmap and the free block cache are read back as they were left at the checkpoint
+	TEST_ASSERT_EQUAL(0, commit_superblock());
+	TEST_ASSERT_EQUAL(0, init_superblock());
+	TEST_ASSERT_EQUAL(num_free_blocks - 2, superblock.num_free_blocks);
+	TEST_ASSERT_EQUAL(1, is_data_block_used(first_datablock_position + 2));
+	TEST_ASSERT_EQUAL(0, is_data_block_used(first_datablock_position + 3));
 
 	free_disk_emulator();
 }
 
-TEST(TestDataBlocksHandler, is_datablock_full_of_free_datablock_numbers) {
-	char full_datablock[BLOCK_SIZE], almost_full_datablock[BLOCK_SIZE], empty_datablock[BLOCK_SIZE];
+TEST(TestDataBlocksHandler, data_block_free) {
 	int i;
+	big_int num_free_blocks;
+	char read_buffer[BLOCK_SIZE];
+	struct data_block datablock_1, datablock_2, datablock_3;
 
-	// We set all the datablocks with 0s initially
-	memset(full_datablock, 0, BLOCK_SIZE);
-	memset(almost_full_datablock, 0, BLOCK_SIZE);
-	memset(empty_datablock, 0, BLOCK_SIZE);
-	
-	// We make one datablock completely full
-	for (i = 1; (i * sizeof(big_int)) <= BLOCK_SIZE; i++) {
-		set_ith_block_number_in_datablock(full_datablock, i, 122); // 122 is a block number. We don't care what it is
-	}
-
-	// We make one datablock almost completely full (last spot is empty)
-	for (i = 1; (i * sizeof(big_int)) <= (BLOCK_SIZE - sizeof(big_int)); i++) {
-		set_ith_block_number_in_datablock(almost_full_datablock, i, 122); // 122 is a block number. We don't care what it is
-	}
+	// BEGINNING OF SETUP for the test
+	init_disk_emulator();
+	create_fs();
 
-	TEST_ASSERT_EQUAL(1, is_datablock_full_of_free_datablock_numbers(full_datablock));
-	TEST_ASSERT_EQUAL(0, is_datablock_full_of_free_datablock_numbers(almost_full_datablock));
-	TEST_ASSERT_EQUAL(0, is_datablock_full_of_free_datablock_numbers(empty_datablock));
+	data_block_alloc(&datablock_1);
+	data_block_alloc(&datablock_2);
+	num_free_blocks = superblock.num_free_blocks;
 
-	// We put one datablock number lost at the end of the block
-	set_ith_block_number_in_datablock(full_datablock, BLOCK_ID_LIST_LENGTH, 122);
-	TEST_ASSERT_EQUAL(0, is_datablock_full_of_free_datablock_numbers(empty_datablock));	
-}
+	// END OF SETUP
 
-TEST(TestDataBlocksHandler, get_ith_position_of_free_spot_in_free_datablock_number_list_for_new_free_datablock) {
-	char full_datablock[BLOCK_SIZE], almost_full_datablock[BLOCK_SIZE], 
-		free_spots_datablock[BLOCK_SIZE], empty_datablock[BLOCK_SIZE];
-	int i, last_ith_filled, last_block_rank_position;
+	memset(datablock_1.block, 1, BLOCK_SIZE); // Put random content in datablock to be freed
+	bwrite(&datablock_1);
 
-	// We set all the datablocks with 0s initially
-	memset(full_datablock, 0, BLOCK_SIZE);
-	memset(almost_full_datablock, 0, BLOCK_SIZE);
-	memset(free_spots_datablock, 0, BLOCK_SIZE);
-	memset(empty_datablock, 0, BLOCK_SIZE);
+	TEST_ASSERT_EQUAL(0, data_block_free(&datablock_1));
+	TEST_ASSERT_EQUAL(num_free_blocks + 1, superblock.num_free_blocks);
+	TEST_ASSERT_EQUAL(0, is_data_block_used(datablock_1.data_block_id));
+	TEST_ASSERT_EQUAL(0, read_bitmap_bit(datablock_1.data_block_id)); // Cached, but free on disk
+	TEST_ASSERT_EQUAL(1, is_data_block_used(datablock_2.data_block_id));
 
-	// We make one datablock completely full
-	for (i = 1; (i * sizeof(big_int)) <= BLOCK_SIZE; i++) {
-		set_ith_block_number_in_datablock(full_datablock, i, 122); // 122 is a block number. We don't care what it is
+	// We make sure the datablock that was freed has only 0s in its content
+	read_block(datablock_1.data_block_id, read_buffer);
+	for (i = 0; i < BLOCK_SIZE; i++) {
+		TEST_ASSERT_EQUAL(0, (int)read_buffer[i]);
 	}
 
-	// We make one datablock almost completely full (last spot is empty)
-	last_block_rank_position = 512; // 4096/8 = BLOCK_SIZE / sizeof(big_int)
-	for (i = 1; (i * sizeof(big_int)) <= (BLOCK_SIZE - sizeof(big_int)); i++) {
-		set_ith_block_number_in_datablock(almost_full_datablock, i, 122); // 122 is a block number. We don't care what it is
-	}
+	// The last freed block is the first reused
+	TEST_ASSERT_EQUAL(0, data_block_alloc(&datablock_3));
+	TEST_ASSERT_EQUAL(datablock_1.data_block_id, datablock_3.data_block_id);
+	TEST_ASSERT_EQUAL(num_free_blocks, superblock.num_free_blocks);
 
-	// We make one datablock half filled up to a certain position
-	last_ith_filled = 120;
+	free_disk_emulator();
+}
 
-	for (i = 1; (i * sizeof(big_int)) <= (last_ith_filled * sizeof(big_int)); i++) {
-		set_ith_block_number_in_datablock(free_spots_datablock, i, 122); // 122 is a block number. We don't care what it is
-	}
+TEST(TestDataBlocksHandler, data_block_free__rejects_metadata_and_free_blocks) {
+	struct data_block datablock;
+	big_int num_free_blocks, block_ids[2];
+	char superblock_buffer[BLOCK_SIZE], read_buffer[BLOCK_SIZE];
 
-	TEST_ASSERT_EQUAL(-1, get_ith_position_of_free_spot_in_free_datablock_number_list_for_new_free_datablock(full_datablock));
-	TEST_ASSERT_EQUAL(last_block_rank_position, get_ith_position_of_free_spot_in_free_datablock_number_list_for_new_free_datablock(almost_full_datablock));
-	TEST_ASSERT_EQUAL((last_ith_filled + 1), get_ith_position_of_free_spot_in_free_datablock_number_list_for_new_free_datablock(free_spots_datablock));
-	TEST_ASSERT_EQUAL(2, get_ith_position_of_free_spot_in_free_datablock_number_list_for_new_free_datablock(empty_datablock));
+	init_disk_emulator();
+	create_fs();
+	num_free_blocks = superblock.num_free_blocks;
+	read_block(0, superblock_buffer);
+
+	// The superblock, inodes and bitmap are never freed nor cleared
+	datablock.data_block_id = 0;
+	TEST_ASSERT_EQUAL(-1, data_block_free(&datablock));
+	datablock.data_block_id = BITMAP_BEGIN;
+	TEST_ASSERT_EQUAL(-1, data_block_free(&datablock));
+	read_block(0, read_buffer);
+	TEST_ASSERT_EQUAL(0, memcmp(superblock_buffer, read_buffer, BLOCK_SIZE));
+	TEST_ASSERT_EQUAL(1, is_data_block_used(BITMAP_BEGIN));
+
+	// A block can't be freed twice
+	data_block_alloc(&datablock);
+	block_ids[0] = block_ids[1] = datablock.data_block_id;
+	TEST_ASSERT_EQUAL(-1, data_block_free_n(block_ids, 2));
+	TEST_ASSERT_EQUAL(num_free_blocks - 1, superblock.num_free_blocks); // Nothing was freed
+	TEST_ASSERT_EQUAL(1, is_data_block_used(datablock.data_block_id));
+	TEST_ASSERT_EQUAL(0, data_block_free(&datablock));
+	TEST_ASSERT_EQUAL(-1, data_block_free(&datablock));
+	TEST_ASSERT_EQUAL(num_free_blocks, superblock.num_free_blocks);
+
+	// A batch holding a free block leaves the blocks in use untouched, their content included
+	data_block_alloc(&datablock);
+	memset(datablock.block, 'a', BLOCK_SIZE);
+	bwrite(&datablock);
+	block_ids[0] = datablock.data_block_id;
+	block_ids[1] = datablock.data_block_id + 1;
+	TEST_ASSERT_EQUAL(0, is_data_block_used(block_ids[1]));
+	TEST_ASSERT_EQUAL(-1, data_block_free_n(block_ids, 2));
+	TEST_ASSERT_EQUAL(1, is_data_block_used(datablock.data_block_id));
+	read_block(datablock.data_block_id, read_buffer);
+	TEST_ASSERT_EQUAL(0, memcmp(datablock.block, read_buffer, BLOCK_SIZE));
 
-	// We put a 0 in first datablock number position (position of pointer and see it doesn't affect results)
-	set_ith_block_number_in_datablock(free_spots_datablock, 1, 0);
-	TEST_ASSERT_EQUAL((last_ith_filled + 1), get_ith_position_of_free_spot_in_free_datablock_number_list_for_new_free_datablock(free_spots_datablock));
+	free_disk_emulator();
 }
 
-TEST(TestDataBlocksHandler, data_block_free) {
+TEST(TestDataBlocksHandler, data_block_alloc_run__allocates_contiguous_blocks_near_the_goal) {
+	big_int first, goal, num_free_blocks;
+	char buffer[BLOCK_SIZE];
 	int i;
-	int first_datablock_position, pointer_to_second_datablock, pointer_to_third_datablock;
-	char first_datablock[BLOCK_SIZE], second_datablock[BLOCK_SIZE];
-	char read_buffer[BLOCK_SIZE];
 
-	// BEGINNING OF SETUP for the test
 	init_disk_emulator();
-
-	superblock.num_free_blocks = 1057;
-
-
-	first_datablock_position = get_block_number_of_first_datablock();
-
-	pointer_to_second_datablock = 9001; // These are random but they have to be after 1st datablock
-
-	// We make the 1st datablock almost full in terms of datablock number (there's room just for a last datablock number)
-	memset(first_datablock, 0, BLOCK_SIZE); // Set 0s to the datablock before setting datablock numbers
-	for (i = 1; (i * sizeof(big_int)) <= (BLOCK_SIZE - sizeof(big_int)); i++) {
-		set_ith_block_number_in_datablock(first_datablock, i, i);
+	create_fs();
+	goal = get_block_number_of_first_datablock() + 1000;
+	num_free_blocks = superblock.num_free_blocks;
+
+	memset(buffer, 'x', BLOCK_SIZE);
+	write_block(goal + 5, buffer, BLOCK_SIZE);
+
+	// A free goal is used as is, the blocks are left as they are
+	TEST_ASSERT_EQUAL(100, data_block_alloc_run(goal, 100, &first));
+	TEST_ASSERT_EQUAL(goal, first);
+	TEST_ASSERT_EQUAL(num_free_blocks - 100, superblock.num_free_blocks);
+	for (i = 0; i < 100; i++) {
+		TEST_ASSERT_EQUAL(1, is_data_block_used(goal + i));
 	}
-	set_ith_block_number_in_datablock(first_datablock, 1, 9001); // Set pointer to second datablock
-
-	// We write to disk the datablock containing the list of free datablocks
-	write_block(first_datablock_position, first_datablock, BLOCK_SIZE);
-
-	pointer_to_third_datablock = 10053;
-	memset(second_datablock, 0, BLOCK_SIZE); // Set 0s to the datablock before setting datablock numbers
-	set_ith_block_number_in_datablock(second_datablock, 1, pointer_to_third_datablock); // Set pointer to third datablock (we won't create it)
-	set_ith_block_number_in_datablock(second_datablock, 2, 8567); // Set a random free datablock number in second datablock list
-
-	// We write to disk the datablock containing the list of free datablocks
-	write_block(pointer_to_second_datablock, second_datablock, BLOCK_SIZE);
-
-	// END OF SETUP
+	TEST_ASSERT_EQUAL(0, is_data_block_used(goal + 100));
+	read_block(goal + 5, buffer);
+	TEST_ASSERT_EQUAL('x', buffer[0]);
 
+	// A used goal is skipped, a hole too short for the run is skipped for a long enough run further
+	TEST_ASSERT_EQUAL(50, data_block_alloc_run(goal + 100, 50, &first));
+	TEST_ASSERT_EQUAL(49, data_block_alloc_run(goal + 151, 49, &first));
+	TEST_ASSERT_EQUAL(10, data_block_alloc_run(goal, 10, &first));
+	TEST_ASSERT_EQUAL(goal + 200, first);
 
-	// We free a datablock
-	struct data_block datablock_to_free_1;
-	datablock_to_free_1.data_block_id = 8046;
-	memset(datablock_to_free_1.block, 1, BLOCK_SIZE); // Put random content in datablock to be freed
+	// The hole is used when nothing better is requested
+	TEST_ASSERT_EQUAL(1, data_block_alloc_run(goal, 1, &first));
+	TEST_ASSERT_EQUAL(goal + 150, first);
 
-	TEST_ASSERT_EQUAL(0, data_block_free(&datablock_to_free_1));
-	TEST_ASSERT_EQUAL(1058, superblock.num_free_blocks);
+	TEST_ASSERT_EQUAL(-1, data_block_alloc_run(goal, 0, &first));
 
-	// Make sure 1st datablock contain right datablock numbers
-	read_block(first_datablock_position, read_buffer);
-	TEST_ASSERT_EQUAL(pointer_to_second_datablock, get_ith_block_number_in_datablock(read_buffer, 1));
-	TEST_ASSERT_EQUAL(2, get_ith_block_number_in_datablock(read_buffer, 2));
-	TEST_ASSERT_EQUAL(3, get_ith_block_number_in_datablock(read_buffer, 3));
-	TEST_ASSERT_EQUAL(8046, get_ith_block_number_in_datablock(read_buffer, BLOCK_SIZE/sizeof(big_int))); // 4096/8 = BLOCK_SIZE/sizeof(big_int) = last blocknumber
+	free_disk_emulator();
+}
 
-	// Make sure 2nd datablock contain the 2 right datablock numbers (pointer to 3rd datablock and another datablock number)
-	read_block(pointer_to_second_datablock, read_buffer);
-	TEST_ASSERT_EQUAL(pointer_to_third_datablock, get_ith_block_number_in_datablock(read_buffer, 1));
-	TEST_ASSERT_EQUAL(8567, get_ith_block_number_in_datablock(read_buffer, 2));
+TEST(TestDataBlocksHandler, data_block_alloc_n_and_data_block_free_n) {
+	big_int block_ids[200], num_free_blocks;
+	char buffer[BLOCK_SIZE];
+	int i, j;
 
-	// We make sure the datablock that was freed has only 0s in its content
-	read_block(8046, read_buffer);
-	for (i = 0; i < BLOCK_SIZE; i++) {
-		TEST_ASSERT_EQUAL(0, (int)read_buffer[i]);
+	init_disk_emulator();
+	create_fs();
+	num_free_blocks = superblock.num_free_blocks;
+
+	// More blocks than the cache holds, they come from the cache then from the bitmap
+	TEST_ASSERT_EQUAL(0, data_block_alloc_n(200, block_ids));
+	TEST_ASSERT_EQUAL(num_free_blocks - 200, superblock.num_free_blocks);
+	TEST_ASSERT_EQUAL(0, superblock.num_cached_free_blocks);
+	for (i = 0; i < 200; i++) {
+		TEST_ASSERT_EQUAL(1, is_data_block_used(block_ids[i]));
+		for (j = i + 1; j < 200; j++) {
+			TEST_ASSERT_TRUE(block_ids[i] != block_ids[j]);
+		}
 	}
 
+	memset(buffer, 'z', BLOCK_SIZE);
+	write_block(block_ids[150], buffer, BLOCK_SIZE);
 
+	// The cache is filled first, the other blocks are cleared in the bitmap
+	TEST_ASSERT_EQUAL(0, data_block_free_n(block_ids, 200));
+	TEST_ASSERT_EQUAL(num_free_blocks, superblock.num_free_blocks);
+	TEST_ASSERT_EQUAL(FREE_BLOCKS_CACHE_SIZE, superblock.num_cached_free_blocks);
+	for (i = 0; i < 200; i++) {
+		TEST_ASSERT_EQUAL(0, is_data_block_used(block_ids[i]));
+		TEST_ASSERT_EQUAL(0, read_bitmap_bit(block_ids[i])); // The cached blocks too
+	}
+	read_block(block_ids[150], buffer);
+	TEST_ASSERT_EQUAL(0, buffer[0]);
 
-	// We free another datablock
-	struct data_block datablock_to_free_2;
-	datablock_to_free_2.data_block_id = 8053;
-	memset(datablock_to_free_1.block, 1, BLOCK_SIZE); // Put random content in datablock to be freed
-
-	// We free a datablock
-	TEST_ASSERT_EQUAL(0, data_block_free(&datablock_to_free_2));
-	TEST_ASSERT_EQUAL(1059, superblock.num_free_blocks);
-
-	// Make sure 1st datablock contain only a pointer to the newly freed datablock and the pointed datablock contain what was in the 1st datablock
-	read_block(first_datablock_position, read_buffer);
-	TEST_ASSERT_EQUAL(8053, get_ith_block_number_in_datablock(read_buffer, 1));
-	TEST_ASSERT_EQUAL(0, get_ith_block_number_in_datablock(read_buffer, 2));
-	TEST_ASSERT_EQUAL(0, get_ith_block_number_in_datablock(read_buffer, 3));
-	TEST_ASSERT_EQUAL(0, get_ith_block_number_in_datablock(read_buffer, BLOCK_SIZE/sizeof(big_int)));
+	free_disk_emulator();
+}
 
-	// Make sure the newly freed datablock contains datablock list that was contained in the 1st datablock before we freed the new datablock
-	read_block(8053, read_buffer);
-	TEST_ASSERT_EQUAL(pointer_to_second_datablock, get_ith_block_number_in_datablock(read_buffer, 1));
-	TEST_ASSERT_EQUAL(2, get_ith_block_number_in_datablock(read_buffer, 2));
-	TEST_ASSERT_EQUAL(3, get_ith_block_number_in_datablock(read_buffer, 3));
-	TEST_ASSERT_EQUAL(8046, get_ith_block_number_in_datablock(read_buffer, BLOCK_SIZE/sizeof(big_int)));
+TEST(TestDataBlocksHandler, data_block_alloc_run__stays_in_the_block_group_of_the_goal) {
+	big_int block_ids[FREE_BLOCKS_CACHE_SIZE], first, goal, group, group_free_blocks;
+	int i;
 
-	// Make sure 3rd datablock contain the remaining datablock numbers
-	read_block(pointer_to_second_datablock, read_buffer);
-	TEST_ASSERT_EQUAL(pointer_to_third_datablock, get_ith_block_number_in_datablock(read_buffer, 1));
-	TEST_ASSERT_EQUAL(8567, get_ith_block_number_in_datablock(read_buffer, 2));
+	init_disk_emulator();
+	create_fs();
+	group = NUM_BLOCK_GROUPS - 1;
+	goal = get_group_goal(group);
+	group_free_blocks = get_group_free_blocks(group);
+
+	TEST_ASSERT_EQUAL(group * BLOCKS_PER_GROUP, goal);
+	TEST_ASSERT_EQUAL(get_block_number_of_first_datablock(), get_group_goal(0));
+	TEST_ASSERT_EQUAL(0, get_group_goal(NUM_BLOCK_GROUPS));
+
+	TEST_ASSERT_EQUAL(10, data_block_alloc_run(goal, 10, &first));
+	TEST_ASSERT_EQUAL(goal, first);
+	TEST_ASSERT_EQUAL(group, get_block_group(first));
+	TEST_ASSERT_EQUAL(group_free_blocks - 10, get_group_free_blocks(group));
+
+	// A run doesn't span two groups
+	goal = get_group_goal(group - 1) + BLOCKS_PER_GROUP - 4;
+	TEST_ASSERT_EQUAL(4, data_block_alloc_run(goal, 16, &first));
+	TEST_ASSERT_EQUAL(goal, first);
+
+	// The freed blocks go back to their group once the cache is full
+	TEST_ASSERT_EQUAL(FREE_BLOCKS_CACHE_SIZE, data_block_alloc_run(get_group_goal(1), FREE_BLOCKS_CACHE_SIZE, &first));
+	for (i = 0; i < FREE_BLOCKS_CACHE_SIZE; i++) {
+		block_ids[i] = first + i;
+	}
+	TEST_ASSERT_EQUAL(0, data_block_free_n(block_ids, FREE_BLOCKS_CACHE_SIZE - superblock.num_cached_free_blocks));
+	first = get_group_goal(group);
+	TEST_ASSERT_EQUAL(0, data_block_free_n(&first, 1));
+	TEST_ASSERT_EQUAL(group_free_blocks - 9, get_group_free_blocks(group));
 
+	free_disk_emulator();
+}
 
+TEST(TestDataBlocksHandler, data_block_free_n__freed_blocks_read_as_0s_after_a_remount) {
+	big_int first, goal, block_ids[4];
+	char buffer[BLOCK_SIZE];
+	int i;
 
-	// We free another datablock
-	struct data_block datablock_to_free_3;
-	datablock_to_free_3.data_block_id = 8078;
-	memset(datablock_to_free_3.block, 1, BLOCK_SIZE); // Put random content in datablock to be freed
+	init_disk_emulator();
+	create_fs();
+	goal = get_block_number_of_first_datablock() + 2000;
 
-	// We free a datablock
-	TEST_ASSERT_EQUAL(0, data_block_free(&datablock_to_free_3));
-	TEST_ASSERT_EQUAL(1060, superblock.num_free_blocks);
+	// Allocating the blocks leaves the disk alone, old content is only cleared when the blocks are freed
+	memset(buffer, 'g', BLOCK_SIZE);
+	for (i = 0; i < 4; i++) {
+		device_write_block(goal + i, buffer, BLOCK_SIZE);
+	}
+	TEST_ASSERT_EQUAL(4, data_block_alloc_run(goal, 4, &first));
+	TEST_ASSERT_EQUAL(goal, first);
+	TEST_ASSERT_EQUAL(0, device_is_unwritten(first));
+	TEST_ASSERT_EQUAL(0, device_read_block(first, buffer));
+	TEST_ASSERT_EQUAL('g', buffer[0]);
+
+	// The disk store is a file, holes are punched in the freed blocks right away
+	memset(buffer, 'k', BLOCK_SIZE);
+	TEST_ASSERT_EQUAL(0, write_block(first + 1, buffer, BLOCK_SIZE));
+	for (i = 0; i < 4; i++) {
+		block_ids[i] = first + i;
+	}
+	TEST_ASSERT_EQUAL(0, data_block_free_n(block_ids, 4));
+	TEST_ASSERT_EQUAL(1, device_is_unwritten(first));
+	TEST_ASSERT_EQUAL(1, device_is_unwritten(first + 3));
+	TEST_ASSERT_EQUAL(0, sync_disk_emulator());
+	free_disk_emulator(); // Unmounted without any scan of the unwritten blocks
 
-	// Make sure 1st datablock contain only a pointer to next datablock and the newly added free datablock
-	read_block(first_datablock_position, read_buffer);
-	TEST_ASSERT_EQUAL(8053, get_ith_block_number_in_datablock(read_buffer, 1));
-	TEST_ASSERT_EQUAL(8078, get_ith_block_number_in_datablock(read_buffer, 2));
-	TEST_ASSERT_EQUAL(0, get_ith_block_number_in_datablock(read_buffer, 3));
-	TEST_ASSERT_EQUAL(0, get_ith_block_number_in_datablock(read_buffer, BLOCK_SIZE/sizeof(big_int)));
+	init_disk_emulator();
+	TEST_ASSERT_EQUAL(0, device_read_block(first, buffer));
+	TEST_ASSERT_EQUAL(0, buffer[0]);
+	TEST_ASSERT_EQUAL(0, device_read_block(first + 1, buffer));
+	TEST_ASSERT_EQUAL(0, buffer[0]);
+	TEST_ASSERT_EQUAL(0, device_read_block(first + 3, buffer));
+	TEST_ASSERT_EQUAL(0, buffer[BLOCK_SIZE - 1]);
+	free_disk_emulator();
+}
 
-	// Make sure the newly freed datablock contains datablock list that was contained in the 1st datablock before we freed the new datablock
-	read_block(8053, read_buffer);
-	TEST_ASSERT_EQUAL(pointer_to_second_datablock, get_ith_block_number_in_datablock(read_buffer, 1));
-	TEST_ASSERT_EQUAL(2, get_ith_block_number_in_datablock(read_buffer, 2));
-	TEST_ASSERT_EQUAL(3, get_ith_block_number_in_datablock(read_buffer, 3));
-	TEST_ASSERT_EQUAL(8046, get_ith_block_number_in_datablock(read_buffer, BLOCK_SIZE/sizeof(big_int)));
+TEST(TestDataBlocksHandler, trim_free_blocks__discards_the_blocks_freed_since_the_last_trim) {
+	big_int first, used_blocks, block_ids[8];
+	char buffer[BLOCK_SIZE];
+	int i;
 
-	// Make sure 3rd datablock contain teh remaining datablock numbers
-	read_block(pointer_to_second_datablock, read_buffer);
-	TEST_ASSERT_EQUAL(pointer_to_third_datablock, get_ith_block_number_in_datablock(read_buffer, 1));
-	TEST_ASSERT_EQUAL(8567, get_ith_block_number_in_datablock(read_buffer, 2));
+	// The memory backend frees the discarded blocks
+	TEST_ASSERT_EQUAL(0, set_disk_backend("memory", NULL));
+	TEST_ASSERT_EQUAL(0, init_disk_emulator());
+	TEST_ASSERT_EQUAL(0, create_fs());
+	TEST_ASSERT_EQUAL(0, trim_free_blocks()); // Nothing was freed yet
+
+	memset(buffer, 't', BLOCK_SIZE);
+	TEST_ASSERT_EQUAL(8, data_block_alloc_run(get_block_number_of_first_datablock() + 3000, 8, &first));
+	for (i = 0; i < 8; i++) {
+		block_ids[i] = first + i;
+		TEST_ASSERT_EQUAL(0, write_block(first + i, buffer, BLOCK_SIZE));
+	}
+	used_blocks = get_memory_backend_used_blocks();
+
+	// Freed blocks read as 0s at once but stay on the disk until the trim
+	TEST_ASSERT_EQUAL(0, data_block_free_n(block_ids, 4));
+	TEST_ASSERT_EQUAL(0, read_block(first, buffer));
+	TEST_ASSERT_EQUAL(0, buffer[0]);
+	TEST_ASSERT_EQUAL(used_blocks, get_memory_backend_used_blocks());
+	TEST_ASSERT_TRUE(trim_free_blocks() >= 4);
+	TEST_ASSERT_EQUAL(used_blocks - 4, get_memory_backend_used_blocks());
+	TEST_ASSERT_EQUAL(0, trim_free_blocks());
+
+	// With immediate discard they are discarded when they are freed
+	set_immediate_discard(1);
+	TEST_ASSERT_EQUAL(0, data_block_free_n(block_ids + 4, 4));
+	set_immediate_discard(0);
+	TEST_ASSERT_EQUAL(used_blocks - 8, get_memory_backend_used_blocks());
+
+	// The memory backend can't punch, a discarded block may read as anything and reallocating it leaves it as is
+	TEST_ASSERT_EQUAL(1, data_block_alloc_run(first + 8, 1, &block_ids[0]));
+	TEST_ASSERT_EQUAL(0, device_is_unwritten(block_ids[0]));
+	TEST_ASSERT_EQUAL(0, data_block_free_n(block_ids, 1));
+	TEST_ASSERT_EQUAL(0, device_is_unwritten(block_ids[0]));
+	TEST_ASSERT_TRUE(trim_free_blocks() >= 1);
 
 	free_disk_emulator();
+	TEST_ASSERT_EQUAL(0, set_disk_backend("file", NULL));
 }
 
 TEST(TestDataBlocksHandler, bread) {
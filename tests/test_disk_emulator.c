@@ -1,8 +1,12 @@
+#include <pthread.h>
+
 #include "unity.h"
 #include "unity_fixture.h"
 
 #include "common.h"
 #include "disk_emulator.h"
+#include "buffer_cache.h"
+#include "disk_backend.h"
 
 
 TEST_GROUP_RUNNER(TestDiskEmulator) {
@@ -13,6 +17,13 @@ TEST_GROUP_RUNNER(TestDiskEmulator) {
   RUN_TEST_CASE(TestDiskEmulator, read_block__write_and_read_correctly_what_was_written);
   RUN_TEST_CASE(TestDiskEmulator, write_block__we_can_write_any_data_structure_to_disk_and_read_them_correctly);
   RUN_TEST_CASE(TestDiskEmulator, write_block__we_can_write_several_consecutive_data_structures_in_same_block_and_read_them_correctly);
+  RUN_TEST_CASE(TestDiskEmulator, write_block_batch__blocks_are_read_back_by_read_block_batch);
+  RUN_TEST_CASE(TestDiskEmulator, write_block_batch__batches_of_several_threads_are_read_back);
+  RUN_TEST_CASE(TestDiskEmulator, write_blocks__contiguous_blocks_are_read_back_by_read_blocks);
+  RUN_TEST_CASE(TestDiskEmulator, buffer_cache_zero_blocks__blocks_read_as_0s_until_written);
+  RUN_TEST_CASE(TestDiskEmulator, set_disk_backend__every_backend_reads_back_what_was_written);
+  RUN_TEST_CASE(TestDiskEmulator, mmap_backend__blocks_of_every_window_persist_across_mounts);
+  RUN_TEST_CASE(TestDiskEmulator, memory_backend__only_blocks_written_with_data_use_memory);
 }
 
 
@@ -230,3 +241,313 @@ TEST(TestDiskEmulator, write_block__we_can_write_several_consecutive_data_struct
 	free(read_buffer);
 	free_disk_emulator();
 }
+
+TEST(TestDiskEmulator, write_block_batch__blocks_are_read_back_by_read_block_batch) {
+	struct block_io ios[100];
+	char *blocks = malloc(100 * BLOCK_SIZE);
+	char read_buffer[BLOCK_SIZE];
+	int i;
+
+	init_disk_emulator();
+
+	// More blocks than the io_uring queue holds, spread over the disk
+	for (i = 0; i < 100; i++) {
+		memset(blocks + i * BLOCK_SIZE, 'a' + i % 26, BLOCK_SIZE);
+		ios[i].block_id = 1000 + i * 7;
+		ios[i].buffer = blocks + i * BLOCK_SIZE;
+	}
+	TEST_ASSERT_EQUAL(0, write_block_batch(ios, 100));
+
+	TEST_ASSERT_EQUAL(0, device_read_block(1000 + 99 * 7, read_buffer));
+	TEST_ASSERT_EQUAL(0, memcmp(blocks + 99 * BLOCK_SIZE, read_buffer, BLOCK_SIZE));
+
+	memset(blocks, 0, 100 * BLOCK_SIZE);
+	TEST_ASSERT_EQUAL(0, read_block_batch(ios, 100));
+	for (i = 0; i < 100; i++) {
+		TEST_ASSERT_EQUAL('a' + i % 26, blocks[i * BLOCK_SIZE]);
+		TEST_ASSERT_EQUAL('a' + i % 26, blocks[i * BLOCK_SIZE + BLOCK_SIZE - 1]);
+	}
+
+	ios[0].block_id = NUM_BLOCKS;
+	TEST_ASSERT_EQUAL(-1, read_block_batch(ios, 100)); // One of the blocks is outside the disk
+
+	free_disk_emulator();
+	free(blocks);
+}
+
+#define BATCH_THREADS 4
+
+// Writes then reads back 100 blocks of its own, the pattern is the index of the thread
+static void *rw_thread_batch(void *arg) {
+	long thread = (long) arg;
+	struct block_io ios[100];
+	char *blocks = malloc(100 * BLOCK_SIZE);
+	long failed = 0;
+	int i;
+
+	for (i = 0; i < 100; i++) {
+		memset(blocks + i * BLOCK_SIZE, 'a' + thread, BLOCK_SIZE);
+		ios[i].block_id = 2000 + i * BATCH_THREADS + thread;
+		ios[i].buffer = blocks + i * BLOCK_SIZE;
+	}
+	failed |= write_block_batch(ios, 100);
+
+	memset(blocks, 0, 100 * BLOCK_SIZE);
+	failed |= read_block_batch(ios, 100);
+	for (i = 0; i < 100; i++) {
+		failed |= blocks[i * BLOCK_SIZE] != 'a' + thread || blocks[i * BLOCK_SIZE + BLOCK_SIZE - 1] != 'a' + thread;
+	}
+	free(blocks);
+	return (void *) failed;
+}
+
+TEST(TestDiskEmulator, write_block_batch__batches_of_several_threads_are_read_back) {
+	pthread_t threads[BATCH_THREADS];
+	void *failed;
+	long i;
+
+	init_disk_emulator();
+
+	for (i = 0; i < BATCH_THREADS; i++) {
+		TEST_ASSERT_EQUAL(0, pthread_create(&threads[i], NULL, rw_thread_batch, (void *) i));
+	}
+	for (i = 0; i < BATCH_THREADS; i++) {
+		TEST_ASSERT_EQUAL(0, pthread_join(threads[i], &failed));
+		TEST_ASSERT_NULL(failed);
+	}
+
+	free_disk_emulator();
+}
+
+TEST(TestDiskEmulator, write_blocks__contiguous_blocks_are_read_back_by_read_blocks) {
+	struct iovec iov[10];
+	char blocks[10][BLOCK_SIZE];
+	char read_buffer[BLOCK_SIZE];
+	int i;
+
+	init_disk_emulator();
+
+	for (i = 0; i < 10; i++) {
+		memset(blocks[i], '0' + i, BLOCK_SIZE);
+		iov[i].iov_base = blocks[i];
+		iov[i].iov_len = BLOCK_SIZE;
+	}
+	TEST_ASSERT_EQUAL(0, write_blocks(500, 10, iov));
+	TEST_ASSERT_EQUAL(0, read_block(503, read_buffer));
+	TEST_ASSERT_EQUAL('3', read_buffer[BLOCK_SIZE - 1]);
+
+	// The cached copy of a block wins over what is on disk
+	set_buffer_cache_write_back(1);
+	memset(read_buffer, 'c', BLOCK_SIZE);
+	TEST_ASSERT_EQUAL(0, write_block(505, read_buffer, BLOCK_SIZE));
+
+	memset(blocks, 0, sizeof(blocks));
+	TEST_ASSERT_EQUAL(0, read_blocks(500, 10, iov));
+	set_buffer_cache_write_back(0);
+	TEST_ASSERT_EQUAL('0', blocks[0][0]);
+	TEST_ASSERT_EQUAL('4', blocks[4][0]);
+	TEST_ASSERT_EQUAL('c', blocks[5][0]);
+	TEST_ASSERT_EQUAL('9', blocks[9][BLOCK_SIZE - 1]);
+
+	TEST_ASSERT_EQUAL(-1, read_blocks(NUM_BLOCKS - 5, 10, iov)); // The run goes past the end of the disk
+	TEST_ASSERT_EQUAL(-1, write_blocks(-1, 10, iov));
+
+	free_disk_emulator();
+}
+
+TEST(TestDiskEmulator, buffer_cache_zero_blocks__blocks_read_as_0s_until_written) {
+	struct iovec iov[10];
+	struct block_io ios[2];
+	char blocks[10][BLOCK_SIZE];
+	char read_buffer[BLOCK_SIZE];
+	int i;
+
+	init_disk_emulator();
+
+	for (i = 0; i < 10; i++) {
+		memset(blocks[i], 'a' + i, BLOCK_SIZE);
+		iov[i].iov_base = blocks[i];
+		iov[i].iov_len = BLOCK_SIZE;
+	}
+	TEST_ASSERT_EQUAL(0, write_blocks(600, 10, iov));
+
+	// A dirty copy of a cleared block is never written back
+	set_buffer_cache_write_back(1);
+	memset(read_buffer, 'd', BLOCK_SIZE);
+	TEST_ASSERT_EQUAL(0, write_block(602, read_buffer, BLOCK_SIZE));
+	TEST_ASSERT_EQUAL(0, buffer_cache_zero_blocks(600, 5));
+	TEST_ASSERT_EQUAL(0, sync_disk_emulator());
+	TEST_ASSERT_EQUAL(1, device_is_unwritten(602));
+	TEST_ASSERT_EQUAL(0, device_is_unwritten(605));
+
+	memset(blocks, 'x', sizeof(blocks));
+	TEST_ASSERT_EQUAL(0, device_read_blocks(600, 10, iov));
+	TEST_ASSERT_EQUAL(0, blocks[0][0]);
+	TEST_ASSERT_EQUAL(0, blocks[2][BLOCK_SIZE - 1]);
+	TEST_ASSERT_EQUAL(0, blocks[4][0]);
+	TEST_ASSERT_EQUAL('f', blocks[5][0]);
+	TEST_ASSERT_EQUAL(0, read_block(602, read_buffer));
+	TEST_ASSERT_EQUAL(0, read_buffer[0]);
+
+	// Writing a block makes the disk serve it again
+	memset(read_buffer, 'w', BLOCK_SIZE);
+	TEST_ASSERT_EQUAL(0, write_block(601, read_buffer, BLOCK_SIZE));
+	TEST_ASSERT_EQUAL(0, sync_disk_emulator());
+	set_buffer_cache_write_back(0);
+	TEST_ASSERT_EQUAL(0, device_is_unwritten(601));
+	ios[0].block_id = 601;
+	ios[0].buffer = blocks[0];
+	ios[1].block_id = 603;
+	ios[1].buffer = blocks[1];
+	memset(blocks, 'x', sizeof(blocks));
+	TEST_ASSERT_EQUAL(0, device_read_block_batch(ios, 2));
+	TEST_ASSERT_EQUAL('w', blocks[0][0]);
+	TEST_ASSERT_EQUAL(0, blocks[1][0]);
+
+	// The disk holds the 0s, the marks are lost at unmount
+	free_disk_emulator();
+	init_disk_emulator();
+	TEST_ASSERT_EQUAL(0, device_is_unwritten(603));
+	memset(read_buffer, 'x', BLOCK_SIZE);
+	TEST_ASSERT_EQUAL(0, device_read_block(603, read_buffer));
+	TEST_ASSERT_EQUAL(0, read_buffer[0]);
+	TEST_ASSERT_EQUAL(0, device_read_block(605, read_buffer));
+	TEST_ASSERT_EQUAL('f', read_buffer[0]);
+
+	free_disk_emulator();
+}
+
+TEST(TestDiskEmulator, set_disk_backend__every_backend_reads_back_what_was_written) {
+	const char *names[] = { "memory", "mmap", "direct", "file" }; // The file backend is restored for the other tests
+	struct block_io ios[3];
+	struct iovec iov[3];
+	char blocks[3][BLOCK_SIZE];
+	char read_buffer[BLOCK_SIZE];
+	char misaligned_buffer[BLOCK_SIZE + 1];
+	int i, j;
+
+	TEST_ASSERT_EQUAL(-1, set_disk_backend("tape", NULL));
+
+	for (i = 0; i < 4; i++) {
+		TEST_ASSERT_EQUAL(0, set_disk_backend(names[i], NULL));
+		TEST_ASSERT_EQUAL_STRING(names[i], get_disk_backend_name());
+		TEST_ASSERT_EQUAL(0, init_disk_emulator());
+		TEST_ASSERT_EQUAL(-1, set_disk_backend("file", NULL)); // Cannot change the backend of a mounted disk
+
+		memset(read_buffer, 'x', BLOCK_SIZE);
+		TEST_ASSERT_EQUAL(0, write_block(42, read_buffer, 10));
+		memset(read_buffer, 0, BLOCK_SIZE);
+		TEST_ASSERT_EQUAL(0, device_read_block(42, read_buffer));
+		TEST_ASSERT_EQUAL('x', read_buffer[9]);
+		TEST_ASSERT_EQUAL(0, read_buffer[10]);
+		TEST_ASSERT_EQUAL(0, device_read_block(42, misaligned_buffer + 1)); // Misaligned for O_DIRECT
+		TEST_ASSERT_EQUAL('x', misaligned_buffer[10]);
+		TEST_ASSERT_EQUAL(0, misaligned_buffer[11]);
+
+		for (j = 0; j < 3; j++) {
+			memset(blocks[j], 'a' + i + j, BLOCK_SIZE);
+			ios[j].block_id = 700 + j * 3;
+			ios[j].buffer = blocks[j];
+			iov[j].iov_base = blocks[j];
+			iov[j].iov_len = BLOCK_SIZE;
+		}
+		TEST_ASSERT_EQUAL(0, write_block_batch(ios, 3));
+		TEST_ASSERT_EQUAL(0, write_blocks(800, 3, iov));
+		memset(blocks, 0, sizeof(blocks));
+		TEST_ASSERT_EQUAL(0, read_block_batch(ios, 3));
+		TEST_ASSERT_EQUAL('a' + i + 2, blocks[2][BLOCK_SIZE - 1]);
+		memset(blocks, 0, sizeof(blocks));
+		TEST_ASSERT_EQUAL(0, read_blocks(800, 3, iov));
+		TEST_ASSERT_EQUAL('a' + i + 1, blocks[1][0]);
+
+		TEST_ASSERT_EQUAL(0, sync_disk_emulator());
+		TEST_ASSERT_EQUAL(-1, device_discard(NUM_BLOCKS - 1, 2));
+		TEST_ASSERT_EQUAL(0, device_zero_out(800, 2));
+		TEST_ASSERT_EQUAL(-1, device_zero_out(NUM_BLOCKS - 1, 2));
+		free_disk_emulator();
+
+		// The blocks zeroed out read as 0s from the disk itself, with or without a zero_out in the backend
+		TEST_ASSERT_EQUAL(0, init_disk_emulator());
+		memset(read_buffer, 'x', BLOCK_SIZE);
+		TEST_ASSERT_EQUAL(0, device_read_block(801, read_buffer));
+		TEST_ASSERT_EQUAL(0, read_buffer[0]);
+		TEST_ASSERT_EQUAL(0, read_buffer[BLOCK_SIZE - 1]);
+		if (strcmp(names[i], "memory") != 0) {
+			TEST_ASSERT_EQUAL(0, device_read_block(802, read_buffer));
+			TEST_ASSERT_EQUAL('a' + i + 2, read_buffer[0]);
+		}
+		free_disk_emulator();
+	}
+}
+
+TEST(TestDiskEmulator, mmap_backend__blocks_of_every_window_persist_across_mounts) {
+	struct iovec iov[2];
+	char blocks[2][BLOCK_SIZE];
+	char read_buffer[BLOCK_SIZE];
+	big_int block_id;
+
+	TEST_ASSERT_EQUAL(0, set_disk_backend("mmap", NULL));
+	TEST_ASSERT_EQUAL(0, init_disk_emulator());
+
+	// A run crossing the boundary between two windows
+	memset(blocks[0], 'l', BLOCK_SIZE);
+	memset(blocks[1], 'r', BLOCK_SIZE);
+	iov[0].iov_base = blocks[0];
+	iov[1].iov_base = blocks[1];
+	iov[0].iov_len = iov[1].iov_len = BLOCK_SIZE;
+	TEST_ASSERT_EQUAL(0, device_write_blocks(MMAP_WINDOW_BLOCKS - 1, 2, iov));
+
+	// More windows than can stay mapped on a big enough disk
+	for (block_id = 2 * MMAP_WINDOW_BLOCKS + 5; block_id < NUM_BLOCKS; block_id += MMAP_WINDOW_BLOCKS) {
+		memcpy(read_buffer, &block_id, sizeof(big_int));
+		TEST_ASSERT_EQUAL(0, device_write_block(block_id, read_buffer, sizeof(big_int)));
+	}
+	TEST_ASSERT_EQUAL(0, device_sync());
+	free_disk_emulator();
+
+	TEST_ASSERT_EQUAL(0, init_disk_emulator());
+	for (block_id = 2 * MMAP_WINDOW_BLOCKS + 5; block_id < NUM_BLOCKS; block_id += MMAP_WINDOW_BLOCKS) {
+		big_int stored;
+		TEST_ASSERT_EQUAL(0, device_read_block(block_id, read_buffer));
+		memcpy(&stored, read_buffer, sizeof(big_int));
+		TEST_ASSERT_EQUAL(block_id, stored);
+	}
+	memset(blocks, 0, sizeof(blocks));
+	TEST_ASSERT_EQUAL(0, device_read_blocks(MMAP_WINDOW_BLOCKS - 1, 2, iov));
+	TEST_ASSERT_EQUAL('l', blocks[0][BLOCK_SIZE - 1]);
+	TEST_ASSERT_EQUAL('r', blocks[1][0]);
+	free_disk_emulator();
+
+	TEST_ASSERT_EQUAL(0, set_disk_backend("file", NULL));
+}
+
+TEST(TestDiskEmulator, memory_backend__only_blocks_written_with_data_use_memory) {
+	char buffer[BLOCK_SIZE];
+
+	TEST_ASSERT_EQUAL(0, set_disk_backend("memory", NULL));
+	TEST_ASSERT_EQUAL(0, init_disk_emulator());
+	TEST_ASSERT_EQUAL(0, get_memory_backend_used_blocks());
+
+	memset(buffer, 0, BLOCK_SIZE);
+	TEST_ASSERT_EQUAL(0, device_write_block(NUM_BLOCKS - 1, buffer, BLOCK_SIZE));
+	TEST_ASSERT_EQUAL(0, get_memory_backend_used_blocks());
+
+	buffer[100] = 'm';
+	TEST_ASSERT_EQUAL(0, device_write_block(NUM_BLOCKS - 1, buffer, BLOCK_SIZE));
+	TEST_ASSERT_EQUAL(0, device_write_block(3, buffer, BLOCK_SIZE));
+	TEST_ASSERT_EQUAL(2, get_memory_backend_used_blocks());
+
+	memset(buffer, 'x', BLOCK_SIZE);
+	TEST_ASSERT_EQUAL(0, device_read_block(1000, buffer)); // Never written
+	TEST_ASSERT_EQUAL(0, buffer[0]);
+	TEST_ASSERT_EQUAL(0, device_read_block(NUM_BLOCKS - 1, buffer));
+	TEST_ASSERT_EQUAL('m', buffer[100]);
+
+	TEST_ASSERT_EQUAL(0, device_discard(NUM_BLOCKS - 10, 10));
+	TEST_ASSERT_EQUAL(1, get_memory_backend_used_blocks());
+	TEST_ASSERT_EQUAL(0, device_read_block(NUM_BLOCKS - 1, buffer));
+	TEST_ASSERT_EQUAL(0, buffer[100]);
+
+	free_disk_emulator();
+	TEST_ASSERT_EQUAL(0, set_disk_backend("file", NULL));
+}
@@ -1,3 +1,5 @@
+#include <pthread.h>
+
 #include "unity.h"
 #include "unity_fixture.h"
 
@@ -13,6 +15,11 @@ TEST_GROUP_RUNNER(TestInodesHandler) {
 	RUN_TEST_CASE(TestInodesHandler, test_ifree_works_correctly);
 	RUN_TEST_CASE(TestInodesHandler, test_iput_works_correctly);
 	RUN_TEST_CASE(TestInodesHandler, test_2_allocs_and_2_saves);
+	RUN_TEST_CASE(TestInodesHandler, test_concurrent_iallocs_return_distinct_inodes);
+	RUN_TEST_CASE(TestInodesHandler, test_ialloc_and_ifree_use_the_free_inodes_cache);
+	RUN_TEST_CASE(TestInodesHandler, test_ialloc_in_group_takes_inodes_from_the_slice_of_the_group);
+	RUN_TEST_CASE(TestInodesHandler, test_inode_slices_cover_every_group);
+	RUN_TEST_CASE(TestInodesHandler, test_ialloc_and_ifree_update_the_inode_bitmap);
 }
 
 TEST_GROUP(TestInodesHandler);
@@ -139,3 +146,149 @@ TEST(TestInodesHandler, test_2_allocs_and_2_saves){
 	TEST_ASSERT_EQUAL(15, inod2.links_nb);
 	TEST_ASSERT_EQUAL(57, inod2.last_modified_file);
 }
+
+#define IALLOC_THREADS 4
+#define IALLOCS_PER_THREAD 50
+
+static void * ialloc_many(void *arg) {
+	int *inode_ids = arg;
+	struct inode inod;
+	int i;
+
+	for(i = 0; i < IALLOCS_PER_THREAD; i++){
+		inode_ids[i] = ialloc(&inod) == 0 ? inod.inode_id : -1;
+	}
+	return NULL;
+}
+
+TEST(TestInodesHandler, test_concurrent_iallocs_return_distinct_inodes){
+	pthread_t threads[IALLOC_THREADS];
+	int inode_ids[IALLOC_THREADS * IALLOCS_PER_THREAD];
+	int i, j;
+
+	for(i = 0; i < IALLOC_THREADS; i++){
+		pthread_create(&threads[i], NULL, ialloc_many, &inode_ids[i * IALLOCS_PER_THREAD]);
+	}
+	for(i = 0; i < IALLOC_THREADS; i++){
+		pthread_join(threads[i], NULL);
+	}
+
+	for(i = 0; i < IALLOC_THREADS * IALLOCS_PER_THREAD; i++){
+		TEST_ASSERT_NOT_EQUAL(-1, inode_ids[i]);
+		for(j = i + 1; j < IALLOC_THREADS * IALLOCS_PER_THREAD; j++){
+			TEST_ASSERT_NOT_EQUAL(inode_ids[i], inode_ids[j]);
+		}
+	}
+}
+
+TEST(TestInodesHandler, test_ialloc_and_ifree_use_the_free_inodes_cache){
+	struct inode inod1, inod2;
+	char before[BLOCK_SIZE], after[BLOCK_SIZE];
+	big_int num_free_inodes = superblock.num_free_inodes;
+
+	read_block(0, before);
+
+	// The cache was refilled when the root directory was created
+	TEST_ASSERT_EQUAL(FREE_INODES_CACHE_SIZE - 1, superblock.num_cached_free_inodes);
+
+	TEST_ASSERT_EQUAL(0, ialloc(&inod1));
+	TEST_ASSERT_EQUAL(0, ialloc(&inod2));
+	TEST_ASSERT_EQUAL(num_free_inodes - 2, superblock.num_free_inodes);
+
+	// Taking inodes from the cache doesn't commit the superblock
+	read_block(0, after);
+	TEST_ASSERT_EQUAL(0, memcmp(before, after, BLOCK_SIZE));
+
+	// A freed inode is reused first
+	TEST_ASSERT_EQUAL(0, ifree(&inod1));
+	TEST_ASSERT_EQUAL(0, ialloc(&inod2));
+	TEST_ASSERT_EQUAL(inod1.inode_id, inod2.inode_id);
+
+	// A cached inode taken behind the cache's back is skipped
+	lock_superblock();
+	superblock.free_inodes_cache[superblock.num_cached_free_inodes++] = inod2.inode_id;
+	unlock_superblock();
+	TEST_ASSERT_EQUAL(0, ialloc(&inod1));
+	TEST_ASSERT_TRUE(inod1.inode_id != inod2.inode_id);
+
+	// Once the cache is empty it is refilled from the inode list
+	while(superblock.num_cached_free_inodes > 0){
+		TEST_ASSERT_EQUAL(0, ialloc(&inod1));
+	}
+	TEST_ASSERT_EQUAL(0, ialloc(&inod2));
+	TEST_ASSERT_EQUAL(inod1.inode_id + 1, inod2.inode_id);
+	TEST_ASSERT_EQUAL(FREE_INODES_CACHE_SIZE - 1, superblock.num_cached_free_inodes);
+}
+
+TEST(TestInodesHandler, test_ialloc_in_group_takes_inodes_from_the_slice_of_the_group){
+	big_int group = NUM_BLOCK_GROUPS - 1;
+	struct inode inod1, inod2;
+
+	TEST_ASSERT_EQUAL(get_block_group(get_block_number_of_first_datablock()), get_inode_group(ROOT_INODE_NUMBER));
+	TEST_ASSERT_EQUAL(group, get_inode_group(NUM_INODES));
+
+	TEST_ASSERT_EQUAL(0, ialloc_in_group(&inod1, group));
+	TEST_ASSERT_EQUAL(group, get_inode_group(inod1.inode_id));
+	TEST_ASSERT_EQUAL(TYPE_ORDINARY, inod1.type);
+	TEST_ASSERT_EQUAL(0, ialloc_in_group(&inod2, group));
+	TEST_ASSERT_EQUAL(inod1.inode_id + 1, inod2.inode_id);
+
+	// The scan of the slice resumes after the last inode taken
+	TEST_ASSERT_EQUAL(0, ifree(&inod1));
+	TEST_ASSERT_EQUAL(0, ialloc_in_group(&inod1, group));
+	TEST_ASSERT_EQUAL(inod2.inode_id + 1, inod1.inode_id);
+
+	// A group without data blocks falls back to the first group holding some
+	TEST_ASSERT_EQUAL(0, ialloc_in_group(&inod1, NUM_BLOCK_GROUPS));
+	TEST_ASSERT_EQUAL(get_inode_group(ROOT_INODE_NUMBER), get_inode_group(inod1.inode_id));
+}
+
+TEST(TestInodesHandler, test_inode_slices_cover_every_group){
+	big_int group, next_inode = 0, first_inode, num_inodes;
+
+	// The slices follow each other, each holds whole inode blocks and none is empty
+	for(group = get_inode_group(ROOT_INODE_NUMBER); group < NUM_BLOCK_GROUPS; group++){
+		get_inode_slice(group, &first_inode, &num_inodes);
+		TEST_ASSERT_EQUAL(next_inode, first_inode);
+		TEST_ASSERT_EQUAL(0, first_inode % (BLOCK_SIZE / INODE_SIZE));
+		TEST_ASSERT_TRUE(num_inodes > 0);
+		TEST_ASSERT_EQUAL(group, get_inode_group(first_inode + 1));
+		TEST_ASSERT_EQUAL(group, get_inode_group(first_inode + num_inodes));
+		next_inode = first_inode + num_inodes;
+	}
+	TEST_ASSERT_EQUAL(NUM_INODES, next_inode);
+}
+
+// Returns the bit of the inode in the inode bitmap stored on disk
+static int read_inode_bitmap_bit(int inode_number) {
+	uint64_t words[BLOCK_SIZE / sizeof(uint64_t)];
+	big_int word = (inode_number - 1) / 64;
+
+	read_block(INODE_BITMAP_BEGIN + word / (BLOCK_SIZE / sizeof(uint64_t)), words);
+	return (words[word % (BLOCK_SIZE / sizeof(uint64_t))] >> ((inode_number - 1) % 64)) & 1;
+}
+
+TEST(TestInodesHandler, test_ialloc_and_ifree_update_the_inode_bitmap){
+	struct inode inod1, inod2;
+
+	TEST_ASSERT_EQUAL(1, read_inode_bitmap_bit(ROOT_INODE_NUMBER));
+	TEST_ASSERT_EQUAL(NUM_INODES - 1, count_free_inodes());
+
+	TEST_ASSERT_EQUAL(0, ialloc(&inod1));
+	TEST_ASSERT_EQUAL(0, ialloc_in_group(&inod2, NUM_BLOCK_GROUPS - 1));
+	TEST_ASSERT_EQUAL(1, read_inode_bitmap_bit(inod1.inode_id));
+	TEST_ASSERT_EQUAL(1, read_inode_bitmap_bit(inod2.inode_id));
+	TEST_ASSERT_EQUAL(0, read_inode_bitmap_bit(inod2.inode_id + 1));
+	TEST_ASSERT_EQUAL(superblock.num_free_inodes, count_free_inodes());
+
+	TEST_ASSERT_EQUAL(0, ifree(&inod2));
+	TEST_ASSERT_EQUAL(0, read_inode_bitmap_bit(inod2.inode_id));
+	TEST_ASSERT_EQUAL(NUM_INODES - 2, count_free_inodes());
+
+	// The bitmap is read back at mount
+	TEST_ASSERT_EQUAL(0, sync_disk_emulator());
+	TEST_ASSERT_EQUAL(0, init_inode_bitmap());
+	TEST_ASSERT_EQUAL(NUM_INODES - 2, count_free_inodes());
+	TEST_ASSERT_EQUAL(0, ialloc_in_group(&inod2, NUM_BLOCK_GROUPS - 1));
+	TEST_ASSERT_EQUAL(1, read_inode_bitmap_bit(inod2.inode_id));
+}
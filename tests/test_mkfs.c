@@ -9,8 +9,9 @@
 TEST_GROUP_RUNNER(TestMkfs) {
 	RUN_TEST_CASE(TestMkfs, superblock_is_written_correctly);
 	RUN_TEST_CASE(TestMkfs, inodes_are_written_contiguously_after_superblock);
-	RUN_TEST_CASE(TestMkfs, free_lists_are_correctly_initialized);
+	RUN_TEST_CASE(TestMkfs, block_bitmap_is_correctly_initialized);
 	RUN_TEST_CASE(TestMkfs, create_fs);
+	RUN_TEST_CASE(TestMkfs, create_fs_lazily_formats_inode_slices);
 }
 
 TEST_GROUP(TestMkfs);
@@ -59,25 +60,24 @@ TEST(TestMkfs, inodes_are_written_contiguously_after_superblock) {
 	}
 }
 
-TEST(TestMkfs, free_lists_are_correctly_initialized) {
+TEST(TestMkfs, block_bitmap_is_correctly_initialized) {
 	create_superblock(); // This is required to init superblock
-	create_free_blocks();
+	create_block_bitmap();
 
-	struct block_id_list block_id_list;
+	uint64_t words[BLOCK_SIZE / sizeof(uint64_t)];
 	big_int free_blocks_count = 0;
-	big_int free_list_pointer = superblock.next_free_block_list;
+	big_int first_data_block = INODE_BITMAP_BEGIN + NUM_INODE_BITMAP_BLOCKS;
+	big_int block_id;
 
-	while(free_list_pointer) {
-		if(read_block(free_list_pointer, &block_id_list))	break;
+	for(block_id = 0; block_id < NUM_BLOCKS; block_id++) {
+		if(block_id % (BLOCK_SIZE * 8) == 0 && read_block(BITMAP_BEGIN + block_id / (BLOCK_SIZE * 8), words))	break;
 
-		free_list_pointer = block_id_list.list[0];
-		int i;
-		for(i = BLOCK_ID_LIST_LENGTH - 1; i > 0; i--) {
-			if(!block_id_list.list[i])	break;
-			free_blocks_count++;
-		}
+		int used = (words[(block_id % (BLOCK_SIZE * 8)) / 64] >> (block_id % 64)) & 1;
+		TEST_ASSERT_EQUAL(block_id < first_data_block, used);
+		free_blocks_count += !used;
 	}
 
+	TEST_ASSERT_EQUAL(BITMAP_BEGIN, superblock.block_bitmap);
 	TEST_ASSERT_EQUAL(superblock.num_free_blocks, free_blocks_count);
 }
 
@@ -105,3 +105,37 @@ TEST(TestMkfs, create_fs) {
 	TEST_ASSERT_EQUAL(0, dir_block.inode_ids[2]);
 	TEST_ASSERT_EQUAL(0, strcmp("", dir_block.names[2]));
 }
+
+TEST(TestMkfs, create_fs_lazily_formats_inode_slices) {
+	big_int last_group = get_inode_group(NUM_INODES), first_inode, num_inodes;
+	struct inode inod;
+	struct data_block blok;
+
+	set_lazy_itable_init(1);
+	create_fs();
+	set_lazy_itable_init(0);
+
+	TEST_ASSERT_TRUE(is_inode_slice_initialized(get_inode_group(ROOT_INODE_NUMBER)));
+	TEST_ASSERT_EQUAL(NUM_INODES - 1, count_free_inodes());
+	if(last_group == get_inode_group(ROOT_INODE_NUMBER)){
+		return; // The volume is too small to have more than one slice
+	}
+
+	// The inodes of the last slice are free without being formatted
+	TEST_ASSERT_FALSE(is_inode_slice_initialized(last_group));
+	TEST_ASSERT_EQUAL(0, iget(NUM_INODES, &inod));
+	TEST_ASSERT_EQUAL(NUM_INODES, inod.inode_id);
+	TEST_ASSERT_EQUAL(TYPE_FREE, inod.type);
+
+	// and the slice is formatted before its first inode is allocated
+	get_inode_slice(last_group, &first_inode, &num_inodes);
+	TEST_ASSERT_EQUAL(0, ialloc_in_group(&inod, last_group));
+	TEST_ASSERT_TRUE(is_inode_slice_initialized(last_group));
+	TEST_ASSERT_EQUAL(first_inode + 1, inod.inode_id);
+	TEST_ASSERT_EQUAL(NUM_INODES - 2, count_free_inodes());
+
+	read_block(ILIST_BEGIN + (NUM_INODES - 1) / (BLOCK_SIZE / INODE_SIZE), blok.block);
+	memcpy(&inod, &blok.block[((NUM_INODES - 1) % (BLOCK_SIZE / INODE_SIZE)) * INODE_SIZE], sizeof(struct inode));
+	TEST_ASSERT_EQUAL(NUM_INODES, inod.inode_id);
+	TEST_ASSERT_EQUAL(TYPE_FREE, inod.type);
+}
@@ -5,6 +5,11 @@
 #include "disk_emulator.h"
 #include "mkfs.h"
 #include "syscalls1.h"
+#include "namei.h"
+#include "inodes_handler.h"
+#include "data_blocks_handler.h"
+#include "block_utils.h"
+#include "inode_table.h"
 
 int dummy_filler(void *buf, const char *name, const struct stat *stbuf, off_t off);
 
@@ -27,6 +32,7 @@ TEST_GROUP_RUNNER(TestSyscalls1) {
 	RUN_TEST_CASE(TestSyscalls1, syscalls1__unlink);
 	RUN_TEST_CASE(TestSyscalls1, random_create_remove_files_dir);
 	RUN_TEST_CASE(TestSyscalls1, batch_mkdir_mknod_rmdir_unlink);
+	RUN_TEST_CASE(TestSyscalls1, syscalls1__mkdir__spreads_top_level_directories);
 }
 
 TEST_GROUP(TestSyscalls1);
@@ -143,3 +149,22 @@ TEST(TestSyscalls1, batch_mkdir_mknod_rmdir_unlink) {
 		TEST_ASSERT_EQUAL(0, syscalls1__unlink(buffer));
 	}
 }
+
+TEST(TestSyscalls1, syscalls1__mkdir__spreads_top_level_directories) {
+	struct inode folder1, folder2, folder3;
+
+	TEST_ASSERT_EQUAL(0, syscalls1__mkdir("/folder1", 0));
+	TEST_ASSERT_EQUAL(0, syscalls1__mkdir("/folder2", 0));
+	TEST_ASSERT_EQUAL(0, syscalls1__mkdir("/folder1/folder3", 0));
+	TEST_ASSERT_EQUAL(0, syscalls1__mknod("/folder1/folder3/newfile", 0, 0));
+	get_inode(namei("/folder1"), &folder1);
+	get_inode(namei("/folder2"), &folder2);
+	get_inode(namei("/folder1/folder3"), &folder3);
+
+	// The top level directories go to different groups, what is below them stays in their group
+	TEST_ASSERT_NOT_EQUAL(get_inode_group(folder1.inode_id), get_inode_group(folder2.inode_id));
+	TEST_ASSERT_EQUAL(get_inode_group(folder1.inode_id), get_inode_group(folder3.inode_id));
+	TEST_ASSERT_EQUAL(get_inode_group(folder1.inode_id), get_inode_group(namei("/folder1/folder3/newfile")));
+	TEST_ASSERT_EQUAL(get_inode_group(folder2.inode_id), get_block_group(get_block_id(&folder2, 0)));
+	TEST_ASSERT_EQUAL(get_inode_group(folder3.inode_id), get_block_group(get_block_id(&folder3, 0)));
+}
@@ -1,3 +1,5 @@
+#include <linux/falloc.h>
+
 #include "unity.h"
 #include "unity_fixture.h"
 
@@ -7,6 +9,10 @@
 #include "inodes_handler.h"
 #include "data_blocks_handler.h"
 #include "inode_table.h"
+#include "buffer_cache.h"
+#include "readahead.h"
+#include "delalloc.h"
+#include "block_utils.h"
 
 
 TEST_GROUP_RUNNER(TestSyscalls2) {
@@ -38,6 +44,15 @@ TEST_GROUP_RUNNER(TestSyscalls2) {
 	RUN_TEST_CASE(TestSyscalls2, pwrite__write_after_end_of_file);
 	RUN_TEST_CASE(TestSyscalls2, pwrite__write_in_a_block_that_was_already_written);
 	RUN_TEST_CASE(TestSyscalls2, batch_open_close);
+	RUN_TEST_CASE(TestSyscalls2, pread__sequential_reads_are_read_ahead_and_random_reads_collapse_the_window);
+	RUN_TEST_CASE(TestSyscalls2, pwrite__sequential_writes_are_laid_out_contiguously);
+	RUN_TEST_CASE(TestSyscalls2, pwrite__indirect_blocks_precede_the_data_they_map);
+	RUN_TEST_CASE(TestSyscalls2, pwrite__delayed_blocks_get_one_run_when_the_file_is_flushed);
+	RUN_TEST_CASE(TestSyscalls2, pwrite__delayed_blocks_of_a_deleted_file_never_reach_the_allocator);
+	RUN_TEST_CASE(TestSyscalls2, fsync__delayed_blocks_reserve_their_indirect_blocks_and_failed_flushes_are_reported);
+	RUN_TEST_CASE(TestSyscalls2, fallocate__preallocates_the_range_in_one_run);
+	RUN_TEST_CASE(TestSyscalls2, fallocate__scattered_ranges_past_the_end_are_freed_with_the_file);
+	RUN_TEST_CASE(TestSyscalls2, fallocate__punch_hole_frees_the_blocks_and_zeroes_the_edges);
 }
 
 
@@ -1021,6 +1036,7 @@ TEST(TestSyscalls2, pwrite__write_after_end_of_file) {
 	TEST_ASSERT_EQUAL(27, inod.num_used_bytes_in_last_block);
 
 	fd2 = syscalls2__open("filepath", O_RDONLY);
+	memset(buffer2, 0, 7 * BLOCK_SIZE); // The byte after the end of file is checked below
 	TEST_ASSERT_EQUAL(6 * BLOCK_SIZE + 27, syscalls2__pread(fd2, buffer2, 7 * BLOCK_SIZE, 0));
 
 	for (i = 0; i < 4 * BLOCK_SIZE; i++) {
@@ -1125,3 +1141,437 @@ TEST(TestSyscalls2, batch_open_close) {
 
 	free_disk_emulator();
 }
+
+TEST(TestSyscalls2, pread__sequential_reads_are_read_ahead_and_random_reads_collapse_the_window) {
+	struct inode inod;
+	struct file_descriptor_entry *fde;
+	struct buffer_cache_stats before, after;
+	char *data = malloc(40 * BLOCK_SIZE);
+	char buffer[BLOCK_SIZE];
+	int fd, i;
+
+	init_disk_emulator();
+	create_fs();
+	ialloc(&inod);
+	syscall2__pid = 2123;
+	syscall2__namei = inod.inode_id;
+
+	// The file spans the direct blocks and the single indirect block
+	memset(data, 'r', 40 * BLOCK_SIZE);
+	fd = syscalls2__open("filepath", O_RDWR);
+	TEST_ASSERT_EQUAL(40 * BLOCK_SIZE, syscalls2__pwrite(fd, data, 40 * BLOCK_SIZE, 0));
+	syscalls2__close(fd);
+
+	// Starts from an empty cache
+	free_disk_emulator();
+	init_disk_emulator();
+	TEST_ASSERT_EQUAL(0, start_readahead());
+
+	fd = syscalls2__open("filepath", O_RDONLY);
+	fde = get_file_descriptor_entry(syscall2__pid, fd);
+	for (i = 0; i < 3; i++) {
+		TEST_ASSERT_EQUAL(BLOCK_SIZE, syscalls2__pread(fd, buffer, BLOCK_SIZE, (off_t) i * BLOCK_SIZE));
+	}
+	TEST_ASSERT_EQUAL(READAHEAD_MIN_BLOCKS * 4, fde->readahead_window);
+	wait_readahead();
+
+	// The blocks ahead of the reader are already cached
+	get_buffer_cache_stats(&before);
+	TEST_ASSERT(before.prefetches > 0);
+	for (i = 3; i < 12; i++) {
+		TEST_ASSERT_EQUAL(BLOCK_SIZE, syscalls2__pread(fd, buffer, BLOCK_SIZE, (off_t) i * BLOCK_SIZE));
+		TEST_ASSERT_EQUAL('r', buffer[BLOCK_SIZE - 1]);
+	}
+	wait_readahead();
+	get_buffer_cache_stats(&after);
+	TEST_ASSERT_EQUAL(before.misses + (after.prefetches - before.prefetches), after.misses);
+
+	TEST_ASSERT_EQUAL(BLOCK_SIZE, syscalls2__pread(fd, buffer, BLOCK_SIZE, 30 * BLOCK_SIZE));
+	TEST_ASSERT_EQUAL(0, fde->readahead_window);
+
+	syscalls2__close(fd);
+	stop_readahead();
+	free_disk_emulator();
+	free(data);
+}
+
+TEST(TestSyscalls2, pwrite__sequential_writes_are_laid_out_contiguously) {
+	struct inode inod;
+	char *data = malloc(24 * BLOCK_SIZE);
+	int fd, i;
+
+	init_disk_emulator();
+	create_fs();
+	ialloc(&inod);
+	syscall2__pid = 2123;
+	syscall2__namei = inod.inode_id;
+
+	// The writes span the direct blocks and the single indirect block, which comes from the free block cache
+	memset(data, 'c', 24 * BLOCK_SIZE);
+	fd = syscalls2__open("filepath", O_RDWR);
+	TEST_ASSERT_EQUAL(24 * BLOCK_SIZE, syscalls2__pwrite(fd, data, 24 * BLOCK_SIZE, 0));
+	TEST_ASSERT_EQUAL(4 * BLOCK_SIZE, syscalls2__pwrite(fd, data, 4 * BLOCK_SIZE, 24 * BLOCK_SIZE));
+	syscalls2__close(fd);
+
+	get_inode(inod.inode_id, &inod);
+	TEST_ASSERT_EQUAL(28, inod.num_allocated_blocks);
+	for (i = 2; i <= 28; i++) {
+		TEST_ASSERT_EQUAL(get_ith_datablock_number(&inod, 1) + i - 1, get_ith_datablock_number(&inod, i));
+	}
+	TEST_ASSERT(inod.single_indirect_block < get_ith_datablock_number(&inod, 1));
+
+	free_disk_emulator();
+	free(data);
+}
+
+TEST(TestSyscalls2, pwrite__indirect_blocks_precede_the_data_they_map) {
+	struct inode inod;
+	char *data = malloc(540 * BLOCK_SIZE), *buffer = malloc(540 * BLOCK_SIZE);
+	int fd, i;
+
+	init_disk_emulator();
+	create_fs();
+	ialloc(&inod);
+	syscall2__pid = 2123;
+	syscall2__namei = inod.inode_id;
+
+	// The file reaches the double indirect block at block 529
+	for (i = 0; i < 540; i++) {
+		memset(data + (size_t) i * BLOCK_SIZE, 'a' + i % 26, BLOCK_SIZE);
+	}
+	fd = syscalls2__open("filepath", O_RDWR);
+	TEST_ASSERT_EQUAL(540 * BLOCK_SIZE, syscalls2__pwrite(fd, data, 540 * BLOCK_SIZE, 0));
+
+	// Each write window is one run, preceded by the indirect blocks it needed
+	get_inode(inod.inode_id, &inod);
+	TEST_ASSERT_EQUAL(inod.single_indirect_block + 1, get_ith_datablock_number(&inod, 1));
+	TEST_ASSERT_EQUAL(get_ith_datablock_number(&inod, 512) + 1, inod.double_indirect_block);
+	TEST_ASSERT_EQUAL(inod.double_indirect_block + 2, get_ith_datablock_number(&inod, 513));
+	for (i = 514; i <= 540; i++) {
+		TEST_ASSERT_EQUAL(get_ith_datablock_number(&inod, 513) + i - 513, get_ith_datablock_number(&inod, i));
+	}
+
+	TEST_ASSERT_EQUAL(540 * BLOCK_SIZE, syscalls2__pread(fd, buffer, 540 * BLOCK_SIZE, 0));
+	TEST_ASSERT_EQUAL(0, memcmp(data, buffer, 540 * BLOCK_SIZE));
+	syscalls2__close(fd);
+
+	free_disk_emulator();
+	free(data);
+	free(buffer);
+}
+
+TEST(TestSyscalls2, pwrite__delayed_blocks_get_one_run_when_the_file_is_flushed) {
+	struct inode inod;
+	char data[3 * BLOCK_SIZE], buffer[3 * BLOCK_SIZE];
+	big_int num_free_blocks;
+	int fd, i;
+
+	init_disk_emulator();
+	create_fs();
+	ialloc(&inod);
+	syscall2__pid = 2123;
+	syscall2__namei = inod.inode_id;
+	set_delayed_allocation(1);
+	num_free_blocks = superblock.num_free_blocks;
+
+	// The blocks are written one by one, the middle one twice, and only reserve free blocks
+	memset(data, 'd', 3 * BLOCK_SIZE);
+	memset(data + BLOCK_SIZE + 10, 'e', 20);
+	fd = syscalls2__open("filepath", O_RDWR);
+	TEST_ASSERT_EQUAL(BLOCK_SIZE, syscalls2__pwrite(fd, data, BLOCK_SIZE, 0));
+	TEST_ASSERT_EQUAL(BLOCK_SIZE, syscalls2__pwrite(fd, data, BLOCK_SIZE, BLOCK_SIZE));
+	TEST_ASSERT_EQUAL(BLOCK_SIZE, syscalls2__pwrite(fd, data, BLOCK_SIZE, 2 * BLOCK_SIZE));
+	TEST_ASSERT_EQUAL(20, syscalls2__pwrite(fd, data + BLOCK_SIZE + 10, 20, BLOCK_SIZE + 10));
+
+	get_inode(inod.inode_id, &inod);
+	TEST_ASSERT_EQUAL(3, inod.num_blocks);
+	TEST_ASSERT_EQUAL(0, inod.num_allocated_blocks);
+	TEST_ASSERT_EQUAL(0, get_ith_datablock_number(&inod, 2));
+	TEST_ASSERT_EQUAL(3, get_delayed_blocks());
+	TEST_ASSERT_EQUAL(3, get_reserved_blocks());
+	TEST_ASSERT_EQUAL(num_free_blocks, superblock.num_free_blocks);
+
+	// The delayed blocks are read from memory
+	TEST_ASSERT_EQUAL(3 * BLOCK_SIZE, syscalls2__pread(fd, buffer, 3 * BLOCK_SIZE, 0));
+	TEST_ASSERT_EQUAL(0, memcmp(data, buffer, 3 * BLOCK_SIZE));
+
+	lock_inode(inod.inode_id);
+	TEST_ASSERT_EQUAL(0, delalloc_flush_file(inod.inode_id));
+	unlock_inode(inod.inode_id);
+
+	get_inode(inod.inode_id, &inod);
+	TEST_ASSERT_EQUAL(3, inod.num_allocated_blocks);
+	for (i = 2; i <= 3; i++) {
+		TEST_ASSERT_EQUAL(get_ith_datablock_number(&inod, 1) + i - 1, get_ith_datablock_number(&inod, i));
+	}
+	TEST_ASSERT_EQUAL(get_inode_group(inod.inode_id), get_block_group(get_ith_datablock_number(&inod, 1)));
+	TEST_ASSERT_EQUAL(0, get_delayed_blocks());
+	TEST_ASSERT_EQUAL(0, get_reserved_blocks());
+	TEST_ASSERT_EQUAL(num_free_blocks - 3, superblock.num_free_blocks);
+
+	memset(buffer, 0, 3 * BLOCK_SIZE);
+	read_block(get_ith_datablock_number(&inod, 2), buffer);
+	TEST_ASSERT_EQUAL(0, memcmp(data + BLOCK_SIZE, buffer, BLOCK_SIZE));
+	TEST_ASSERT_EQUAL(3 * BLOCK_SIZE, syscalls2__pread(fd, buffer, 3 * BLOCK_SIZE, 0));
+	TEST_ASSERT_EQUAL(0, memcmp(data, buffer, 3 * BLOCK_SIZE));
+	syscalls2__close(fd);
+
+	set_delayed_allocation(0);
+	free_disk_emulator();
+}
+
+TEST(TestSyscalls2, pwrite__delayed_blocks_of_a_deleted_file_never_reach_the_allocator) {
+	struct inode inod;
+	char data[4 * BLOCK_SIZE], bitmap[BLOCK_SIZE], after[BLOCK_SIZE];
+	big_int num_free_blocks;
+	int fd;
+
+	init_disk_emulator();
+	create_fs();
+	ialloc(&inod);
+	syscall2__pid = 2123;
+	syscall2__namei = inod.inode_id;
+	set_delayed_allocation(1);
+	num_free_blocks = superblock.num_free_blocks;
+	read_block(BITMAP_BEGIN, bitmap);
+
+	memset(data, 't', 4 * BLOCK_SIZE);
+	fd = syscalls2__open("filepath", O_RDWR);
+	TEST_ASSERT_EQUAL(4 * BLOCK_SIZE, syscalls2__pwrite(fd, data, 4 * BLOCK_SIZE, 0));
+	syscalls2__close(fd);
+	TEST_ASSERT_EQUAL(4, get_reserved_blocks());
+
+	// Deleting the file only releases the reservations
+	lock_inode(inod.inode_id);
+	delalloc_drop_file(inod.inode_id);
+	get_inode(inod.inode_id, &inod);
+	inod.links_nb = 0;
+	TEST_ASSERT_EQUAL(0, put_inode(&inod));
+	unlock_inode(inod.inode_id);
+
+	TEST_ASSERT_EQUAL(0, get_delayed_blocks());
+	TEST_ASSERT_EQUAL(0, get_reserved_blocks());
+	TEST_ASSERT_EQUAL(num_free_blocks, superblock.num_free_blocks);
+	read_block(BITMAP_BEGIN, after);
+	TEST_ASSERT_EQUAL(0, memcmp(bitmap, after, BLOCK_SIZE));
+
+	set_delayed_allocation(0);
+	free_disk_emulator();
+}
+
+TEST(TestSyscalls2, fsync__delayed_blocks_reserve_their_indirect_blocks_and_failed_flushes_are_reported) {
+	struct inode inod;
+	char data[2 * BLOCK_SIZE];
+	big_int num_free_blocks, (*runs)[2] = malloc((NUM_BLOCK_GROUPS * 4 + 64) * sizeof(*runs)), block_ids[1024];
+	big_int num_runs = 0, i, j;
+	int fd, length;
+
+	init_disk_emulator();
+	create_fs();
+	ialloc(&inod);
+	syscall2__pid = 2123;
+	syscall2__namei = inod.inode_id;
+	set_delayed_allocation(1);
+	num_free_blocks = superblock.num_free_blocks;
+	memset(data, 'r', 2 * BLOCK_SIZE);
+
+	// Past the direct blocks, each delayed block also reserves the indirect block that may map it
+	fd = syscalls2__open("filepath", O_RDWR);
+	TEST_ASSERT_EQUAL(2 * BLOCK_SIZE, syscalls2__pwrite(fd, data, 2 * BLOCK_SIZE, NUM_DIRECT_BLOCKS * BLOCK_SIZE));
+	TEST_ASSERT_EQUAL(4, get_reserved_blocks());
+	TEST_ASSERT_EQUAL(0, syscalls2__fsync(fd));
+	TEST_ASSERT_EQUAL(0, get_reserved_blocks());
+	TEST_ASSERT_EQUAL(num_free_blocks - 3, superblock.num_free_blocks);
+
+	// The volume fills up, the other allocations leave the reserved block to the flush of the delayed block
+	TEST_ASSERT_EQUAL(BLOCK_SIZE, syscalls2__pwrite(fd, data, BLOCK_SIZE, 0));
+	while ((length = data_block_alloc_run(0, BLOCKS_PER_GROUP, &runs[num_runs][0])) > 0) {
+		runs[num_runs++][1] = length;
+		TEST_ASSERT_TRUE(num_runs < NUM_BLOCK_GROUPS * 4 + 64);
+	}
+	TEST_ASSERT_EQUAL(1, superblock.num_free_blocks);
+	TEST_ASSERT_EQUAL(-1, data_block_alloc_n(1, block_ids));
+	TEST_ASSERT_EQUAL(0, delalloc_flush_all()); // Like the flusher thread
+	TEST_ASSERT_EQUAL(0, get_delayed_blocks());
+	TEST_ASSERT_EQUAL(0, get_reserved_blocks());
+	TEST_ASSERT_EQUAL(0, superblock.num_free_blocks);
+
+	// A reservation lost behind the back of the next delayed block makes its flush fail
+	runs[num_runs - 1][1]--;
+	block_ids[0] = runs[num_runs - 1][0] + runs[num_runs - 1][1];
+	TEST_ASSERT_EQUAL(0, data_block_free_n(block_ids, 1));
+	TEST_ASSERT_EQUAL(BLOCK_SIZE, syscalls2__pwrite(fd, data, BLOCK_SIZE, BLOCK_SIZE));
+	data_block_release_reservation(1);
+	TEST_ASSERT_EQUAL(1, data_block_alloc_run(0, 1, &runs[num_runs][0]));
+	runs[num_runs++][1] = 1;
+	TEST_ASSERT_EQUAL(-1, delalloc_flush_all());
+	TEST_ASSERT_EQUAL(1, get_delayed_blocks());
+
+	// The failure is reported once, by the close of a writer
+	TEST_ASSERT_EQUAL(-1, syscalls2__close(fd));
+	TEST_ASSERT_EQUAL(EIO, errno);
+	fd = syscalls2__open("filepath", O_RDWR);
+	TEST_ASSERT_EQUAL(0, syscalls2__close(fd));
+
+	// fsync reports the failure of its own flush
+	fd = syscalls2__open("filepath", O_RDWR);
+	TEST_ASSERT_EQUAL(-1, syscalls2__fsync(fd));
+	TEST_ASSERT_EQUAL(EIO, errno);
+	for (i = 0; i < num_runs; i++) {
+		for (j = 0; j < runs[i][1]; j++) {
+			block_ids[j % 1024] = runs[i][0] + j;
+			if (j % 1024 == 1023 || j == runs[i][1] - 1) {
+				TEST_ASSERT_EQUAL(0, data_block_free_n(block_ids, j % 1024 + 1));
+			}
+		}
+	}
+	TEST_ASSERT_EQUAL(0, data_block_reserve(1)); // Given back to the delayed block
+	TEST_ASSERT_EQUAL(0, syscalls2__fsync(fd));
+	TEST_ASSERT_EQUAL(0, get_delayed_blocks());
+	TEST_ASSERT_EQUAL(0, get_reserved_blocks());
+	TEST_ASSERT_EQUAL(0, syscalls2__close(fd));
+	TEST_ASSERT_EQUAL(num_free_blocks - 5, superblock.num_free_blocks);
+
+	free(runs);
+	set_delayed_allocation(0);
+	free_disk_emulator();
+}
+
+TEST(TestSyscalls2, fallocate__preallocates_the_range_in_one_run) {
+	struct inode inod;
+	char zeros[BLOCK_SIZE], buffer[BLOCK_SIZE];
+	big_int num_free_blocks, goal;
+	int fd, i;
+
+	init_disk_emulator();
+	create_fs();
+	ialloc(&inod);
+	syscall2__pid = 2123;
+	syscall2__namei = inod.inode_id;
+	num_free_blocks = superblock.num_free_blocks;
+	memset(zeros, 0, BLOCK_SIZE);
+
+	// Old content left in the free blocks where the file goes, the allocator doesn't clear it
+	memset(buffer, 's', BLOCK_SIZE);
+	goal = get_group_goal(get_inode_group(inod.inode_id));
+	for (i = 0; i < 256; i++) {
+		if (!is_data_block_used(goal + i)) {
+			TEST_ASSERT_EQUAL(0, device_write_block(goal + i, buffer, BLOCK_SIZE));
+		}
+	}
+
+	fd = syscalls2__open("filepath", O_RDWR);
+	TEST_ASSERT_EQUAL(0, syscalls2__fallocate(fd, 0, 0, 40 * BLOCK_SIZE - 10));
+	TEST_ASSERT_EQUAL(0, syscalls2__fallocate(fd, FALLOC_FL_KEEP_SIZE, 40 * BLOCK_SIZE, 8 * BLOCK_SIZE));
+	TEST_ASSERT_EQUAL(-1, syscalls2__fallocate(fd, FALLOC_FL_PUNCH_HOLE, 0, BLOCK_SIZE));
+	TEST_ASSERT_EQUAL(EOPNOTSUPP, errno);
+	TEST_ASSERT_EQUAL(0, get_reserved_blocks()); // Only held while the runs are allocated
+
+	// A range bigger than the free space fails before allocating anything
+	TEST_ASSERT_EQUAL(-1, syscalls2__fallocate(fd, FALLOC_FL_KEEP_SIZE, 100 * BLOCK_SIZE, (off_t) superblock.num_free_blocks * BLOCK_SIZE));
+	TEST_ASSERT_EQUAL(ENOSPC, errno);
+	TEST_ASSERT_EQUAL(0, get_reserved_blocks());
+	TEST_ASSERT_EQUAL(num_free_blocks - 48 - 1, superblock.num_free_blocks); // One indirect block maps blocks 17 to 48
+
+	// The size only covers the first range, the blocks past it are preallocated in the same run
+	get_inode(inod.inode_id, &inod);
+	TEST_ASSERT_EQUAL(40, inod.num_blocks);
+	TEST_ASSERT_EQUAL(BLOCK_SIZE - 10, inod.num_used_bytes_in_last_block);
+	TEST_ASSERT_EQUAL(48, inod.num_allocated_blocks);
+	for (i = 2; i <= 48; i++) {
+		TEST_ASSERT_EQUAL(get_ith_datablock_number(&inod, 1) + i - 1, get_ith_datablock_number(&inod, i));
+	}
+	TEST_ASSERT_EQUAL(BLOCK_SIZE, syscalls2__pread(fd, buffer, BLOCK_SIZE, 20 * BLOCK_SIZE));
+	TEST_ASSERT_EQUAL(0, memcmp(zeros, buffer, BLOCK_SIZE));
+	TEST_ASSERT_EQUAL(0, device_read_block(get_ith_datablock_number(&inod, 47), buffer)); // Zeroed out on the disk too
+	TEST_ASSERT_EQUAL(0, memcmp(zeros, buffer, BLOCK_SIZE));
+
+	// A write into the preallocated blocks uses them
+	memset(buffer, 'f', BLOCK_SIZE);
+	TEST_ASSERT_EQUAL(BLOCK_SIZE, syscalls2__pwrite(fd, buffer, BLOCK_SIZE, 44 * BLOCK_SIZE));
+	syscalls2__close(fd);
+	get_inode(inod.inode_id, &inod);
+	TEST_ASSERT_EQUAL(45, inod.num_blocks);
+	TEST_ASSERT_EQUAL(48, inod.num_allocated_blocks);
+
+	// Deleting the file frees the blocks preallocated past its end as well
+	inod.links_nb = 0;
+	TEST_ASSERT_EQUAL(0, put_inode(&inod));
+	TEST_ASSERT_EQUAL(num_free_blocks, superblock.num_free_blocks);
+
+	free_disk_emulator();
+}
+
+TEST(TestSyscalls2, fallocate__scattered_ranges_past_the_end_are_freed_with_the_file) {
+	struct inode inod;
+	big_int num_free_blocks, first_block, i;
+	int fd;
+
+	init_disk_emulator();
+	create_fs();
+	ialloc(&inod);
+	syscall2__pid = 2123;
+	syscall2__namei = inod.inode_id;
+	num_free_blocks = superblock.num_free_blocks;
+
+	// Single blocks spread over the double and triple indirections each need their own indirect blocks, then a
+	// range longer than a batch of freed blocks. The file keeps its size of 0
+	fd = syscalls2__open("filepath", O_RDWR);
+	for (i = 0; i < 24; i++) {
+		first_block = NUM_DIRECT_BLOCKS + BLOCK_ID_LIST_LENGTH + i * 41 * BLOCK_ID_LIST_LENGTH;
+		TEST_ASSERT_EQUAL(0, syscalls2__fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t) first_block * BLOCK_SIZE, BLOCK_SIZE));
+	}
+	TEST_ASSERT_EQUAL(0, syscalls2__fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t) (first_block + 1000) * BLOCK_SIZE,
+		(off_t) 3 * FREE_BATCH_BLOCKS / 2 * BLOCK_SIZE));
+	TEST_ASSERT_EQUAL(0, syscalls2__close(fd));
+	get_inode(inod.inode_id, &inod);
+	TEST_ASSERT_EQUAL(0, inod.num_blocks);
+	TEST_ASSERT_EQUAL(24 + 3 * FREE_BATCH_BLOCKS / 2, inod.num_allocated_blocks);
+	TEST_ASSERT_TRUE(superblock.num_free_blocks < num_free_blocks - inod.num_allocated_blocks - 24);
+
+	// Deleting the file gives every block back, the indirect blocks too
+	inod.links_nb = 0;
+	TEST_ASSERT_EQUAL(0, put_inode(&inod));
+	TEST_ASSERT_EQUAL(num_free_blocks, superblock.num_free_blocks);
+	TEST_ASSERT_EQUAL(0, get_reserved_blocks());
+
+	free_disk_emulator();
+}
+
+TEST(TestSyscalls2, fallocate__punch_hole_frees_the_blocks_and_zeroes_the_edges) {
+	struct inode inod;
+	char data[8 * BLOCK_SIZE], buffer[8 * BLOCK_SIZE];
+	big_int num_free_blocks;
+	int fd;
+
+	init_disk_emulator();
+	create_fs();
+	ialloc(&inod);
+	syscall2__pid = 2123;
+	syscall2__namei = inod.inode_id;
+
+	memset(data, 'p', 8 * BLOCK_SIZE);
+	fd = syscalls2__open("filepath", O_RDWR);
+	TEST_ASSERT_EQUAL(8 * BLOCK_SIZE, syscalls2__pwrite(fd, data, 8 * BLOCK_SIZE, 0));
+	num_free_blocks = superblock.num_free_blocks;
+
+	// Blocks 3 to 5 are inside the hole, blocks 2 and 6 are only zeroed in part
+	TEST_ASSERT_EQUAL(0, syscalls2__fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, BLOCK_SIZE + 100, 4 * BLOCK_SIZE));
+	memset(data + BLOCK_SIZE + 100, 0, 4 * BLOCK_SIZE);
+
+	get_inode(inod.inode_id, &inod);
+	TEST_ASSERT_EQUAL(8, inod.num_blocks);
+	TEST_ASSERT_EQUAL(BLOCK_SIZE, inod.num_used_bytes_in_last_block);
+	TEST_ASSERT_EQUAL(5, inod.num_allocated_blocks);
+	TEST_ASSERT_NOT_EQUAL(0, get_ith_datablock_number(&inod, 2));
+	TEST_ASSERT_EQUAL(0, get_ith_datablock_number(&inod, 3));
+	TEST_ASSERT_EQUAL(0, get_ith_datablock_number(&inod, 5));
+	TEST_ASSERT_NOT_EQUAL(0, get_ith_datablock_number(&inod, 6));
+	TEST_ASSERT_EQUAL(num_free_blocks + 3, superblock.num_free_blocks);
+
+	TEST_ASSERT_EQUAL(8 * BLOCK_SIZE, syscalls2__pread(fd, buffer, 8 * BLOCK_SIZE, 0));
+	TEST_ASSERT_EQUAL(0, memcmp(data, buffer, 8 * BLOCK_SIZE));
+	syscalls2__close(fd);
+
+	free_disk_emulator();
+}